@@ -0,0 +1,73 @@
+#include "udpAck.h"
+
+
+void ackInit(AckPolicy *a, TimerWheel *wheel, uint32_t every, uint32_t delayUs,
+             uint32_t window)
+{
+   uint32_t most;
+
+   //the sender's window has to hold several ACKs' worth of packets, or it
+   //stalls waiting for the timer
+   most = window / 4 < ACK_EVERY_MAX ? window / 4 : ACK_EVERY_MAX;
+   if (every > most)
+      every = most;
+   if (every <= 1)
+   {
+      every = 1;
+      delayUs = 0;
+   }
+   else if (delayUs == 0)
+      delayUs = ACK_DELAY_US;
+   else if (delayUs > ACK_DELAY_MAX_US)
+      delayUs = ACK_DELAY_MAX_US;
+
+   a->every = every;
+   a->delayUs = delayUs;
+   a->pending = 0;
+   a->quick = ACK_QUICK;
+   a->acks = 0;
+   a->timer.pprev = NULL;
+   a->wheel = wheel;
+}
+
+int ackOnData(AckPolicy *a, uint32_t seq, int urgent, unsigned long long now)
+{
+   a->pending++;
+   a->lastSeq = seq;
+   a->lastUs = now;
+
+   //after a gap the sender is recovering with a small window, so the next
+   //packets are acknowledged one by one again
+   if (urgent)
+   {
+      a->quick = ACK_QUICK;
+      return 1;
+   }
+   if (a->quick > 0)
+   {
+      a->quick--;
+      return 1;
+   }
+   if (a->pending >= a->every)
+      return 1;
+
+   //the deadline counts from the first packet held
+   if (!timerArmed(&a->timer))
+      timerAdd(a->wheel, &a->timer, now + a->delayUs);
+   return 0;
+}
+
+uint32_t ackSent(AckPolicy *a, unsigned long long now)
+{
+   a->pending = 0;
+   a->acks++;
+   if (a->wheel != NULL)
+      timerCancel(a->wheel, &a->timer);
+   return now > a->lastUs ? now - a->lastUs : 0;
+}
+
+void ackStop(AckPolicy *a)
+{
+   if (a->wheel != NULL)
+      timerCancel(a->wheel, &a->timer);
+}
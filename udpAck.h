@@ -0,0 +1,57 @@
+//udpAck When a receiver acknowledges - in order DATA is covered by one ACK
+//every few packets or after a short delay, anything out of order at once
+
+#ifndef UDPACK_H
+#define UDPACK_H
+
+#include <stdint.h>
+#include "udpTimer.h"
+
+#define ACK_EVERY_DEFAULT	8	//in order packets per ACK a sender asks for by default
+#define ACK_DELAY_US	1000		//longest an ACK is held by default
+#define ACK_EVERY_MAX	64		//most in order packets one ACK may wait for
+#define ACK_DELAY_MAX_US	25000	//longest a packet may wait for its ACK
+#define ACK_QUICK	16		//in order packets acknowledged one by one after a gap,
+					//while the sender's window is still small
+
+/*
+	DATA STRUCTURES
+*/
+
+//ACK schedule of one connection
+typedef struct {
+   uint32_t every;		//in order packets per ACK, 1 to acknowledge each
+   uint32_t delayUs;		//longest a packet waits for its ACK
+   uint32_t pending;		//packets received since the last ACK
+   uint32_t quick;		//packets still acknowledged one by one
+   uint32_t lastSeq;		//newest packet received, the ACK carries it in seqNum
+   unsigned long long lastUs;	//time it arrived, the ACK reports the delay since
+   unsigned long acks;		//ACKs sent
+   TimerNode timer;		//deadline of the ACK held back
+   TimerWheel *wheel;		//wheel the deadline is armed in, NULL before ackInit
+} AckPolicy;
+
+
+/*
+	FUNCTIONS
+*/
+
+//grants a sender's request for an ACK every every packets held at most delayUs,
+//0 asks for an ACK per packet - with a window of window packets, deadlines go
+//into wheel and every and delayUs of a are what was granted
+void ackInit(AckPolicy *a, TimerWheel *wheel, uint32_t every, uint32_t delayUs,
+             uint32_t window);
+
+//records DATA packet seq arriving at now, urgent when it leaves or fills a gap
+//or arrived before, returns 1 when an ACK is due right away - otherwise the
+//timer is armed and the wheel hands it back once the ACK is due
+int ackOnData(AckPolicy *a, uint32_t seq, int urgent, unsigned long long now);
+
+//records that an ACK covering every pending packet is sent at now, returns the
+//delay to report in it
+uint32_t ackSent(AckPolicy *a, unsigned long long now);
+
+//disarms the timer, also safe before ackInit
+void ackStop(AckPolicy *a);
+
+#endif
@@ -0,0 +1,471 @@
+#define _GNU_SOURCE
+#include "udpBatch.h"
+#include <errno.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+
+
+void batchInitSend(SendBatch *batch, int sock, int size)
+{
+   if (size < 1 || size > BATCH_MAX)
+      size = BATCH_MAX;
+
+   memset(batch->msgs, 0, sizeof(batch->msgs));
+   memset(batch->gsoMsgs, 0, sizeof(batch->gsoMsgs));
+   batch->sock = sock;
+   batch->size = size;
+   batch->count = 0;
+   batch->gso = 0;
+   batch->zerocopy = 0;
+   batch->zcRing = NULL;
+   batch->zcSeen = NULL;
+   batch->zcNext = 0;
+   batch->zcCopied = 0;
+   batch->impair = NULL;
+}
+
+void batchImpair(SendBatch *batch, Impair *imp)
+{
+   batch->impair = imp;
+}
+
+//returns 1 while the send carrying a ring entry may still read it
+static int zcBusy(SendBatch *batch, ZcEntry *entry)
+{
+   return entry->busy && (int32_t)(entry->id - batch->zcLow) >= 0;
+}
+
+//hands out the next ring entry once the kernel is done with its last use
+static int zcTake(SendBatch *batch)
+{
+   ZcEntry *entry;
+   int waited;
+   int e;
+
+   e = batch->zcHead++ % ZC_RING;
+   entry = &batch->zcRing[e];
+   for (waited = 0; zcBusy(batch, entry) && waited < ZC_WAIT_MS; waited += 10)
+      batchReap(batch, 10);
+
+   //give up on completions that never came, a late one is ignored and at
+   //worst the reused header fails its checksum at the receiver
+   if (zcBusy(batch, entry))
+   {
+      while (batch->zcLow != entry->id + 1)
+         batch->zcSeen[batch->zcLow++ % ZC_RING] = 0;
+   }
+   entry->busy = 0;
+   return e;
+}
+
+//queues one copy of a datagram that passed the impairment
+static void addCopy(SendBatch *batch, void *hdr, int hdrLen, void *data, int dataLen,
+                    struct sockaddr_in *addr)
+{
+   struct msghdr *msg;
+   ZcEntry *entry;
+   int i;
+
+   i = batch->count++;
+   if (batch->zerocopy)
+   {
+      //every zero-copy datagram takes an entry so the ring bounds the
+      //sends awaiting completion, small headers are copied into it
+      batch->zcEntry[i] = zcTake(batch);
+      entry = &batch->zcRing[batch->zcEntry[i]];
+      if (hdrLen <= ZC_HDR_MAX)
+      {
+         memcpy(entry->hdr, hdr, hdrLen);
+         hdr = entry->hdr;
+      }
+   }
+   batch->iovs[i][0].iov_base = hdr;
+   batch->iovs[i][0].iov_len = hdrLen;
+   batch->iovs[i][1].iov_base = data;
+   batch->iovs[i][1].iov_len = dataLen;
+   batch->lens[i] = hdrLen + dataLen;
+   batch->addrs[i] = *addr;
+
+   msg = &batch->msgs[i].msg_hdr;
+   msg->msg_name = &batch->addrs[i];
+   msg->msg_namelen = sizeof(struct sockaddr_in);
+   msg->msg_iov = batch->iovs[i];
+   msg->msg_iovlen = 2;
+
+   if (batch->count >= batch->size)
+      batchFlush(batch);
+}
+
+void batchAddParts(SendBatch *batch, void *hdr, int hdrLen, void *data, int dataLen,
+                   struct sockaddr_in *addr)
+{
+   int copies;
+
+   copies = batch->impair != NULL ? impairPass(batch->impair, hdr, hdrLen, data, dataLen, addr) : 1;
+   for (; copies > 0; copies--)
+      addCopy(batch, hdr, hdrLen, data, dataLen, addr);
+}
+
+void batchAdd(SendBatch *batch, void *buf, int len, struct sockaddr_in *addr)
+{
+   batchAddParts(batch, buf, len, NULL, 0, addr);
+}
+
+//records the zero-copy send id of datagrams [first..last)
+static void zcSent(SendBatch *batch, int first, int last, uint32_t id)
+{
+   for (; first < last; first++)
+   {
+      batch->zcRing[batch->zcEntry[first]].busy = 1;
+      batch->zcRing[batch->zcEntry[first]].id = id;
+   }
+}
+
+//sends msgs[first..count) with one datagram per message
+static int flushPlain(SendBatch *batch, int first)
+{
+   int flags;
+   int sent;
+   int ret;
+   int i;
+
+   //sendmmsg may stop short, keep going until the batch is empty
+   flags = batch->zerocopy ? MSG_ZEROCOPY : 0;
+   sent = first;
+   while (sent < batch->count)
+   {
+      ret = sendmmsg(batch->sock, batch->msgs + sent, batch->count - sent, flags);
+      if (ret < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         //out of memory for pinned pages, wait for some to be released
+         if (errno == ENOBUFS && batch->zerocopy && batchReap(batch, ZC_WAIT_MS) > 0)
+            continue;
+         //drop the rest like a full socket buffer would, the protocol resends
+         break;
+      }
+      if (batch->zerocopy)
+         for (i = sent; i < sent + ret; i++)
+            zcSent(batch, i, i + 1, batch->zcNext++);
+      sent += ret;
+   }
+   return sent - first;
+}
+
+//groups runs of datagrams to the same address, all the same length except
+//a shorter last one, into single UDP_SEGMENT sends
+static int flushGso(SendBatch *batch)
+{
+   struct msghdr *hdr;
+   struct cmsghdr *cm;
+   size_t seg;
+   size_t bytes;
+   int flags;
+   int nmsgs;
+   int sent;
+   int ret;
+   int i;
+   int j;
+
+   nmsgs = 0;
+   for (i = 0; i < batch->count; i = j)
+   {
+      seg = batch->lens[i];
+      bytes = seg;
+      for (j = i + 1; j < batch->count && j - i < GSO_MAX_SEGS; j++)
+      {
+         if ((size_t)batch->lens[j - 1] != seg || (size_t)batch->lens[j] > seg ||
+             bytes + batch->lens[j] > GSO_MAX_BYTES ||
+             batch->addrs[j].sin_port != batch->addrs[i].sin_port ||
+             batch->addrs[j].sin_addr.s_addr != batch->addrs[i].sin_addr.s_addr)
+            break;
+         bytes += batch->lens[j];
+      }
+
+      //the kernel cuts the joined iovecs of the run every seg bytes
+      hdr = &batch->gsoMsgs[nmsgs].msg_hdr;
+      hdr->msg_name = &batch->addrs[i];
+      hdr->msg_namelen = sizeof(struct sockaddr_in);
+      hdr->msg_iov = batch->iovs[i];
+      hdr->msg_iovlen = 2 * (j - i);
+      hdr->msg_control = NULL;
+      hdr->msg_controllen = 0;
+      if (j - i > 1)
+      {
+         hdr->msg_control = batch->gsoCtrl[nmsgs];
+         hdr->msg_controllen = sizeof(batch->gsoCtrl[nmsgs]);
+         cm = CMSG_FIRSTHDR(hdr);
+         cm->cmsg_level = SOL_UDP;
+         cm->cmsg_type = UDP_SEGMENT;
+         cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+         *(uint16_t *)CMSG_DATA(cm) = seg;
+      }
+      batch->gsoFirst[nmsgs++] = i;
+   }
+   batch->gsoFirst[nmsgs] = batch->count;
+
+   flags = batch->zerocopy ? MSG_ZEROCOPY : 0;
+   sent = 0;
+   while (sent < nmsgs)
+   {
+      ret = sendmmsg(batch->sock, batch->gsoMsgs + sent, nmsgs - sent, flags);
+      if (ret < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         if (errno == ENOBUFS && batch->zerocopy && batchReap(batch, ZC_WAIT_MS) > 0)
+            continue;
+         //the device cannot segment - fall back to one datagram per message
+         if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT ||
+             errno == EOPNOTSUPP)
+         {
+            batch->gso = 0;
+            return flushPlain(batch, batch->gsoFirst[sent]);
+         }
+         break;
+      }
+      if (batch->zerocopy)
+         for (i = sent; i < sent + ret; i++)
+            zcSent(batch, batch->gsoFirst[i], batch->gsoFirst[i + 1], batch->zcNext++);
+      sent += ret;
+   }
+   return sent;
+}
+
+int batchFlush(SendBatch *batch)
+{
+   int sent;
+
+   //completions wake select() on the socket, so collect them every time
+   if (batch->zerocopy)
+      batchReap(batch, 0);
+   if (batch->count == 0)
+      return 0;
+   if (batch->gso)
+      sent = flushGso(batch);
+   else
+      sent = flushPlain(batch, 0);
+
+   batch->count = 0;
+   return sent;
+}
+
+int batchEnableGso(SendBatch *batch)
+{
+   int seg;
+
+   //a socket wide size of 0 leaves segmentation to the control messages,
+   //the call only succeeds on kernels that know UDP_SEGMENT
+   seg = 0;
+   if (setsockopt(batch->sock, SOL_UDP, UDP_SEGMENT, &seg, sizeof(seg)) < 0)
+      return -1;
+   batch->gso = 1;
+   return 0;
+}
+
+int batchEnableZerocopy(SendBatch *batch)
+{
+   int on;
+
+   on = 1;
+   if (setsockopt(batch->sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0)
+      return -1;
+
+   batch->zcRing = calloc(ZC_RING, sizeof(ZcEntry));
+   batch->zcSeen = calloc(ZC_RING, sizeof(uint8_t));
+   if (batch->zcRing == NULL || batch->zcSeen == NULL)
+   {
+      batchFreeSend(batch);
+      return -1;
+   }
+   batch->zcHead = 0;
+   batch->zcNext = 0;
+   batch->zcLow = 0;
+   batch->zcCopied = 0;
+   batch->zerocopy = 1;
+   return 0;
+}
+
+int batchReap(SendBatch *batch, int waitMs)
+{
+   struct pollfd pfd;
+   struct msghdr msg;
+   struct cmsghdr *cm;
+   struct sock_extended_err *ee;
+   char ctrl[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+   uint32_t id;
+   int reaped;
+
+   if (!batch->zerocopy)
+      return 0;
+
+   //a pending completion shows up as POLLERR
+   if (waitMs > 0)
+   {
+      pfd.fd = batch->sock;
+      pfd.events = 0;
+      poll(&pfd, 1, waitMs);
+   }
+
+   //each notification covers the send ids ee_info to ee_data
+   reaped = 0;
+   while (1)
+   {
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_control = ctrl;
+      msg.msg_controllen = sizeof(ctrl);
+      if (recvmsg(batch->sock, &msg, MSG_ERRQUEUE) < 0)
+         break;
+      for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+      {
+         if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR)
+            continue;
+         ee = (struct sock_extended_err *)CMSG_DATA(cm);
+         if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee->ee_errno != 0)
+            continue;
+         for (id = ee->ee_info; (int32_t)(ee->ee_data - id) >= 0; id++)
+         {
+            if ((int32_t)(id - batch->zcLow) >= 0)
+               batch->zcSeen[id % ZC_RING] = 1;
+            reaped++;
+         }
+         if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            batch->zcCopied += ee->ee_data - ee->ee_info + 1;
+      }
+   }
+
+   //completions may arrive out of order, zcLow only passes a gap once filled
+   while (batch->zcSeen[batch->zcLow % ZC_RING])
+      batch->zcSeen[batch->zcLow++ % ZC_RING] = 0;
+   return reaped;
+}
+
+void batchFreeSend(SendBatch *batch)
+{
+   //the kernel may still read header copies until their sends complete
+   while (batch->zerocopy && batch->zcLow != batch->zcNext &&
+          batchReap(batch, ZC_WAIT_MS) > 0)
+      ;
+   free(batch->zcRing);
+   free(batch->zcSeen);
+   batch->zcRing = NULL;
+   batch->zcSeen = NULL;
+   batch->zerocopy = 0;
+}
+
+void batchInitRecv(RecvBatch *batch, int size)
+{
+   struct msghdr *hdr;
+   int i;
+
+   if (size < 1 || size > BATCH_MAX)
+      size = BATCH_MAX;
+
+   memset(batch->msgs, 0, sizeof(batch->msgs));
+   batch->size = size;
+   batch->count = 0;
+   batch->groBuf = NULL;
+   for (i = 0; i < BATCH_MAX; i++)
+   {
+      batch->iovs[i].iov_base = &batch->pkts[i];
+      batch->iovs[i].iov_len = sizeof(Packet);
+
+      hdr = &batch->msgs[i].msg_hdr;
+      hdr->msg_name = &batch->addrs[i];
+      hdr->msg_iov = &batch->iovs[i];
+      hdr->msg_iovlen = 1;
+   }
+}
+
+int batchEnableGro(RecvBatch *batch, int sock)
+{
+   int on;
+   int i;
+
+   on = 1;
+   if (setsockopt(sock, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0)
+      return -1;
+
+   batch->groBuf = malloc((size_t)batch->size * GRO_SLOT_SIZE);
+   if (batch->groBuf == NULL)
+      return -1;
+   for (i = 0; i < batch->size; i++)
+   {
+      batch->iovs[i].iov_base = batch->groBuf + (size_t)i * GRO_SLOT_SIZE;
+      batch->iovs[i].iov_len = GRO_BUF_SIZE;
+      batch->msgs[i].msg_hdr.msg_control = batch->groCtrl[i];
+   }
+   return 0;
+}
+
+void batchFreeRecv(RecvBatch *batch)
+{
+   free(batch->groBuf);
+   batch->groBuf = NULL;
+}
+
+int batchRecv(RecvBatch *batch, int sock, int flags)
+{
+   struct msghdr *hdr;
+   struct cmsghdr *cm;
+   char *buf;
+   int seg;
+   int step;
+   int len;
+   int off;
+   int segs;
+   int n;
+   int k;
+   int i;
+   int ret;
+
+   for (i = 0; i < batch->size; i++)
+   {
+      batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+      if (batch->groBuf != NULL)
+         batch->msgs[i].msg_hdr.msg_controllen = sizeof(batch->groCtrl[i]);
+   }
+
+   do
+      ret = recvmmsg(sock, batch->msgs, batch->size, flags, NULL);
+   while (ret < 0 && errno == EINTR);
+
+   //split coalesced datagrams at the segment size the kernel reports
+   n = 0;
+   for (i = 0; i < ret; i++)
+   {
+      hdr = &batch->msgs[i].msg_hdr;
+      buf = batch->iovs[i].iov_base;
+      len = batch->msgs[i].msg_len;
+      seg = len;
+      if (batch->groBuf != NULL)
+      {
+         for (cm = CMSG_FIRSTHDR(hdr); cm != NULL; cm = CMSG_NXTHDR(hdr, cm))
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+               seg = *(int *)CMSG_DATA(cm);
+      }
+      if (seg <= 0)
+         seg = len;
+
+      //segments start every seg bytes, which need not keep the headers
+      //aligned, so move them up to 8 byte boundaries from the last one down
+      step = (seg + 7) & ~7;
+      segs = len > 0 ? (len + seg - 1) / seg : 0;
+      if (segs > BATCH_OUT_MAX - n)
+         segs = BATCH_OUT_MAX - n;
+      for (k = segs - 1; k >= 0; k--)
+      {
+         off = k * seg;
+         batch->len[n + k] = len - off < seg ? len - off : seg;
+         if (step != seg)
+            memmove(buf + (size_t)k * step, buf + off, batch->len[n + k]);
+         batch->pkt[n + k] = (Packet *)(buf + (size_t)k * step);
+         batch->from[n + k] = &batch->addrs[i];
+      }
+      n += segs;
+   }
+
+   batch->count = n;
+   return ret < 0 ? -1 : n;
+}
@@ -0,0 +1,126 @@
+//udpBatch Batched datagram I/O with sendmmsg/recvmmsg
+
+#ifndef UDPBATCH_H
+#define UDPBATCH_H
+
+//sendmmsg/recvmmsg need _GNU_SOURCE defined before the first system header
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include "udpProtocol.h"
+#include "udpImpair.h"
+
+#define BATCH_MAX	64		//most datagrams moved by one syscall
+#define BATCH_DEFAULT	32		//batch size when none is given
+#define GSO_MAX_SEGS	64		//most segments the kernel splits from one send
+#define GSO_MAX_BYTES	65000		//most bytes in one segmented send
+#define BATCH_OUT_MAX	(BATCH_MAX * GSO_MAX_SEGS)	//most datagrams one receive call can return
+#define GRO_BUF_SIZE	65536		//receive buffer for one coalesced datagram
+#define GRO_SLOT_SIZE	(GRO_BUF_SIZE + BATCH_OUT_MAX * 7)	//room to move every segment to an 8 byte boundary
+#define ZC_RING		4096		//header copies that can wait on zero-copy completions
+#define ZC_HDR_MAX	64		//largest first part copied into the ring
+#define ZC_WAIT_MS	1000		//longest wait for a completion before reusing a header copy
+
+/*
+	DATA STRUCTURES
+*/
+
+//header copy of a datagram sent with MSG_ZEROCOPY, the kernel reads it
+//until the send completes
+typedef struct {
+   int busy;			//set until the send carrying it completes
+   uint32_t id;			//zero-copy send id of that send
+   char hdr[ZC_HDR_MAX];
+} ZcEntry;
+
+//datagrams queued for one sendmmsg call
+typedef struct {
+   int sock;			//socket to send on
+   int size;			//datagrams queued before an automatic flush
+   int count;			//datagrams currently queued
+   struct mmsghdr msgs[BATCH_MAX];
+   struct iovec iovs[BATCH_MAX][2];	//header and payload of each datagram
+   int lens[BATCH_MAX];		//bytes in each datagram
+   struct sockaddr_in addrs[BATCH_MAX];
+
+   int gso;			//set when runs of equal datagrams go out as one UDP_SEGMENT send
+   struct mmsghdr gsoMsgs[BATCH_MAX];	//segmented sends built at flush time
+   int gsoFirst[BATCH_MAX + 1];	//first datagram of each segmented send, then count
+   char gsoCtrl[BATCH_MAX][CMSG_SPACE(sizeof(uint16_t))];	//UDP_SEGMENT control messages
+
+   int zerocopy;		//set when datagrams go out with MSG_ZEROCOPY
+   ZcEntry *zcRing;		//header copies, ZC_RING of them
+   uint32_t zcHead;		//ring entries handed out so far
+   int zcEntry[BATCH_MAX];	//ring entry of each queued datagram
+   uint8_t *zcSeen;		//completions seen, indexed by send id % ZC_RING
+   uint32_t zcNext;		//id the kernel gives the next zero-copy send
+   uint32_t zcLow;		//every send id below this has completed
+   unsigned long zcCopied;	//completed sends the kernel copied anyway
+
+   Impair *impair;		//faults applied to every queued datagram, NULL for none
+} SendBatch;
+
+//datagrams filled by one recvmmsg call
+typedef struct {
+   int size;			//most datagrams taken per call
+   int count;			//datagrams received by the last call
+   struct mmsghdr msgs[BATCH_MAX];
+   struct iovec iovs[BATCH_MAX];
+   struct sockaddr_in addrs[BATCH_MAX];	//sender of each datagram
+   Packet pkts[BATCH_MAX];	//received datagrams
+
+   char *groBuf;		//coalesced datagrams when UDP_GRO is on, NULL otherwise
+   char groCtrl[BATCH_MAX][CMSG_SPACE(sizeof(int))];	//UDP_GRO control messages
+
+   Packet *pkt[BATCH_OUT_MAX];	//datagrams of the last call, split from groBuf when coalesced
+   int len[BATCH_OUT_MAX];	//length of each datagram
+   struct sockaddr_in *from[BATCH_OUT_MAX];	//sender of each datagram
+} RecvBatch;
+
+
+/*
+	FUNCTIONS
+*/
+
+//prepares an empty send batch of size datagrams (1 is one sendto per datagram)
+void batchInitSend(SendBatch *batch, int sock, int size);
+
+//applies the faults of imp (started on the same socket) to every datagram queued from now on, NULL for none
+void batchImpair(SendBatch *batch, Impair *imp);
+
+//queues len bytes at buf for addr, flushing once size datagrams are queued - buf must stay valid until the flush
+void batchAdd(SendBatch *batch, void *buf, int len, struct sockaddr_in *addr);
+
+//queues one datagram of hdrLen bytes at hdr followed by dataLen bytes at data,
+//with zero-copy the header is copied and data must not change until the send completes
+void batchAddParts(SendBatch *batch, void *hdr, int hdrLen, void *data, int dataLen,
+                   struct sockaddr_in *addr);
+
+//sends every queued datagram, returns the number sent
+int batchFlush(SendBatch *batch);
+
+//prepares a receive batch of size datagrams
+void batchInitRecv(RecvBatch *batch, int size);
+
+//receives up to size datagrams (more with GRO), flags as for recvmmsg (MSG_WAITFORONE blocks for the first only), returns the count or -1
+int batchRecv(RecvBatch *batch, int sock, int flags);
+
+//releases the GRO buffers of a receive batch
+void batchFreeRecv(RecvBatch *batch);
+
+//sends runs of equal sized datagrams with UDP_SEGMENT, returns -1 if the kernel lacks GSO
+int batchEnableGso(SendBatch *batch);
+
+//sends datagrams with MSG_ZEROCOPY, returns -1 if the kernel lacks SO_ZEROCOPY
+int batchEnableZerocopy(SendBatch *batch);
+
+//collects zero-copy completions from the error queue, waiting up to waitMs for one, returns the number collected
+int batchReap(SendBatch *batch, int waitMs);
+
+//releases the zero-copy ring of a send batch
+void batchFreeSend(SendBatch *batch);
+
+//receives coalesced datagrams with UDP_GRO, returns -1 if the kernel lacks GRO
+int batchEnableGro(RecvBatch *batch, int sock);
+
+#endif
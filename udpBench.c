@@ -0,0 +1,1666 @@
+//================================================== file = udpBench.c =======
+//=  Benchmarks for the building blocks of the Reliable UDP Protocol         =
+//=============================================================================
+//=  Notes:                                                                   =
+//=    1) This program  compiles for BSD sockets only.                        =
+//=    2) Every benchmark runs on loopback inside this one process            =
+//=    3) This program take command line input as shown below                 =
+//=---------------------------------------------------------------------------=
+//=  Example execution: (./udpBench batch 200000)                             =
+//=    batch  packets/s                                                       =
+//=        1     312345                                                       =
+//=---------------------------------------------------------------------------=
+//=  Build: gcc udpBench.c udpProtocol.c udpBatch.c udpSource.c udpStorage.c=
+//=         udpRing.c udpConn.c udpFec.c udpCompress.c udpResume.c udpDelta.c =
+//=         udpImpair.c udpMetrics.c udpTimer.c udpAck.c udpBundle.c        =
+//=         udpMerkle.c -lz                                                   =
+//=         -lpthread -lnsl for BSD                                           =
+//=         (-DUSE_URING for the io_uring engine)                             =
+//=---------------------------------------------------------------------------=
+//=  Execute: ./udpBench batch|gso|crc|fec|send|store|scale|delta [packets]   =
+//=           ./udpBench matrix [-s MB,..] [-l loss,..] [-r ms,..]             =
+//=                             [-x MB:loss:ms,..] [-p 'args;..'] [-t seconds] =
+//=                             [-j]                                          =
+//=           ./udpBench files [files]                                        =
+//=           ./udpBench merkle [MB]                                          =
+//=---------------------------------------------------------------------------=
+//=  Author: Justin Bramel                                                    =
+//=          University of South Florida                                      =
+//=          Email: jbramel@mail.usf.edu                                    =
+//=---------------------------------------------------------------------------=
+//=  History:  11/27/2017 - Final version                                     =
+//=============================================================================
+#define  BSD               // WIN for Winsock and BSD for BSD sockets
+#define  _GNU_SOURCE       // Needed for sendmmsg() and recvmmsg()
+
+//----- Include files ---------------------------------------------------------
+#include <stdio.h>          // Needed for printf()
+#include <string.h>         // Needed for memset() and strcmp()
+#include <stdlib.h>         // Needed for exit() and atoi()
+#include <unistd.h>         // Needed for close() and write()
+#include <sys/resource.h>   // Needed for getrusage()
+#include <pthread.h>        // Needed for the scale benchmark threads
+#include <fcntl.h>          // Needed for open()
+#include <errno.h>          // Needed for EADDRINUSE
+#include <signal.h>         // Needed for kill()
+#include <dirent.h>         // Needed for readdir()
+#include <libgen.h>         // Needed for dirname()
+#include <sys/wait.h>       // Needed for wait4()
+#include <sys/stat.h>       // Needed for mkdir()
+#include <poll.h>           // Needed for poll()
+#include "udpProtocol.h"
+#include "udpBatch.h"
+#include "udpSource.h"
+#include "udpStorage.h"
+#include "udpConn.h"
+#include "udpFec.h"
+#include "udpDelta.h"
+#include "udpMerkle.h"
+#ifdef BSD
+  #include <sys/types.h>    // Needed for sockets stuff
+  #include <netinet/in.h>   // Needed for sockets stuff
+  #include <sys/socket.h>   // Needed for sockets stuff
+  #include <arpa/inet.h>    // Needed for sockets stuff
+#endif
+
+//----- Defines ---------------------------------------------------------------
+#define  BENCH_PACKETS  200000      // Packets per run when none are given
+#define  BENCH_FILE     (64 << 20)  // Bytes in the file sent by benchSend
+#define  SCALE_IDLE_MS  200         // Quiet time that ends a scale run
+#define  MATRIX_PORT    1050        // Port udpServer receives on
+#define  MATRIX_TIMEOUT 120         // Seconds a matrix run may take when -t is not given
+#define  MATRIX_UP_MS   2000        // Longest wait for udpServer to bind its port
+#define  MATRIX_LINGER_MS 5000      // Longest wait for udpServer to exit after the client
+#define  MATRIX_MAX     16          // Most values in one matrix dimension
+#define  MATRIX_ARGS    32          // Most arguments passed to udpClient or udpServer
+#define  BENCH_FILES    1000        // Files per run of the files benchmark when none are given
+#define  FILES_SIZE_MAX 8192        // Largest file it sends, sizes spread from 1 byte up
+#define  FILES_PER_DIR  100         // Files per directory of the tree it sends
+#define  FILES_TIMEOUT  300         // Seconds a files run may take
+
+//----- Scale benchmark state -------------------------------------------------
+typedef struct {
+  pthread_t            thread;          // Thread running the sender or worker
+  int                  sock;            // Socket of the thread
+  struct sockaddr_in   peer;            // Worker port, for a sender
+  uint32_t             connId;          // Connection ID of a sender's packets
+  int                  packets;         // Packets to send, or received
+  unsigned long long   last;            // Time of the last packet received
+} ScaleThread;
+
+//----- Matrix benchmark result -----------------------------------------------
+typedef struct {
+  const char          *status;          // ok, differ, failed or timeout
+  double               seconds;         // Client start to exit
+  unsigned long long   cpuUs;           // CPU time of client and server together
+  unsigned long        sent;            // DATA packets the client sent once
+  unsigned long        resent;          // DATA packets it sent again
+  unsigned long long   p50;             // Median ACK latency (in us)
+  unsigned long long   p99;             // 99th percentile ACK latency (in us)
+} MatrixResult;
+
+//----- Prototypes ------------------------------------------------------------
+int benchBatch(int packets);
+int benchGso(int packets);
+int benchCrc(int packets);
+int benchFec(int packets);
+int benchSend(int packets);
+int benchStore(int packets);
+int benchScale(int packets);
+int benchDelta(int packets);
+int benchMatrix(int argc, char *argv[]);
+int benchFiles(int files, char *self);
+int benchMerkle(int megabytes);
+
+//===== Bind a UDP socket to an ephemeral loopback port =======================
+static int loopbackSocket(struct sockaddr_in *addr)
+{
+  int                  sock;            // Socket descriptor
+  int                  bufSize;         // Socket buffer size
+  socklen_t            addr_len;        // Length of addr
+
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0)
+  {
+    printf("*** ERROR - socket() failed \n");
+    exit(-1);
+  }
+  bufSize = 4 * 1024 * 1024;
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof(bufSize));
+  setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &bufSize, sizeof(bufSize));
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_port = 0;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(sock, (struct sockaddr *)addr, sizeof(*addr)) < 0)
+  {
+    printf("*** ERROR - bind() failed \n");
+    exit(-1);
+  }
+  addr_len = sizeof(*addr);
+  getsockname(sock, (struct sockaddr *)addr, &addr_len);
+  return(sock);
+}
+
+//===== Main program ==========================================================
+int main(int argc, char *argv[])
+{
+  int                  packets;         // Packets per run
+
+  if (argc < 2)
+  {
+    printf("usage: 'udpBench mode [packets]' where mode is one of          \n");
+    printf("       batch - packets/s against sendmmsg()/recvmmsg() batch   \n");
+    printf("               size on loopback                                \n");
+    printf("       gso   - packets/s and syscalls with and without UDP     \n");
+    printf("               GSO/GRO at the largest batch size               \n");
+    printf("       crc   - CRC32C GB/s of the dispatched and table driven  \n");
+    printf("               implementations for common packet sizes         \n");
+    printf("       fec   - GF(256) GB/s of the SIMD and table kernels, and \n");
+    printf("               encode/rebuild GB/s for common k:m codes        \n");
+    printf("       send  - sender CPU per GB reading the file, sending it  \n");
+    printf("               from a mapping and with MSG_ZEROCOPY            \n");
+    printf("       store - MB/s and write calls storing received packets   \n");
+    printf("               one write() each and coalesced by udpStorage    \n");
+    printf("       scale - aggregate packets/s into 1 to N SO_REUSEPORT     \n");
+    printf("               workers steered by connection ID                \n");
+    printf("       delta - weak/strong hash, signature and scan GB/s against \n");
+    printf("               the share of changed blocks                     \n");
+    printf("       matrix - goodput, retransmissions, CPU per GB and ACK    \n");
+    printf("               latency of udpClient to udpServer over sizes x  \n");
+    printf("               loss x RTT x settings and extra cells (-x),     \n");
+    printf("               as CSV (-j for JSON)                            \n");
+    printf("       files - files/s of udpClient to udpServer sending a tree \n");
+    printf("               of small files as one directory and one by one  \n");
+    printf("       merkle - hash tree GB/s of 1 to %d threads against CRC32C  \n", MERKLE_THREADS_MAX);
+    printf("               on one thread, over a file of packets MB (64)   \n");
+    return(0);
+  }
+  // The matrix options follow the mode, its argv[0] names udpBench again so
+  // the programs next to it are found
+  if (strcmp(argv[1], "matrix") == 0)
+  {
+    argv[1] = argv[0];
+    return(benchMatrix(argc - 1, argv + 1));
+  }
+  packets = argc > 2 ? atoi(argv[2]) : BENCH_PACKETS;
+
+  if (strcmp(argv[1], "batch") == 0)
+    return(benchBatch(packets));
+  if (strcmp(argv[1], "gso") == 0)
+    return(benchGso(packets));
+  if (strcmp(argv[1], "crc") == 0)
+    return(benchCrc(packets));
+  if (strcmp(argv[1], "fec") == 0)
+    return(benchFec(packets));
+  if (strcmp(argv[1], "send") == 0)
+    return(benchSend(packets));
+  if (strcmp(argv[1], "store") == 0)
+    return(benchStore(packets));
+  if (strcmp(argv[1], "scale") == 0)
+    return(benchScale(packets));
+  if (strcmp(argv[1], "delta") == 0)
+    return(benchDelta(packets));
+  if (strcmp(argv[1], "files") == 0)
+    return(benchFiles(argc > 2 ? atoi(argv[2]) : BENCH_FILES, argv[0]));
+  if (strcmp(argv[1], "merkle") == 0)
+    return(benchMerkle(argc > 2 ? atoi(argv[2]) : 0));
+
+  printf("*** ERROR - unknown benchmark '%s' \n", argv[1]);
+  return(1);
+}
+
+//=============================================================================
+//=  Function to measure packets per second against batch size              =
+//=============================================================================
+//=  Inputs:                                                                  =
+//=    packets -- Number of full size packets moved for each batch size      =
+//=---------------------------------------------------------------------------=
+//=  Outputs:                                                                 =
+//=    Prints one line per batch size, returns 0                              =
+//=---------------------------------------------------------------------------=
+//=  Side effects:                                                            =
+//=    Each packet is sent and received once, both syscalls are counted       =
+//=---------------------------------------------------------------------------=
+int benchBatch(int packets)
+{
+  int                  send_s;          // Sending socket
+  int                  recv_s;          // Receiving socket
+  struct sockaddr_in   send_addr;       // Address of send_s
+  struct sockaddr_in   recv_addr;       // Address of recv_s
+  SendBatch            sendBatch;       // Outgoing batch
+  RecvBatch            recvBatch;       // Incoming batch
+  Packet               pkt;             // Packet sent over and over
+  int                  size;            // Batch size under test
+  int                  moved;           // Packets received so far
+  int                  got;             // Packets received for this batch
+  int                  i;               // Loop counter
+  unsigned long long   start;           // Start time (in us)
+  unsigned long long   elapsed;         // Run time (in us)
+
+  send_s = loopbackSocket(&send_addr);
+  recv_s = loopbackSocket(&recv_addr);
+  memset(&pkt, 0, sizeof(pkt));
+  createPacket(&pkt, PAYLOAD_SIZE, 0, 0, DATA);
+
+  printf("batch  packets/s\n");
+  for (size = 1; size <= BATCH_MAX; size *= 2)
+  {
+    batchInitSend(&sendBatch, send_s, size);
+    batchInitRecv(&recvBatch, size);
+
+    start = nowUs();
+    for (moved = 0; moved < packets; moved += got)
+    {
+      for (i = 0; i < size; i++)
+        batchAdd(&sendBatch, &pkt, PKT_SIZE, &recv_addr);
+      batchFlush(&sendBatch);
+
+      //loopback delivers synchronously, one call normally takes the batch
+      for (got = 0; got < size; got += recvBatch.count)
+        batchRecv(&recvBatch, recv_s, MSG_WAITFORONE);
+    }
+    elapsed = nowUs() - start;
+
+    printf("%5d  %9.0f\n", size, moved * 1e6 / (elapsed ? elapsed : 1));
+  }
+
+  close(send_s);
+  close(recv_s);
+  return(0);
+}
+
+//=============================================================================
+//=  Function to compare plain batches with GSO sends and GRO receives       =
+//=============================================================================
+//=  Inputs:                                                                  =
+//=    packets -- Number of full size packets moved for each mode             =
+//=---------------------------------------------------------------------------=
+//=  Outputs:                                                                 =
+//=    Prints one line per mode, returns 0                                    =
+//=---------------------------------------------------------------------------=
+//=  Side effects:                                                            =
+//=    Modes the kernel does not support are reported and skipped            =
+//=---------------------------------------------------------------------------=
+int benchGso(int packets)
+{
+  int                  send_s;          // Sending socket
+  int                  recv_s;          // Receiving socket
+  struct sockaddr_in   send_addr;       // Address of send_s
+  struct sockaddr_in   recv_addr;       // Address of recv_s
+  SendBatch            sendBatch;       // Outgoing batch
+  RecvBatch            recvBatch;       // Incoming batch
+  Packet               pkt;             // Packet sent over and over
+  int                  mode;            // 0 plain, 1 GSO, 2 GSO and GRO
+  int                  moved;           // Packets received so far
+  int                  got;             // Packets received for this batch
+  int                  calls;           // Receive syscalls made
+  int                  i;               // Loop counter
+  unsigned long long   start;           // Start time (in us)
+  unsigned long long   elapsed;         // Run time (in us)
+  static const char   *names[] = { "plain", "gso", "gso+gro" };
+
+  memset(&pkt, 0, sizeof(pkt));
+  createPacket(&pkt, PAYLOAD_SIZE, 0, 0, DATA);
+
+  printf("mode      packets/s  packets/recv call\n");
+  for (mode = 0; mode < 3; mode++)
+  {
+    send_s = loopbackSocket(&send_addr);
+    recv_s = loopbackSocket(&recv_addr);
+    batchInitSend(&sendBatch, send_s, BATCH_MAX);
+    batchInitRecv(&recvBatch, BATCH_MAX);
+    if ((mode >= 1 && batchEnableGso(&sendBatch) < 0) ||
+        (mode == 2 && batchEnableGro(&recvBatch, recv_s) < 0))
+    {
+      printf("%-8s  not supported by this kernel\n", names[mode]);
+      close(send_s);
+      close(recv_s);
+      continue;
+    }
+
+    calls = 0;
+    start = nowUs();
+    for (moved = 0; moved < packets; moved += got)
+    {
+      for (i = 0; i < BATCH_MAX; i++)
+        batchAdd(&sendBatch, &pkt, PKT_SIZE, &recv_addr);
+      batchFlush(&sendBatch);
+
+      for (got = 0; got < BATCH_MAX; got += recvBatch.count)
+      {
+        batchRecv(&recvBatch, recv_s, MSG_WAITFORONE);
+        calls++;
+      }
+    }
+    elapsed = nowUs() - start;
+
+    printf("%-8s  %9.0f  %17.1f\n", names[mode],
+        moved * 1e6 / (elapsed ? elapsed : 1), (double)moved / calls);
+    batchFreeRecv(&recvBatch);
+    close(send_s);
+    close(recv_s);
+  }
+
+  return(0);
+}
+
+//=============================================================================
+//=  Function to measure checksum throughput against packet size            =
+//=============================================================================
+//=  Inputs:                                                                  =
+//=    packets -- Number of packets checksummed at each size                  =
+//=---------------------------------------------------------------------------=
+//=  Outputs:                                                                 =
+//=    Prints one line per packet size, returns 0                             =
+//=---------------------------------------------------------------------------=
+//=  Side effects:                                                            =
+//=    Both columns match on CPUs without SSE4.2                              =
+//=---------------------------------------------------------------------------=
+int benchCrc(int packets)
+{
+  static const int     sizes[] = { 64, PKT_SIZE, 1472, HEADER_SIZE + PAYLOAD_MAX };
+  Packet               pkt;             // Packet being checksummed
+  volatile uint32_t    sum;             // Running checksum, keeps the work live
+  double               rate[2];         // GB/s of each implementation
+  int                  impl;            // 0 dispatched, 1 table driven
+  int                  size;            // Bytes checksummed per packet
+  int                  i;               // Loop counter
+  int                  j;               // Loop counter
+  unsigned long long   start;           // Start time (in us)
+  unsigned long long   elapsed;         // Run time (in us)
+
+  for (i = 0; i < (int)sizeof(pkt); i++)
+    ((unsigned char *)&pkt)[i] = rand();
+
+  sum = 0;
+  printf(" size  crc32c GB/s  table GB/s\n");
+  for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+  {
+    size = sizes[i];
+    for (impl = 0; impl < 2; impl++)
+    {
+      start = nowUs();
+      for (j = 0; j < packets; j++)
+        sum ^= impl == 0 ? crc32c(sum, &pkt, size) : crc32cSoftware(sum, &pkt, size);
+      elapsed = nowUs() - start;
+      rate[impl] = (double)packets * size / (elapsed ? elapsed : 1) / 1e3;
+    }
+    printf("%5d  %11.2f  %10.2f\n", size, rate[0], rate[1]);
+  }
+
+  return(0);
+}
+
+//=============================================================================
+//=  Function to measure FEC throughput                                       =
+//=============================================================================
+//=  Inputs:                                                                  =
+//=    packets -- Number of DATA packets encoded and decoded for each code    =
+//=---------------------------------------------------------------------------=
+//=  Outputs:                                                                 =
+//=    Prints the kernel rates, then one line per code, returns 0             =
+//=---------------------------------------------------------------------------=
+//=  Side effects:                                                            =
+//=    Both kernel columns match on CPUs without SSSE3; every group is        =
+//=    decoded with m DATA packets lost, the most the code rebuilds           =
+//=---------------------------------------------------------------------------=
+int benchFec(int packets)
+{
+  static const int     codes[][2] = { { 8, 1 }, { 16, 2 }, { 16, 4 }, { 32, 8 }, { 64, 16 } };
+  static uint8_t       src[PAYLOAD_MAX];        // Payload multiplied
+  static uint8_t       dst[PAYLOAD_MAX];        // Payload added to
+  static Packet        repair[FEC_PARITY_MAX];  // REPAIR packets of a group
+  FecEncoder           enc;             // Encoder under test
+  FecDecoder           dec;             // Decoder under test
+  FecRebuilt           rebuilt[FEC_PARITY_MAX]; // Packets rebuilt
+  double               rate[2];         // GB/s of each kernel or stage
+  int                  impl;            // 0 dispatched, 1 table driven
+  int                  k;               // DATA packets per group
+  int                  m;               // REPAIR packets per group
+  int                  groups;          // Groups per run
+  int                  count;           // REPAIR packets of a group
+  int                  lost;            // Packets not rebuilt
+  int                  c;               // Code being measured
+  int                  g;               // Group being encoded
+  int                  i;               // Loop counter
+  int                  j;               // Loop counter
+  unsigned long long   start;           // Start time (in us)
+  unsigned long long   elapsed;         // Run time (in us)
+
+  for (i = 0; i < PAYLOAD_MAX; i++)
+    src[i] = rand();
+
+  // Multiply and add one jumbo payload at a time
+  for (impl = 0; impl < 2; impl++)
+  {
+    start = nowUs();
+    for (j = 0; j < packets; j++)
+    {
+      if (impl == 0)
+        fecMulAdd(dst, src, j % 255 + 1, PAYLOAD_MAX);
+      else
+        fecMulAddSoftware(dst, src, j % 255 + 1, PAYLOAD_MAX);
+    }
+    elapsed = nowUs() - start;
+    rate[impl] = (double)packets * PAYLOAD_MAX / (elapsed ? elapsed : 1) / 1e3;
+  }
+  printf("mul-add GB/s  simd %.2f  table %.2f\n", rate[0], rate[1]);
+
+  // Encode groups of jumbo payloads, then rebuild m lost packets per group
+  printf(" code  encode GB/s  rebuild GB/s\n");
+  for (c = 0; c < (int)(sizeof(codes) / sizeof(codes[0])); c++)
+  {
+    k = codes[c][0];
+    m = codes[c][1];
+    groups = packets / k > 0 ? packets / k : 1;
+    if (fecEncoderInit(&enc, k, m, PAYLOAD_MAX) < 0 ||
+        fecDecoderInit(&dec, k, m, PAYLOAD_MAX, k) < 0)
+    {
+      printf("*** ERROR - unable to allocate a %d:%d code \n", k, m);
+      exit(-1);
+    }
+
+    start = nowUs();
+    for (g = 0; g < groups; g++)
+    {
+      for (i = 0; i < k; i++)
+        fecEncode(&enc, g * k + i, (char *)src, PAYLOAD_MAX);
+      fecFinish(&enc);
+    }
+    elapsed = nowUs() - start;
+    rate[0] = (double)groups * k * PAYLOAD_MAX / (elapsed ? elapsed : 1) / 1e3;
+
+    // Every group has the same REPAIR packets, the decoder only sees seqNums
+    for (i = 0; i < k; i++)
+      fecEncode(&enc, i, (char *)src, PAYLOAD_MAX);
+    count = fecFinish(&enc);
+    memcpy(repair, enc.repair, count * sizeof(Packet));
+    for (j = 0; j < count; j++)
+      readPacket(&repair[j]);
+
+    lost = 0;
+    start = nowUs();
+    for (g = 0; g < groups; g++)
+    {
+      for (i = m; i < k; i++)
+        fecData(&dec, g * k + i, (char *)src, PAYLOAD_MAX, rebuilt);
+      for (j = 0; j < count; j++)
+      {
+        repair[j].seqNum = g * k;
+        lost -= fecRepair(&dec, &repair[j], rebuilt);
+      }
+      lost += m;
+    }
+    elapsed = nowUs() - start;
+    rate[1] = (double)groups * k * PAYLOAD_MAX / (elapsed ? elapsed : 1) / 1e3;
+    printf("%2d:%-2d  %11.2f  %12.2f%s\n", k, m, rate[0], rate[1],
+           lost ? "  *** packets not rebuilt" : "");
+
+    fecEncoderFree(&enc);
+    fecDecoderFree(&dec);
+  }
+
+  return(0);
+}
+
+//===== CPU time used by this process (in us) =================================
+static unsigned long long cpuUs(void)
+{
+  struct rusage        usage;           // User and system time
+
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ULL +
+         usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+//===== Open the file for benchSend mode, mode 3 with a reader thread =========
+static void sendOpen(Source *src, char *fileName, int mode)
+{
+  sourceOpen(src, fileName, mode == 1 || mode == 2);
+  if (mode == 3 && sourceStart(src, PAYLOAD_MAX, BATCH_MAX) < 0)
+    printf("  *** WARNING - no reader thread, reading in line \n");
+}
+
+//===== Next block for benchSend, waiting for the reader thread ===============
+static int sendNext(Source *src, Slot *slot)
+{
+  struct pollfd        fd;              // Reader to wait for
+  int                  length;          // Bytes in the block
+
+  while ((length = sourceNext(src, slot, PAYLOAD_MAX)) < 0)
+  {
+    fd.fd = sourceWaitFd(src);
+    fd.events = POLLIN;
+    poll(&fd, 1, -1);
+  }
+  return length;
+}
+
+//=============================================================================
+//=  Function to measure the sender CPU cost of each payload source         =
+//=============================================================================
+//=  Inputs:                                                                  =
+//=    packets -- Number of jumbo packets sent in each mode                   =
+//=---------------------------------------------------------------------------=
+//=  Outputs:                                                                 =
+//=    Prints one line per mode, returns 0                                    =
+//=---------------------------------------------------------------------------=
+//=  Side effects:                                                            =
+//=    Writes and removes a BENCH_FILE byte file in /tmp. Nothing reads the  =
+//=    receiving socket, so loopback delivery stops at its full buffer and   =
+//=    the CPU cost is the sender's. Loopback copies zero-copy sends anyway. =
+//=---------------------------------------------------------------------------=
+int benchSend(int packets)
+{
+  char                 fileName[] = "/tmp/udpBenchXXXXXX";
+  static char          block[1 << 20];  // Data written to the file
+  int                  send_s;          // Sending socket
+  int                  recv_s;          // Receiving socket
+  struct sockaddr_in   send_addr;       // Address of send_s
+  struct sockaddr_in   recv_addr;       // Address of recv_s
+  SendBatch            sendBatch;       // Outgoing batch
+  Source               src;             // File being sent
+  Slot                 slot;            // Window slot reused for every packet
+  int                  fh;              // File handle
+  int                  mode;            // 0 read, 1 mapped, 2 zero-copy, 3 reader thread
+  int                  held;            // Blocks taken from the reader thread
+  int                  length;          // Payload bytes of the packet
+  int                  i;               // Loop counter
+  unsigned long long   bytes;           // Payload bytes sent
+  unsigned long long   start;           // Start time (in us)
+  unsigned long long   cpu;             // CPU time at the start (in us)
+  unsigned long long   elapsed;         // Run time (in us)
+  static const char   *names[] = { "read", "mmap", "zerocopy", "reader" };
+
+  fh = mkstemp(fileName);
+  if (fh < 0)
+  {
+    printf("*** ERROR - unable to create '%s' \n", fileName);
+    exit(-1);
+  }
+  for (i = 0; i < (int)sizeof(block); i++)
+    block[i] = rand();
+  for (i = 0; i < BENCH_FILE / (int)sizeof(block); i++)
+    write(fh, block, sizeof(block));
+  close(fh);
+
+  slot.pkt = malloc(sizeof(Packet));
+  printf("mode       GB/s  CPU s/GB\n");
+  for (mode = 0; mode < 4; mode++)
+  {
+    send_s = loopbackSocket(&send_addr);
+    recv_s = loopbackSocket(&recv_addr);
+    batchInitSend(&sendBatch, send_s, BATCH_MAX);
+    batchEnableGso(&sendBatch);
+    if (mode == 2 && batchEnableZerocopy(&sendBatch) < 0)
+    {
+      printf("%-8s   not supported by this kernel\n", names[mode]);
+      close(send_s);
+      close(recv_s);
+      continue;
+    }
+
+    sendOpen(&src, fileName, mode);
+    held = 0;
+    bytes = 0;
+    start = nowUs();
+    cpu = cpuUs();
+    for (i = 0; i < packets; i++)
+    {
+      length = sendNext(&src, &slot);
+      if (length == 0)
+      {
+        // The queued datagrams still point into the file's blocks
+        batchFlush(&sendBatch);
+        sourceClose(&src);
+        sendOpen(&src, fileName, mode);
+        held = 0;
+        length = sendNext(&src, &slot);
+      }
+      createPacket(slot.pkt, length, i, 0, DATA);
+      batchAddParts(&sendBatch, slot.pkt, HEADER_SIZE, slot.data, length, &recv_addr);
+      bytes += length;
+
+      // A full batch is flushed as it fills, so only the last BATCH_MAX
+      // blocks may still be queued
+      if (++held > BATCH_MAX)
+        sourceRelease(&src, held - BATCH_MAX);
+    }
+    batchFlush(&sendBatch);
+    batchFreeSend(&sendBatch);
+    elapsed = nowUs() - start;
+    cpu = cpuUs() - cpu;
+    sourceClose(&src);
+
+    printf("%-8s  %5.2f  %9.3f\n", names[mode], bytes / 1e3 / (elapsed ? elapsed : 1),
+        cpu / 1e6 / (bytes / 1e9));
+    close(send_s);
+    close(recv_s);
+  }
+
+  free(slot.pkt);
+  unlink(fileName);
+  return(0);
+}
+
+//=============================================================================
+//=  Function to compare ways of storing received packets                   =
+//=============================================================================
+//=  Inputs:                                                                  =
+//=    packets -- Number of default sized packets stored in each mode         =
+//=---------------------------------------------------------------------------=
+//=  Outputs:                                                                 =
+//=    Prints one line per mode, returns 0                                    =
+//=---------------------------------------------------------------------------=
+//=  Side effects:                                                            =
+//=    Writes and removes a file in /tmp. Packets come in batches of         =
+//=    BATCH_DEFAULT like recvFiles() sees them, the reversed mode stores     =
+//=    each batch back to front so no two blocks are adjacent               =
+//=---------------------------------------------------------------------------=
+int benchStore(int packets)
+{
+  char                 fileName[] = "/tmp/udpBenchXXXXXX";
+  static char          batch[BATCH_DEFAULT][PAYLOAD_SIZE]; // Packet payloads
+  Storage              store;           // File being stored
+  int                  fh;              // File handle
+  int                  mode;            // 0 write(), 1 in order, 2 reversed
+  int                  seq;             // First seqNum of the batch
+  int                  count;           // Packets in the batch
+  int                  i;               // Loop counter
+  unsigned long        calls;           // Write calls made
+  unsigned long long   start;           // Start time (in us)
+  unsigned long long   elapsed;         // Run time (in us)
+  static const char   *names[] = { "write", "store", "reversed" };
+
+  for (i = 0; i < (int)sizeof(batch); i++)
+    ((char *)batch)[i] = rand();
+
+  fh = mkstemp(fileName);
+  if (fh < 0)
+  {
+    printf("*** ERROR - unable to create '%s' \n", fileName);
+    exit(-1);
+  }
+  close(fh);
+
+  printf("mode        MB/s  write calls\n");
+  for (mode = 0; mode < 3; mode++)
+  {
+    storeOpen(&store, fileName);
+    storeReserve(&store, (uint64_t)packets * PAYLOAD_SIZE, PAYLOAD_SIZE);
+    calls = 0;
+    start = nowUs();
+    for (seq = 0; seq < packets; seq += count)
+    {
+      count = packets - seq < BATCH_DEFAULT ? packets - seq : BATCH_DEFAULT;
+      for (i = 0; i < count; i++)
+      {
+        if (mode == 0)
+        {
+          write(store.fh, batch[i], PAYLOAD_SIZE);
+          calls++;
+        }
+        else if (mode == 1)
+          storeWrite(&store, seq + i, batch[i], PAYLOAD_SIZE);
+        else
+          storeWrite(&store, seq + count - 1 - i, batch[i], PAYLOAD_SIZE);
+      }
+      storeFlush(&store);
+    }
+    storeClose(&store);
+    elapsed = nowUs() - start;
+
+    printf("%-8s  %6.0f  %11lu\n", names[mode],
+        (double)packets * PAYLOAD_SIZE / (elapsed ? elapsed : 1),
+        mode == 0 ? calls : store.writes);
+  }
+
+  unlink(fileName);
+  return(0);
+}
+
+//===== Send one connection's packets as fast as batches go out ==============
+static void *scaleSender(void *arg)
+{
+  ScaleThread         *self;            // This sender
+  SendBatch            sendBatch;       // Outgoing batch
+  Packet               pkt;             // Packet sent over and over
+  int                  i;               // Loop counter
+
+  self = arg;
+  createPacket(&pkt, PAYLOAD_SIZE, 0, 0, DATA);
+  pkt.connId = htonl(self->connId);
+  memset(pkt.payload, 0x5a, PAYLOAD_SIZE);
+  sealPacket(&pkt);
+
+  batchInitSend(&sendBatch, self->sock, BATCH_DEFAULT);
+  for (i = 0; i < self->packets; i++)
+    batchAdd(&sendBatch, &pkt, PKT_SIZE, &self->peer);
+  batchFlush(&sendBatch);
+  return NULL;
+}
+
+//===== Receive, verify and acknowledge like a server worker =================
+static void *scaleWorker(void *arg)
+{
+  ScaleThread         *self;            // This worker
+  RecvBatch            recvBatch;       // Incoming batch
+  SendBatch            sendBatch;       // ACKs for the batch
+  Packet               replies[BATCH_MAX]; // Buffers for queued ACKs
+  Packet              *pkt;             // ACK being built
+  Packet              *inPkt;           // Incoming packet
+  int                  i;               // Packet within the batch
+
+  self = arg;
+  batchInitRecv(&recvBatch, BATCH_DEFAULT);
+  batchInitSend(&sendBatch, self->sock, BATCH_DEFAULT);
+  self->packets = 0;
+  self->last = 0;
+
+  //the socket timeout ends the run once the senders are done
+  while (batchRecv(&recvBatch, self->sock, MSG_WAITFORONE) > 0)
+  {
+    for (i = 0; i < recvBatch.count; i++)
+    {
+      inPkt = recvBatch.pkt[i];
+      if (!verifyPacket(inPkt, recvBatch.len[i]))
+        continue;
+      readPacket(inPkt);
+      pkt = &replies[sendBatch.count];
+      createPacket(pkt, 0, inPkt->seqNum, inPkt->seqNum + 1, ACK);
+      pkt->connId = htonl(inPkt->connId);
+      sealPacket(pkt);
+      batchAdd(&sendBatch, pkt, packetSize(pkt), recvBatch.from[i]);
+      self->packets++;
+    }
+    batchFlush(&sendBatch);
+    self->last = nowUs();
+  }
+  batchFreeRecv(&recvBatch);
+  return NULL;
+}
+
+//=============================================================================
+//=  Function to measure receive throughput against the number of workers   =
+//=============================================================================
+//=  Inputs:                                                                  =
+//=    packets -- Number of default sized packets sent for each worker count  =
+//=---------------------------------------------------------------------------=
+//=  Outputs:                                                                 =
+//=    Prints one line per worker count, returns 0                            =
+//=---------------------------------------------------------------------------=
+//=  Side effects:                                                            =
+//=    Runs 1 to N workers (N the online CPUs, at least 4), each on its own   =
+//=    SO_REUSEPORT socket as udpServer -t -s does, fed by as many senders    =
+//=    whose connection IDs steer them to distinct workers - packets the      =
+//=    workers cannot keep up with are dropped by the kernel and not counted  =
+//=---------------------------------------------------------------------------=
+int benchScale(int packets)
+{
+  ScaleThread         *workers;         // Receiving threads
+  ScaleThread         *senders;         // Sending threads
+  struct sockaddr_in   addr;            // Port the workers share
+  struct sockaddr_in   any;             // Ephemeral address for a sender
+  struct timeval       idle;            // Receive timeout ending a run
+  socklen_t            addr_len;        // Length of addr
+  int                  maxWorkers;      // Largest worker count tried
+  int                  n;               // Worker count under test
+  int                  i;               // Loop counter
+  int                  reuse;           // SO_REUSEPORT on
+  int                  bufSize;         // Socket buffer size
+  int                  received;        // Packets the workers took
+  unsigned long long   start;           // Start time (in us)
+  unsigned long long   end;             // Last packet received (in us)
+
+  maxWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (maxWorkers < 4)
+    maxWorkers = 4;
+  workers = calloc(maxWorkers, sizeof(ScaleThread));
+  senders = calloc(maxWorkers, sizeof(ScaleThread));
+  if (workers == NULL || senders == NULL)
+  {
+    printf("*** ERROR - unable to allocate %d workers \n", maxWorkers);
+    exit(-1);
+  }
+  reuse = 1;
+  bufSize = 4 * 1024 * 1024;
+  idle.tv_sec = SCALE_IDLE_MS / 1000;
+  idle.tv_usec = (SCALE_IDLE_MS % 1000) * 1000;
+
+  printf("workers  packets/s    MB/s  received\n");
+  for (n = 1; n <= maxWorkers; n++)
+  {
+    //the first worker picks the port, the others join its group
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (i = 0; i < n; i++)
+    {
+      workers[i].sock = socket(AF_INET, SOCK_DGRAM, 0);
+      setsockopt(workers[i].sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+      setsockopt(workers[i].sock, SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof(bufSize));
+      setsockopt(workers[i].sock, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+      if (bind(workers[i].sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+      {
+        printf("*** ERROR - bind() failed \n");
+        exit(-1);
+      }
+      addr_len = sizeof(addr);
+      getsockname(workers[i].sock, (struct sockaddr *)&addr, &addr_len);
+    }
+    if (n > 1 && connSteer(workers[0].sock, n) < 0)
+      printf("  *** WARNING - no SO_ATTACH_REUSEPORT_CBPF support, hashing by address \n");
+
+    for (i = 0; i < n; i++)
+    {
+      senders[i].sock = loopbackSocket(&any);
+      senders[i].peer = addr;
+      senders[i].connId = n + i;
+      senders[i].packets = packets / n;
+    }
+
+    start = nowUs();
+    for (i = 0; i < n; i++)
+      pthread_create(&workers[i].thread, NULL, scaleWorker, &workers[i]);
+    for (i = 0; i < n; i++)
+      pthread_create(&senders[i].thread, NULL, scaleSender, &senders[i]);
+
+    received = 0;
+    end = start;
+    for (i = 0; i < n; i++)
+    {
+      pthread_join(senders[i].thread, NULL);
+      close(senders[i].sock);
+    }
+    for (i = 0; i < n; i++)
+    {
+      pthread_join(workers[i].thread, NULL);
+      close(workers[i].sock);
+      received += workers[i].packets;
+      if (workers[i].last > end)
+        end = workers[i].last;
+    }
+
+    printf("%7d  %9.0f  %6.0f  %7.1f%%\n", n,
+        received * 1e6 / (end > start ? end - start : 1),
+        (double)received * PKT_SIZE / (end > start ? end - start : 1),
+        100.0 * received / (packets / n * n));
+  }
+
+  free(workers);
+  free(senders);
+  return(0);
+}
+
+//=============================================================================
+//=  Function to measure delta signature and scan throughput                  =
+//=============================================================================
+//=  Inputs:                                                                  =
+//=    packets -- Number of jumbo payloads hashed by each checksum kernel     =
+//=---------------------------------------------------------------------------=
+//=  Outputs:                                                                 =
+//=    Prints the hash and signature rates, then one line per share of       =
+//=    changed blocks, returns 0                                              =
+//=---------------------------------------------------------------------------=
+//=  Side effects:                                                            =
+//=    Writes and removes a BENCH_FILE byte file in /tmp. A changed block is  =
+//=    replaced by a longer random one, so every block after it is found at  =
+//=    a new offset. Both weak columns match on CPUs without AVX2            =
+//=---------------------------------------------------------------------------=
+int benchDelta(int packets)
+{
+  static const double  changes[] = { 0, 0.001, 0.01, 0.1, 1 };
+  char                 fileName[] = "/tmp/udpBenchXXXXXX";
+  uint8_t             *old;             // Receiver's copy
+  uint8_t             *new;             // Sender's version
+  uint64_t             size;            // Bytes in new
+  uint64_t             literal;         // Bytes of new the scan did not find
+  DeltaSig             sig;             // Signature of old
+  DeltaOp             *ops;             // Plan found by the scan
+  long                 count;           // Ops in it
+  uint32_t             blockSize;       // Signature block size
+  volatile uint32_t    sum;             // Running checksum, keeps the work live
+  double               rate[2];         // GB/s of each kernel
+  int                  impl;            // 0 dispatched, 1 scalar
+  int                  fh;              // File handle
+  int                  c;               // Share of changed blocks being measured
+  long                 i;               // Loop counter
+  uint32_t             j;               // Loop counter
+  unsigned long long   start;           // Start time (in us)
+  unsigned long long   elapsed;         // Run time (in us)
+
+  blockSize = deltaBlockSize(BENCH_FILE);
+  old = malloc(BENCH_FILE);
+  new = malloc(BENCH_FILE + BENCH_FILE / blockSize * 8);
+  if (old == NULL || new == NULL)
+  {
+    printf("*** ERROR - unable to allocate %d byte files \n", BENCH_FILE);
+    exit(-1);
+  }
+  for (i = 0; i < BENCH_FILE; i++)
+    old[i] = rand();
+
+  // Weak checksum kernels and the strong hash, one jumbo payload at a time
+  sum = 0;
+  for (impl = 0; impl < 2; impl++)
+  {
+    start = nowUs();
+    for (i = 0; i < packets; i++)
+      sum ^= impl == 0 ? deltaWeak(old + i % 4096 * 8, PAYLOAD_MAX) :
+                         deltaWeakSoftware(old + i % 4096 * 8, PAYLOAD_MAX);
+    elapsed = nowUs() - start;
+    rate[impl] = (double)packets * PAYLOAD_MAX / (elapsed ? elapsed : 1) / 1e3;
+  }
+  printf("weak GB/s  simd %.2f  scalar %.2f\n", rate[0], rate[1]);
+  start = nowUs();
+  for (i = 0; i < packets; i++)
+    sum ^= deltaStrong(old + i % 4096 * 8, PAYLOAD_MAX);
+  elapsed = nowUs() - start;
+  printf("strong GB/s  %.2f\n", (double)packets * PAYLOAD_MAX / (elapsed ? elapsed : 1) / 1e3);
+
+  // Signature of the receiver's copy, read back from the page cache
+  fh = mkstemp(fileName);
+  if (fh < 0 || write(fh, old, BENCH_FILE) != BENCH_FILE)
+  {
+    printf("*** ERROR - unable to create '%s' \n", fileName);
+    exit(-1);
+  }
+  start = nowUs();
+  if (deltaSignature(&sig, fh, BENCH_FILE, blockSize) < 0)
+  {
+    printf("*** ERROR - unable to read '%s' \n", fileName);
+    exit(-1);
+  }
+  elapsed = nowUs() - start;
+  printf("signature GB/s  %.2f  (%u blocks of %u)\n",
+         (double)BENCH_FILE / (elapsed ? elapsed : 1) / 1e3, sig.count, blockSize);
+  close(fh);
+  unlink(fileName);
+
+  printf("changed  scan GB/s  literal\n");
+  for (c = 0; c < (int)(sizeof(changes) / sizeof(changes[0])); c++)
+  {
+    size = 0;
+    for (j = 0; j < sig.count; j++)
+    {
+      if (rand() < changes[c] * RAND_MAX)
+      {
+        for (i = 0; i < blockSize + 8; i++)
+          new[size++] = rand();
+      }
+      else
+      {
+        memcpy(new + size, old + (uint64_t)j * blockSize, blockSize);
+        size += blockSize;
+      }
+    }
+
+    start = nowUs();
+    count = deltaScan(&sig, new, size, &ops);
+    elapsed = nowUs() - start;
+    if (count < 0)
+    {
+      printf("*** ERROR - unable to allocate the delta \n");
+      exit(-1);
+    }
+    literal = 0;
+    for (i = 0; i < count; i++)
+      if (ops[i].from == DELTA_LITERAL)
+        literal += ops[i].len;
+    printf("%6.1f%%  %9.2f  %6.2f%%\n", changes[c] * 100,
+           (double)size / (elapsed ? elapsed : 1) / 1e3, 100.0 * literal / size);
+    free(ops);
+  }
+
+  deltaSigFree(&sig);
+  free(old);
+  free(new);
+  return(0);
+}
+
+//===== Split a sep separated list in place, returns the number of items ======
+static int splitList(char *list, char sep, char **items, int max)
+{
+  int                  count;           // Items found
+
+  count = 0;
+  while (count < max)
+  {
+    items[count++] = list;
+    list = strchr(list, sep);
+    if (list == NULL)
+      break;
+    *list++ = '\0';
+  }
+  return count;
+}
+
+//===== Run path with args, its output going to logName =======================
+static pid_t spawn(char *path, char **args, char *logName)
+{
+  pid_t                pid;             // Child process
+  int                  fh;              // Log file
+
+  pid = fork();
+  if (pid != 0)
+    return pid;
+  fh = open(logName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fh >= 0)
+  {
+    dup2(fh, 1);
+    dup2(fh, 2);
+    close(fh);
+  }
+  execv(path, args);
+  _exit(127);
+}
+
+//===== Wait for pid until deadline, killing it then - returns -1 if killed ===
+static int reap(pid_t pid, unsigned long long deadline, struct rusage *usage)
+{
+  int                  status;          // Exit status
+
+  while (wait4(pid, &status, WNOHANG, usage) == 0)
+  {
+    if (nowUs() >= deadline)
+    {
+      kill(pid, SIGKILL);
+      wait4(pid, &status, 0, usage);
+      return -1;
+    }
+    usleep(1000);
+  }
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+//===== Returns 1 once something holds the server port ========================
+static int portTaken(void)
+{
+  struct sockaddr_in   addr;            // Server port on loopback
+  int                  sock;            // Probe socket
+  int                  taken;           // Set when bind() finds the port in use
+
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(MATRIX_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  taken = bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno == EADDRINUSE;
+  close(sock);
+  return taken;
+}
+
+//===== CRC32C of size new random bytes written to a file, or of all it has ==
+static int fileCrc(char *fileName, uint64_t size, uint32_t *crc)
+{
+  static uint64_t      x = 88172645463325252ULL; // xorshift state
+  uint64_t             buf[8192];       // One chunk of the file
+  uint64_t             done;            // Bytes so far
+  ssize_t              n;               // Bytes in buf
+  int                  fh;              // File handle
+  int                  i;               // Word of buf
+
+  fh = size ? open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(fileName, O_RDONLY);
+  if (fh < 0)
+    return -1;
+  *crc = 0;
+  for (done = 0; size == 0 || done < size; done += n)
+  {
+    if (size != 0)
+    {
+      for (i = 0; i < 8192; i++)
+      {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        buf[i] = x;
+      }
+      n = size - done < sizeof(buf) ? size - done : sizeof(buf);
+      if (write(fh, buf, n) != n)
+        break;
+    }
+    else if ((n = read(fh, buf, sizeof(buf))) <= 0)
+      break;
+    *crc = crc32c(*crc, buf, n);
+  }
+  close(fh);
+  return size != 0 && done < size ? -1 : 0;
+}
+
+//===== Remove a directory and the files in it ================================
+static void removeDir(char *dirName)
+{
+  char                 path[PATH_MAX];  // File in dirName
+  DIR                 *dir;             // Directory being emptied
+  struct dirent       *ent;             // Entry of it
+
+  dir = opendir(dirName);
+  if (dir == NULL)
+    return;
+  while ((ent = readdir(dir)) != NULL)
+  {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dirName, ent->d_name);
+    if (ent->d_type == DT_DIR)
+      removeDir(path);
+    else
+      unlink(path);
+  }
+  closedir(dir);
+  rmdir(dirName);
+}
+
+//===== Send one file from udpClient to udpServer and measure it ==============
+static void matrixRun(char *binDir, char *work, uint64_t size, double loss,
+                      double rttMs, char *settings, int timeout, MatrixResult *res)
+{
+  char                 client[PATH_MAX]; // udpClient program
+  char                 server[PATH_MAX]; // udpServer program
+  char                 src[PATH_MAX];   // File sent
+  char                 outDir[PATH_MAX]; // Directory the server stores it in
+  char                 dst[PATH_MAX];   // File stored
+  char                 clientLog[PATH_MAX]; // Output of udpClient
+  char                 serverLog[PATH_MAX]; // Output of udpServer
+  char                 faults[128];     // -I argument of both programs
+  char                 extra[256];      // Copy of settings split into arguments
+  char                 line[256];       // Line of the client output
+  char                *cargs[MATRIX_ARGS]; // udpClient arguments
+  char                *sargs[MATRIX_ARGS]; // udpServer arguments
+  struct rusage        usage;           // CPU time of one program
+  uint32_t             srcCrc;          // CRC32C of the file sent
+  uint32_t             dstCrc;          // CRC32C of the file stored
+  unsigned long long   start;           // Client start time (in us)
+  pid_t                spid;            // udpServer process
+  pid_t                cpid;            // udpClient process
+  int                  clientRc;        // Client exit status, -1 if killed
+  int                  serverUp;        // Set if the server was still serving
+  int                  status;          // Its exit status otherwise
+  FILE                *fp;              // Client output
+  int                  n;               // Arguments so far
+
+  memset(res, 0, sizeof(*res));
+  res->status = "failed";
+  snprintf(src, sizeof(src), "%s/bench.dat", work);
+  snprintf(outDir, sizeof(outDir), "%s/out", work);
+  snprintf(clientLog, sizeof(clientLog), "%s/client.log", work);
+  snprintf(serverLog, sizeof(serverLog), "%s/server.log", work);
+  if (snprintf(client, sizeof(client), "%s/udpClient", binDir) >= (int)sizeof(client) ||
+      snprintf(server, sizeof(server), "%s/udpServer", binDir) >= (int)sizeof(server) ||
+      snprintf(dst, sizeof(dst), "%s/bench.dat", outDir) >= (int)sizeof(dst))
+    return;
+  removeDir(outDir);
+  if (mkdir(outDir, 0755) < 0 || fileCrc(src, size, &srcCrc) < 0)
+    return;
+
+  // Half the RTT is added on each side, the loss applies to each direction
+  snprintf(faults, sizeof(faults), "loss=%g,delay=%g,seed=1", loss, rttMs / 2);
+
+  n = 0;
+  sargs[n++] = server;
+  sargs[n++] = "0";
+  sargs[n++] = "-d";
+  sargs[n++] = outDir;
+  sargs[n++] = "-I";
+  sargs[n++] = faults;
+  sargs[n] = NULL;
+
+  n = 0;
+  cargs[n++] = client;
+  cargs[n++] = src;
+  cargs[n++] = "127.0.0.1";
+  cargs[n++] = "1050";
+  cargs[n++] = "0";
+  cargs[n++] = "-I";
+  cargs[n++] = faults;
+  snprintf(extra, sizeof(extra), "%s", settings);
+  if (extra[0] != '\0')
+    n += splitList(extra, ' ', cargs + n, MATRIX_ARGS - 1 - n);
+  cargs[n] = NULL;
+
+  spid = spawn(server, sargs, serverLog);
+  for (start = nowUs(); !portTaken() && nowUs() - start < MATRIX_UP_MS * 1000ULL; )
+    usleep(1000);
+
+  start = nowUs();
+  cpid = spawn(client, cargs, clientLog);
+  clientRc = reap(cpid, start + timeout * 1000000ULL, &usage);
+  res->seconds = (nowUs() - start) / 1e6;
+  res->cpuUs = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ULL +
+               usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+
+  // The server is not told to exit after one transfer, it would first wait
+  // for its last FIN_ACK to cross the delayed link - the file is complete
+  // once the client has that FIN_ACK, a server no longer running failed
+  serverUp = wait4(spid, &status, WNOHANG, &usage) == 0;
+  if (serverUp)
+  {
+    kill(spid, SIGKILL);
+    wait4(spid, &status, 0, &usage);
+  }
+  res->cpuUs += (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ULL +
+                usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+
+  fp = fopen(clientLog, "r");
+  while (fp != NULL && fgets(line, sizeof(line), fp) != NULL)
+  {
+    sscanf(line, "retransmitted: %lu of %lu packets", &res->resent, &res->sent);
+    sscanf(line, "ACK latency: p50 %llu us, p99 %llu us", &res->p50, &res->p99);
+  }
+  if (fp != NULL)
+    fclose(fp);
+
+  if (clientRc < 0)
+    res->status = "timeout";
+  else if (clientRc == 0 && serverUp && fileCrc(dst, 0, &dstCrc) == 0)
+    res->status = dstCrc == srcCrc ? "ok" : "differ";
+}
+
+//===== Print one matrix run as a CSV line or JSON object =====================
+static void matrixPrint(int json, int runs, uint64_t size, double loss, double rttMs,
+                        const char *settings, MatrixResult *res)
+{
+  const char          *q;               // Character of the settings being quoted
+
+  // Settings are client arguments, quoted for CSV and JSON alike
+  printf(json ? "%s  {\"size\": %llu, \"loss\": %g, \"rtt_ms\": %g, \"settings\": \""
+              : "%s%llu,%g,%g,\"", json && runs > 0 ? ",\n" : "",
+         (unsigned long long)size, loss, rttMs);
+  for (q = settings; *q != '\0'; q++)
+  {
+    if (*q == '"')
+      fputs(json ? "\\\"" : "\"\"", stdout);
+    else if (*q == '\\' && json)
+      fputs("\\\\", stdout);
+    else
+      putchar(*q);
+  }
+  printf(json ? "\", \"status\": \"%s\", \"seconds\": %.3f, \"goodput_mbps\": %.1f, "
+                "\"retrans_ratio\": %.4f, \"cpu_s_per_gb\": %.2f, "
+                "\"lat_p50_us\": %llu, \"lat_p99_us\": %llu}"
+              : "\",%s,%.3f,%.1f,%.4f,%.2f,%llu,%llu\n",
+         res->status, res->seconds,
+         strcmp(res->status, "ok") == 0 ? size * 8 / res->seconds / 1e6 : 0,
+         res->sent ? (double)res->resent / res->sent : 0,
+         res->cpuUs / 1e6 / (size / 1e9), res->p50, res->p99);
+  fflush(stdout);
+}
+
+//=============================================================================
+//=  Function to measure whole transfers over a matrix of network conditions =
+//=============================================================================
+//=  Inputs:                                                                  =
+//=    argc, argv - Options after the mode: -s sizes in MB, -l loss rates,    =
+//=                 -r RTTs in ms (comma separated), -x extra MB:loss:ms     =
+//=                 cells (comma separated, run after the matrix), -p       =
+//=                 udpClient settings (semicolon separated), -t seconds    =
+//=                 per run, -j for JSON                                      =
+//=---------------------------------------------------------------------------=
+//=  Outputs:                                                                 =
+//=    Prints one CSV line (or JSON object) per run, returns 0                =
+//=---------------------------------------------------------------------------=
+//=  Side effects:                                                            =
+//=    Runs udpServer and udpClient from the directory of udpBench, so the   =
+//=    server port must be free. The RTT and loss are emulated by both with  =
+//=    -I, the same seed every run. Files go to a directory in /tmp that is  =
+//=    removed at the end. CPU time is the two programs' user and system     =
+//=---------------------------------------------------------------------------=
+int benchMatrix(int argc, char *argv[])
+{
+  char                 sizeList[] = "1,16,64";
+  char                 lossList[] = "0,0.001,0.01";
+  char                 rttList[] = "0,1,10";
+  char                 settingList[] = ";-f 16:2;-c bbr";
+  char                 cellList[] = "1:0.02:20";
+  char                 work[] = "/tmp/udpBenchXXXXXX";
+  char                 binDir[PATH_MAX]; // Directory of udpClient and udpServer
+  char                 path[PATH_MAX];  // Path of udpBench, cut down to binDir
+  char                *sizes[MATRIX_MAX]; // Values of each dimension
+  char                *losses[MATRIX_MAX];
+  char                *rtts[MATRIX_MAX];
+  char                *settings[MATRIX_MAX];
+  char                *cells[MATRIX_MAX]; // Extra size:loss:RTT runs
+  char                *cell[3];         // Values of an extra run
+  int                  numSizes;        // Values in each dimension
+  int                  numLosses;
+  int                  numRtts;
+  int                  numSettings;
+  int                  numCells;
+  int                  timeout;         // Seconds a run may take
+  int                  json;            // Set to print JSON instead of CSV
+  int                  opt;             // Current getopt() option
+  int                  a, b, c, d;      // Position in the matrix
+  int                  runs;            // Runs printed
+  uint64_t             size;            // Bytes sent by a run
+  MatrixResult         res;             // Measures of a run
+
+  timeout = MATRIX_TIMEOUT;
+  json = 0;
+  numSizes = splitList(sizeList, ',', sizes, MATRIX_MAX);
+  numLosses = splitList(lossList, ',', losses, MATRIX_MAX);
+  numRtts = splitList(rttList, ',', rtts, MATRIX_MAX);
+  numSettings = splitList(settingList, ';', settings, MATRIX_MAX);
+  numCells = splitList(cellList, ',', cells, MATRIX_MAX);
+  opt = 0;
+  while (opt != -1)
+  {
+    opt = getopt(argc, argv, "s:l:r:x:p:t:j");
+    if (opt == 's')
+      numSizes = splitList(optarg, ',', sizes, MATRIX_MAX);
+    else if (opt == 'l')
+      numLosses = splitList(optarg, ',', losses, MATRIX_MAX);
+    else if (opt == 'r')
+      numRtts = splitList(optarg, ',', rtts, MATRIX_MAX);
+    else if (opt == 'x')
+      numCells = splitList(optarg, ',', cells, MATRIX_MAX);
+    else if (opt == 'p')
+      numSettings = splitList(optarg, ';', settings, MATRIX_MAX);
+    else if (opt == 't')
+      timeout = atoi(optarg);
+    else if (opt == 'j')
+      json = 1;
+    else if (opt != -1)
+    {
+      printf("usage: 'udpBench matrix [-s MB,..] [-l loss,..] [-r ms,..] \n");
+      printf("       [-x MB:loss:ms,..] [-p 'clientArgs;..'] [-t seconds] [-j]' \n");
+      return(1);
+    }
+  }
+
+  snprintf(path, sizeof(path), "%s", argv[0]);
+  snprintf(binDir, sizeof(binDir), "%s", dirname(path));
+  if (portTaken())
+  {
+    printf("*** ERROR - port %d is in use, stop the udpServer holding it \n", MATRIX_PORT);
+    return(1);
+  }
+  if (mkdtemp(work) == NULL)
+  {
+    printf("*** ERROR - unable to create a directory in /tmp \n");
+    exit(-1);
+  }
+
+  if (json)
+    printf("[\n");
+  else
+    printf("size,loss,rtt_ms,settings,status,seconds,goodput_mbps,retrans_ratio,"
+           "cpu_s_per_gb,lat_p50_us,lat_p99_us\n");
+  runs = 0;
+  for (a = 0; a < numSizes; a++)
+    for (b = 0; b < numLosses; b++)
+      for (c = 0; c < numRtts; c++)
+        for (d = 0; d < numSettings; d++)
+        {
+          size = (uint64_t)(atof(sizes[a]) * (1 << 20));
+          if (size == 0)
+            size = 1;
+          matrixRun(binDir, work, size, atof(losses[b]), atof(rtts[c]), settings[d],
+                    timeout, &res);
+          matrixPrint(json, runs, size, atof(losses[b]), atof(rtts[c]), settings[d], &res);
+          runs++;
+        }
+
+  // The extra cells, 1 MB at 2% loss and 20 ms by default, put a loss based
+  // controller through a recovery every few RTTs
+  for (a = 0; a < numCells; a++)
+  {
+    if (splitList(cells[a], ':', cell, 3) < 3)
+      continue;
+    size = (uint64_t)(atof(cell[0]) * (1 << 20));
+    if (size == 0)
+      size = 1;
+    for (d = 0; d < numSettings; d++)
+    {
+      matrixRun(binDir, work, size, atof(cell[1]), atof(cell[2]), settings[d],
+                timeout, &res);
+      matrixPrint(json, runs, size, atof(cell[1]), atof(cell[2]), settings[d], &res);
+      runs++;
+    }
+  }
+  if (json)
+    printf("\n]\n");
+
+  removeDir(work);
+  return(0);
+}
+
+//===== Send the tree under work/src whole or file by file, returns the status
+static const char *filesRun(char *binDir, char *work, int files, int perFile,
+                            uint32_t *crcs, double *seconds)
+{
+  char                 client[PATH_MAX]; // udpClient program
+  char                 server[PATH_MAX]; // udpServer program
+  char                 src[PATH_MAX];   // Directory or file sent
+  char                 outDir[PATH_MAX]; // Directory the server stores it in
+  char                 dst[PATH_MAX];   // File stored
+  char                 clientLog[PATH_MAX]; // Output of udpClient
+  char                 serverLog[PATH_MAX]; // Output of udpServer
+  char                 transfers[16];   // -n argument of udpServer
+  char                *cargs[MATRIX_ARGS]; // udpClient arguments
+  char                *sargs[MATRIX_ARGS]; // udpServer arguments
+  struct rusage        usage;           // Unused
+  unsigned long long   start;           // Client start time (in us)
+  unsigned long long   deadline;        // Time the run is given up at
+  uint32_t             crc;             // CRC32C of a file stored
+  pid_t                spid;            // udpServer process
+  pid_t                cpid;            // udpClient process
+  int                  rc;              // Exit status of the last program
+  int                  len;             // Length of dst
+  int                  i;               // File
+
+  snprintf(outDir, sizeof(outDir), "%s/out", work);
+  snprintf(clientLog, sizeof(clientLog), "%s/client.log", work);
+  snprintf(serverLog, sizeof(serverLog), "%s/server.log", work);
+  snprintf(transfers, sizeof(transfers), "%d", perFile ? files : 1);
+  *seconds = 0;
+  if (snprintf(client, sizeof(client), "%s/udpClient", binDir) >= (int)sizeof(client) ||
+      snprintf(server, sizeof(server), "%s/udpServer", binDir) >= (int)sizeof(server))
+    return "failed";
+  removeDir(outDir);
+  if (mkdir(outDir, 0755) < 0)
+    return "failed";
+
+  sargs[0] = server;
+  sargs[1] = "0";
+  sargs[2] = "-d";
+  sargs[3] = outDir;
+  sargs[4] = "-n";
+  sargs[5] = transfers;
+  sargs[6] = NULL;
+  cargs[0] = client;
+  cargs[1] = src;
+  cargs[2] = "127.0.0.1";
+  cargs[3] = "1050";
+  cargs[4] = "0";
+  cargs[5] = NULL;
+
+  spid = spawn(server, sargs, serverLog);
+  for (start = nowUs(); !portTaken() && nowUs() - start < MATRIX_UP_MS * 1000ULL; )
+    usleep(1000);
+
+  // One udpClient for the directory, or one per file each naming its own
+  start = nowUs();
+  deadline = start + FILES_TIMEOUT * 1000000ULL;
+  rc = 0;
+  for (i = 0; i < (perFile ? files : 1) && rc == 0; i++)
+  {
+    if (perFile)
+      snprintf(src, sizeof(src), "%s/src/d%03d/f%06d", work, i / FILES_PER_DIR, i);
+    else
+      snprintf(src, sizeof(src), "%s/src", work);
+    cpid = spawn(client, cargs, clientLog);
+    rc = reap(cpid, deadline, &usage);
+  }
+  *seconds = (nowUs() - start) / 1e6;
+  if (reap(spid, nowUs() + MATRIX_LINGER_MS * 1000ULL, &usage) != 0 || rc != 0)
+    return rc < 0 ? "timeout" : "failed";
+
+  // A directory keeps its tree, files sent one by one land side by side
+  for (i = 0; i < files; i++)
+  {
+    if (perFile)
+      len = snprintf(dst, sizeof(dst), "%s/f%06d", outDir, i);
+    else
+      len = snprintf(dst, sizeof(dst), "%s/src/d%03d/f%06d", outDir, i / FILES_PER_DIR, i);
+    if (len >= (int)sizeof(dst) || fileCrc(dst, 0, &crc) < 0 || crc != crcs[i])
+      return "differ";
+  }
+  return "ok";
+}
+
+//=============================================================================
+//=  Function to measure files per second of a tree of small files            =
+//=============================================================================
+//=  Inputs:                                                                  =
+//=    files ---- Number of files in the tree, FILES_PER_DIR per directory    =
+//=    self ----- Path of udpBench, udpClient and udpServer are next to it    =
+//=---------------------------------------------------------------------------=
+//=  Outputs:                                                                 =
+//=    Prints one line per way of sending the tree, returns 0                 =
+//=---------------------------------------------------------------------------=
+//=  Side effects:                                                            =
+//=    Runs udpServer and udpClient, so the server port must be free. The    =
+//=    tree is sent once as a directory - its files packed into one bundle - =
+//=    and once with one udpClient per file. Files of 1 to FILES_SIZE_MAX     =
+//=    bytes go to a directory in /tmp that is removed at the end            =
+//=---------------------------------------------------------------------------=
+int benchFiles(int files, char *self)
+{
+  char                 work[] = "/tmp/udpBenchXXXXXX";
+  char                 binDir[PATH_MAX]; // Directory of udpClient and udpServer
+  char                 path[PATH_MAX];  // Directory or file of the tree
+  uint32_t            *crcs;            // CRC32C of each file
+  uint64_t             bytes;           // Bytes of all the files
+  const char          *status;          // ok, differ, failed or timeout
+  double               seconds;         // Time of a run
+  int                  perFile;         // Set for the run of one udpClient per file
+  int                  i;               // File
+
+  if (files < 1)
+    files = 1;
+  snprintf(path, sizeof(path), "%s", self);
+  snprintf(binDir, sizeof(binDir), "%s", dirname(path));
+  if (portTaken())
+  {
+    printf("*** ERROR - port %d is in use, stop the udpServer holding it \n", MATRIX_PORT);
+    return(1);
+  }
+  crcs = malloc(files * sizeof(uint32_t));
+  if (crcs == NULL || mkdtemp(work) == NULL)
+  {
+    printf("*** ERROR - unable to create a directory in /tmp \n");
+    exit(-1);
+  }
+
+  // The same sizes every run, spread evenly over 1 to FILES_SIZE_MAX bytes
+  bytes = 0;
+  snprintf(path, sizeof(path), "%s/src", work);
+  mkdir(path, 0755);
+  for (i = 0; i < files; i++)
+  {
+    if (i % FILES_PER_DIR == 0)
+    {
+      snprintf(path, sizeof(path), "%s/src/d%03d", work, i / FILES_PER_DIR);
+      mkdir(path, 0755);
+    }
+    snprintf(path, sizeof(path), "%s/src/d%03d/f%06d", work, i / FILES_PER_DIR, i);
+    if (fileCrc(path, 1 + (uint64_t)i * 7919 % FILES_SIZE_MAX, &crcs[i]) < 0)
+    {
+      printf("*** ERROR - unable to create '%s' \n", path);
+      exit(-1);
+    }
+    bytes += 1 + (uint64_t)i * 7919 % FILES_SIZE_MAX;
+  }
+
+  printf("%d files, %llu bytes\n", files, (unsigned long long)bytes);
+  printf("mode       seconds    files/s    MB/s  status\n");
+  for (perFile = 0; perFile < 2; perFile++)
+  {
+    status = filesRun(binDir, work, files, perFile, crcs, &seconds);
+    printf("%-9s  %7.3f  %9.1f  %6.2f  %s\n", perFile ? "per-file" : "directory",
+           seconds, files / seconds, bytes / seconds / 1e6, status);
+    fflush(stdout);
+  }
+
+  removeDir(work);
+  free(crcs);
+  return(0);
+}
+
+//=============================================================================
+//=  Function to measure hash tree throughput against its hashing threads     =
+//=============================================================================
+//=  Inputs:                                                                  =
+//=    megabytes -- Size of the file hashed                                   =
+//=---------------------------------------------------------------------------=
+//=  Outputs:                                                                 =
+//=    Prints the single threaded CRC32C rate over the file, then one line    =
+//=    per thread count with the tree's rate and speedup, returns 0           =
+//=---------------------------------------------------------------------------=
+//=  Side effects:                                                            =
+//=    Writes and removes a file in /tmp, read back from the page cache by    =
+//=    every run. The tree is built as a verifying receiver builds it, the    =
+//=    whole file in place from the start                                     =
+//=---------------------------------------------------------------------------=
+int benchMerkle(int megabytes)
+{
+  char                 fileName[] = "/tmp/udpBenchXXXXXX";
+  Merkle               tree;            // Tree of the file
+  uint64_t             size;            // Bytes in the file
+  uint64_t             root;            // Root of the first run
+  uint32_t             crc;             // CRC32C of the file
+  double               rate;            // GB/s of one run
+  double               base;            // GB/s of CRC32C
+  int                  fh;              // File handle
+  int                  threads;         // Hashing threads of a run
+  unsigned long long   start;           // Start time (in us)
+  unsigned long long   elapsed;         // Run time (in us)
+
+  size = (uint64_t)(megabytes > 0 ? megabytes : BENCH_FILE >> 20) << 20;
+  fh = mkstemp(fileName);
+  if (fh < 0)
+  {
+    printf("*** ERROR - unable to create '%s' \n", fileName);
+    exit(-1);
+  }
+  close(fh);
+  if (fileCrc(fileName, size, &crc) < 0)
+  {
+    printf("*** ERROR - unable to write '%s' \n", fileName);
+    exit(-1);
+  }
+
+  // CRC32C reads the file back once, as a whole file check on one thread would
+  start = nowUs();
+  fileCrc(fileName, 0, &crc);
+  elapsed = nowUs() - start;
+  base = (double)size / (elapsed ? elapsed : 1) / 1e3;
+  printf("%llu MB, %u byte chunks\n", (unsigned long long)(size >> 20), MERKLE_CHUNK);
+  printf("crc32c GB/s  %.2f\n", base);
+
+  printf("threads  tree GB/s  speedup\n");
+  root = 0;
+  for (threads = 1; threads <= MERKLE_THREADS_MAX; threads *= 2)
+  {
+    start = nowUs();
+    if (merkleInit(&tree, size, MERKLE_CHUNK) < 0 ||
+        merkleStart(&tree, fileName, threads) < 0 || merkleFinish(&tree) < 0)
+    {
+      printf("*** ERROR - unable to hash '%s' \n", fileName);
+      exit(-1);
+    }
+    elapsed = nowUs() - start;
+    if (threads == 1)
+      root = merkleRoot(&tree);
+    else if (merkleRoot(&tree) != root)
+      printf("*** ERROR - %d threads found a different root \n", threads);
+    merkleFree(&tree);
+    rate = (double)size / (elapsed ? elapsed : 1) / 1e3;
+    printf("%7d  %9.2f  %6.2fx\n", threads, rate, rate / base);
+  }
+
+  unlink(fileName);
+  return(0);
+}
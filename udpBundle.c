@@ -0,0 +1,654 @@
+#define _GNU_SOURCE
+#include "udpBundle.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#define COPY_CHUNK	(64 * 1024)	//bytes per read when copy_file_range cannot be used
+
+
+/*
+	MANIFEST - the stream starts with the magic word, the entry count and the
+	manifest size, then each entry as its size, mode, flags and path length in
+	network order followed by the path, then the bytes of every packed file in
+	manifest order
+*/
+
+static void putWords(char *to, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+   uint32_t net[4];
+
+   net[0] = htonl(a);
+   net[1] = htonl(b);
+   net[2] = htonl(c);
+   net[3] = htonl(d);
+   memcpy(to, net, sizeof(net));
+}
+
+static void getWords(const char *from, uint32_t *w)
+{
+   int i;
+
+   memcpy(w, from, 4 * sizeof(uint32_t));
+   for (i = 0; i < 4; i++)
+      w[i] = ntohl(w[i]);
+}
+
+//places the packed files after the manifest, in order
+static void layout(Bundle *b)
+{
+   uint32_t i;
+
+   b->manifestBytes = 0;
+   for (i = 0; i < b->count; i++)
+      b->manifestBytes += BUNDLE_ENTRY + strlen(b->entries[i].path);
+   b->size = BUNDLE_HEADER + b->manifestBytes;
+   for (i = 0; i < b->count; i++)
+   {
+      if (b->entries[i].flags & (BUNDLE_ISDIR | BUNDLE_STREAMED))
+         continue;
+      b->entries[i].offset = b->size;
+      b->size += b->entries[i].size;
+   }
+}
+
+static int addEntry(Bundle *b, const char *path, uint64_t size, uint32_t mode, uint32_t flags)
+{
+   BundleEntry *grown;
+   BundleEntry *e;
+
+   if (b->count == b->alloc)
+   {
+      grown = realloc(b->entries, (b->alloc ? 2 * b->alloc : 256) * sizeof(BundleEntry));
+      if (grown == NULL)
+         return -1;
+      b->entries = grown;
+      b->alloc = b->alloc ? 2 * b->alloc : 256;
+   }
+   e = &b->entries[b->count];
+   e->path = strdup(path);
+   if (e->path == NULL)
+      return -1;
+   e->size = size;
+   e->offset = 0;
+   e->mode = mode & 07777;
+   e->flags = flags;
+   b->count++;
+   return 0;
+}
+
+//lists what the directory at path holds, path is a PATH_MAX buffer whose
+//first rootLen bytes name the directory sent - returns -1 if out of memory
+static int scanDir(Bundle *b, char *path, size_t rootLen, uint32_t pathMax)
+{
+   struct dirent *ent;
+   struct stat st;
+   const char *rel;
+   size_t len;
+   DIR *dir;
+   int ret;
+
+   dir = opendir(path);
+   if (dir == NULL)
+   {
+      b->skipped++;
+      return 0;
+   }
+   len = strlen(path);
+   ret = 0;
+   while (ret == 0 && (ent = readdir(dir)) != NULL)
+   {
+      if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+         continue;
+      if (len + 1 + strlen(ent->d_name) >= PATH_MAX || b->count >= BUNDLE_ENTRIES_MAX)
+      {
+         b->skipped++;
+         continue;
+      }
+      path[len] = '/';
+      strcpy(path + len + 1, ent->d_name);
+      rel = path + rootLen + 1;
+
+      //a directory goes ahead of what it holds, links and devices are left out
+      if (lstat(path, &st) < 0 || (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)))
+         b->skipped++;
+      else if (S_ISDIR(st.st_mode))
+         ret = addEntry(b, rel, 0, st.st_mode, BUNDLE_ISDIR) < 0 ? -1 :
+               scanDir(b, path, rootLen, pathMax);
+      else
+         ret = addEntry(b, rel, st.st_size, st.st_mode,
+                        st.st_size >= BUNDLE_SMALL && strlen(rel) <= pathMax ?
+                        BUNDLE_STREAMED : 0);
+      path[len] = '\0';
+   }
+   closedir(dir);
+   return ret;
+}
+
+int bundleScan(Bundle *b, const char *dirName, uint32_t pathMax)
+{
+   char path[PATH_MAX];
+   struct stat st;
+   size_t len;
+
+   memset(b, 0, sizeof(*b));
+   len = strlen(dirName);
+   while (len > 1 && dirName[len - 1] == '/')
+      len--;
+   if (len >= sizeof(path))
+      return -1;
+   memcpy(path, dirName, len);
+   path[len] = '\0';
+   if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode) || access(path, R_OK | X_OK) < 0)
+      return -1;
+   if (scanDir(b, path, len, pathMax) < 0)
+   {
+      bundleFree(b);
+      return -1;
+   }
+   layout(b);
+   return 0;
+}
+
+static int writeAll(int fd, const char *data, size_t len)
+{
+   ssize_t n;
+
+   while (len > 0)
+   {
+      n = write(fd, data, len);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         return -1;
+      data += n;
+      len -= n;
+   }
+   return 0;
+}
+
+int bundlePack(Bundle *b, const char *dirName, int fd)
+{
+   char path[PATH_MAX];
+   BundleEntry *e;
+   uint64_t left;
+   size_t used;
+   size_t len;
+   ssize_t n;
+   char *buf;
+   uint32_t i;
+   int ret;
+   int fh;
+
+   buf = malloc(BUNDLE_BUF);
+   if (buf == NULL)
+      return -1;
+
+   //the manifest and the small files go through one buffer, so a pipe sees
+   //few large writes however small the files
+   putWords(buf, BUNDLE_MAGIC, b->count, b->manifestBytes >> 32, b->manifestBytes & 0xffffffff);
+   used = BUNDLE_HEADER;
+   ret = 0;
+   for (i = 0; i < b->count && ret == 0; i++)
+   {
+      e = &b->entries[i];
+      len = strlen(e->path);
+      if (used + BUNDLE_ENTRY + len > BUNDLE_BUF)
+      {
+         ret = writeAll(fd, buf, used);
+         used = 0;
+      }
+      putWords(buf + used, e->size >> 32, e->size & 0xffffffff, e->mode,
+               e->flags << 16 | (uint32_t)len);
+      memcpy(buf + used + BUNDLE_ENTRY, e->path, len);
+      used += BUNDLE_ENTRY + len;
+   }
+
+   for (i = 0; i < b->count && ret == 0; i++)
+   {
+      e = &b->entries[i];
+      if (e->flags & (BUNDLE_ISDIR | BUNDLE_STREAMED))
+         continue;
+      snprintf(path, sizeof(path), "%s/%s", dirName, e->path);
+      fh = open(path, O_RDONLY);
+      for (left = e->size; left > 0 && ret == 0; left -= n)
+      {
+         if (used == BUNDLE_BUF)
+         {
+            ret = writeAll(fd, buf, used);
+            used = 0;
+         }
+         n = left < BUNDLE_BUF - used ? left : BUNDLE_BUF - used;
+         n = fh >= 0 ? read(fh, buf + used, n) : 0;
+         if (n <= 0)
+         {
+            //the file shrank or cannot be read, the size sent still holds
+            if (fh >= 0)
+               close(fh);
+            fh = -1;
+            n = left < BUNDLE_BUF - used ? left : BUNDLE_BUF - used;
+            memset(buf + used, 0, n);
+         }
+         used += n;
+      }
+      if (fh >= 0)
+         close(fh);
+   }
+   if (ret == 0 && used > 0)
+      ret = writeAll(fd, buf, used);
+   free(buf);
+   return ret;
+}
+
+void bundleFree(Bundle *b)
+{
+   uint32_t i;
+
+   //the count may be known before the entries are
+   for (i = 0; b->entries != NULL && i < b->count; i++)
+      free(b->entries[i].path);
+   free(b->entries);
+   b->entries = NULL;
+   b->count = 0;
+   b->alloc = 0;
+}
+
+int bundlePathValid(const char *path)
+{
+   const char *end;
+   size_t len;
+
+   if (path[0] == '\0' || path[0] == '/')
+      return 0;
+   for (;;)
+   {
+      end = strchr(path, '/');
+      len = end != NULL ? (size_t)(end - path) : strlen(path);
+      if (len == 0 || (len == 1 && path[0] == '.') ||
+          (len == 2 && path[0] == '.' && path[1] == '.'))
+         return 0;
+      if (end == NULL)
+         return 1;
+      path = end + 1;
+   }
+}
+
+int bundleMakeParents(const char *dirName, const char *path)
+{
+   char full[PATH_MAX];
+   char *slash;
+   int len;
+
+   len = snprintf(full, sizeof(full), "%s/%s", dirName, path);
+   if (len < 0 || len >= (int)sizeof(full))
+      return -1;
+   for (slash = strchr(full + strlen(dirName) + 1, '/'); slash != NULL;
+        slash = strchr(slash + 1, '/'))
+   {
+      *slash = '\0';
+      if (mkdir(full, 0777) < 0 && errno != EEXIST)
+         return -1;
+      *slash = '/';
+   }
+   return 0;
+}
+
+
+/*
+	UNPACKING - threads take the entries in manifest order, a packed file once
+	every byte of it is in the spool, and copy it out with copy_file_range so
+	its bytes stay in the kernel. Directories are made while the manifest is
+	read, so no file waits on the thread creating its parent. Streamed files
+	came before the bundle, they only get their modes
+*/
+
+static int readAt(int fd, void *to, size_t len, uint64_t at)
+{
+   ssize_t n;
+
+   while (len > 0)
+   {
+      n = pread(fd, to, len, at);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         return -1;
+      to = (char *)to + n;
+      len -= n;
+      at += n;
+   }
+   return 0;
+}
+
+static int readHeader(Unpacker *u)
+{
+   char raw[BUNDLE_HEADER];
+   uint64_t bytes;
+   uint32_t w[4];
+
+   if (readAt(u->spool, raw, sizeof(raw), 0) < 0)
+      return -1;
+   getWords(raw, w);
+   bytes = (uint64_t)w[2] << 32 | w[3];
+   if (w[0] != BUNDLE_MAGIC || w[1] > BUNDLE_ENTRIES_MAX ||
+       bytes < (uint64_t)w[1] * BUNDLE_ENTRY || bytes > (uint64_t)w[1] * (BUNDLE_ENTRY + PATH_MAX))
+      return -1;
+   u->manifest.count = w[1];
+   u->manifest.manifestBytes = bytes;
+   return 0;
+}
+
+//lists the entries and creates the directories, refusing any path leaving
+//dir - their bytes keep their place in the stream
+static int readManifest(Unpacker *u)
+{
+   char path[PATH_MAX];
+   BundleEntry *e;
+   uint64_t pos;
+   uint32_t len;
+   uint32_t w[4];
+   uint32_t i;
+   char *raw;
+
+   raw = malloc(u->manifest.manifestBytes + 1);
+   u->manifest.entries = calloc(u->manifest.count + 1, sizeof(BundleEntry));
+   u->manifest.alloc = u->manifest.count;
+   if (raw == NULL || u->manifest.entries == NULL ||
+       readAt(u->spool, raw, u->manifest.manifestBytes, BUNDLE_HEADER) < 0)
+   {
+      free(raw);
+      u->manifest.count = 0;
+      return -1;
+   }
+   u->manifest.size = BUNDLE_HEADER + u->manifest.manifestBytes;
+   pos = 0;
+   for (i = 0; i < u->manifest.count; i++)
+   {
+      e = &u->manifest.entries[i];
+      if (pos + BUNDLE_ENTRY > u->manifest.manifestBytes)
+         break;
+      getWords(raw + pos, w);
+      len = w[3] & 0xffff;
+      if (pos + BUNDLE_ENTRY + len > u->manifest.manifestBytes)
+         break;
+      e->size = (uint64_t)w[0] << 32 | w[1];
+      e->mode = w[2] & 07777;
+      e->flags = w[3] >> 16;
+      e->path = strndup(raw + pos + BUNDLE_ENTRY, len);
+      pos += BUNDLE_ENTRY + len;
+      if (e->flags & BUNDLE_ISDIR)
+         e->size = 0;
+      if (!(e->flags & (BUNDLE_ISDIR | BUNDLE_STREAMED)))
+      {
+         e->offset = u->manifest.size;
+         u->manifest.size += e->size;
+         if (u->manifest.size < e->offset)
+            break;
+      }
+
+      //a path with a NUL, or one that would leave dir, is refused
+      if (e->path != NULL && (strlen(e->path) != len || !bundlePathValid(e->path) ||
+                              snprintf(path, sizeof(path), "%s/%s", u->dir, e->path) >=
+                              (int)sizeof(path)))
+      {
+         free(e->path);
+         e->path = NULL;
+      }
+      if (e->path == NULL)
+         u->errors++;
+      else if ((e->flags & BUNDLE_ISDIR) && mkdir(path, 0700) < 0 && errno != EEXIST)
+         u->errors++;
+      else if (e->flags & BUNDLE_ISDIR)
+         u->dirs++;
+   }
+   free(raw);
+   if (i < u->manifest.count || pos != u->manifest.manifestBytes)
+   {
+      u->manifest.count = i;
+      return -1;
+   }
+   return 0;
+}
+
+//creates the file of entry e from its bytes in the spool
+static int unpackFile(Unpacker *u, BundleEntry *e)
+{
+   char path[PATH_MAX];
+   char *buf;
+   loff_t from;
+   uint64_t left;
+   ssize_t n;
+   int ret;
+   int fh;
+
+   if (snprintf(path, sizeof(path), "%s/%s", u->dir, e->path) >= (int)sizeof(path))
+      return -1;
+   fh = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+   if (fh < 0)
+      return -1;
+   from = e->offset;
+   left = e->size;
+   while (left > 0 && (n = copy_file_range(u->spool, &from, fh, NULL, left, 0)) > 0)
+      left -= n;
+
+   //file systems that cannot copy between the two get the bytes through memory
+   if (left > 0 && (buf = malloc(COPY_CHUNK)) != NULL)
+   {
+      while (left > 0)
+      {
+         n = left < COPY_CHUNK ? left : COPY_CHUNK;
+         if (readAt(u->spool, buf, n, from) < 0 ||
+             pwrite(fh, buf, n, e->size - left) != n)
+            break;
+         from += n;
+         left -= n;
+      }
+      free(buf);
+   }
+   ret = left == 0 && fchmod(fh, e->mode) == 0 ? 0 : -1;
+   if (close(fh) < 0)
+      ret = -1;
+   return ret;
+}
+
+//gives a file streamed on a connection of its own, already in place, the mode of entry e
+static int modeStreamed(Unpacker *u, BundleEntry *e)
+{
+   char path[PATH_MAX];
+   int ret;
+   int fh;
+
+   if (snprintf(path, sizeof(path), "%s/%s", u->dir, e->path) >= (int)sizeof(path))
+      return -1;
+   fh = open(path, O_RDONLY | O_NOFOLLOW);
+   if (fh < 0)
+      return -1;
+   ret = fchmod(fh, e->mode);
+   close(fh);
+   return ret;
+}
+
+static void *unpackThread(void *arg)
+{
+   Unpacker *u = arg;
+   BundleEntry *e;
+   uint64_t need;
+   int ret;
+
+   pthread_mutex_lock(&u->lock);
+   while (!u->stop)
+   {
+      //one thread reads the header, then the manifest, once each is in
+      if (u->stage < 2)
+      {
+         need = BUNDLE_HEADER + (u->stage == 1 ? u->manifest.manifestBytes : 0);
+         if (u->parsing || (u->avail < need && !u->ended))
+         {
+            pthread_cond_wait(&u->cond, &u->lock);
+            continue;
+         }
+         ret = -1;
+         if (u->avail >= need)
+         {
+            u->parsing = 1;
+            pthread_mutex_unlock(&u->lock);
+            ret = u->stage == 0 ? readHeader(u) : readManifest(u);
+            pthread_mutex_lock(&u->lock);
+            u->parsing = 0;
+         }
+         if (ret < 0)
+         {
+            u->errors++;
+            u->stop = 1;
+         }
+         else
+            u->stage++;
+         pthread_cond_broadcast(&u->cond);
+         continue;
+      }
+      if (u->next == u->manifest.count)
+         break;
+
+      //a packed file is taken once its last byte is in
+      e = &u->manifest.entries[u->next];
+      if (e->path != NULL && !(e->flags & (BUNDLE_ISDIR | BUNDLE_STREAMED)) &&
+          e->offset + e->size > u->avail && !u->ended)
+      {
+         pthread_cond_wait(&u->cond, &u->lock);
+         continue;
+      }
+      u->next++;
+      if (e->path == NULL || (e->flags & BUNDLE_ISDIR))
+         continue;
+      if (!(e->flags & BUNDLE_STREAMED) && e->offset + e->size > u->avail)
+      {
+         u->errors++;
+         continue;
+      }
+      u->busy++;
+      pthread_mutex_unlock(&u->lock);
+      ret = e->flags & BUNDLE_STREAMED ? modeStreamed(u, e) : unpackFile(u, e);
+      pthread_mutex_lock(&u->lock);
+      u->busy--;
+      if (ret < 0)
+         u->errors++;
+      else if (!(e->flags & BUNDLE_STREAMED))
+      {
+         u->files++;
+         u->bytes += e->size;
+      }
+   }
+
+   //bundleFinish waits for the last thread out
+   pthread_cond_broadcast(&u->cond);
+   pthread_mutex_unlock(&u->lock);
+   return NULL;
+}
+
+int bundleUnpack(Unpacker *u, const char *spoolPath, const char *dir)
+{
+   memset(u, 0, sizeof(*u));
+   snprintf(u->spoolPath, sizeof(u->spoolPath), "%s", spoolPath);
+   snprintf(u->dir, sizeof(u->dir), "%s", dir);
+   u->spool = open(spoolPath, O_RDONLY);
+   if (u->spool < 0 || (mkdir(dir, 0777) < 0 && errno != EEXIST))
+   {
+      if (u->spool >= 0)
+         close(u->spool);
+      u->spool = -1;
+      return -1;
+   }
+   pthread_mutex_init(&u->lock, NULL);
+   pthread_cond_init(&u->cond, NULL);
+   for (u->numThreads = 0; u->numThreads < BUNDLE_THREADS; u->numThreads++)
+      if (pthread_create(&u->threads[u->numThreads], NULL, unpackThread, u) != 0)
+         break;
+   if (u->numThreads == 0)
+   {
+      bundleStop(u);
+      return -1;
+   }
+   return 0;
+}
+
+void bundleAvail(Unpacker *u, uint64_t bytes)
+{
+   pthread_mutex_lock(&u->lock);
+   if (bytes > u->avail)
+   {
+      u->avail = bytes;
+      pthread_cond_broadcast(&u->cond);
+   }
+   pthread_mutex_unlock(&u->lock);
+}
+
+//joins the threads and closes the spool, keeping the counts
+static void unpackEnd(Unpacker *u)
+{
+   int i;
+
+   for (i = 0; i < u->numThreads; i++)
+      pthread_join(u->threads[i], NULL);
+   u->numThreads = 0;
+   close(u->spool);
+   u->spool = -1;
+   unlink(u->spoolPath);
+   pthread_cond_destroy(&u->cond);
+   pthread_mutex_destroy(&u->lock);
+}
+
+int bundleFinish(Unpacker *u, uint64_t bytes)
+{
+   char path[PATH_MAX];
+   BundleEntry *e;
+   uint32_t i;
+
+   if (u->spool < 0)
+      return -1;
+   pthread_mutex_lock(&u->lock);
+   if (bytes > u->avail)
+      u->avail = bytes;
+   u->ended = 1;
+   pthread_cond_broadcast(&u->cond);
+   while (!u->stop && !(u->stage == 2 && u->next == u->manifest.count && u->busy == 0))
+      pthread_cond_wait(&u->cond, &u->lock);
+   pthread_mutex_unlock(&u->lock);
+   unpackEnd(u);
+
+   //directories get their modes last, deepest first, one without write
+   //permission would have kept out the files it holds
+   for (i = u->stage == 2 ? u->manifest.count : 0; i-- > 0; )
+   {
+      e = &u->manifest.entries[i];
+      if (e->path == NULL || !(e->flags & BUNDLE_ISDIR))
+         continue;
+      if (snprintf(path, sizeof(path), "%s/%s", u->dir, e->path) >= (int)sizeof(path) ||
+          chmod(path, e->mode) < 0)
+         u->errors++;
+   }
+   if (u->stage == 2 && u->avail != u->manifest.size)
+      u->errors++;
+   bundleFree(&u->manifest);
+   return u->errors == 0 ? 0 : -1;
+}
+
+void bundleStop(Unpacker *u)
+{
+   if (u->spoolPath[0] == '\0' || u->spool < 0)
+      return;
+   if (u->numThreads > 0)
+   {
+      pthread_mutex_lock(&u->lock);
+      u->stop = 1;
+      pthread_cond_broadcast(&u->cond);
+      pthread_mutex_unlock(&u->lock);
+   }
+   unpackEnd(u);
+   bundleFree(&u->manifest);
+}
@@ -0,0 +1,115 @@
+//udpBundle Directories sent as one stream - a manifest of every path, size and
+//mode, then the contents of the small files back to back
+
+#ifndef UDPBUNDLE_H
+#define UDPBUNDLE_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+
+#define BUNDLE_MAGIC	0x55424e44	//first word of a bundle, "UBND"
+#define BUNDLE_HEADER	16		//bytes ahead of the manifest: magic, entries, manifest bytes
+#define BUNDLE_ENTRY	16		//bytes of a manifest entry ahead of its path
+#define BUNDLE_SMALL	(1 << 20)	//files smaller than this are packed, larger ones streamed on their own
+#define BUNDLE_THREADS	8		//threads creating the files of one bundle
+#define BUNDLE_BUF	(256 * 1024)	//bytes of packed files collected per write of the stream
+#define BUNDLE_ENTRIES_MAX	(1 << 24)	//most entries a manifest may list
+#define BUNDLE_SUFFIX	".bundle"	//appended to the directory name while its bundle is received
+
+//what a connection carries, SynParams bundle
+#define BUNDLE_NONE	0		//a single file
+#define BUNDLE_DIR	1		//a bundle, unpacked into the directory named
+#define BUNDLE_MEMBER	2		//a streamed file of a bundle, named by its path from dirName
+
+//manifest entry flags
+#define BUNDLE_ISDIR	1		//a directory, created before any file
+#define BUNDLE_STREAMED	2		//a file sent on a connection of its own before the bundle, not in it
+
+/*
+	DATA STRUCTURES
+*/
+
+//one directory or file below the directory sent
+typedef struct {
+   char *path;			//path relative to that directory, '/' separated
+   uint64_t size;		//bytes of a file, 0 for a directory
+   uint64_t offset;		//offset of a packed file's bytes in the bundle
+   uint32_t mode;		//permission bits
+   uint32_t flags;		//BUNDLE_ISDIR, BUNDLE_STREAMED
+} BundleEntry;
+
+//manifest of a directory, parents listed before what they hold
+typedef struct {
+   BundleEntry *entries;
+   uint32_t count;		//entries listed
+   uint32_t alloc;		//entries allocated
+   uint64_t manifestBytes;	//bytes of the manifest in the stream
+   uint64_t size;		//bytes of the whole stream
+   unsigned long skipped;	//links, devices and unreadable entries left out (sender only)
+} Bundle;
+
+//receiver's side, unpacking a bundle while it arrives in a spool file - files
+//are created by a pool of threads as soon as their bytes are in
+typedef struct {
+   Bundle manifest;		//entries, known once the manifest is in
+   int spool;			//spool file read back, -1 once closed
+   char spoolPath[PATH_MAX];	//its path, removed once unpacked
+   char dir[PATH_MAX];		//directory the entries are created in
+   pthread_t threads[BUNDLE_THREADS];
+   int numThreads;		//threads started
+   pthread_mutex_t lock;	//guards everything below
+   pthread_cond_t cond;		//signalled when bytes arrive, work runs out or a thread stops
+   uint64_t avail;		//bytes of the stream in the spool, all of them in order
+   int ended;			//set once avail is the whole stream
+   int stop;			//set to make the threads quit
+   int stage;			//0 until the header is read, 1 until the manifest is, then 2
+   int parsing;			//set while a thread reads either
+   uint32_t next;		//entry handed to a thread next
+   int busy;			//threads writing a file
+   unsigned long files;		//files created
+   unsigned long dirs;		//directories created
+   uint64_t bytes;		//bytes written to them
+   unsigned long errors;	//entries that failed or were refused
+} Unpacker;
+
+
+/*
+	FUNCTIONS
+*/
+
+//lists the directories and regular files below dirName - files of at least
+//BUNDLE_SMALL bytes whose path fits pathMax bytes are marked BUNDLE_STREAMED -
+//and lays out the stream, returns -1 if dirName cannot be read
+int bundleScan(Bundle *b, const char *dirName, uint32_t pathMax);
+
+//writes the stream of b to fd, the files read from dirName - one that shrank since
+//the scan is padded with zeros - returns -1 if fd cannot be written
+int bundlePack(Bundle *b, const char *dirName, int fd);
+
+//releases the entries, also safe on a zeroed one
+void bundleFree(Bundle *b);
+
+//returns 1 if path is relative and stays below its directory, no empty, "." or ".." parts
+int bundlePathValid(const char *path);
+
+//creates the missing directories on the way to file path below dirName, returns -1 on failure
+int bundleMakeParents(const char *dirName, const char *path);
+
+//creates dir and starts the threads unpacking into it from the spool file
+//spoolPath, returns -1 if either cannot be opened
+int bundleUnpack(Unpacker *u, const char *spoolPath, const char *dir);
+
+//tells the threads the first bytes of the stream are in the spool
+void bundleAvail(Unpacker *u, uint64_t bytes);
+
+//ends the stream at bytes, waits for every entry - the streamed files, already in
+//place, get their modes - sets the modes of the directories and removes the
+//spool, returns -1 if any entry failed
+int bundleFinish(Unpacker *u, uint64_t bytes);
+
+//stops the threads of a bundle not finished and removes its spool, also safe
+//after bundleFinish or on a zeroed one
+void bundleStop(Unpacker *u);
+
+#endif
@@ -11,9 +11,18 @@
 //=    Starting file transfer...                                              =
 //=    File transfer is complete                                              =
 //=---------------------------------------------------------------------------=
-//=  Build: gcc udpClient.c udpProtocol.c -lnsl for BSD                                   
+//=  Build: gcc udpClient.c udpProtocol.c udpCongestion.c udpBatch.c        =
+//=         udpSource.c udpRing.c udpFec.c udpCompress.c udpDelta.c         =
+//=         udpImpair.c udpMetrics.c udpTimer.c udpBundle.c udpMerkle.c     =
+//=         -lz -lm -lnsl -lpthread                                           =
+//=         for BSD                                                           =
+//=         (add -DUSE_URING to read the file ahead through io_uring)         =
 //=---------------------------------------------------------------------------=
 //=  Execute: ./udpClient [sendFile] [destIP] [destPort] [packetLoss?0:1]                                                     
+//=           [-w windowSize] [-c none|reno|cubic|bbr] [-b batchSize] [-g]    =
+//=           [-m payloadSize] [-P] [-M] [-Z] [-n remoteName] [-k stripes]    =
+//=           [-f data:parity] [-z codec] [-D] [-I faults] [-E target]        =
+//=           [-a every[:us]] [-V]                                            =
 //=---------------------------------------------------------------------------=
 //=  Author: Justin Bramel                                                    =
 //=          University of South Florida                                      =
@@ -22,6 +31,7 @@
 //=  History:  11/27/2017 - Final version                                     =
 //=============================================================================
 #define  BSD               // WIN for Winsock and BSD for BSD sockets
+#define  _GNU_SOURCE      // Needed for sendmmsg() and recvmmsg()
 
 //----- Include files ---------------------------------------------------------
 #include <stdio.h>          // Needed for printf()
@@ -29,9 +39,25 @@
 #include <stdlib.h>         // Needed for exit()
 #include <fcntl.h>          // Needed for file i/o constants
 #include <string.h>         // Needed for strcpy()
-#include <math.h>           // Needed for fabs()
 #include <ctype.h>
+#include <unistd.h>         // Needed for getopt(), read() and close()
+#include <sys/time.h>       // Needed for gettimeofday()
+#include <sys/random.h>     // Needed for getrandom()
+#include <pthread.h>        // Needed for the stripe threads
+#include <errno.h>          // Needed for ETIMEDOUT
+#include <signal.h>         // Needed for signal()
 #include "udpProtocol.h"
+#include "udpCongestion.h"
+#include "udpBatch.h"
+#include "udpSource.h"
+#include "udpFec.h"
+#include "udpCompress.h"
+#include "udpDelta.h"
+#include "udpImpair.h"
+#include "udpMetrics.h"
+#include "udpAck.h"
+#include "udpBundle.h"
+#include "udpMerkle.h"
 #ifdef WIN
   #include <windows.h>      // Needed for all Winsock stuff
   #include <io.h>           // Needed for open(), close(), and eof()
@@ -52,67 +78,867 @@
 //----- Defines ---------------------------------------------------------------
 #define  PORT_NUM    1050   // Port number used at the server
 #define  SIZE        496    // Buffer size
-#define DISCARD_RATE 0.02   // Discard rate (from 0.0 to 1.0)
-#define G            0.125  // Used to sample RTO
-#define H            0.25   // Used to sample RTO
-#define F            4      // Used to sample RTO
+#define TLP_MIN_US   500    // Shortest wait for an ACK before a tail loss probe
+#define SYN_TRIES    8      // SYN retransmissions before giving up on SYN_ACK
+#define FIN_TRIES    6      // FIN retransmissions before giving up on FIN_ACK
+#define SIG_TRIES    8      // Rounds without a SIGNATURE reply before giving up
+#define TREE_TRIES   8      // Rounds without a TREE reply before giving up
+#define PROBE_TRIES  2      // Probes of one size before trying a smaller one
+#define STRIPE_MAX   64     // Most parallel streams for one file
+#define KEEPALIVE_MS 5000   // Stripe 0 resends a packet this often while it waits
+
+//----- Loss detection --------------------------------------------------------
+// RACK (RFC 8985) - a packet is lost once one sent after it was delivered and
+// an RTT of that one plus a reordering allowance has passed since it was sent
+typedef struct {
+  unsigned long long   xmit;            // Send time of the latest sent packet delivered
+  uint32_t             seq;             // Its seqNum, orders packets sent the same us
+  unsigned long long   rttUs;           // Its RTT
+  uint32_t             end;             // One past the highest seqNum delivered
+  int                  reordering;      // Set once a packet arrived after a later one
+  int                  reoMult;         // Quarters of the min RTT allowed for reordering
+} Rack;
+
+//----- Transfer options ------------------------------------------------------
+typedef struct {
+  char                *destIpAddr;      // Receiver IP address
+  int                  destPortNum;     // Receiver port number
+  Impair              *impair;          // Faults applied to the packets sent
+  MetricsExport       *metrics;         // Exports the metrics, NULL for nowhere
+  uint32_t             window;          // Requested window size
+  char                *ccName;          // Congestion controller
+  int                  batchSize;       // Datagrams per syscall
+  int                  gso;             // Use UDP segmentation offload
+  uint32_t             payload;         // Requested payload size
+  int                  probe;           // Probe the path MTU
+  int                  mapFile;         // Send payloads from a file mapping
+  int                  zerocopy;        // Send payloads with MSG_ZEROCOPY
+  uint32_t             fecData;         // DATA packets per FEC group, 0 for none
+  uint32_t             fecParity;       // REPAIR packets per FEC group
+  uint32_t             ackEvery;        // In order packets per ACK asked for
+  uint32_t             ackDelay;        // Longest an ACK may be held in us, 0 for the server's
+  int                  codec;           // Compression of the payloads
+  int                  delta;           // Send only what the server's copy lacks
+  int                  verify;          // Connections to match the server's copy on, 0 for none
+  int                  stripes;         // Parallel streams for each file
+} SendOptions;
+
+//----- Striped sessions ------------------------------------------------------
+typedef struct {
+  uint32_t             id;              // Session ID shared by every stripe
+  int                  left;            // Stripes other than 0 not yet FIN'd
+  pthread_mutex_t      lock;            // Guards left
+  pthread_cond_t       cond;            // Signalled each time left drops
+} Session;
+
+typedef struct {
+  Session             *session;         // Session the stripe belongs to
+  uint32_t             index;           // Stripe number, 0 FINs last
+  uint64_t             start;           // First byte of the file it sends
+  uint64_t             end;             // One past the last byte it sends
+  pthread_t            thread;          // Thread sending the stripe
+  int                  ret;             // Return code of sendFile()
+
+  // Arguments of sendFile() for the thread
+  char                *fileName;
+  SendOptions         *opts;
+  int                  bundle;
+  char                *remoteName;
+} Stripe;
+
+//----- Directory transfers ---------------------------------------------------
+typedef struct {
+  Bundle              *bundle;          // Manifest of the directory
+  char                *dirName;         // Directory the files are read from
+  int                  fd;              // Write end of the pipe sendFile() reads
+  int                  ret;             // Return code of bundlePack()
+} Packer;
+
 //----- Prototypes ------------------------------------------------------------
-int sendFile(char *fileName, char *destIpAddr, int destPortNum, int options);
+int sendFile(char *fileName, SendOptions *opts, int bundle, char *remoteName,
+             Stripe *stripe);
 
-double rand_val(void)
+//===== Convert a timeout in us for select() ==================================
+static void setTimeout(struct timeval *timeout, unsigned long long us)
 {
-  const long  a =      16807;  // Multiplier
-  const long  m = 2147483647;  // Modulus
-  const long  q =     127773;  // m div a
-  const long  r =       2836;  // m mod a
-  static long x = 1;           // Random int value (seed is set to 1)
-  long        x_div_q;         // x divided by q
-  long        x_mod_q;         // x modulo q
-  long        x_new;           // New x value
-
-  // RNG using integer arithmetic
-  x_div_q = x / q;
-  x_mod_q = x % q;
-  x_new = (a * x_mod_q) - (r * x_div_q);
-  if (x_new > 0)
-    x = x_new;
-  else
-    x = x_new + m;
+  timeout->tv_sec = us / 1000000;
+  timeout->tv_usec = us % 1000000;
+}
+
+//===== Queue a window slot and arm its retransmission timer ==================
+static void transmit(SendBatch *batch, Slot *slot, struct sockaddr_in *server_addr,
+                     Metrics *m, TimerWheel *wheel, unsigned long long rtoUs)
+{
+  slot->sentTime = nowUs();
+  timerAdd(wheel, &slot->timer, slot->sentTime + rtoUs);
+  METRIC_ADD(m->pktsSent, 1);
+  METRIC_ADD(m->bytesSent, packetSize(slot->pkt));
+  batchAddParts(batch, slot->pkt, HEADER_SIZE, slot->data,
+                packetSize(slot->pkt) - HEADER_SIZE, server_addr);
+}
+
+//===== Window slot whose timer node expired, and its seqNum ==================
+static Slot *timerSlot(Tcb *tcb, TimerNode *node, uint32_t *seq)
+{
+  Slot                *slot;            // Slot holding node
+  uint32_t             base;            // Index of the sendBase slot
+
+  slot = (Slot *)((char *)node - offsetof(Slot, timer));
+  base = tcb->sendBase % tcb->window;
+  *seq = tcb->sendBase + ((uint32_t)(slot - tcb->sendWin) + tcb->window - base) % tcb->window;
+  return slot;
+}
+
+//===== Mark [start, end) acknowledged ========================================
+// Returns the packets newly acked, their timers are disarmed and the latest
+// sent of them becomes the RACK reference
+static uint32_t ackRange(Tcb *tcb, TimerWheel *wheel, Rack *rack, uint32_t start,
+                         uint32_t end, unsigned long long now, unsigned long long minRttUs)
+{
+  Slot                *slot;            // Slot of the packet acked
+  uint32_t             seq;             // Packet acked
+  uint32_t             count;           // Packets newly acked
+
+  count = 0;
+  for (seq = bitmapNextClear(&tcb->seqMap, start, end); seq < end;
+       seq = bitmapNextClear(&tcb->seqMap, seq + 1, end))
+  {
+    slot = &tcb->sendWin[seq % tcb->window];
+    bitmapSet(&tcb->seqMap, seq);
+    timerCancel(wheel, &slot->timer);
+    count++;
+
+    // An ACK this soon after a retransmission is for the original, whose
+    // send time is gone - the packet was only late, so allow more reordering
+    if (slot->retransmitted && now - slot->sentTime < minRttUs)
+    {
+      rack->reordering = 1;
+      rack->reoMult++;
+      continue;
+    }
+    if (seq < rack->end && !slot->retransmitted)
+      rack->reordering = 1;
+    if (seq >= rack->end)
+      rack->end = seq + 1;
+    if (slot->sentTime > rack->xmit || (slot->sentTime == rack->xmit && seq > rack->seq))
+    {
+      rack->xmit = slot->sentTime;
+      rack->seq = seq;
+      rack->rttUs = now - slot->sentTime;
+    }
+  }
+  return count;
+}
+
+//===== Read the file for the compressor ======================================
+static int readSource(void *arg, Slot *slot, uint32_t len)
+{
+  return sourceNext(arg, slot, len);
+}
+
+//===== Send the REPAIR packets of the group built so far =====================
+static int sendRepair(FecEncoder *enc, SendBatch *batch, SendBatch *repairBatch,
+                      uint32_t connId, struct sockaddr_in *server_addr, Metrics *m)
+{
+  int                  count;           // REPAIR packets of the group
+  int                  j;               // REPAIR packet being sent
+
+  // The DATA packets of the group go first so REPAIR packets only rebuild
+  // what was lost, and the kernel copies REPAIR packets before the encoder
+  // reuses them for the next group
+  batchFlush(batch);
+  count = fecFinish(enc);
+  for (j = 0; j < count; j++)
+  {
+    enc->repair[j].connId = htonl(connId);
+    sealPacket(&enc->repair[j]);
+    METRIC_ADD(m->pktsSent, 1);
+    METRIC_ADD(m->bytesSent, packetSize(&enc->repair[j]));
+    batchAdd(repairBatch, &enc->repair[j], packetSize(&enc->repair[j]), server_addr);
+  }
+  batchFlush(repairBatch);
+  return count;
+}
+
+//===== Find the largest payload the path carries unfragmented ================
+static uint32_t probePayload(int client_s, struct sockaddr_in *server_addr,
+                             uint32_t maxPayload, unsigned long long rtoUs)
+{
+  static const int     mtus[] = { 9000, 8192, 4352, 1500, 1492, 1280, 576 };
+  Packet               pkt;             // Probe packet
+  Packet               inPkt;           // PROBE_ACK packet
+  fd_set               recvsds;         // Used for time out
+  struct timeval       timeout;         // Time to wait for PROBE_ACK
+  uint32_t             size;            // Payload size being probed
+  uint32_t             found;           // Largest payload acknowledged
+  int                  pmtu;            // Saved IP_MTU_DISCOVER mode
+  int                  dontFrag;        // IP_MTU_DISCOVER mode for probes
+  socklen_t            optLen;          // Length of pmtu
+  int                  i;               // Candidate being tried
+  int                  tries;           // Attempts for one candidate
+  int                  len;             // Length of the received PROBE_ACK
+
+  // Probes go out with DF set so a hop with a smaller MTU drops them
+  optLen = sizeof(pmtu);
+  getsockopt(client_s, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, &optLen);
+  dontFrag = IP_PMTUDISC_PROBE;
+  setsockopt(client_s, IPPROTO_IP, IP_MTU_DISCOVER, &dontFrag, sizeof(dontFrag));
+
+  // Try maxPayload, then the payloads of common MTUs below it
+  found = 0;
+  size = maxPayload;
+  for (i = -1; found == 0 && i < (int)(sizeof(mtus) / sizeof(mtus[0])); i++)
+  {
+    if (i >= 0)
+      size = mtus[i] - 28 - HEADER_SIZE;
+    if (size > maxPayload || size < PAYLOAD_MIN)
+      continue;
+
+    memset(pkt.payload, 0, size);
+    for (tries = 0; tries < PROBE_TRIES && found == 0; tries++)
+    {
+      createPacket(&pkt, size, size, 0, PROBE);
+      sealPacket(&pkt);
+      // EMSGSIZE - larger than the local interface allows
+      if (sendto(client_s, &pkt, packetSize(&pkt), 0,
+          (struct sockaddr *)server_addr, sizeof(*server_addr)) < 0)
+        break;
+
+      FD_ZERO(&recvsds);
+      FD_SET((unsigned int) client_s, &recvsds);
+      setTimeout(&timeout, rtoUs);
+      while (found == 0 && select(client_s + 1, &recvsds, NULL, NULL, &timeout) > 0)
+      {
+        len = recv(client_s, (void *)&inPkt, sizeof(Packet), 0);
+        if (!verifyPacket(&inPkt, len))
+          continue;
+        readPacket(&inPkt);
+        if (inPkt.flag == PROBE_ACK && inPkt.seqNum == size)
+          found = size;
+      }
+    }
+  }
 
-  // Return a random value between 0.0 and 1.0
-  return((double) x / m);
+  setsockopt(client_s, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu));
+  return found ? found : PAYLOAD_SIZE;
+}
+
+//===== Fetch the signature of the server's copy of the file ==================
+static int fetchSignature(int client_s, Impair *impair, struct sockaddr_in *server_addr,
+                          uint32_t connId, DeltaSig *sig, uint32_t payloadSize,
+                          uint32_t window, unsigned long long rtoUs)
+{
+  Packet               pkt;             // SIGNATURE request
+  Packet               inPkt;           // SIGNATURE reply
+  Bitmap               got;             // Replies received, by chunk
+  fd_set               recvsds;         // Used for time out
+  struct timeval       timeout;         // Time to wait for replies
+  uint32_t             per;             // Entries per reply
+  uint32_t             chunks;          // Replies making up the signature
+  uint32_t             chunk;           // Chunk being asked for or received
+  uint32_t             left;            // Replies still missing
+  uint32_t             asked;           // Requests sent this round
+  uint32_t             received;        // Replies received this round
+  uint32_t             n;               // Entries in a chunk
+  int                  tries;           // Rounds in a row without a reply
+  int                  len;             // Length of a received datagram
+
+  per = payloadSize / DELTA_SIG_SIZE;
+  chunks = (sig->count + per - 1) / per;
+  if (bitmapInit(&got, chunks) < 0)
+    return -1;
+
+  // Each round asks for up to a window of the missing chunks and takes the
+  // replies, a chunk lost either way is asked for again next round
+  left = chunks;
+  chunk = 0;
+  tries = 0;
+  while (left > 0 && tries < SIG_TRIES)
+  {
+    for (asked = 0; asked < window && asked < left; chunk = (chunk + 1) % chunks)
+    {
+      if (bitmapTest(&got, chunk))
+        continue;
+      n = sig->count - chunk * per < per ? sig->count - chunk * per : per;
+      createPacket(&pkt, 0, chunk * per, n, SIGNATURE);
+      pkt.connId = htonl(connId);
+      sealPacket(&pkt);
+      impairSendto(impair, client_s, &pkt, packetSize(&pkt), server_addr);
+      asked++;
+    }
+
+    FD_ZERO(&recvsds);
+    FD_SET((unsigned int) client_s, &recvsds);
+    setTimeout(&timeout, rtoUs);
+    received = 0;
+    while (received < asked && select(client_s + 1, &recvsds, NULL, NULL, &timeout) > 0)
+    {
+      len = recv(client_s, (void *)&inPkt, sizeof(Packet), 0);
+      if (!verifyPacket(&inPkt, len))
+        continue;
+      readPacket(&inPkt);
+      if (inPkt.flag != SIGNATURE || inPkt.connId != connId ||
+          inPkt.seqNum % per != 0 || inPkt.seqNum >= sig->count)
+        continue;
+      chunk = inPkt.seqNum / per;
+      n = sig->count - chunk * per < per ? sig->count - chunk * per : per;
+      if (bitmapTest(&got, chunk) || inPkt.ackNum != n || inPkt.length != n * DELTA_SIG_SIZE)
+        continue;
+      deltaUnpackSig(sig, inPkt.seqNum, n, inPkt.payload);
+      bitmapSet(&got, chunk);
+      left--;
+      received++;
+    }
+    if (received == 0)
+    {
+      rtoUs = rtoUs*2;
+      tries++;
+    }
+    else
+      tries = 0;
+  }
+  bitmapFree(&got);
+  return left > 0 ? -1 : 0;
+}
+
+//===== Give up on a transfer before its first DATA packet ====================
+// Releases what sendFile() set up so far, src and m may be NULL, and lets
+// stripe 0 end the session without this stripe - returns -1 for sendFile()
+static int dropSend(int client_s, Impair *imp, Source *src, Metrics *m, Stripe *stripe)
+{
+  if (stripe != NULL && stripe->index != 0)
+  {
+    pthread_mutex_lock(&stripe->session->lock);
+    stripe->session->left--;
+    pthread_cond_signal(&stripe->session->cond);
+    pthread_mutex_unlock(&stripe->session->lock);
+  }
+  if (m != NULL)
+  {
+    metricsRemove(m);
+    free(m);
+  }
+  if (src != NULL)
+    sourceClose(src);
+  impairStop(imp);
+#ifdef WIN
+  closesocket(client_s);
+  WSACleanup();
+#endif
+#ifdef BSD
+  close(client_s);
+#endif
+  return -1;
+}
+
+//===== Thread sending one stripe of a file ===================================
+static void *sendStripe(void *arg)
+{
+  Stripe              *s = arg;
+
+  s->ret = sendFile(s->fileName, s->opts, s->bundle, s->remoteName, s);
+  return NULL;
+}
+
+//===== Find the chunks of a file that differ from the server's copy ==========
+// Walks the hash tree down from the root, asking for the server's nodes below
+// each one that differs - the server notes the leaves that do, then keeps the
+// rest of the file as its progress. Returns how many leaves differ, -1 if the
+// server stops answering or cannot keep the rest
+static long findChunks(int client_s, Impair *impair, struct sockaddr_in *server_addr,
+                       uint32_t connId, Merkle *tree, uint32_t payloadSize,
+                       uint32_t window, unsigned long long rtoUs)
+{
+  Packet               pkt;             // TREE request
+  Packet               inPkt;           // TREE reply
+  Bitmap               differ;          // Nodes of the level above that differ
+  Bitmap               below;           // Nodes of the level asked for that differ
+  Bitmap               got;             // Replies received, by request
+  SackBlock           *asks;            // Nodes asked for by each request, lowest first
+  fd_set               recvsds;         // Used for time out
+  struct timeval       timeout;         // Time to wait for replies
+  uint32_t             numAsks;         // Requests for the level
+  uint32_t             per;             // Nodes per request
+  uint32_t             level;           // Level asked for, one below the level above
+  uint32_t             above;           // Nodes of the level above
+  uint32_t             node;            // Node that differs, or one of a reply
+  uint32_t             end;             // One past its last child
+  uint32_t             ask;             // Request being sent or answered
+  uint32_t             lo, hi;          // Requests a reply may answer
+  uint32_t             left;            // Replies still missing
+  uint32_t             asked;           // Requests sent this round
+  uint32_t             received;        // Replies received this round
+  int                  tries;           // Rounds in a row without a reply
+  int                  len;             // Length of a received datagram
+  long                 found;           // Leaves that differ
+
+  per = payloadSize / MERKLE_HASH_SIZE;
+  asks = malloc(tree->counts[0] * sizeof(SackBlock));
+  if (asks == NULL || bitmapInit(&differ, 1) < 0)
+  {
+    free(asks);
+    return -1;
+  }
+
+  // The root is the one node above the top level, and it differs
+  bitmapSet(&differ, 0);
+  tries = 0;
+  for (level = tree->levels; level > 0 && tries < TREE_TRIES; level--)
+  {
+    // The children of each node that differs, adjacent ones in one request
+    above = level < tree->levels ? tree->counts[level] : 1;
+    numAsks = 0;
+    for (node = bitmapNextSet(&differ, 0, above); node < above;
+         node = bitmapNextSet(&differ, node + 1, above))
+    {
+      end = 2 * node + 2 < tree->counts[level - 1] ? 2 * node + 2 : tree->counts[level - 1];
+      if (numAsks > 0 && asks[numAsks - 1].end == 2 * node &&
+          end - asks[numAsks - 1].start <= per)
+        asks[numAsks - 1].end = end;
+      else
+      {
+        asks[numAsks].start = level < tree->levels ? 2 * node : 0;
+        asks[numAsks].end = end;
+        numAsks++;
+      }
+    }
+    bitmapFree(&differ);
+    if (bitmapInit(&below, tree->counts[level - 1]) < 0 || bitmapInit(&got, numAsks + 1) < 0)
+    {
+      free(asks);
+      return -1;
+    }
+
+    // Each round sends up to a window of the requests not yet answered, each
+    // carrying this side's nodes, and takes the replies
+    left = numAsks;
+    ask = 0;
+    tries = 0;
+    while (left > 0 && tries < TREE_TRIES)
+    {
+      for (asked = 0; asked < window && asked < left; ask = (ask + 1) % numAsks)
+      {
+        if (bitmapTest(&got, ask))
+          continue;
+        createPacket(&pkt, (asks[ask].end - asks[ask].start) * MERKLE_HASH_SIZE,
+                     asks[ask].start, level - 1, TREE);
+        merklePack(tree, level - 1, asks[ask].start, asks[ask].end - asks[ask].start,
+                   pkt.payload);
+        pkt.connId = htonl(connId);
+        sealPacket(&pkt);
+        impairSendto(impair, client_s, &pkt, packetSize(&pkt), server_addr);
+        asked++;
+      }
+
+      FD_ZERO(&recvsds);
+      FD_SET((unsigned int) client_s, &recvsds);
+      setTimeout(&timeout, rtoUs);
+      received = 0;
+      while (received < asked && select(client_s + 1, &recvsds, NULL, NULL, &timeout) > 0)
+      {
+        len = recv(client_s, (void *)&inPkt, sizeof(Packet), 0);
+        if (!verifyPacket(&inPkt, len))
+          continue;
+        readPacket(&inPkt);
+        if (inPkt.flag != TREE || inPkt.connId != connId || inPkt.ackNum != level - 1)
+          continue;
+
+        //the request starting at seqNum, found by bisection
+        lo = 0;
+        hi = numAsks;
+        while (hi - lo > 1)
+          if (asks[(lo + hi) / 2].start <= inPkt.seqNum)
+            lo = (lo + hi) / 2;
+          else
+            hi = (lo + hi) / 2;
+        if (asks[lo].start != inPkt.seqNum || bitmapTest(&got, lo) ||
+            inPkt.length != (asks[lo].end - asks[lo].start) * MERKLE_HASH_SIZE)
+          continue;
+        for (node = asks[lo].start; node < asks[lo].end; node++)
+          if (merkleDiffer(tree, level - 1, node,
+                           inPkt.payload + (node - asks[lo].start) * MERKLE_HASH_SIZE))
+            bitmapSet(&below, node);
+        bitmapSet(&got, lo);
+        left--;
+        received++;
+      }
+      if (received == 0)
+      {
+        rtoUs = rtoUs*2;
+        tries++;
+      }
+      else
+        tries = 0;
+    }
+    bitmapFree(&got);
+    differ = below;
+  }
+  free(asks);
+  found = 0;
+  for (node = bitmapNextSet(&differ, 0, tree->counts[0]); node < tree->counts[0];
+       node = bitmapNextSet(&differ, node + 1, tree->counts[0]))
+    found++;
+  bitmapFree(&differ);
+  if (tries == TREE_TRIES)
+    return -1;
+
+  // Then the server keeps all but those chunks for the next connection
+  for (tries = 0; tries < TREE_TRIES; tries++)
+  {
+    createPacket(&pkt, 0, 0, MERKLE_REPAIR, TREE);
+    pkt.connId = htonl(connId);
+    sealPacket(&pkt);
+    impairSendto(impair, client_s, &pkt, packetSize(&pkt), server_addr);
+
+    FD_ZERO(&recvsds);
+    FD_SET((unsigned int) client_s, &recvsds);
+    setTimeout(&timeout, rtoUs);
+    if (select(client_s + 1, &recvsds, NULL, NULL, &timeout) == 0)
+    {
+      rtoUs = rtoUs*2;
+      continue;
+    }
+    len = recv(client_s, (void *)&inPkt, sizeof(Packet), 0);
+    if (!verifyPacket(&inPkt, len))
+      continue;
+    readPacket(&inPkt);
+    if (inPkt.flag == TREE && inPkt.connId == connId && inPkt.ackNum == MERKLE_REPAIR)
+      break;
+  }
+  return tries < TREE_TRIES && inPkt.seqNum == 1 ? found : -1;
+}
+
+//===== Send a file as parallel stripes, each on its own socket ===============
+static int sendStriped(char *fileName, SendOptions *opts, int bundle, char *remoteName)
+{
+  SendOptions          striped;         // Options of every stripe
+  Session              session;         // Shared by every stripe
+  Stripe               stripes[STRIPE_MAX]; // One per thread
+  struct stat          st;              // Size of the file
+  int                  count;           // Stripes to send
+  int                  i;               // Stripe number
+  int                  ret;             // Return code, -1 if any stripe failed
+
+  // A stripe neither sends a delta nor verifies, it sees only part of the file
+  striped = *opts;
+  striped.delta = 0;
+  striped.verify = 0;
+  count = opts->stripes;
+
+  // Ranges need a known size, and every stripe at least one byte
+  if (stat(fileName, &st) < 0 || !S_ISREG(st.st_mode) || (uint64_t) st.st_size < (uint64_t) count)
+  {
+    printf("  *** WARNING - '%s' cannot be striped, sending it whole \n", fileName);
+    return sendFile(fileName, &striped, bundle, remoteName, NULL);
+  }
+
+  // The server groups the stripes by a session ID, 0 means not striped
+  session.id = 0;
+  while (session.id == 0)
+    if (getrandom(&session.id, sizeof(session.id), 0) != sizeof(session.id))
+      session.id = (uint32_t) nowUs() ^ (uint32_t) getpid();
+  session.left = count - 1;
+  pthread_mutex_init(&session.lock, NULL);
+  pthread_cond_init(&session.cond, NULL);
+
+  for (i = 0; i < count; i++)
+  {
+    stripes[i].session = &session;
+    stripes[i].index = i;
+    stripes[i].start = (uint64_t) st.st_size * i / count;
+    stripes[i].end = (uint64_t) st.st_size * (i + 1) / count;
+    stripes[i].fileName = fileName;
+    stripes[i].opts = &striped;
+    stripes[i].bundle = bundle;
+    stripes[i].remoteName = remoteName;
+    if (pthread_create(&stripes[i].thread, NULL, sendStripe, &stripes[i]) != 0)
+    {
+      printf("*** ERROR - pthread_create() failed \n");
+      exit(-1);
+    }
+  }
+  // A stripe that failed leaves a hole in the server's file, the whole
+  // file failed then
+  ret = 0;
+  for (i = 0; i < count; i++)
+  {
+    pthread_join(stripes[i].thread, NULL);
+    if (stripes[i].ret < 0)
+    {
+      printf("  *** ERROR - stripe %d of '%s' failed \n", i, fileName);
+      ret = -1;
+    }
+  }
+
+  pthread_cond_destroy(&session.cond);
+  pthread_mutex_destroy(&session.lock);
+  return ret;
+}
+
+//===== Thread writing a directory's bundle into the pipe sendFile() reads =====
+static void *packBundle(void *arg)
+{
+  Packer              *p = arg;
+
+  p->ret = bundlePack(p->bundle, p->dirName, p->fd);
+  close(p->fd);
+  return NULL;
+}
+
+//===== Send a directory as one bundle, its large files each on their own ====
+static int sendDirectory(char *dirName, SendOptions *opts, char *remoteName)
+{
+  SendOptions          packed;          // Options of the bundle
+  Bundle               bundle;          // Manifest of the directory
+  Packer               packer;          // Thread writing the bundle
+  pthread_t            thread;          // Thread running packBundle()
+  char                 pipeName[32];    // Read end of the pipe, as a file name
+  char                 path[PATH_MAX];  // File streamed on its own
+  char                 member[FILE_NAME_MAX + 1]; // Its name at the server
+  int                  fds[2];          // Pipe carrying the bundle
+  char                *base;           // Directory name the server keeps
+  uint32_t             pathMax;         // Longest path a streamed file may have
+  uint32_t             i;               // Entry of the manifest
+  int                  sent;            // Return code of one file
+  int                  ret;             // Return code, -1 if any file failed
+
+  // A streamed file is named by its path below the directory's last path
+  // component, which has to fit in a SYN - files with longer paths are
+  // packed whatever their size
+  base = strrchr(remoteName, '/') ? strrchr(remoteName, '/') + 1 : remoteName;
+  pathMax = strlen(base) + 1 < FILE_NAME_MAX ? FILE_NAME_MAX - strlen(base) - 1 : 0;
+  if (bundleScan(&bundle, dirName, pathMax) < 0)
+  {
+    printf("  *** ERROR - unable to read the directory '%s' \n", dirName);
+    exit(1);
+  }
+  printf("Bundling %u entries of '%s' into %llu bytes (%lu skipped) \n", bundle.count,
+         dirName, (unsigned long long)bundle.size, bundle.skipped);
+
+  // The large files go first, the server makes the directories on the way to
+  // each - the bundle comes last, so the modes its manifest lists are set once
+  // every file is in place, even those of directories the server may not write
+  ret = 0;
+  for (i = 0; i < bundle.count; i++)
+  {
+    if (!(bundle.entries[i].flags & BUNDLE_STREAMED))
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dirName, bundle.entries[i].path);
+    snprintf(member, sizeof(member), "%s/%s", base, bundle.entries[i].path);
+    if (opts->stripes > 1)
+      sent = sendStriped(path, opts, BUNDLE_MEMBER, member);
+    else
+      sent = sendFile(path, opts, BUNDLE_MEMBER, member, NULL);
+    if (sent < 0)
+    {
+      printf("  *** ERROR - unable to send '%s' of '%s' \n", bundle.entries[i].path, dirName);
+      ret = -1;
+    }
+  }
+
+  // The small files stream through a pipe while they are read, sendFile()
+  // sends it like any other unsized file - one that cannot be mapped, has
+  // no copy at the server to patch and is not read again to verify it. A
+  // bundle the server refuses closes the pipe under the packer, its write
+  // then fails rather than raising SIGPIPE
+  signal(SIGPIPE, SIG_IGN);
+  if (pipe(fds) < 0)
+  {
+    printf("*** ERROR - pipe() failed \n");
+    exit(-1);
+  }
+  packer.bundle = &bundle;
+  packer.dirName = dirName;
+  packer.fd = fds[1];
+  if (pthread_create(&thread, NULL, packBundle, &packer) != 0)
+  {
+    printf("*** ERROR - pthread_create() failed \n");
+    exit(-1);
+  }
+  snprintf(pipeName, sizeof(pipeName), "/dev/fd/%d", fds[0]);
+  packed = *opts;
+  packed.mapFile = 0;
+  packed.zerocopy = 0;
+  packed.delta = 0;
+  packed.verify = 0;
+  if (sendFile(pipeName, &packed, BUNDLE_DIR, remoteName, NULL) < 0)
+    ret = -1;
+  close(fds[0]);
+  pthread_join(thread, NULL);
+  if (packer.ret < 0)
+  {
+    printf("  *** ERROR - unable to send all of '%s' \n", dirName);
+    ret = -1;
+  }
+  bundleFree(&bundle);
+  return ret;
 }
 
 //===== Main program ==========================================================
 int main(int argc, char *argv[])
 {
   char                 sendFileName[256];   // Send file name
+  struct stat          st;                  // Whether it is a directory
   char                 recv_ipAddr[16];     // Reciver IP address
   int                  recv_port;           // Receiver port number
-  int                  options;             // Options
+  int                  emul;                // Emulate packet loss or not
+  Impair               impair;              // Faults applied to the packets sent
+  char                 *exportTarget;       // Where metrics go, NULL for nowhere
+  MetricsExport        metrics;             // Exports the metrics of every stripe
+  SendOptions          opts;                // Options of every transfer
+  char                 *remoteName;         // Name the server stores the file under
+  int                  opt;                 // Current getopt() option
   int                  retcode;             // Return code
 
+  // Parse optional flags, getopt() moves them ahead of the positional args
+  memset(&opts, 0, sizeof(opts));
+  opts.window = WINDOW_DEFAULT;
+  opts.ccName = "cubic";
+  opts.batchSize = BATCH_DEFAULT;
+  opts.payload = PAYLOAD_SIZE;
+  opts.ackEvery = ACK_EVERY_DEFAULT;
+  opts.codec = CODEC_NONE;
+  opts.stripes = 1;
+  remoteName = NULL;
+  impairInit(&impair);
+  exportTarget = NULL;
+  opt = 0;
+  while (opt != -1)
+  {
+    opt = getopt(argc, argv, "w:c:b:gm:PMZn:k:f:z:DI:E:a:V");
+    if (opt == 'w')
+      opts.window = atoi(optarg);
+    else if (opt == 'c')
+      opts.ccName = optarg;
+    else if (opt == 'b')
+      opts.batchSize = atoi(optarg);
+    else if (opt == 'g')
+      opts.gso = 1;
+    else if (opt == 'm')
+      opts.payload = atoi(optarg);
+    else if (opt == 'P')
+      opts.probe = 1;
+    else if (opt == 'M')
+      opts.mapFile = 1;
+    else if (opt == 'Z')
+      opts.mapFile = opts.zerocopy = 1;
+    else if (opt == 'n')
+      remoteName = optarg;
+    else if (opt == 'k')
+      opts.stripes = atoi(optarg);
+    else if (opt == 'f')
+    {
+      opts.fecData = atoi(optarg);
+      opts.fecParity = strchr(optarg, ':') ? atoi(strchr(optarg, ':') + 1) : 1;
+      if (!fecValid(opts.fecData, opts.fecParity))
+        argc = 0;
+    }
+    else if (opt == 'z')
+    {
+      opts.codec = compressCodec(optarg);
+      if (opts.codec < 0)
+        argc = 0;
+    }
+    else if (opt == 'D')
+      opts.delta = 1;
+    else if (opt == 'V')
+      opts.verify = MERKLE_ROUNDS;
+    else if (opt == 'I')
+    {
+      if (impairParse(&impair, optarg) < 0)
+        argc = 0;
+    }
+    else if (opt == 'E')
+      exportTarget = optarg;
+    else if (opt == 'a')
+    {
+      opts.ackEvery = atoi(optarg);
+      opts.ackDelay = strchr(optarg, ':') ? atoi(strchr(optarg, ':') + 1) : 0;
+      if (opts.ackEvery > ACK_EVERY_MAX || opts.ackDelay > ACK_DELAY_MAX_US)
+        argc = 0;
+    }
+    else if (opt != -1)
+      argc = 0;                             // Force the usage message
+  }
+
   // Usage and parsing command line arguments
-  if (argc != 5)
+  if (argc - optind != 4 || opts.stripes < 1 || opts.stripes > STRIPE_MAX ||
+      ((opts.delta || opts.verify) && opts.stripes > 1))
   {
     printf("usage: 'projectServer sendFile recvIpAddr recvPort emul' where \n");
     printf("       sendFile is the filename of an existing file to be sent \n");
+    printf("       (or a directory, sent whole as one bundle)              \n");
     printf("       to the receiver, recvIpAddr is the IP address of the    \n");
     printf("       receiver, recvPort is the port number for the       \n");
     printf("       receiver where udpServer is running,and emul is whether \n");
     printf("       to emulate or not a packet loss                         \n");
+    printf("  -w windowSize  packets in flight (1 is stop and wait)        \n");
+    printf("  -c cc          congestion control: none, reno, cubic or bbr  \n");
+    printf("  -b batchSize   datagrams per sendmmsg()/recvmmsg() call      \n");
+    printf("  -g             send batches with UDP GSO when the kernel can \n");
+    printf("  -m payload     payload bytes per packet (up to 8948 jumbo)   \n");
+    printf("  -P             probe the path MTU, -m is the upper bound     \n");
+    printf("  -M             send payloads straight from a file mapping    \n");
+    printf("  -Z             as -M with MSG_ZEROCOPY sends                 \n");
+    printf("  -n remoteName  name stored by the server (default: sendFile) \n");
+    printf("  -k stripes     send the file as 1 to 64 parallel streams     \n");
+    printf("  -f k:m         send m FEC repair packets per k data packets, \n");
+    printf("                 k up to 64 and m up to 16 (k:1 is XOR)        \n");
+    printf("  -z codec       compress 64KB blocks: none or deflate         \n");
+    printf("  -D             send only what the server's copy lacks (no -k)\n");
+    printf("  -I faults      emulate a network on the packets sent, as     \n");
+    printf("                 loss=P,burst=p:r[:P],delay=ms,jitter=ms,      \n");
+    printf("                 reorder=P,dup=P,corrupt=P,rate=Mbit/s,limit=n,\n");
+    printf("                 seed=n (emul 1 is loss=0.02)                  \n");
+    printf("  -E target      export metrics each second to a file, JSON if \n");
+    printf("                 it ends in .json, or to unix:socketPath       \n");
+    printf("  -a n[:us]      ask for an ACK every n in order packets, held \n");
+    printf("                 at most us (default 8, 0 acks each packet)    \n");
+    printf("  -V             verify the file against a hash tree, sending  \n");
+    printf("                 the chunks that differ again (no -k)          \n");
     return(0);
   }
-  strcpy(sendFileName, argv[1]);
-  strcpy(recv_ipAddr, argv[2]);
-  recv_port = atoi(argv[3]);
+  snprintf(sendFileName, sizeof(sendFileName), "%s", argv[optind]);
 
-  // Initialize parameters
-  options = atoi(argv[4]);
+  // The server keeps only the last path component, of a directory too
+  if (stat(sendFileName, &st) == 0 && S_ISDIR(st.st_mode))
+    while (strlen(sendFileName) > 1 && sendFileName[strlen(sendFileName) - 1] == '/')
+      sendFileName[strlen(sendFileName) - 1] = '\0';
+  if (remoteName == NULL)
+    remoteName = strrchr(sendFileName, '/') ? strrchr(sendFileName, '/') + 1 : sendFileName;
+  strcpy(recv_ipAddr, argv[optind + 1]);
+  recv_port = atoi(argv[optind + 2]);
+  opts.destIpAddr = recv_ipAddr;
+  opts.destPortNum = recv_port;
+  opts.impair = &impair;
+
+  // Initialize parameters, emul 1 is the old fixed loss unless -I is given
+  emul = atoi(argv[optind + 3]);
+  if (emul == 1 && !impairActive(&impair))
+    impairParse(&impair, IMPAIR_LEGACY);
+
+  if (exportTarget != NULL && metricsStart(&metrics, exportTarget, METRICS_INTERVAL_MS) < 0)
+  {
+    printf("  *** ERROR - unable to export metrics to '%s' \n", exportTarget);
+    exit(1);
+  }
+  opts.metrics = exportTarget ? &metrics : NULL;
 
   // Send the file
   printf("Starting file transfer... \n");
-  retcode = sendFile(sendFileName, recv_ipAddr, recv_port, options);
+  if (stat(sendFileName, &st) == 0 && S_ISDIR(st.st_mode))
+    retcode = sendDirectory(sendFileName, &opts, remoteName);
+  else if (opts.stripes > 1)
+    retcode = sendStriped(sendFileName, &opts, BUNDLE_NONE, remoteName);
+  else
+    retcode = sendFile(sendFileName, &opts, BUNDLE_NONE, remoteName, NULL);
+  if (exportTarget != NULL)
+    metricsStop(&metrics);
+  if (retcode < 0)
+  {
+    printf("  *** ERROR - file transfer failed \n");
+    return 1;
+  }
   printf("File transfer is complete \n");
 
   // Return
@@ -124,9 +950,13 @@ int main(int argc, char *argv[])
 //=============================================================================
 //=  Inputs:                                                                  =
 //=    fileName ----- Name of file to open, read, and send                    =
-//=    destIpAddr --- IP address or receiver                                  =
-//=    destPortNum -- Port number receiver is listening on                    =
-//=    options ------ Options whether to emulate packet loss or not           =
+//=    opts --------- Options main() parsed, read-only and shared by stripes: =
+//=                   receiver, emulated faults, metrics export, window and   =
+//=                   congestion control, batching, payload, FEC, ACKs,       =
+//=                   codec, delta and the connections left to verify on      =
+//=    bundle ------- BUNDLE_NONE, or what the file is to a directory sent    =
+//=    remoteName --- Name the server stores the file under                   =
+//=    stripe ------- Range and session to send as one stripe, NULL for all   =
 //=---------------------------------------------------------------------------=
 //=  Outputs:                                                                 =
 //=    Returns -1 for fail and 0 for success                                  =
@@ -137,7 +967,8 @@ int main(int argc, char *argv[])
 //=  Bugs:                                                                    =
 //=    None known                                                             =
 //=---------------------------------------------------------------------------=
-int sendFile(char *fileName, char *destIpAddr, int destPortNum, int options)
+int sendFile(char *fileName, SendOptions *opts, int bundle, char *remoteName,
+             Stripe *stripe)
 {
 #ifdef WIN
   WORD wVersionRequested = MAKEWORD(1,1);       // Stuff for WSA functions
@@ -145,28 +976,90 @@ int sendFile(char *fileName, char *destIpAddr, int destPortNum, int options)
 #endif
   int                  client_s;        // Client socket descriptor
   struct sockaddr_in   server_addr;     // Server Internet address
-  char                 out_buf[4096];   // Output buffer for data
-  int                  fh;              // File handle
+  Source               src;             // File being sent
   int                  length;          // Length of send buffer
   int                  retcode;         // Return code
   int                  sel;		        // Return code for select
   fd_set	           recvsds;         // Used for time out
   struct timeval       timeout;		    //struct for time interval for select
-  struct timeval       te;              //struct for current time
   unsigned int 		   addr_len;        // Length of server address
-  double               rtt;             // RTT for a given packet
-  double               srtt;            // Used to sample RTO
-  double               serr;            // Used to sample RTO
-  double               sdev;            // USed to sample RTO
-  int                  rto;             // RTO for the timeout
-  unsigned long long   startTime;       // UNIX start time (in ms)
-  unsigned long long   endTime;         // UNIX end time (in ms)
+  RttEstimator         est;             // Smoothed RTT and RTO
+  TimerWheel           wheel;           // Deadline of every packet in flight
+  TimerNode           *node;            // Deadline that expired
+  TimerNode            probeTimer;      // Deadline of the tail loss probe
+  int                  probeOut;        // Set while a probe awaits an ACK
+  Rack                 rack;            // Latest delivery, for loss detection
+  unsigned long long   reoWnd;          // Reordering allowance of RACK
+  unsigned long long   due;             // Time a packet counts as lost
+  int                  rackScan;        // Set when the holes need checking
+  int                  timedOut;        // Set when an RTO expired
+  int                  progress;        // Set when ACKs delivered new packets
+  unsigned long long   now;             // Current time (in us)
+  unsigned long long   wait;            // Time until the next event (in us)
+  unsigned long long   rttUs;           // RTT sample for congestion control
+  uint32_t             delayUs;         // Time the server held the incoming ACK
+  Congestion           cc;              // Congestion controller and pacer
+  uint32_t             inFlight;        // Packets sent and not yet acked
+  uint32_t             acked;           // Packets newly acked by an ACK
+  uint32_t             recoverSeq;      // Holes below this are the same loss
+  unsigned long long   lossTime;        // Unacked packets sent before this are lost
+  uint32_t             lossSeq;         // Next packet to check for such a loss
+  uint32_t             lossEnd;         // nextSeq when the timeout occurred
+  uint32_t             budget;          // Lost packets an ACK may clock out
   Tcb                  tcb;             // Transfer control block
-  Packet               pkt;             // Outgoing packet
+  SynParams            params;          // Handshake parameters
+  Slot                *slot;            // Window slot being worked on
+  Packet               pkt;             // Outgoing control packet
   Packet               inPkt;           // Incoming packet
-  int                  reset;           // Flag to sample RTT
-  double               z;               // Random value used for packet loss
-  int 		       dup; 		//for regocnizing duplicate packets
+  Packet              *ackPkt;          // Incoming ACK within a batch
+  SendBatch            sendBatch;       // Packets sent by one sendmmsg()
+  RecvBatch            recvBatch;       // ACKs taken by one recvmmsg()
+  int                  j;               // ACK within the receive batch
+  uint32_t             seq;             // Sequence number being worked on
+  int                  eof;             // Set once the whole file has been read
+  int                  starved;         // Set while the read ahead is behind
+  int                  waitFd;          // Read ahead to wake on when starved, or -1
+  uint32_t             firstSeq;        // Packet of the first block read
+  int                  tries;           // SYN or FIN retransmissions so far
+  int                  answered;        // Set once the SYN or FIN was answered
+  unsigned long long   deadline;        // End of the wait for one answer
+  int                  numDups;         // Duplicate ACKs received
+  int                  numHoles;        // Holes resent by RACK
+  unsigned long        numProbes;       // Tail loss probes sent
+  int                  numCorrupt;      // ACKs dropped for a bad checksum
+  int                  len;             // Length of a received datagram
+  SackBlock            sack[SACK_MAX];  // SACK blocks of the incoming ACK
+  int                  count;           // Number of SACK blocks
+  int                  i;               // Loop counter
+  uint32_t             limit;           // Holes below this seqNum are checked
+  uint32_t             connId;          // Connection ID granted in the SYN_ACK
+  int                  fec;             // Set when REPAIR packets follow each group
+  FecEncoder           enc;             // Builds the REPAIR packets
+  SendBatch            repairBatch;     // REPAIR packets of one group
+  unsigned long        numRepair;       // REPAIR packets sent
+  Compressor           comp;            // Frames the file when compressing
+  SackBlock            extents[(PAYLOAD_MAX - PARAMS_SIZE) / sizeof(SackBlock)]; // Blocks the server has
+  int                  numExtents;      // Ranges in extents
+  uint64_t             start;           // First byte of the file this connection sends
+  uint64_t             end;             // One past its last byte
+  unsigned long        numKept;         // Blocks the server kept from an earlier connection
+  int                  framed;          // Set when payloads come from the compressor
+  DeltaSig             sig;             // Signature of the server's copy
+  DeltaOp             *ops;             // Plan of a delta transfer
+  long                 numOps;          // Ops in it
+  unsigned long long   deltaUs;         // Time the signature fetch started
+  Impair               imp;             // Faults of this socket, copied from opts
+  SendOptions          retry;           // Options of the connection sending the chunks that differ
+  uint32_t             window;          // Window asked for, then granted
+  uint32_t             payload;         // Payload asked for, then granted
+  int                  codec;           // Compression asked for, then granted
+  int                  verify;          // Connections left to match the server's copy on
+  unsigned long        numSent;         // DATA packets sent for the first time
+  Metrics             *m;               // Counters and histograms of the transfer
+  Merkle               tree;            // Hash tree of the file, when the server verifies it
+  long                 numDiffer;       // Chunks found to differ from the server's copy
+  int                  repair;          // Set to send the file again for those chunks
+  int                  failed;          // Set once the file may not have arrived whole
 
 #ifdef WIN
   // This stuff initializes winsock
@@ -177,178 +1070,772 @@ int sendFile(char *fileName, char *destIpAddr, int destPortNum, int options)
   client_s = socket(AF_INET, SOCK_DGRAM, 0);
   if (client_s < 0)
   {
-    printf("*** ERROR - socket() failed \n");
-    exit(-1);
+    printf("  *** ERROR - socket() failed \n");
+    return dropSend(client_s, opts->impair, NULL, NULL, stripe);
   }
 
   // Fill-in the server's address information and do a connect
   server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons(destPortNum);
-  server_addr.sin_addr.s_addr = inet_addr(destIpAddr);
+  server_addr.sin_port = htons(opts->destPortNum);
+  server_addr.sin_addr.s_addr = inet_addr(opts->destIpAddr);
   addr_len = sizeof(server_addr);
+
+  // Every packet but the MTU probes goes through the emulated network, each
+  // stripe draws its own faults from the seed
+  imp = *opts->impair;
+  if (impairStart(&imp, client_s, stripe != NULL ? stripe->index : 0) < 0)
+  {
+    printf("  *** ERROR - unable to start the network emulation \n");
+    return dropSend(client_s, &imp, NULL, NULL, stripe);
+  }
   
   // Open file to send
-  #ifdef WIN
-    fh = open(fileName, O_RDONLY | O_BINARY, S_IREAD | S_IWRITE);
-  #endif
-  #ifdef BSD
-    fh = open(fileName, O_RDONLY, S_IREAD | S_IWRITE);
-  #endif
-  if (fh == -1)
+  if (sourceOpen(&src, fileName, opts->mapFile || opts->delta) < 0)
   {
      printf("  *** ERROR - unable to open '%s' \n", fileName);
-     exit(1);
+     return dropSend(client_s, &imp, NULL, NULL, stripe);
   }
 
-  tcb.nextSeq = 0;   // The first sequence number is 0
-  reset =1;          // Set to 1 to start sampling from the beginnign
-  srtt = 100;       // 100ms, assume initially it will take one second
-  sdev = 0;          // Set to 1 initially to keep RTO unchanged
-  rto = 99;         // RTO is initially just below 0
-  dup = 0;
-  int numDups = 0;
+  rttInit(&est);
+  numDups = 0;
+  numHoles = 0;
+  numProbes = 0;
+  numCorrupt = 0;
+  numSent = 0;
+  m = calloc(1, sizeof(Metrics));
+  if (m == NULL)
+  {
+    printf("  *** ERROR - unable to allocate the metrics \n");
+    return dropSend(client_s, &imp, &src, NULL, stripe);
+  }
+
+  window = opts->window;
+  payload = opts->payload;
+  codec = opts->codec;
+  verify = opts->verify;
 
-  //Initiate SYN/SYN ACK SEQUENCE
-   while(1)
+  //Initiate SYN/SYN ACK SEQUENCE - SYN requests a window and payload size,
+  //SYN_ACK grants them
+   params.window = window;
+   params.payload = payload;
+   params.fileSize = src.size;
+   params.offset = 0;
+   params.session = 0;
+   params.stripe = 0;
+   params.fecData = opts->fecData;
+   params.fecParity = opts->fecParity;
+   params.ackEvery = opts->ackEvery;
+   params.ackDelay = opts->ackDelay;
+   params.codec = codec;
+   params.stamp = src.stamp;
+   params.resume = 0;
+   params.delta = opts->delta && src.map != NULL;
+   params.deltaCount = 0;
+   params.bundle = bundle;
+   if (stripe != NULL || src.size == 0)
+     verify = 0;
+   params.verify = verify ? MERKLE_CHUNK : 0;
+   if (opts->delta && src.map == NULL)
+     printf("  *** WARNING - unable to map '%s', sending it whole \n", fileName);
+   if (stripe != NULL)
    {
-     createPacket(&pkt, 1, 0, 0, SYN);
-     //clear and set recv descriptor 
-     FD_ZERO(&recvsds);
-     FD_SET((unsigned int) client_s, &recvsds);
-     //set timeout to 2 seconds if reset == 1 else use remaining time
-     timeout.tv_sec = 0;
-     timeout.tv_usec = rto*1000;
- 
-     //SEND SYN AND START TIMER
-     sendto(client_s, &pkt, PKT_SIZE, 0, 
-         (struct sockaddr *)&server_addr, sizeof(server_addr));
-     sel = select(client_s + 1, &recvsds, NULL, NULL, &timeout);
-     if (sel == 0) 
-     {  
-        rto = rto*2;
-  	continue;
-     }
-     else 
+     sourceRange(&src, stripe->start, stripe->end);
+     params.offset = stripe->start;
+     params.session = stripe->session->id;
+     params.stripe = stripe->index;
+   }
+   snprintf(params.name, sizeof(params.name), "%s", remoteName);
+   for (tries = 0; tries < SYN_TRIES; tries++)
+   {
+     createPacket(&pkt, paramsSize(&params), 0, 0, SYN);
+     packParams(&pkt, &params);
+     sealPacket(&pkt);
+
+     //SEND SYN AND START TIMER - anything but the answer is read past until
+     //the RTO runs out, only then is the SYN sent again
+     impairSendto(&imp, client_s, &pkt, packetSize(&pkt), &server_addr);
+     answered = 0;
+     deadline = nowUs() + est.rtoUs;
+     while (!answered && (now = nowUs()) < deadline)
      {
-       //Receive ACK packet
-       recvfrom(client_s, (void *)&inPkt, PKT_SIZE, 0,
+       FD_ZERO(&recvsds);
+       FD_SET((unsigned int) client_s, &recvsds);
+       setTimeout(&timeout, deadline - now);
+       sel = select(client_s + 1, &recvsds, NULL, NULL, &timeout);
+       if (sel <= 0)
+         break;
+       len = recvfrom(client_s, (void *)&inPkt, sizeof(Packet), 0,
            (struct sockaddr *)&server_addr, &addr_len);
+       if (!verifyPacket(&inPkt, len))
+         continue;
        readPacket(&inPkt);
-       if (inPkt.flag == SYN_ACK) 
-       {  
-   
-         break;
-         
-       }
+       answered = inPkt.flag == SYN_ACK || inPkt.flag == SYN_REFUSED;
      }
+     if (answered)
+       break;
+     rttBackoff(&est);
    }
+   if (tries == SYN_TRIES)
+   {
+     printf("  *** ERROR - no SYNACK received for '%s' \n", remoteName);
+     return dropSend(client_s, &imp, &src, m, stripe);
+   }
+   if (inPkt.flag == SYN_REFUSED)
+   {
+     printf("  *** ERROR - the server refused '%s' \n", remoteName);
+     return dropSend(client_s, &imp, &src, m, stripe);
+   }
+   unpackParams(&inPkt, &params);
+   numExtents = unpackExtents(&inPkt, extents);
+   connId = inPkt.connId;
+
+  metricsAdd(opts->metrics, m, "send", remoteName, connId);
+
+  // The server may grant less than requested, zero means stop and wait
+  if (params.window == 0)
+    params.window = 1;
+  if (params.window < window)
+    window = params.window;
+  if (params.payload >= PAYLOAD_MIN && params.payload < payload)
+    payload = params.payload;
+
+  // A delayed ACK may come that much later than its packet
+  est.ackDelayUs = params.ackEvery > 1 ? params.ackDelay : 0;
+  fec = params.fecData != 0 && params.fecData == opts->fecData &&
+        params.fecParity == opts->fecParity;
+  if (opts->fecData != 0 && !fec)
+    printf("  *** WARNING - the server refused FEC, sending without it \n");
+  if (params.codec != (uint32_t)codec)
+  {
+    printf("  *** WARNING - the server refused compression, sending without it \n");
+    codec = CODEC_NONE;
+  }
+  if (params.delta < DELTA_BLOCK_MIN || params.delta > DELTA_BLOCK_MAX || src.map == NULL)
+    params.delta = 0;
+  if (opts->delta && params.delta == 0)
+    printf("  *** WARNING - the server has no copy to update, sending the whole file \n");
+  framed = codec != CODEC_NONE || params.delta != 0;
 
+  // Shrink the payload to what the path carries without fragmentation - a
+  // resumed file keeps the block size it was started with
+  if (opts->probe && (params.resume > 0 || numExtents > 0))
+    printf("  *** WARNING - resuming, the path MTU is not probed \n");
+  else if (opts->probe)
+  {
+    payload = probePayload(client_s, &server_addr, payload, est.rtoUs);
+    printf("Path MTU probe: %u byte payload \n", payload);
+  }
+
+  // Everything the transfer needs is set up before its first DATA packet,
+  // the first part that fails ends it. A file the server verifies is hashed
+  // into a tree as it is sent, by threads reading it back behind the sender
+  memset(&tcb, 0, sizeof(tcb));
+  enc.repair = NULL;
+  ops = NULL;
+  numOps = 0;
+  failed = 1;
+  if (params.verify < MERKLE_CHUNK_MIN || params.verify > MERKLE_CHUNK_MAX || !verify)
+    params.verify = 0;
+  if (verify && params.verify == 0)
+    printf("  *** WARNING - the server refused to verify '%s' \n", fileName);
+  if (params.verify != 0 && (merkleInit(&tree, src.size, params.verify) < 0 ||
+                             merkleStart(&tree, fileName, MERKLE_THREADS) < 0))
+    printf("  *** ERROR - unable to hash '%s' \n", fileName);
+  else if (initializeClient(&tcb, window, payload) < 0)
+    printf("  *** ERROR - unable to allocate a window of %u packets \n", window);
+  else if (ccInit(&cc, opts->ccName, tcb.window) < 0)
+    printf("  *** ERROR - unknown congestion control '%s' \n", opts->ccName);
+  else if (fec && fecEncoderInit(&enc, opts->fecData, opts->fecParity, tcb.payloadSize) < 0)
+    printf("  *** ERROR - unable to allocate the FEC encoder \n");
+  else
+    failed = 0;
+  if (!failed)
+    METRIC_SET(m->window, tcb.window);
+
+  // The server already has every block below params.resume, reading starts
+  // past them, and those in the extents are read for FEC but not sent
+  numKept = 0;
+  if (!failed && (params.resume > 0 || numExtents > 0))
+  {
+    start = stripe != NULL ? stripe->start : 0;
+    end = stripe != NULL ? stripe->end : src.size;
+    tcb.nextSeq = params.resume;
+    tcb.sendBase = params.resume;
+    for (i = 0; i < numExtents; i++)
+    {
+      if (extents[i].start >= params.resume)
+        bitmapSetRange(&tcb.seqMap, extents[i].start, extents[i].end);
+    }
+    sourceRange(&src, start + (uint64_t)params.resume * tcb.payloadSize, end);
+    printf("Resuming at block %u (%d ranges above it already sent) \n", params.resume,
+           numExtents);
+  }
+
+  // A delta transfer sends only what the server's copy lacks, the signature
+  // of that copy comes first and the file is scanned for its blocks
+  if (!failed && params.delta != 0)
+  {
+    deltaUs = nowUs();
+    if (deltaSigInit(&sig, params.delta, params.deltaCount) < 0 ||
+        fetchSignature(client_s, &imp, &server_addr, connId, &sig, tcb.payloadSize,
+                       tcb.window, est.rtoUs) < 0)
+    {
+      printf("  *** ERROR - unable to fetch the signature of the server's copy \n");
+      failed = 1;
+    }
+    else
+    {
+      now = nowUs();
+      numOps = deltaScan(&sig, (uint8_t *)src.map, src.size, &ops);
+      if (numOps < 0)
+      {
+        printf("  *** ERROR - unable to allocate the delta of '%s' \n", fileName);
+        failed = 1;
+      }
+      else
+        printf("Delta: %u blocks of %u fetched in %.1f ms, scanned in %.1f ms \n",
+               sig.count, sig.blockSize, (now - deltaUs) / 1000.0,
+               (nowUs() - now) / 1000.0);
+    }
+    deltaSigFree(&sig);
+  }
+  if (!failed && framed && compressInit(&comp, codec, readSource, &src) < 0)
+  {
+    printf("  *** ERROR - unable to allocate the compressor \n");
+    failed = 1;
+  }
+  if (failed)
+  {
+    free(ops);
+    fecEncoderFree(&enc);
+    releaseTcb(&tcb);
+    if (params.verify != 0)
+      merkleFree(&tree);
+    return dropSend(client_s, &imp, &src, m, stripe);
+  }
+  if (ops != NULL)
+    compressPlan(&comp, ops, numOps);
+
+  batchInitSend(&sendBatch, client_s, opts->batchSize);
+  batchImpair(&sendBatch, &imp);
+  batchInitRecv(&recvBatch, opts->batchSize);
+  numRepair = 0;
+  if (fec)
+  {
+    batchInitSend(&repairBatch, client_s, FEC_PARITY_MAX);
+    batchImpair(&repairBatch, &imp);
+  }
+
+  // Unless mapped or framed, the file is read ahead by a thread of its own,
+  // into blocks the window slots then point at
+  firstSeq = tcb.nextSeq;
+  if (!framed)
+    sourceStart(&src, tcb.payloadSize, tcb.window);
+  if (opts->gso && batchEnableGso(&sendBatch) < 0)
+    printf("  *** WARNING - no UDP GSO support, sending datagrams one by one \n");
+  if (opts->zerocopy && batchEnableZerocopy(&sendBatch) < 0)
+    printf("  *** WARNING - no MSG_ZEROCOPY support, payloads are copied \n");
+  if (opts->mapFile && src.map == NULL)
+    printf("  *** WARNING - unable to map '%s', reading it instead \n", fileName);
 
   // Read and send the file to the receiver
-  do
+  eof = 0;
+  inFlight = 0;
+  recoverSeq = 0;
+  lossTime = 0;
+  lossSeq = 0;
+  lossEnd = 0;
+  memset(&rack, 0, sizeof(rack));
+  rack.reoMult = 1;
+  memset(&probeTimer, 0, sizeof(probeTimer));
+  probeOut = 0;
+  cc.deliveredTime = nowUs();
+  timerInit(&wheel, cc.deliveredTime);
+  while (!eof || tcb.sendBase != tcb.nextSeq)
   {
-    //Read packet data - place into packet payload - fill in packet header
-    length = read(fh, pkt.payload, PAYLOAD_SIZE); 
-    createPacket(&pkt, length, tcb.nextSeq++, 0, DATA);
-    
-    if (length > 0)
+    // Fill the window - read packet data into the free slots and send them
+    // as far as the congestion window and the pacer allow, once the reader
+    // has the blocks below sendBase back
+    sourceRelease(&src, tcb.sendBase - firstSeq);
+    now = nowUs();
+    starved = 0;
+    while (!eof && tcb.nextSeq - tcb.sendBase < tcb.window &&
+           inFlight < ccWindow(&cc) && ccCanSend(&cc, now))
     {
-        
-        while(1)
+      slot = &tcb.sendWin[tcb.nextSeq % tcb.window];
+      if (framed)
+        length = compressNext(&comp, slot, tcb.payloadSize);
+      else
+        length = sourceNext(&src, slot, tcb.payloadSize);
+      if (length < 0)
+      {
+        // Blocks the server kept moved sendBase on since the release above,
+        // the reader may be waiting for them before it reads any further
+        sourceRelease(&src, tcb.sendBase - firstSeq);
+        starved = 1;
+        break;
+      }
+      if (length == 0)
+      {
+        eof = 1;
+        if (fec)
+          numRepair += sendRepair(&enc, &sendBatch, &repairBatch, connId,
+                                  &server_addr, m);
+        break;
+      }
+      // The server holds ACKs for a few packets, but not for the last one
+      // the windows allow - nothing more comes until it is ACKed
+      createPacket(slot->pkt, length, tcb.nextSeq,
+                   inFlight + 1 >= ccWindow(&cc) ||
+                   tcb.nextSeq + 1 - tcb.sendBase >= tcb.window ? ACK_NOW : 0, DATA);
+      slot->pkt->connId = htonl(connId);
+      sealPacketData(slot->pkt, slot->data);
+      slot->retransmitted = 0;
+      slot->delivered = cc.delivered;
+      slot->deliveredTime = cc.deliveredTime;
+
+      // A block the server kept from an earlier connection counts as acked
+      if (bitmapTest(&tcb.seqMap, tcb.nextSeq))
+      {
+        if (tcb.sendBase == tcb.nextSeq)
+          tcb.sendBase++;
+        numKept++;
+      }
+      else
+      {
+        transmit(&sendBatch, slot, &server_addr, m, &wheel, est.rtoUs);
+        ccOnSend(&cc);
+        inFlight++;
+        numSent++;
+      }
+      if (fec && fecEncode(&enc, tcb.nextSeq, slot->data, length))
+        numRepair += sendRepair(&enc, &sendBatch, &repairBatch, connId,
+                                &server_addr, m);
+      tcb.nextSeq++;
+    }
+    if (params.verify != 0)
+      merkleAvail(&tree, framed ? comp.rawBytes : (uint64_t)tcb.nextSeq * tcb.payloadSize);
+    if (eof && tcb.sendBase == tcb.nextSeq)
+      break;
+
+    // A tail loss probe is due 2 RTTs after the last progress, plus the time
+    // the server may hold its ACK, unless the RTO of the oldest packet comes
+    // first - one probe until an ACK answers it
+    slot = &tcb.sendWin[tcb.sendBase % tcb.window];
+    due = now + (2 * est.srttUs > TLP_MIN_US ? 2 * est.srttUs : TLP_MIN_US) + est.ackDelayUs;
+    if (inFlight == 0 || probeOut || est.srttUs == 0 ||
+        (timerArmed(&slot->timer) && slot->timer.due <= due))
+      timerCancel(&wheel, &probeTimer);
+    else if (!timerArmed(&probeTimer))
+      timerAdd(&wheel, &probeTimer, due);
+
+    //clear and set recv descriptor 
+    FD_ZERO(&recvsds);
+    FD_SET((unsigned int) client_s, &recvsds);
+    waitFd = starved ? sourceWaitFd(&src) : -1;
+    if (waitFd >= 0)
+      FD_SET((unsigned int) waitFd, &recvsds);
+
+    //wait no longer than the next packet deadline, or until the pacer
+    //releases the next packet when only the pacer holds it back
+    wait = ~0ULL;
+    due = timerNext(&wheel);
+    if (due != TIMER_NONE)
+      wait = due > now ? due - now : 0;
+    if (!eof && !starved && tcb.nextSeq - tcb.sendBase < tcb.window &&
+        inFlight < ccWindow(&cc) && ccPacingDelay(&cc, now) < wait)
+      wait = ccPacingDelay(&cc, now);
+    setTimeout(&timeout, wait);
+
+    //send everything queued above with one syscall, then call select()
+    batchFlush(&sendBatch);
+    sel = select((waitFd > client_s ? waitFd : client_s) + 1, &recvsds, NULL, NULL, &timeout);
+
+    //Receive every queued ACK packet - seqNum is the packet being
+    //acknowledged and ackNum the next seqNum the receiver expects in order
+    progress = 0;
+    batchRecv(&recvBatch, client_s, MSG_DONTWAIT);
+    for (j = 0; j < recvBatch.count; j++)
+    {
+      ackPkt = recvBatch.pkt[j];
+      METRIC_ADD(m->pktsRecv, 1);
+      METRIC_ADD(m->bytesRecv, recvBatch.len[j]);
+      if (!verifyPacket(ackPkt, recvBatch.len[j]))
+      {
+        numCorrupt++;
+        continue;
+      }
+      readPacket(ackPkt);
+      if (ackPkt->flag != ACK || ackPkt->connId != connId)
+        continue;
+
+      now = nowUs();
+      acked = 0;
+      rttUs = 0;
+      seq = ackPkt->seqNum;
+      count = unpackAck(ackPkt, &delayUs, sack);
+      slot = &tcb.sendWin[seq % tcb.window];
+      if (seq >= tcb.sendBase && seq < tcb.nextSeq &&
+          !bitmapTest(&tcb.seqMap, seq))
+      {
+        // Sample the RTT only for packets that were never retransmitted,
+        // without the time the server held the ACK back
+        if (!slot->retransmitted)
+        {
+          rttUs = now - slot->sentTime;
+          if (delayUs < rttUs)
+            rttUs -= delayUs;
+          histAdd(&m->rtt, rttUs);
+          rttSample(&est, rttUs);
+          METRIC_SET(m->srttUs, est.srttUs);
+          METRIC_SET(m->rtoUs, est.rtoUs);
+        }
+      }
+      else
+      {
+        numDups++;
+        slot = NULL;
+      }
+
+      //everything below ackNum has been received, even if those ACKs were
+      //lost, and so has everything in the SACK blocks - lowest first, so
+      //only packets that really arrived late count as reordered. ackNum may
+      //be past nextSeq once a hole below blocks the server kept is filled
+      if (ackPkt->ackNum > tcb.sendBase)
+        acked += ackRange(&tcb, &wheel, &rack, tcb.sendBase,
+                          ackPkt->ackNum < tcb.nextSeq ? ackPkt->ackNum : tcb.nextSeq, now,
+                          est.minRttUs);
+      for (i = 0; i < count; i++)
+      {
+        if (sack[i].start < tcb.sendBase)
+          sack[i].start = tcb.sendBase;
+        if (sack[i].end > tcb.nextSeq)
+          sack[i].end = tcb.nextSeq;
+        if (sack[i].start < sack[i].end)
+          acked += ackRange(&tcb, &wheel, &rack, sack[i].start, sack[i].end, now,
+                            est.minRttUs);
+      }
+      if (slot != NULL)
+        acked += ackRange(&tcb, &wheel, &rack, seq, seq + 1, now, est.minRttUs);
+
+      inFlight -= acked;
+      METRIC_SET(m->inFlight, inFlight);
+      METRIC_SET(m->cwnd, ccWindow(&cc));
+      if (acked > 0)
+      {
+        ccOnAck(&cc, acked, rttUs, slot ? slot->delivered : 0,
+                slot ? slot->deliveredTime : 0, now);
+        progress = 1;
+      }
+
+      //slide the window past the acknowledged packets
+      tcb.sendBase = bitmapNextClear(&tcb.seqMap, tcb.sendBase, tcb.nextSeq);
+
+      //after a timeout the ACKs clock out the rest of the lost packets, two
+      //for each one acknowledged as in slow start
+      budget = 2 * acked;
+      if (lossSeq < tcb.sendBase)
+        lossSeq = tcb.sendBase;
+      for (lossSeq = bitmapNextClear(&tcb.seqMap, lossSeq, lossEnd);
+           lossSeq < lossEnd && budget > 0;
+           lossSeq = bitmapNextClear(&tcb.seqMap, lossSeq + 1, lossEnd))
+      {
+        slot = &tcb.sendWin[lossSeq % tcb.window];
+        if (slot->sentTime < lossTime)
         {
-            //clear and set recv descriptor 
-            FD_ZERO(&recvsds);
-            FD_SET((unsigned int) client_s, &recvsds);
-        
-	    //set timeout to 2 seconds if reset == 1 else use remaining time
-	    timeout.tv_sec = 0;
-            timeout.tv_usec = rto*1000;
-
-            gettimeofday(&te,NULL);
-            startTime = te.tv_sec*1000LL + te.tv_usec/1000; // transfrom to ms
-            
-            //packet loss
-            if(options){
-                z = rand_val();
-                if (z > DISCARD_RATE && dup != 1) {
-	                sendto(client_s, &pkt, PKT_SIZE, 0, 
-                            (struct sockaddr *)&server_addr, sizeof(server_addr));   	
-                }
-            }
-            else if (dup != 1) {
-	            sendto(client_s, &pkt, PKT_SIZE, 0, 
-	                    (struct sockaddr *)&server_addr, sizeof(server_addr));  
-            }
-            
-	    //call select() (start timeout)
-            sel = select(client_s + 1, &recvsds, NULL, NULL, &timeout);
-	        
-            //Timeout has occurred - GOTO beginning of while(1) to retransmit       
-	        if (sel == 0)
-            {
-                reset = 0; // retransmit packet
-	        rto = rto*2;          
-            }	
-	        
-            //Ack packet has been received (could be delayed ack from previous
-            //timeout)
-            else
-	    {   
-	            //Receive ACK packet
-	            recvfrom(client_s, (void *)&inPkt, PKT_SIZE, 0,
-                       (struct sockaddr *)&server_addr, &addr_len);
-                    readPacket(&inPkt);
-                // Previous packet was recevied, this is not a recvfrom a 
-                // retransmission
-                if(reset == 1 && inPkt.flag == ACK && inPkt.ackNum == tcb.nextSeq){ 
-                    gettimeofday(&te,NULL);
-                    endTime = te.tv_sec*1000LL + te.tv_usec/1000;
-                    rtt = endTime-startTime; // rtt is in ms
-                    if(rtt == 0) rtt = 1;
-                    srtt = (1-G)*srtt+G*rtt;
-                    serr = rtt-srtt;
-                    sdev = (1-H)*sdev+H*fabs(serr);
-                    rto = srtt+F*sdev;
-                    
-                }
-	            
-                
-                //If packet is ACK and contains proper ackNum, send next packet
-                //with new timeout
-	        if (inPkt.flag == ACK && inPkt.ackNum == tcb.nextSeq)
-                {
-	            reset = 1;
-                    dup = 0; 
-	            break;
-	        }
-                //duplicate packet - do nothing and use remaining timeout   
-	        else if (inPkt.flag == ACK && inPkt.ackNum < tcb.nextSeq) 
-		{
-                  dup = 1;
-                  rto = timeout.tv_sec*1000LL + timeout.tv_usec/1000;
-                  numDups++;
-                  
-                }
-                else 
-                {
-                  reset = 0;
-                  dup = 0;
-                }
-	    }
+          slot->retransmitted = 1;
+          transmit(&sendBatch, slot, &server_addr, m, &wheel, est.rtoUs);
+          METRIC_ADD(m->retransmits, 1);
+          budget--;
         }
+      }
     }
-    else //send FIN to terminate connection
+
+    //new deliveries answer the probe and push it back
+    if (progress)
+    {
+      probeOut = 0;
+      timerCancel(&wheel, &probeTimer);
+    }
+
+    //Expired deadlines - a tail loss probe resends the highest packet in
+    //flight so its ACK reveals any loss at the tail, a packet out for the RTO
+    //times out, and any other one waits for its RTO again - the RACK check
+    //below brings that forward when a later sent packet was delivered
+    now = nowUs();
+    rackScan = progress;
+    timedOut = 0;
+    while ((node = timerPop(&wheel, now)) != NULL)
+    {
+      if (node == &probeTimer)
+      {
+        for (seq = tcb.nextSeq; seq > tcb.sendBase && bitmapTest(&tcb.seqMap, seq - 1); seq--)
+          ;
+        if (seq == tcb.sendBase || probeOut)
+          continue;
+        slot = &tcb.sendWin[(seq - 1) % tcb.window];
+        slot->retransmitted = 1;
+        transmit(&sendBatch, slot, &server_addr, m, &wheel, est.rtoUs);
+        METRIC_ADD(m->retransmits, 1);
+        numProbes++;
+        probeOut = 1;
+        continue;
+      }
+      slot = timerSlot(&tcb, node, &seq);
+      if (slot->sentTime + est.rtoUs <= now)
+      {
+        timedOut = 1;
+        continue;
+      }
+      timerAdd(&wheel, node, slot->sentTime + est.rtoUs);
+      if (seq < rack.end)
+        rackScan = 1;
+    }
+
+    //RACK - resend each hole sent before the latest packet delivered once it
+    //has been out for that packet's RTT plus the reordering allowance, which
+    //is dropped while recovering or with DUPTHRESH packets above the hole
+    //when no reordering has been seen. The first loss after recoverSeq starts
+    //a new loss event for the congestion controller.
+    if (rackScan)
+    {
+      reoWnd = rack.reoMult * est.minRttUs / 4;
+      if (reoWnd > est.srttUs)
+        reoWnd = est.srttUs;
+      if (!rack.reordering && (recoverSeq > tcb.sendBase ||
+          rack.end >= tcb.sendBase + DUPTHRESH))
+        reoWnd = 0;
+
+      //with FEC a hole is first left to the REPAIR packets of its group,
+      //they follow its last packet so are due once the group is below limit
+      limit = rack.end > tcb.sendBase ? rack.end : tcb.sendBase;
+      if (fec)
+        limit -= limit % opts->fecData;
+      for (seq = bitmapNextClear(&tcb.seqMap, tcb.sendBase, limit); seq < limit;
+           seq = bitmapNextClear(&tcb.seqMap, seq + 1, limit))
+      {
+        slot = &tcb.sendWin[seq % tcb.window];
+        if (slot->sentTime > rack.xmit || (slot->sentTime == rack.xmit && seq >= rack.seq))
+          continue;
+        due = slot->sentTime + rack.rttUs + reoWnd;
+        if (due > now)
+        {
+          if (due < slot->timer.due)
+            timerAdd(&wheel, &slot->timer, due);
+          continue;
+        }
+        if (seq >= recoverSeq)
+        {
+          ccOnLoss(&cc, now);
+          recoverSeq = tcb.nextSeq;
+        }
+        slot->retransmitted = 1;
+        transmit(&sendBatch, slot, &server_addr, m, &wheel, est.rtoUs);
+        METRIC_ADD(m->retransmits, 1);
+        numHoles++;
+      }
+    }
+
+    //RTO - every packet not yet acknowledged counts as lost, retransmit as
+    //many as the reduced congestion window allows and leave the rest to be
+    //clocked out by the ACKs that follow
+    if (timedOut)
+    {
+      ccOnTimeout(&cc, now);
+      rttBackoff(&est);
+      recoverSeq = tcb.nextSeq;
+      lossTime = now;
+      lossEnd = tcb.nextSeq;
+      lossSeq = tcb.sendBase;
+      count = 0;
+      for (seq = tcb.sendBase; seq < tcb.nextSeq;
+           seq = bitmapNextClear(&tcb.seqMap, seq + 1, tcb.nextSeq))
+      {
+        slot = &tcb.sendWin[seq % tcb.window];
+        if ((uint32_t) count < ccWindow(&cc))
+        {
+          slot->retransmitted = 1;
+          transmit(&sendBatch, slot, &server_addr, m, &wheel, est.rtoUs);
+          METRIC_ADD(m->retransmits, 1);
+          count++;
+        }
+        else if (!timerArmed(&slot->timer))
+          timerAdd(&wheel, &slot->timer, now + est.rtoUs);
+      }
+      METRIC_ADD(m->timeouts, 1);
+      METRIC_SET(m->rtoUs, est.rtoUs);
+    }
+  }
+
+  // Stripe 0's FIN ends the session, so it waits for the others - resending
+  // its last packet now and then so the server does not reap it meanwhile
+  if (stripe != NULL && stripe->index == 0)
+  {
+    pthread_mutex_lock(&stripe->session->lock);
+    while (stripe->session->left > 0)
     {
-      createPacket(&pkt, 0, 0, 0, FIN);
-      sendto(client_s, &pkt, PKT_SIZE, 0, 
-              (struct sockaddr *)&server_addr, sizeof(server_addr));
+      struct timespec  until;           // End of the wait
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_sec += KEEPALIVE_MS / 1000;
+      if (pthread_cond_timedwait(&stripe->session->cond, &stripe->session->lock,
+                                 &until) == ETIMEDOUT && tcb.nextSeq > params.resume)
+      {
+        slot = &tcb.sendWin[(tcb.nextSeq - 1) % tcb.window];
+        batchAddParts(&sendBatch, slot->pkt, HEADER_SIZE, slot->data,
+                      packetSize(slot->pkt) - HEADER_SIZE, &server_addr);
+        batchFlush(&sendBatch);
+      }
     }
-  } while ( length > 0);
+    pthread_mutex_unlock(&stripe->session->lock);
+
+    // Drop the ACKs of those resends so they do not use up FIN tries
+    while (recv(client_s, &inPkt, sizeof(inPkt), MSG_DONTWAIT) > 0)
+      ;
+  }
+
+  //the FIN of a verified file carries the root of its tree, once every chunk
+  //is hashed
+  if (params.verify != 0 && merkleFinish(&tree) < 0)
+  {
+    printf("  *** ERROR - unable to read all of '%s' to verify it \n", fileName);
+    failed = 1;
+  }
+
+  //send FIN to terminate connection and wait for FIN_ACK
+  for (tries = 0; tries < FIN_TRIES; tries++)
+  {
+    createPacket(&pkt, params.verify ? MERKLE_HASH_SIZE : 0, tcb.nextSeq,
+                 params.delta ? comp.crc : 0, FIN);
+    if (params.verify != 0)
+      merklePack(&tree, tree.levels - 1, 0, 1, pkt.payload);
+    pkt.connId = htonl(connId);
+    sealPacket(&pkt);
+    impairSendto(&imp, client_s, &pkt, packetSize(&pkt), &server_addr);
+
+    // Late ACKs and anything else are read past until the FIN_ACK comes,
+    // only a timeout without it costs a try
+    answered = 0;
+    deadline = nowUs() + est.rtoUs;
+    while (!answered && (now = nowUs()) < deadline)
+    {
+      FD_ZERO(&recvsds);
+      FD_SET((unsigned int) client_s, &recvsds);
+      setTimeout(&timeout, deadline - now);
+      sel = select(client_s + 1, &recvsds, NULL, NULL, &timeout);
+      if (sel <= 0)
+        break;
+      len = recvfrom(client_s, (void *)&inPkt, sizeof(Packet), 0,
+          (struct sockaddr *)&server_addr, &addr_len);
+      if (!verifyPacket(&inPkt, len))
+        continue;
+      readPacket(&inPkt);
+      answered = inPkt.flag == FIN_ACK && inPkt.connId == connId;
+    }
+    if (answered)
+      break;
+    rttBackoff(&est);
+  }
+  // Without a FIN_ACK the server may not have stored or closed the file
+  if (tries == FIN_TRIES)
+  {
+    printf("  *** ERROR - no FIN_ACK received for '%s' \n", remoteName);
+    failed = 1;
+  }
+  else if (params.delta != 0 && inPkt.ackNum != comp.crc)
+  {
+    printf("  *** ERROR - the server's rebuild of '%s' does not match, it kept the old one \n",
+           fileName);
+    failed = 1;
+  }
+
+  // The copies match when the roots of both trees do, otherwise the trees
+  // lead to the chunks that differ - the server keeps the rest and the file
+  // is sent again, resuming without them. Copies that still differ fail
+  repair = 0;
+  if (tries < FIN_TRIES && params.verify != 0)
+  {
+    if (inPkt.length == MERKLE_HASH_SIZE &&
+        !merkleDiffer(&tree, tree.levels - 1, 0, inPkt.payload))
+      printf("Verified: %u chunks of %u bytes match, root %016llx \n", tree.counts[0],
+             tree.chunk, (unsigned long long)merkleRoot(&tree));
+    else if (framed || (numDiffer = findChunks(client_s, &imp, &server_addr, connId, &tree,
+                                               tcb.payloadSize, tcb.window, est.rtoUs)) < 0)
+    {
+      printf("  *** ERROR - '%s' does not match the server's copy \n", fileName);
+      failed = 1;
+    }
+    else if (verify > 1)
+    {
+      printf("  *** WARNING - %ld chunks of '%s' differ from the server's copy, sending them again \n",
+             numDiffer, fileName);
+      repair = 1;
+    }
+    else
+    {
+      printf("  *** ERROR - %ld chunks of '%s' still differ from the server's copy \n",
+             numDiffer, fileName);
+      failed = 1;
+    }
+  }
+
+  // Let stripe 0 end the session once every other stripe is through
+  if (stripe != NULL && stripe->index != 0)
+  {
+    pthread_mutex_lock(&stripe->session->lock);
+    stripe->session->left--;
+    pthread_cond_signal(&stripe->session->cond);
+    pthread_mutex_unlock(&stripe->session->lock);
+  }
 
   printf("numDuplicates: %d\n",numDups);
+  printf("numHolesResent: %d\n",numHoles);
+  printf("numTailProbes: %lu\n",numProbes);
+  printf("numCorrupt: %d\n",numCorrupt);
+  printf("retransmitted: %llu of %lu packets\n", (unsigned long long)m->retransmits, numSent);
+  printf("ACKs: %llu for %lu packets sent\n", (unsigned long long)m->pktsRecv, numSent);
+  printf("ACK latency: p50 %llu us, p99 %llu us (%llu samples)\n",
+         (unsigned long long)histQuantile(&m->rtt, 0.5),
+         (unsigned long long)histQuantile(&m->rtt, 0.99), (unsigned long long)m->rtt.count);
+  printf("congestion control: %s (cwnd %u)\n", opts->ccName, ccWindow(&cc));
+  if (params.resume > 0 || numKept > 0)
+    printf("resumed: %u blocks skipped, %lu more kept by the server\n",
+           params.resume, numKept);
 
-  // Close the file that was sent to the receiver
-  close(fh);
+  // Close the file that was sent to the receiver, once the kernel is done with it
+  batchFreeSend(&sendBatch);
+  if (framed)
+  {
+    printf("compressed %llu bytes into %llu (%lu of %lu blocks deflated)\n",
+           (unsigned long long)comp.rawBytes, (unsigned long long)comp.wireBytes,
+           comp.packed, comp.blocks);
+    if (params.delta != 0)
+      printf("delta: %llu bytes copied by the server, %ld ops\n",
+             (unsigned long long)comp.copyBytes, numOps);
+    compressFree(&comp);
+    free(ops);
+  }
+  if (fec)
+  {
+    printf("FEC %u:%u repair packets: %lu\n", opts->fecData, opts->fecParity,
+           numRepair);
+    fecEncoderFree(&enc);
+    batchFreeSend(&repairBatch);
+  }
+  if (opts->zerocopy)
+    printf("zero-copy sends: %u (%lu copied by the kernel)\n",
+           sendBatch.zcNext, sendBatch.zcCopied);
+  if (impairActive(&imp))
+    printf("emulated faults: %lu passed, %lu lost, %lu overflowed, %lu duplicated, "
+           "%lu corrupted, %lu reordered\n", imp.passed, imp.lost, imp.overflow,
+           imp.duplicated, imp.corrupted, imp.reordered);
+  impairStop(&imp);
+  metricsRemove(m);
+  free(m);
+  if (params.verify != 0)
+    merkleFree(&tree);
+  sourceClose(&src);
+  releaseTcb(&tcb);
+  batchFreeRecv(&recvBatch);
 
   // Close the client socket
 #ifdef WIN
@@ -373,6 +1860,17 @@ int sendFile(char *fileName, char *destIpAddr, int destPortNum, int options)
   WSACleanup();
 #endif
 
-  // Return zero
-  return(0);
+  // Send the chunks that differ, the server resumes the file without them
+  if (repair)
+  {
+    retry = *opts;
+    retry.window = window;
+    retry.payload = payload;
+    retry.codec = codec;
+    retry.verify = verify - 1;
+    return(sendFile(fileName, &retry, bundle, remoteName, stripe));
+  }
+
+  // Return zero, or -1 when the file may not have arrived whole
+  return(failed ? -1 : 0);
 }
@@ -0,0 +1,407 @@
+#include "udpCompress.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+
+static const struct {
+   const char *name;
+   int codec;
+} codecs[] = {
+   { "none", CODEC_NONE },
+   { "deflate", CODEC_DEFLATE },
+};
+
+int compressCodec(const char *name)
+{
+   size_t i;
+
+   for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++)
+      if (strcmp(codecs[i].name, name) == 0)
+         return codecs[i].codec;
+   return -1;
+}
+
+int compressValid(int codec)
+{
+   return codec == CODEC_NONE || codec == CODEC_DEFLATE;
+}
+
+
+/*
+	COMPRESSOR
+*/
+
+int compressInit(Compressor *comp, int codec, CompressRead read, void *arg)
+{
+   memset(comp, 0, sizeof(Compressor));
+   if (!compressValid(codec))
+      return -1;
+   comp->codec = codec;
+   comp->read = read;
+   comp->arg = arg;
+   comp->readSlot.pkt = &comp->readPkt;
+   comp->raw = malloc(COMPRESS_BLOCK);
+   comp->frame = malloc(COMPRESS_HDR + COMPRESS_BLOCK);
+   if (comp->raw == NULL || comp->frame == NULL ||
+       deflateInit2(&comp->zs, COMPRESS_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+   {
+      free(comp->raw);
+      free(comp->frame);
+      return -1;
+   }
+   comp->backoff = COMPRESS_SKIP_MIN;
+   return 0;
+}
+
+void compressPlan(Compressor *comp, DeltaOp *ops, long count)
+{
+   comp->ops = ops;
+   comp->opCount = count;
+   comp->op = 0;
+   comp->opDone = 0;
+}
+
+//reads until the block has limit bytes or the file ends, -1 if the reader fell
+//behind - bytes the receiver copies are only counted, not kept
+static int compressFill(Compressor *comp, uint32_t limit, int keep)
+{
+   int ret;
+
+   while (comp->rawLen < limit)
+   {
+      ret = comp->read(comp->arg, &comp->readSlot,
+                       limit - comp->rawLen < COMPRESS_READ ? limit - comp->rawLen : COMPRESS_READ);
+      if (ret < 0)
+         return -1;
+      if (ret == 0)
+      {
+         comp->eof = 1;
+         break;
+      }
+      if (keep)
+         memcpy(comp->raw + comp->rawLen, comp->readSlot.data, ret);
+      comp->crc = crc32c(comp->crc, comp->readSlot.data, ret);
+      comp->rawLen += ret;
+   }
+   return 0;
+}
+
+//turns the block into the next frame, deflated only if it shrinks enough -
+//a block that does not makes the next ones go raw without trying, for
+//longer each time, so already compressed files cost little CPU
+static void compressFrame(Compressor *comp)
+{
+   uint32_t wireLen;
+   uint32_t rawLen;
+   uint32_t net[2];
+
+   rawLen = comp->rawLen;
+   wireLen = 0;
+   if (comp->skip > 0)
+      comp->skip--;
+   else if (comp->codec == CODEC_DEFLATE)
+   {
+      comp->zs.next_in = (Bytef *)comp->raw;
+      comp->zs.avail_in = rawLen;
+      comp->zs.next_out = (Bytef *)comp->frame + COMPRESS_HDR;
+      comp->zs.avail_out = rawLen - rawLen / COMPRESS_GAIN;
+      if (deflate(&comp->zs, Z_FINISH) == Z_STREAM_END)
+      {
+         wireLen = comp->zs.total_out;
+         comp->backoff = COMPRESS_SKIP_MIN;
+      }
+      else
+      {
+         comp->skip = comp->backoff;
+         if (comp->backoff < COMPRESS_SKIP_MAX)
+            comp->backoff *= 2;
+      }
+      deflateReset(&comp->zs);
+   }
+
+   if (wireLen > 0)
+   {
+      net[1] = htonl(rawLen | FRAME_PACKED);
+      comp->packed++;
+   }
+   else
+   {
+      wireLen = rawLen;
+      memcpy(comp->frame + COMPRESS_HDR, comp->raw, rawLen);
+      net[1] = htonl(rawLen);
+   }
+   net[0] = htonl(wireLen);
+   memcpy(comp->frame, net, COMPRESS_HDR);
+   comp->frameLen = COMPRESS_HDR + wireLen;
+   comp->framePos = 0;
+   comp->rawBytes += rawLen;
+   comp->wireBytes += comp->frameLen;
+   comp->blocks++;
+   comp->rawLen = 0;
+}
+
+//turns the bytes just read past into a frame naming offset from of the receiver's copy
+static void compressCopy(Compressor *comp, uint64_t from)
+{
+   uint32_t net[4];
+
+   net[0] = htonl(FRAME_COPY_LEN);
+   net[1] = htonl(comp->rawLen | FRAME_COPY);
+   net[2] = htonl(from >> 32);
+   net[3] = htonl(from & 0xffffffff);
+   memcpy(comp->frame, net, sizeof(net));
+   comp->frameLen = COMPRESS_HDR + FRAME_COPY_LEN;
+   comp->framePos = 0;
+   comp->rawBytes += comp->rawLen;
+   comp->copyBytes += comp->rawLen;
+   comp->wireBytes += comp->frameLen;
+   comp->blocks++;
+   comp->rawLen = 0;
+}
+
+//builds the next frame, returns 0 once there are no more, -1 if the reader fell behind
+static int compressStep(Compressor *comp)
+{
+   DeltaOp *op;
+   uint64_t done;
+   uint32_t limit;
+
+   if (comp->ops == NULL)
+   {
+      if (!comp->eof && compressFill(comp, COMPRESS_BLOCK, 1) < 0)
+         return -1;
+      if (comp->rawLen == 0)
+         return 0;
+      compressFrame(comp);
+      return 1;
+   }
+
+   //a frame never spans two ops, a file that got shorter ends the plan early
+   if (comp->op == comp->opCount)
+      return 0;
+   op = &comp->ops[comp->op];
+   limit = op->len - comp->opDone < COMPRESS_BLOCK ? op->len - comp->opDone : COMPRESS_BLOCK;
+   if (compressFill(comp, limit, op->from == DELTA_LITERAL) < 0)
+      return -1;
+   if (comp->rawLen == 0)
+   {
+      comp->op = comp->opCount;
+      return 0;
+   }
+   done = comp->opDone;
+   comp->opDone += comp->rawLen;
+   if (op->from == DELTA_LITERAL)
+      compressFrame(comp);
+   else
+      compressCopy(comp, op->from + done);
+   if (comp->eof)
+      comp->op = comp->opCount;
+   else if (comp->opDone == op->len)
+   {
+      comp->op++;
+      comp->opDone = 0;
+   }
+   return 1;
+}
+
+int compressNext(Compressor *comp, Slot *slot, uint32_t payloadSize)
+{
+   int ret;
+
+   uint32_t length;
+   uint32_t n;
+
+   slot->data = slot->pkt->payload;
+   length = 0;
+   while (length < payloadSize)
+   {
+      if (comp->framePos == comp->frameLen)
+      {
+         ret = compressStep(comp);
+         if (ret < 0)
+            return length > 0 ? (int)length : -1;
+         if (ret == 0)
+            break;
+      }
+      n = comp->frameLen - comp->framePos;
+      if (n > payloadSize - length)
+         n = payloadSize - length;
+      memcpy(slot->data + length, comp->frame + comp->framePos, n);
+      comp->framePos += n;
+      length += n;
+   }
+   return length;
+}
+
+void compressFree(Compressor *comp)
+{
+   deflateEnd(&comp->zs);
+   free(comp->raw);
+   free(comp->frame);
+   comp->raw = NULL;
+   comp->frame = NULL;
+}
+
+
+/*
+	DECOMPRESSOR
+*/
+
+int decompressInit(Decompressor *dec, int codec, uint32_t window, uint32_t payloadSize)
+{
+   memset(dec, 0, sizeof(Decompressor));
+   dec->basis = -1;
+   if (!compressValid(codec))
+      return -1;
+   dec->window = window;
+   dec->payloadSize = payloadSize;
+   dec->ring = malloc((size_t)window * payloadSize);
+   dec->lens = malloc(window * sizeof(uint32_t));
+   dec->frame = malloc(COMPRESS_BLOCK);
+   dec->raw = malloc(COMPRESS_BLOCK);
+   if (dec->ring == NULL || dec->lens == NULL || dec->frame == NULL || dec->raw == NULL ||
+       inflateInit2(&dec->zs, -15) != Z_OK)
+   {
+      decompressFree(dec);
+      return -1;
+   }
+   dec->codec = codec;
+   dec->framed = 1;
+   return 0;
+}
+
+void decompressBasis(Decompressor *dec, int fh)
+{
+   dec->basis = fh;
+}
+
+void decompressPut(Decompressor *dec, uint32_t seq, char *data, uint32_t len)
+{
+   memcpy(dec->ring + (size_t)(seq % dec->window) * dec->payloadSize, data, len);
+   dec->lens[seq % dec->window] = len;
+}
+
+//inflates the frame just completed into its block, or reads the block a copy
+//frame names from the basis, returns its length or -1
+static int decompressBlock(Decompressor *dec, char **block)
+{
+   uint32_t net[2];
+   uint64_t from;
+   uint32_t rawLen;
+   uint32_t len;
+   ssize_t ret;
+
+   rawLen = dec->rawLen & ~(FRAME_PACKED | FRAME_COPY);
+   *block = dec->frame;
+   if (dec->rawLen & FRAME_COPY)
+   {
+      memcpy(net, dec->frame, FRAME_COPY_LEN);
+      from = (uint64_t)ntohl(net[0]) << 32 | ntohl(net[1]);
+      for (len = 0; len < rawLen; len += ret)
+      {
+         ret = pread(dec->basis, dec->raw + len, rawLen - len, from + len);
+         if (ret <= 0)
+            return -1;
+      }
+      dec->copyBytes += rawLen;
+      *block = dec->raw;
+   }
+   else if (dec->rawLen & FRAME_PACKED)
+   {
+      dec->zs.next_in = (Bytef *)dec->frame;
+      dec->zs.avail_in = dec->wireLen;
+      dec->zs.next_out = (Bytef *)dec->raw;
+      dec->zs.avail_out = rawLen;
+      if (inflate(&dec->zs, Z_FINISH) != Z_STREAM_END || dec->zs.total_out != rawLen)
+         return -1;
+      inflateReset(&dec->zs);
+      *block = dec->raw;
+   }
+   return rawLen;
+}
+
+int decompressNext(Decompressor *dec, uint32_t to, char **block, uint64_t *pos)
+{
+   uint32_t net[2];
+   uint32_t len;
+   uint32_t n;
+   char *data;
+   int ret;
+
+   for (; dec->seq != to; dec->seq++, dec->pos = 0)
+   {
+      data = dec->ring + (size_t)(dec->seq % dec->window) * dec->payloadSize;
+      len = dec->lens[dec->seq % dec->window];
+      while (dec->pos < len)
+      {
+         //a header can straddle two packets
+         if (dec->hdrLen < COMPRESS_HDR)
+         {
+            n = COMPRESS_HDR - dec->hdrLen < len - dec->pos ? COMPRESS_HDR - dec->hdrLen : len - dec->pos;
+            memcpy(dec->hdr + dec->hdrLen, data + dec->pos, n);
+            dec->hdrLen += n;
+            dec->pos += n;
+            dec->wireBytes += n;
+            if (dec->hdrLen < COMPRESS_HDR)
+               continue;
+            memcpy(net, dec->hdr, COMPRESS_HDR);
+            dec->wireLen = ntohl(net[0]);
+            dec->rawLen = ntohl(net[1]);
+            dec->framePos = 0;
+            if (dec->wireLen == 0 || dec->wireLen > COMPRESS_BLOCK ||
+                (dec->rawLen & ~(FRAME_PACKED | FRAME_COPY)) > COMPRESS_BLOCK ||
+                (dec->rawLen & FRAME_COPY ? (dec->rawLen & FRAME_PACKED) || dec->basis < 0 ||
+                                            dec->wireLen != FRAME_COPY_LEN :
+                 !(dec->rawLen & FRAME_PACKED) && dec->wireLen != dec->rawLen))
+               return -1;
+            continue;
+         }
+
+         n = dec->wireLen - dec->framePos < len - dec->pos ? dec->wireLen - dec->framePos : len - dec->pos;
+         memcpy(dec->frame + dec->framePos, data + dec->pos, n);
+         dec->framePos += n;
+         dec->pos += n;
+         dec->wireBytes += n;
+         if (dec->framePos == dec->wireLen)
+         {
+            ret = decompressBlock(dec, block);
+            if (ret < 0)
+               return -1;
+            dec->hdrLen = 0;
+            dec->crc = crc32c(dec->crc, *block, ret);
+            *pos = dec->rawPos;
+            dec->rawPos += ret;
+            return ret;
+         }
+      }
+   }
+   return 0;
+}
+
+int decompressPending(Decompressor *dec)
+{
+   return dec->hdrLen > 0;
+}
+
+void decompressFree(Decompressor *dec)
+{
+   if (dec->framed)
+   {
+      inflateEnd(&dec->zs);
+      if (dec->basis >= 0)
+         close(dec->basis);
+   }
+   free(dec->ring);
+   free(dec->lens);
+   free(dec->frame);
+   free(dec->raw);
+   dec->ring = NULL;
+   dec->lens = NULL;
+   dec->frame = NULL;
+   dec->raw = NULL;
+   dec->codec = CODEC_NONE;
+   dec->framed = 0;
+   dec->basis = -1;
+}
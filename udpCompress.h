@@ -0,0 +1,132 @@
+//udpCompress Blocks of the file compressed before packetizing and inflated before the write
+
+#ifndef UDPCOMPRESS_H
+#define UDPCOMPRESS_H
+
+#include <stdint.h>
+#include <zlib.h>
+#include "udpProtocol.h"
+#include "udpDelta.h"
+
+#define CODEC_NONE	0		//DATA payloads are the file itself, or raw frames of a delta transfer
+#define CODEC_DEFLATE	1		//DATA payloads are a stream of frames, deflated when that pays
+
+#define COMPRESS_BLOCK	(64 * 1024)	//raw bytes per frame, the last one of the file may be shorter
+#define COMPRESS_READ	8192		//bytes read from the file at a time, divides COMPRESS_BLOCK
+#define COMPRESS_HDR	8		//frame header: wire length, then raw length and FRAME_PACKED or FRAME_COPY
+#define COMPRESS_LEVEL	1		//zlib level, the link is usually faster than higher levels
+#define COMPRESS_GAIN	8		//a block is sent deflated only if it shrinks by 1/COMPRESS_GAIN
+#define COMPRESS_SKIP_MIN	4	//blocks sent raw untried after one that did not shrink
+#define COMPRESS_SKIP_MAX	64	//the skip doubles while blocks keep not shrinking up to this
+#define FRAME_PACKED	0x80000000	//set in the raw length of a deflated frame
+#define FRAME_COPY	0x40000000	//set in the raw length of a frame naming bytes of the receiver's copy
+#define FRAME_COPY_LEN	8		//wire length of such a frame: the offset in that copy
+
+/*
+	DATA STRUCTURES
+*/
+
+//reads the next len bytes of the file into slot as sourceNext does
+typedef int (*CompressRead)(void *arg, Slot *slot, uint32_t len);
+
+//turns the file into frames and hands them out a payload at a time
+typedef struct {
+   int codec;			//CODEC_DEFLATE, or CODEC_NONE for raw frames
+   z_stream zs;			//deflate state, reset for every block
+   CompressRead read;		//where blocks come from
+   void *arg;			//passed to read
+   Packet readPkt;		//buffer read fills
+   Slot readSlot;		//slot pointing at readPkt
+   char *raw;			//block being collected, COMPRESS_BLOCK bytes
+   uint32_t rawLen;		//bytes in it
+   char *frame;			//frame being handed out, header then payload
+   uint32_t frameLen;		//bytes in it
+   uint32_t framePos;		//bytes already handed out
+   int eof;			//set once read has reached the end of the file
+   uint32_t skip;		//blocks still to send raw without trying to deflate them
+   uint32_t backoff;		//skip after the next block that does not shrink
+   uint64_t rawBytes;		//file bytes framed so far
+   uint64_t wireBytes;		//frame bytes built so far
+   unsigned long blocks;	//frames built
+   unsigned long packed;	//frames that went out deflated
+   DeltaOp *ops;		//plan of a delta transfer, NULL to frame the whole file
+   long opCount;		//ops in it
+   long op;			//op being framed
+   uint64_t opDone;		//bytes of it framed
+   uint64_t copyBytes;		//file bytes sent as copy frames
+   uint32_t crc;		//CRC32C of every file byte read
+} Compressor;
+
+//collects DATA payloads in seqNum order and hands out the blocks of the frames they carry
+typedef struct {
+   int codec;			//CODEC_DEFLATE or CODEC_NONE
+   int framed;			//set once initialized, DATA payloads are frames
+   z_stream zs;			//inflate state, reset for every block
+   uint32_t window;		//packets held, the receive window
+   uint32_t payloadSize;	//largest payload
+   char *ring;			//payload of packet seq at (seq % window) * payloadSize
+   uint32_t *lens;		//length of each payload in ring
+   char hdr[COMPRESS_HDR];	//header of the frame being received
+   uint32_t hdrLen;		//bytes of it received
+   char *frame;			//payload of the frame being received
+   uint32_t wireLen;		//bytes in that payload
+   uint32_t framePos;		//bytes of it received
+   uint32_t rawLen;		//raw length of the frame, with FRAME_PACKED
+   char *raw;			//inflated block
+   uint64_t rawPos;		//file offset of the next block, from the start of the stripe
+   uint32_t seq;		//packet being read
+   uint32_t pos;		//bytes of it read
+   uint64_t wireBytes;		//frame bytes received
+   int basis;			//receiver's copy of the file, read by copy frames, -1 for none
+   uint64_t copyBytes;		//bytes read from it
+   uint32_t crc;		//CRC32C of the blocks handed out
+} Decompressor;
+
+
+/*
+	FUNCTIONS
+*/
+
+//returns the codec called name, -1 if there is none
+int compressCodec(const char *name);
+
+//returns 1 if codec is one this build can decompress
+int compressValid(int codec);
+
+//prepares a compressor for codec taking the file from read, returns -1 if it cannot be allocated
+int compressInit(Compressor *comp, int codec, CompressRead read, void *arg);
+
+//frames the file as the count ops say, copied ranges are read past and sent
+//as copy frames - ops stays the caller's
+void compressPlan(Compressor *comp, DeltaOp *ops, long count);
+
+//as sourceNext, but fills slot->pkt->payload with the next bytes of the frame
+//stream - payloads may be short before the end when read falls behind
+int compressNext(Compressor *comp, Slot *slot, uint32_t payloadSize);
+
+//releases the buffers of a compressor
+void compressFree(Compressor *comp);
+
+//prepares a decompressor for codec and a window of packets of up to payloadSize bytes,
+//returns -1 if it cannot be allocated
+int decompressInit(Decompressor *dec, int codec, uint32_t window, uint32_t payloadSize);
+
+//makes copy frames read from the file fh, which decompressFree closes - call after decompressInit
+void decompressBasis(Decompressor *dec, int fh);
+
+//keeps the payload of packet seq until the packets before it are in
+void decompressPut(Decompressor *dec, uint32_t seq, char *data, uint32_t len);
+
+//reads the frames of the packets kept by decompressPut up to (not including) to,
+//returns the length of the next block completed with *block and *pos set to it and
+//its file offset, 0 once the packets run out, -1 for a malformed frame - the block
+//is valid until the next call
+int decompressNext(Decompressor *dec, uint32_t to, char **block, uint64_t *pos);
+
+//returns 1 while a frame has been started and not finished
+int decompressPending(Decompressor *dec);
+
+//releases the buffers of a decompressor, also safe on a zeroed one
+void decompressFree(Decompressor *dec);
+
+#endif
@@ -0,0 +1,325 @@
+#include "udpCongestion.h"
+#include <string.h>
+#include <math.h>
+
+#define BBR_STARTUP	0
+#define BBR_DRAIN	1
+#define BBR_PROBE_BW	2
+
+//PROBE_BW pacing gains, one phase per min RTT
+static const double bbrCycle[BBR_CYCLE_LEN] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+
+
+/*
+	NONE - fixed window, no pacing (the window negotiated at the handshake)
+*/
+
+static void noneInit(Congestion *cc)
+{
+   cc->cwnd = cc->maxWindow;
+}
+
+static void noneOnAck(Congestion *cc, uint32_t acked, unsigned long long rttUs, double rate, unsigned long long now)
+{
+}
+
+static void noneOnEvent(Congestion *cc, unsigned long long now)
+{
+}
+
+
+/*
+	RENO - slow start, additive increase, halve on loss
+*/
+
+static void renoInit(Congestion *cc)
+{
+   cc->cwnd = CC_INIT_CWND;
+}
+
+static void renoOnAck(Congestion *cc, uint32_t acked, unsigned long long rttUs, double rate, unsigned long long now)
+{
+   if (cc->cwnd < cc->ssthresh)
+      cc->cwnd += acked;
+   else
+      cc->cwnd += (double)acked / cc->cwnd;
+}
+
+static void renoOnLoss(Congestion *cc, unsigned long long now)
+{
+   cc->ssthresh = cc->cwnd / 2;
+   if (cc->ssthresh < CC_MIN_CWND)
+      cc->ssthresh = CC_MIN_CWND;
+   cc->cwnd = cc->ssthresh;
+}
+
+static void renoOnTimeout(Congestion *cc, unsigned long long now)
+{
+   renoOnLoss(cc, now);
+   cc->cwnd = 1;
+}
+
+
+/*
+	CUBIC - window grows as a cubic function of the time since the last loss
+*/
+
+static void cubicOnAck(Congestion *cc, uint32_t acked, unsigned long long rttUs, double rate, unsigned long long now)
+{
+   double t;			//time into the epoch in s, one RTT ahead
+   double target;		//cubic window one RTT from now
+
+   if (cc->cwnd < cc->ssthresh)
+   {
+      cc->cwnd += acked;
+      return;
+   }
+
+   if (cc->epochStart == 0)
+   {
+      cc->epochStart = now;
+      if (cc->cwnd < cc->wMax)
+         cc->k = cbrt((cc->wMax - cc->cwnd) / CUBIC_C);
+      else
+      {
+         cc->k = 0;
+         cc->wMax = cc->cwnd;
+      }
+      cc->wEst = cc->cwnd;
+   }
+
+   t = (now - cc->epochStart + cc->minRtt) / 1e6;
+   target = CUBIC_C * (t - cc->k) * (t - cc->k) * (t - cc->k) + cc->wMax;
+   if (target > cc->cwnd)
+      cc->cwnd += (target - cc->cwnd) / cc->cwnd * acked;
+   else
+      cc->cwnd += 0.01 * acked / cc->cwnd;
+
+   //never grow slower than Reno would - at the rate that makes up for the
+   //smaller decrease until the last peak, at Reno's own rate past it
+   cc->wEst += (cc->wEst < cc->wMax ? 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) : 1) *
+               acked / cc->cwnd;
+   if (cc->wEst > cc->cwnd)
+      cc->cwnd = cc->wEst;
+}
+
+static void cubicOnLoss(Congestion *cc, unsigned long long now)
+{
+   cc->epochStart = 0;
+
+   //fast convergence - release bandwidth when the last peak was not reached
+   if (cc->cwnd < cc->wMax)
+      cc->wMax = cc->cwnd * (1 + CUBIC_BETA) / 2;
+   else
+      cc->wMax = cc->cwnd;
+
+   cc->ssthresh = cc->cwnd * CUBIC_BETA;
+   if (cc->ssthresh < CC_MIN_CWND)
+      cc->ssthresh = CC_MIN_CWND;
+   cc->cwnd = cc->ssthresh;
+}
+
+static void cubicOnTimeout(Congestion *cc, unsigned long long now)
+{
+   cubicOnLoss(cc, now);
+   cc->cwnd = 1;
+}
+
+
+/*
+	BBR - window and pacing rate from a model of bottleneck bandwidth and min RTT
+*/
+
+static void bbrInit(Congestion *cc)
+{
+   cc->cwnd = CC_INIT_CWND;
+   cc->state = BBR_STARTUP;
+   cc->pacingGain = BBR_HIGH_GAIN;
+}
+
+static void bbrOnAck(Congestion *cc, uint32_t acked, unsigned long long rttUs, double rate, unsigned long long now)
+{
+   double bdp;			//bandwidth delay product in packets
+   double cwndGain;		//multiplier on bdp for the window
+   int i;
+
+   //a round trip ends once a packet sent after the round started is acked
+   if (cc->delivered >= cc->roundEnd)
+   {
+      cc->roundEnd = cc->delivered + (uint64_t)cc->cwnd;
+      cc->rounds++;
+      cc->bwRounds[cc->rounds % BBR_BW_ROUNDS] = 0;
+
+      //startup ends after three rounds without 25% bandwidth growth
+      if (cc->state == BBR_STARTUP && cc->btlBw > 0)
+      {
+         if (cc->btlBw >= cc->fullBw * 1.25)
+         {
+            cc->fullBw = cc->btlBw;
+            cc->fullCount = 0;
+         }
+         else if (++cc->fullCount >= 3)
+         {
+            cc->state = BBR_DRAIN;
+            cc->pacingGain = 1 / BBR_HIGH_GAIN;
+         }
+      }
+
+      //drain the startup queue for one round then start probing
+      else if (cc->state == BBR_DRAIN)
+      {
+         cc->state = BBR_PROBE_BW;
+         cc->cycle = 0;
+         cc->cycleStamp = now;
+         cc->pacingGain = bbrCycle[0];
+      }
+   }
+
+   //windowed max filter of the delivery rate
+   if (rate > cc->bwRounds[cc->rounds % BBR_BW_ROUNDS])
+      cc->bwRounds[cc->rounds % BBR_BW_ROUNDS] = rate;
+   cc->btlBw = 0;
+   for (i = 0; i < BBR_BW_ROUNDS; i++)
+      if (cc->bwRounds[i] > cc->btlBw)
+         cc->btlBw = cc->bwRounds[i];
+
+   //move to the next gain phase every min RTT
+   if (cc->state == BBR_PROBE_BW && now - cc->cycleStamp > cc->minRtt)
+   {
+      cc->cycle = (cc->cycle + 1) % BBR_CYCLE_LEN;
+      cc->cycleStamp = now;
+      cc->pacingGain = bbrCycle[cc->cycle];
+   }
+
+   if (cc->btlBw == 0 || cc->minRtt == 0)
+      return;
+
+   bdp = cc->btlBw * cc->minRtt;
+   cwndGain = cc->state == BBR_PROBE_BW ? 2 : BBR_HIGH_GAIN;
+   cc->cwnd = bdp * cwndGain;
+   if (cc->cwnd < 4)
+      cc->cwnd = 4;
+   cc->pacingRate = cc->pacingGain * cc->btlBw * 1e6;
+}
+
+static void bbrOnLoss(Congestion *cc, unsigned long long now)
+{
+   //the model, not loss, sets the window
+}
+
+static void bbrOnTimeout(Congestion *cc, unsigned long long now)
+{
+   //hold back until the next ACK rebuilds the window from the model
+   cc->cwnd = 4;
+}
+
+
+static const CongestionOps controllers[] = {
+   { "none",  noneInit,  noneOnAck,  noneOnEvent, noneOnEvent },
+   { "reno",  renoInit,  renoOnAck,  renoOnLoss,  renoOnTimeout },
+   { "cubic", renoInit,  cubicOnAck, cubicOnLoss, cubicOnTimeout },
+   { "bbr",   bbrInit,   bbrOnAck,   bbrOnLoss,   bbrOnTimeout },
+};
+
+
+int ccInit(Congestion *cc, const char *name, uint32_t maxWindow)
+{
+   int i;
+
+   memset(cc, 0, sizeof(*cc));
+   for (i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++)
+   {
+      if (strcmp(controllers[i].name, name) == 0)
+         cc->ops = &controllers[i];
+   }
+   if (cc->ops == NULL)
+      return -1;
+
+   cc->maxWindow = maxWindow;
+   cc->ssthresh = maxWindow;
+   cc->ops->init(cc);
+   return 0;
+}
+
+void ccOnAck(Congestion *cc, uint32_t acked, unsigned long long rttUs,
+             uint64_t priorDelivered, unsigned long long priorTime, unsigned long long now)
+{
+   double rate;			//delivery rate sample in packets/us
+
+   cc->delivered += acked;
+   cc->deliveredTime = now;
+
+   if (rttUs > 0)
+   {
+      cc->srtt = cc->srtt == 0 ? rttUs : 0.875 * cc->srtt + 0.125 * rttUs;
+      if (cc->minRtt == 0 || rttUs < cc->minRtt || now - cc->minRttStamp > BBR_RTT_WINDOW)
+      {
+         cc->minRtt = rttUs;
+         cc->minRttStamp = now;
+      }
+   }
+
+   rate = 0;
+   if (priorTime != 0 && now > priorTime)
+      rate = (double)(cc->delivered - priorDelivered) / (now - priorTime);
+
+   cc->ops->onAck(cc, acked, rttUs, rate, now);
+   if (cc->cwnd > cc->maxWindow)
+      cc->cwnd = cc->maxWindow;
+
+   //loss based controllers pace at a multiple of cwnd per RTT, BBR sets its own rate
+   if (cc->ops->onAck != bbrOnAck && cc->ops->onAck != noneOnAck && cc->srtt > 0)
+      cc->pacingRate = (cc->cwnd < cc->ssthresh ? 2 : 1.2) * cc->cwnd / cc->srtt * 1e6;
+}
+
+void ccOnLoss(Congestion *cc, unsigned long long now)
+{
+   cc->ops->onLoss(cc, now);
+}
+
+void ccOnTimeout(Congestion *cc, unsigned long long now)
+{
+   cc->ops->onTimeout(cc, now);
+}
+
+uint32_t ccWindow(Congestion *cc)
+{
+   if (cc->cwnd < 1)
+      return 1;
+   return (uint32_t)cc->cwnd;
+}
+
+int ccCanSend(Congestion *cc, unsigned long long now)
+{
+   double burst;		//most tokens the bucket holds
+
+   if (cc->pacingRate <= 0)
+      return 1;
+
+   burst = cc->pacingRate * PACE_BURST_US / 1e6;
+   if (burst < PACE_BURST_MIN)
+      burst = PACE_BURST_MIN;
+
+   if (cc->lastRefill == 0)
+      cc->tokens = burst;
+   else
+      cc->tokens += (now - cc->lastRefill) * cc->pacingRate / 1e6;
+   if (cc->tokens > burst)
+      cc->tokens = burst;
+   cc->lastRefill = now;
+
+   return cc->tokens >= 1;
+}
+
+void ccOnSend(Congestion *cc)
+{
+   if (cc->pacingRate > 0)
+      cc->tokens -= 1;
+}
+
+unsigned long long ccPacingDelay(Congestion *cc, unsigned long long now)
+{
+   if (cc->pacingRate <= 0 || cc->tokens >= 1)
+      return 0;
+   return (unsigned long long)((1 - cc->tokens) * 1e6 / cc->pacingRate) + 1;
+}
@@ -0,0 +1,103 @@
+//udpCongestion Congestion control and pacing for the sender
+
+#ifndef UDPCONGESTION_H
+#define UDPCONGESTION_H
+
+#include <stdint.h>
+
+#define CC_INIT_CWND	10		//initial congestion window in packets
+#define CC_MIN_CWND	2		//smallest window after a loss
+#define PACE_BURST_MIN	4		//packets the pacer may always send back to back
+#define PACE_BURST_US	1000		//otherwise allow bursts worth this many us of the rate
+
+#define CUBIC_C		0.4		//CUBIC scaling constant
+#define CUBIC_BETA	0.7		//CUBIC multiplicative decrease
+
+#define BBR_BW_ROUNDS	10		//rounds covered by the bottleneck bandwidth max filter
+#define BBR_RTT_WINDOW	10000000	//us covered by the min RTT filter
+#define BBR_HIGH_GAIN	2.885		//startup gain, 2/ln(2)
+#define BBR_CYCLE_LEN	8		//phases of the PROBE_BW gain cycle
+
+/*
+	DATA STRUCTURES
+*/
+
+typedef struct Congestion Congestion;
+
+//callbacks implemented by each congestion controller
+typedef struct {
+   const char *name;		//name selected on the command line
+   void (*init)(Congestion *cc);
+   //acked newly acknowledged packets, rttUs RTT sample (0 if none), rate delivery rate sample in packets/us (0 if none)
+   void (*onAck)(Congestion *cc, uint32_t acked, unsigned long long rttUs, double rate, unsigned long long now);
+   //a hole was found by SACK, called once per window of data
+   void (*onLoss)(Congestion *cc, unsigned long long now);
+   //the retransmission timer expired
+   void (*onTimeout)(Congestion *cc, unsigned long long now);
+} CongestionOps;
+
+//state of the congestion controller and pacer of one connection
+struct Congestion {
+   const CongestionOps *ops;	//controller in use
+   uint32_t maxWindow;		//flow control window, cwnd never exceeds it
+   double cwnd;			//congestion window in packets
+   double ssthresh;		//slow start threshold in packets
+   double srtt;			//smoothed RTT in us
+   double minRtt;		//lowest RTT in us seen in the last BBR_RTT_WINDOW
+   unsigned long long minRttStamp;	//time minRtt was sampled
+
+   uint64_t delivered;		//packets acknowledged so far
+   unsigned long long deliveredTime;	//time delivered last changed
+
+   double pacingRate;		//packets per second, 0 disables pacing
+   double tokens;		//packets the pacer may send right now
+   unsigned long long lastRefill;	//time tokens were last refilled
+
+   double wMax;			//CUBIC: window before the last reduction
+   double k;			//CUBIC: time in s to climb back to wMax
+   double wEst;			//CUBIC: window Reno would have (TCP friendly region)
+   unsigned long long epochStart;	//CUBIC: start of the current growth epoch
+
+   int state;			//BBR: STARTUP, DRAIN or PROBE_BW
+   double bwRounds[BBR_BW_ROUNDS];	//BBR: highest delivery rate of recent rounds in packets/us
+   double btlBw;		//BBR: bottleneck bandwidth estimate in packets/us
+   double fullBw;		//BBR: bandwidth at the last startup growth check
+   int fullCount;		//BBR: rounds without 25% bandwidth growth
+   uint64_t roundEnd;		//BBR: delivered count that ends the current round
+   uint32_t rounds;		//BBR: rounds completed
+   int cycle;			//BBR: position in the PROBE_BW gain cycle
+   unsigned long long cycleStamp;	//BBR: start of the current gain phase
+   double pacingGain;		//BBR: multiplier on btlBw for the pacing rate
+};
+
+
+/*
+	FUNCTIONS
+*/
+
+//selects a controller by name ("none", "reno", "cubic" or "bbr"), returns -1 if unknown
+int ccInit(Congestion *cc, const char *name, uint32_t maxWindow);
+
+//reports acked newly acknowledged packets, rttUs and the delivered state recorded when the acked packet was sent
+void ccOnAck(Congestion *cc, uint32_t acked, unsigned long long rttUs,
+             uint64_t priorDelivered, unsigned long long priorTime, unsigned long long now);
+
+//reports a loss detected through SACK
+void ccOnLoss(Congestion *cc, unsigned long long now);
+
+//reports a retransmission timeout
+void ccOnTimeout(Congestion *cc, unsigned long long now);
+
+//returns the number of packets allowed in flight
+uint32_t ccWindow(Congestion *cc);
+
+//refills the pacer, returns 1 if a packet may be sent now
+int ccCanSend(Congestion *cc, unsigned long long now);
+
+//takes a token from the pacer for a packet sent
+void ccOnSend(Congestion *cc);
+
+//returns the us until the pacer allows the next packet
+unsigned long long ccPacingDelay(Congestion *cc, unsigned long long now);
+
+#endif
@@ -0,0 +1,272 @@
+#include "udpConn.h"
+#include <stddef.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+
+//spreads IDs over the chains whatever the step between them
+#define CONN_HASH(id)	(((id) * 2654435761u) >> 22 & (CONN_BUCKETS - 1))
+
+//a file name an unfinished transfer writes - every worker's are listed
+//together, the tables themselves are never read by another worker
+typedef struct ConnName {
+   char name[FILE_NAME_MAX + 16];
+   uint32_t session;
+   uint32_t id;
+   struct ConnName *next;
+} ConnName;
+
+static ConnName *names;
+static pthread_mutex_t namesLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+void connInit(ConnTable *table, uint32_t first, uint32_t step)
+{
+   memset(table->buckets, 0, sizeof(table->buckets));
+   table->step = step > 0 ? step : 1;
+   table->nextId = first > 0 ? first : table->step;
+   table->count = 0;
+}
+
+Conn *connFind(ConnTable *table, uint32_t id)
+{
+   Conn *conn;
+
+   for (conn = table->buckets[CONN_HASH(id)]; conn != NULL; conn = conn->next)
+   {
+      if (conn->id == id)
+         return conn;
+   }
+   return NULL;
+}
+
+Conn *connFindSyn(ConnTable *table, struct sockaddr_in *addr)
+{
+   Conn *conn;
+   int i;
+
+   //SYNs are rare enough to walk the whole table
+   for (i = 0; i < CONN_BUCKETS; i++)
+   {
+      for (conn = table->buckets[i]; conn != NULL; conn = conn->next)
+      {
+         if (!conn->started && !conn->finished &&
+             conn->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+             conn->addr.sin_port == addr->sin_port)
+            return conn;
+      }
+   }
+   return NULL;
+}
+
+Conn *connFindName(ConnTable *table, char *name, uint32_t session)
+{
+   Conn *conn;
+   int i;
+
+   for (i = 0; i < CONN_BUCKETS; i++)
+   {
+      for (conn = table->buckets[i]; conn != NULL; conn = conn->next)
+      {
+         if (!conn->finished && (session == 0 || conn->session != session) &&
+             strcmp(conn->name, name) == 0)
+            return conn;
+      }
+   }
+   return NULL;
+}
+
+int connClaimName(Conn *conn)
+{
+   ConnName *entry;
+
+   pthread_mutex_lock(&namesLock);
+   for (entry = names; entry != NULL; entry = entry->next)
+   {
+      if ((conn->session == 0 || entry->session != conn->session) &&
+          strcmp(entry->name, conn->name) == 0)
+         break;
+   }
+   if (entry != NULL)
+   {
+      pthread_mutex_unlock(&namesLock);
+      return -1;
+   }
+   entry = malloc(sizeof(ConnName));
+   if (entry != NULL)
+   {
+      snprintf(entry->name, sizeof(entry->name), "%s", conn->name);
+      entry->session = conn->session;
+      entry->id = conn->id;
+      entry->next = names;
+      names = entry;
+      conn->claimed = 1;
+   }
+   pthread_mutex_unlock(&namesLock);
+   return entry != NULL ? 0 : -1;
+}
+
+void connReleaseName(Conn *conn)
+{
+   ConnName **link;
+   ConnName *entry;
+
+   if (!conn->claimed)
+      return;
+   pthread_mutex_lock(&namesLock);
+   for (link = &names; *link != NULL && (*link)->id != conn->id; link = &(*link)->next)
+      ;
+   entry = *link;
+   if (entry != NULL)
+      *link = entry->next;
+   pthread_mutex_unlock(&namesLock);
+   free(entry);
+   conn->claimed = 0;
+}
+
+Conn *connAdd(ConnTable *table, struct sockaddr_in *addr)
+{
+   Conn *conn;
+   uint32_t id;
+
+   conn = calloc(1, sizeof(Conn));
+   if (conn == NULL)
+      return NULL;
+
+   //skip 0, it marks a packet sent before the handshake
+   id = table->nextId;
+   table->nextId += table->step;
+   if (table->nextId < id)
+      table->nextId = id % table->step ? id % table->step : table->step;
+   conn->id = id;
+   conn->addr = *addr;
+   conn->lastUs = nowUs();
+   conn->next = table->buckets[CONN_HASH(id)];
+   table->buckets[CONN_HASH(id)] = conn;
+   table->count++;
+   return conn;
+}
+
+void connRemove(ConnTable *table, Conn *conn)
+{
+   Conn **link;
+
+   link = &table->buckets[CONN_HASH(conn->id)];
+   while (*link != conn)
+      link = &(*link)->next;
+   *link = conn->next;
+   table->count--;
+
+   if (!conn->finished)
+   {
+      connSave(conn);
+      storeClose(&conn->store);
+      if (conn->deltaPath[0] != '\0')
+         unlink(conn->deltaPath);
+   }
+   connReleaseName(conn);
+   releaseTcb(&conn->tcb);
+   fecDecoderFree(&conn->fec);
+   decompressFree(&conn->decomp);
+   deltaSigFree(&conn->sig);
+   metricsRemove(&conn->metrics);
+   ackStop(&conn->ack);
+   if (conn->unpack != NULL)
+   {
+      bundleStop(conn->unpack);
+      free(conn->unpack);
+   }
+   if (conn->tree != NULL)
+   {
+      merkleFree(conn->tree);
+      free(conn->tree);
+   }
+   bitmapFree(&conn->redo);
+   free(conn);
+}
+
+int connSave(Conn *conn)
+{
+   Resume res;
+
+   //blocks of a failed file may not have been written
+   if (conn->part[0] == '\0' || !conn->unsaved || conn->failed)
+      return 0;
+   conn->unsaved = 0;
+
+   //the file first, so the progress file never names a block still in memory
+   if (storeSync(&conn->store) < 0)
+      return -1;
+   res.stamp = conn->stamp;
+   res.fileSize = conn->store.size;
+   res.offset = conn->store.base;
+   res.payloadSize = conn->store.payloadSize;
+   res.resume = conn->tcb.expectedSeq;
+   res.count = bitmapRanges(&conn->tcb.seqMap, res.resume, conn->highSeq, res.extents,
+                            RESUME_EXTENTS_MAX);
+   return resumeSave(&res, conn->part);
+}
+
+int connSync(ConnTable *table, unsigned long long now)
+{
+   Conn *conn;
+   int failed;
+   int i;
+
+   failed = 0;
+   for (i = 0; i < CONN_BUCKETS; i++)
+   {
+      for (conn = table->buckets[i]; conn != NULL; conn = conn->next)
+      {
+         if (conn->finished || !conn->unsaved || now - conn->savedUs < RESUME_SYNC_US)
+            continue;
+         conn->savedUs = now;
+         if (connSave(conn) < 0)
+            failed++;
+      }
+   }
+   return failed;
+}
+
+int connSteer(int sock, uint32_t workers)
+{
+   //the program sees the UDP payload and loads in network order, a socket
+   //index of workers or more falls back to the hash
+   struct sock_filter code[] = {
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(Packet, connId)),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 2, 0),
+      BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, workers),
+      BPF_STMT(BPF_RET | BPF_A, 0),
+      BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+   };
+   struct sock_fprog prog;
+
+   prog.len = sizeof(code) / sizeof(code[0]);
+   prog.filter = code;
+   return setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+int connReap(ConnTable *table, unsigned long long now)
+{
+   Conn *conn;
+   Conn *next;
+   int dropped;
+   int i;
+
+   dropped = 0;
+   for (i = 0; i < CONN_BUCKETS; i++)
+   {
+      for (conn = table->buckets[i]; conn != NULL; conn = next)
+      {
+         next = conn->next;
+         if (now - conn->lastUs < (conn->finished || conn->failed ?
+                                   CONN_LINGER_US : CONN_IDLE_US))
+            continue;
+         if (!conn->finished)
+            dropped++;
+         connRemove(table, conn);
+      }
+   }
+   return dropped;
+}
@@ -0,0 +1,119 @@
+//udpConn Transfers a server is receiving, looked up by connection ID
+
+#ifndef UDPCONN_H
+#define UDPCONN_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <limits.h>
+#include "udpProtocol.h"
+#include "udpStorage.h"
+#include "udpFec.h"
+#include "udpCompress.h"
+#include "udpResume.h"
+#include "udpMetrics.h"
+#include "udpAck.h"
+#include "udpBundle.h"
+#include "udpMerkle.h"
+
+#define CONN_BUCKETS	1024		//hash chains, a power of two
+#define CONN_IDLE_US	30000000ULL	//silence after which an unfinished transfer is dropped
+#define CONN_LINGER_US	3000000ULL	//time a finished transfer still answers a repeated FIN
+#define CONN_REAP_MS	1000		//interval between idle checks
+#define CONN_STALE_US	2000000ULL	//silence after which a SYN for the same file takes a transfer over
+
+/*
+	DATA STRUCTURES
+*/
+
+//one transfer being received
+typedef struct Conn {
+   uint32_t id;			//connection ID carried in every packet of the transfer
+   struct sockaddr_in addr;	//client address, packets from anywhere else are dropped
+   Tcb tcb;			//receive window state
+   Storage store;		//file being written
+   FecDecoder fec;		//rebuilds lost DATA packets from REPAIR packets, groups NULL without FEC
+   Decompressor decomp;		//inflates compressed DATA payloads and copies delta blocks, framed 0 without
+   DeltaSig sig;		//signature of the file a delta transfer replaces, count 0 without
+   char deltaPath[PATH_MAX];	//file the new version is rebuilt in, renamed over the old one once complete, empty without
+   char name[FILE_NAME_MAX + 16];	//name of that file
+   char part[PATH_MAX];		//its progress file, empty when the transfer cannot be resumed
+   Metrics metrics;		//counters and histograms of the transfer, exported while it lasts
+   AckPolicy ack;		//when DATA packets are acknowledged
+   Unpacker *unpack;		//creates the files of a directory's bundle as it arrives, NULL for a file
+   Merkle *tree;		//hash tree of the file as it lands, NULL when it is not verified
+   Bitmap redo;			//chunks whose hashes differ from the client's
+   int mismatch;		//1 once the root the FIN carries differs, 2 once all but the redo chunks
+				//are saved as its progress, 3 if they could not be
+   uint64_t stamp;		//version of the file being sent, saved in the progress file
+   int unsaved;			//set when blocks have landed since the progress file was saved
+   unsigned long long savedUs;	//time the progress file was last saved
+   uint32_t session;		//striped session sharing the file, 0 if not striped
+   uint32_t stripe;		//stripe number within the session
+   uint32_t highSeq;		//one past the highest seqNum received
+   int started;			//set once the client has sent more than SYNs
+   unsigned long long lastUs;	//time the client was last heard from
+   int finished;		//set once FIN has been acknowledged and the file closed
+   int dirty;			//set while blocks of this batch wait for storeFlush
+   int failed;			//set after a write error, its packets are ignored until it is reaped
+   int claimed;			//set while name is claimed against the transfers of every worker
+   struct Conn *next;		//next connection in the same hash chain
+} Conn;
+
+//every transfer of a server, chained by connection ID
+typedef struct {
+   Conn *buckets[CONN_BUCKETS];
+   uint32_t nextId;		//ID handed to the next connection, never 0
+   uint32_t step;		//distance between IDs, the number of workers
+   int count;			//connections in the table
+} ConnTable;
+
+
+/*
+	FUNCTIONS
+*/
+
+//prepares an empty table handing out IDs first, first + step, ... so that
+//ID % step is the same for every connection of one worker
+void connInit(ConnTable *table, uint32_t first, uint32_t step);
+
+//returns the connection with ID id, NULL if there is none
+Conn *connFind(ConnTable *table, uint32_t id);
+
+//returns the connection addr opened that has not received data yet, for repeated SYNs
+Conn *connFindSyn(ConnTable *table, struct sockaddr_in *addr);
+
+//returns an unfinished connection outside session (0 for none) writing the file name, NULL if there is none
+Conn *connFindName(ConnTable *table, char *name, uint32_t session);
+
+//claims conn->name for conn against the transfers of every worker, returns -1 if an
+//unfinished one outside conn's session (0 for none) already writes that file
+int connClaimName(Conn *conn);
+
+//gives up the name conn claimed, once its file is closed
+void connReleaseName(Conn *conn);
+
+//adds a connection from addr under a fresh ID, returns NULL if it cannot be allocated
+Conn *connAdd(ConnTable *table, struct sockaddr_in *addr);
+
+//closes the file of conn unless it finished, saving its progress first or deleting an unfinished
+//delta rebuild or bundle, releases its Tcb and hash tree, takes it off the metrics export and removes it
+void connRemove(ConnTable *table, Conn *conn);
+
+//forces the blocks conn has written to disk and saves them in its progress file,
+//returns -1 on a write error
+int connSave(Conn *conn);
+
+//saves the progress of connections that have made some since RESUME_SYNC_US ago,
+//returns how many of them could not be saved
+int connSync(ConnTable *table, unsigned long long now);
+
+//makes the SO_REUSEPORT group of sock deliver each packet to socket connId % workers,
+//SYNs (connId 0) keep the kernel's hash, returns -1 if the kernel refuses the program
+int connSteer(int sock, uint32_t workers);
+
+//removes connections idle past CONN_IDLE_US, or finished or failed and past CONN_LINGER_US,
+//returns how many of them were unfinished
+int connReap(ConnTable *table, unsigned long long now);
+
+#endif
@@ -0,0 +1,615 @@
+#include "udpDelta.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define STRONG_K1	0x9e3779b97f4a7c15ULL
+#define STRONG_K2	0xc2b2ae3d27d4eb4fULL
+#define SIG_READ	(1 << 20)	//bytes a signature thread reads at a time
+
+
+/*
+	HASHES - the weak checksum is rsync's: a is the sum of the bytes and b
+	the sum of the running sums, both mod 2^16, so sliding the window one
+	byte costs a few adds. A whole block is summed 32 bytes at a time.
+*/
+
+static uint32_t (*weakImpl)(const uint8_t *data, size_t len);
+static pthread_once_t deltaOnce = PTHREAD_ONCE_INIT;
+
+uint32_t deltaWeakSoftware(const uint8_t *data, size_t len)
+{
+   uint32_t a;
+   uint32_t b;
+   size_t i;
+
+   a = 0;
+   b = 0;
+   for (i = 0; i < len; i++)
+   {
+      a += data[i];
+      b += a;
+   }
+   return (b & 0xffff) << 16 | (a & 0xffff);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static uint32_t sum8(__m256i v)
+{
+   uint32_t lanes[8];
+   uint32_t sum;
+   int i;
+
+   _mm256_storeu_si256((__m256i *)lanes, v);
+   sum = 0;
+   for (i = 0; i < 8; i++)
+      sum += lanes[i];
+   return sum;
+}
+
+//32 bytes x at offset m add 32 * a_m + sum((32 - k) * x_k) to b, the weights
+//go through PMADDUBSW, the byte sum through PSADBW - lanes wrap mod 2^32,
+//which keeps the low 16 bits right
+__attribute__((target("avx2")))
+static uint32_t weakAvx2(const uint8_t *data, size_t len)
+{
+   const __m256i weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22,
+                                            21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11,
+                                            10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+   const __m256i ones = _mm256_set1_epi16(1);
+   const __m256i zero = _mm256_setzero_si256();
+   __m256i sums;
+   __m256i prefix;
+   __m256i weighted;
+   __m256i x;
+   uint32_t a;
+   uint32_t b;
+   size_t i;
+
+   sums = zero;
+   prefix = zero;
+   weighted = zero;
+   for (i = 0; i + 32 <= len; i += 32)
+   {
+      x = _mm256_loadu_si256((const __m256i *)(data + i));
+      prefix = _mm256_add_epi32(prefix, sums);
+      sums = _mm256_add_epi32(sums, _mm256_sad_epu8(x, zero));
+      weighted = _mm256_add_epi32(weighted,
+                                  _mm256_madd_epi16(_mm256_maddubs_epi16(x, weights), ones));
+   }
+   a = sum8(sums);
+   b = 32 * sum8(prefix) + sum8(weighted);
+   for (; i < len; i++)
+   {
+      a += data[i];
+      b += a;
+   }
+   return (b & 0xffff) << 16 | (a & 0xffff);
+}
+#endif
+
+static void deltaSetup(void)
+{
+   weakImpl = deltaWeakSoftware;
+#if defined(__x86_64__)
+   if (__builtin_cpu_supports("avx2"))
+      weakImpl = weakAvx2;
+#endif
+}
+
+uint32_t deltaWeak(const uint8_t *data, size_t len)
+{
+   pthread_once(&deltaOnce, deltaSetup);
+   return weakImpl(data, len);
+}
+
+static uint64_t strongMix(uint64_t h, uint64_t w)
+{
+   h ^= w * STRONG_K2;
+   h = (h << 31 | h >> 33) * STRONG_K1;
+   return h;
+}
+
+//four independent lanes keep the multipliers busy, the final mix spreads
+//every input bit over the result - not cryptographic, the whole file CRC
+//checked at the end catches what gets past 96 bits
+uint64_t deltaStrong(const uint8_t *data, size_t len)
+{
+   uint64_t h[4];
+   uint64_t w;
+   uint64_t r;
+   size_t i;
+   int j;
+
+   h[0] = STRONG_K1 ^ len;
+   h[1] = STRONG_K2 ^ len;
+   h[2] = ~STRONG_K1;
+   h[3] = ~STRONG_K2;
+   for (i = 0; i + 32 <= len; i += 32)
+   {
+      for (j = 0; j < 4; j++)
+      {
+         memcpy(&w, data + i + 8 * j, 8);
+         h[j] = strongMix(h[j], w);
+      }
+   }
+   for (j = 0; i + 8 <= len; i += 8, j++)
+   {
+      memcpy(&w, data + i, 8);
+      h[j] = strongMix(h[j], w);
+   }
+   if (i < len)
+   {
+      w = 0;
+      memcpy(&w, data + i, len - i);
+      h[3] = strongMix(h[3], w);
+   }
+
+   r = h[0] ^ (h[1] << 17 | h[1] >> 47) ^ (h[2] << 31 | h[2] >> 33) ^ (h[3] << 47 | h[3] >> 17);
+   r ^= r >> 33;
+   r *= 0xff51afd7ed558ccdULL;
+   r ^= r >> 33;
+   r *= 0xc4ceb9fe1a85ec53ULL;
+   r ^= r >> 33;
+   return r;
+}
+
+//returns the threads to split size bytes over
+static int deltaThreads(uint64_t size)
+{
+   long cpus;
+   uint64_t n;
+
+   cpus = sysconf(_SC_NPROCESSORS_ONLN);
+   n = size / DELTA_SPLIT_MIN;
+   if (n > (uint64_t)cpus)
+      n = cpus;
+   if (n > DELTA_THREADS_MAX)
+      n = DELTA_THREADS_MAX;
+   return n > 0 ? n : 1;
+}
+
+
+/*
+	SIGNATURE
+*/
+
+uint32_t deltaBlockSize(uint64_t size)
+{
+   uint32_t blockSize;
+
+   //the square root of the size balances signature bytes against the bytes
+   //a changed block costs, rounded up to a power of two
+   blockSize = DELTA_BLOCK_MIN;
+   while (blockSize < DELTA_BLOCK_MAX && (uint64_t)blockSize * blockSize < size)
+      blockSize *= 2;
+   return blockSize;
+}
+
+int deltaSigInit(DeltaSig *sig, uint32_t blockSize, uint32_t count)
+{
+   sig->blockSize = blockSize;
+   sig->count = count;
+   sig->weak = malloc((count + 1) * sizeof(uint32_t));
+   sig->strong = malloc((count + 1) * sizeof(uint64_t));
+   if (sig->weak == NULL || sig->strong == NULL)
+   {
+      deltaSigFree(sig);
+      return -1;
+   }
+   return 0;
+}
+
+//blocks [first, last) of the file hashed by one thread
+typedef struct {
+   DeltaSig *sig;
+   int fh;
+   uint32_t first;
+   uint32_t last;
+   int failed;
+} SigPart;
+
+static void *sigThread(void *arg)
+{
+   SigPart *part;
+   uint8_t *buf;
+   uint32_t perRead;
+   uint32_t block;
+   uint32_t n;
+   uint32_t i;
+   size_t want;
+   ssize_t got;
+   size_t len;
+   uint32_t bs;
+
+   part = arg;
+   bs = part->sig->blockSize;
+   perRead = SIG_READ / bs;
+   buf = malloc((size_t)perRead * bs);
+   if (buf == NULL)
+   {
+      part->failed = 1;
+      return NULL;
+   }
+   for (block = part->first; block < part->last && !part->failed; block += n)
+   {
+      n = part->last - block < perRead ? part->last - block : perRead;
+      want = (size_t)n * bs;
+      for (len = 0; len < want; len += got)
+      {
+         got = pread(part->fh, buf + len, want - len, (uint64_t)block * bs + len);
+         if (got <= 0)
+         {
+            part->failed = 1;
+            break;
+         }
+      }
+      for (i = 0; i < n && !part->failed; i++)
+      {
+         part->sig->weak[block + i] = deltaWeak(buf + (size_t)i * bs, bs);
+         part->sig->strong[block + i] = deltaStrong(buf + (size_t)i * bs, bs);
+      }
+   }
+   free(buf);
+   return NULL;
+}
+
+int deltaSignature(DeltaSig *sig, int fh, uint64_t size, uint32_t blockSize)
+{
+   SigPart parts[DELTA_THREADS_MAX];
+   pthread_t threads[DELTA_THREADS_MAX];
+   int started[DELTA_THREADS_MAX];
+   uint32_t count;
+   int failed;
+   int n;
+   int t;
+
+   count = size / blockSize;
+   if (deltaSigInit(sig, blockSize, count) < 0)
+      return -1;
+
+   n = deltaThreads(size);
+   failed = 0;
+   for (t = 0; t < n; t++)
+   {
+      parts[t].sig = sig;
+      parts[t].fh = fh;
+      parts[t].first = (uint64_t)count * t / n;
+      parts[t].last = (uint64_t)count * (t + 1) / n;
+      parts[t].failed = 0;
+      started[t] = t > 0 && pthread_create(&threads[t], NULL, sigThread, &parts[t]) == 0;
+      if (t > 0 && !started[t])
+         sigThread(&parts[t]);
+   }
+   sigThread(&parts[0]);
+   for (t = 0; t < n; t++)
+   {
+      if (t > 0 && started[t])
+         pthread_join(threads[t], NULL);
+      failed |= parts[t].failed;
+   }
+   if (failed)
+   {
+      deltaSigFree(sig);
+      return -1;
+   }
+   return 0;
+}
+
+void deltaPackSig(DeltaSig *sig, uint32_t first, uint32_t n, char *to)
+{
+   uint32_t net[3];
+   uint32_t i;
+
+   for (i = first; i < first + n; i++)
+   {
+      net[0] = htonl(sig->weak[i]);
+      net[1] = htonl(sig->strong[i] >> 32);
+      net[2] = htonl(sig->strong[i] & 0xffffffff);
+      memcpy(to, net, DELTA_SIG_SIZE);
+      to += DELTA_SIG_SIZE;
+   }
+}
+
+void deltaUnpackSig(DeltaSig *sig, uint32_t first, uint32_t n, const char *from)
+{
+   uint32_t net[3];
+   uint32_t i;
+
+   for (i = first; i < first + n; i++)
+   {
+      memcpy(net, from, DELTA_SIG_SIZE);
+      sig->weak[i] = ntohl(net[0]);
+      sig->strong[i] = (uint64_t)ntohl(net[1]) << 32 | ntohl(net[2]);
+      from += DELTA_SIG_SIZE;
+   }
+}
+
+void deltaSigFree(DeltaSig *sig)
+{
+   free(sig->weak);
+   free(sig->strong);
+   sig->weak = NULL;
+   sig->strong = NULL;
+   sig->blockSize = 0;
+   sig->count = 0;
+}
+
+
+/*
+	SCAN - every thread slides a window over its own range of the new file,
+	a match may not cross into the next range, so each split costs at most
+	one block sent as literal bytes
+*/
+
+//blocks by weak checksum, a bit filter small enough for the cache turns
+//away most positions before the table is touched
+typedef struct {
+   DeltaSig *sig;
+   uint32_t *slots;		//block + 1, 0 for an empty slot, linear probing
+   uint32_t slotBits;
+   uint64_t *filter;		//bit set for the weak checksums of the blocks
+   uint32_t filterBits;
+} DeltaIndex;
+
+//ops found by one thread for bytes [start, end)
+typedef struct {
+   DeltaIndex *index;
+   const uint8_t *data;
+   uint64_t start;
+   uint64_t end;
+   DeltaOp *ops;
+   long count;
+   long cap;
+   int failed;
+} ScanPart;
+
+static uint32_t slotOf(uint32_t weak, uint32_t bits)
+{
+   return (weak * 2654435761u) >> (32 - bits);
+}
+
+static uint32_t filterOf(uint32_t weak, uint32_t bits)
+{
+   return ((weak ^ weak >> 15) * 0x2c1b3c6du) >> (32 - bits);
+}
+
+static int indexInit(DeltaIndex *index, DeltaSig *sig)
+{
+   uint32_t block;
+   uint32_t slot;
+   uint32_t bit;
+
+   index->sig = sig;
+   for (index->slotBits = 4; (1u << index->slotBits) < 2 * sig->count; index->slotBits++)
+      ;
+   for (index->filterBits = 12; index->filterBits < 24 &&
+        (1u << index->filterBits) < 16 * sig->count; index->filterBits++)
+      ;
+   index->slots = calloc(1u << index->slotBits, sizeof(uint32_t));
+   index->filter = calloc((1u << index->filterBits) / 64, sizeof(uint64_t));
+   if (index->slots == NULL || index->filter == NULL)
+   {
+      free(index->slots);
+      free(index->filter);
+      return -1;
+   }
+   for (block = 0; block < sig->count; block++)
+   {
+      slot = slotOf(sig->weak[block], index->slotBits);
+      while (index->slots[slot] != 0)
+         slot = (slot + 1) & ((1u << index->slotBits) - 1);
+      index->slots[slot] = block + 1;
+      bit = filterOf(sig->weak[block], index->filterBits);
+      index->filter[bit / 64] |= 1ULL << (bit % 64);
+   }
+   return 0;
+}
+
+//returns the block whose hashes match the window at data, or -1 - next is tried first,
+//it keeps a run of unchanged blocks one copy op - the caller has checked the filter,
+//and it stays out of line so the per byte loop keeps its locals in registers
+__attribute__((noinline))
+static int64_t indexFind(DeltaIndex *index, uint32_t weak, const uint8_t *data, int64_t next)
+{
+   DeltaSig *sig;
+   uint64_t strong;
+   uint32_t slot;
+   uint32_t block;
+   int haveStrong;
+
+   sig = index->sig;
+   strong = 0;
+   haveStrong = 0;
+   if (next >= 0 && next < sig->count && sig->weak[next] == weak)
+   {
+      strong = deltaStrong(data, sig->blockSize);
+      haveStrong = 1;
+      if (sig->strong[next] == strong)
+         return next;
+   }
+   for (slot = slotOf(weak, index->slotBits); index->slots[slot] != 0;
+        slot = (slot + 1) & ((1u << index->slotBits) - 1))
+   {
+      block = index->slots[slot] - 1;
+      if (sig->weak[block] != weak)
+         continue;
+      if (!haveStrong)
+      {
+         strong = deltaStrong(data, sig->blockSize);
+         haveStrong = 1;
+      }
+      if (sig->strong[block] == strong)
+         return block;
+   }
+   return -1;
+}
+
+//appends an op, merging it into the last one when they continue each other
+static void scanAdd(ScanPart *part, uint64_t from, uint64_t len)
+{
+   DeltaOp *last;
+   DeltaOp *ops;
+
+   if (len == 0 || part->failed)
+      return;
+   last = part->count > 0 ? &part->ops[part->count - 1] : NULL;
+   if (last != NULL && (from == DELTA_LITERAL ? last->from == DELTA_LITERAL :
+                        last->from != DELTA_LITERAL && last->from + last->len == from))
+   {
+      last->len += len;
+      return;
+   }
+   if (part->count == part->cap)
+   {
+      part->cap = part->cap ? part->cap * 2 : 256;
+      ops = realloc(part->ops, part->cap * sizeof(DeltaOp));
+      if (ops == NULL)
+      {
+         part->failed = 1;
+         return;
+      }
+      part->ops = ops;
+   }
+   part->ops[part->count].from = from;
+   part->ops[part->count].len = len;
+   part->count++;
+}
+
+static void *scanThread(void *arg)
+{
+   ScanPart *part;
+   DeltaIndex *index;
+   const uint64_t *filter;
+   const uint8_t *data;
+   uint32_t filterBits;
+   uint32_t bs;
+   uint64_t end;
+   uint64_t pos;
+   uint64_t literal;
+   uint32_t weak;
+   uint32_t bit;
+   uint32_t a;
+   uint32_t b;
+   uint32_t out;
+   int64_t block;
+   int64_t next;
+
+   //the loop runs once per byte, everything it reads is kept in locals
+   part = arg;
+   index = part->index;
+   filter = index->filter;
+   filterBits = index->filterBits;
+   data = part->data;
+   bs = index->sig->blockSize;
+   end = part->end;
+   pos = part->start;
+   literal = pos;
+   next = -1;
+   if (index->sig->count > 0 && end - pos >= bs)
+   {
+      a = deltaWeak(data + pos, bs);
+      b = a >> 16;
+      while (1)
+      {
+         weak = (b & 0xffff) << 16 | (a & 0xffff);
+         bit = filterOf(weak, filterBits);
+         block = filter[bit / 64] >> (bit % 64) & 1 ? indexFind(index, weak, data + pos, next) : -1;
+         if (block >= 0)
+         {
+            scanAdd(part, DELTA_LITERAL, pos - literal);
+            scanAdd(part, (uint64_t)block * bs, bs);
+            pos += bs;
+            literal = pos;
+            next = block + 1;
+            if (end - pos < bs)
+               break;
+            a = deltaWeak(data + pos, bs);
+            b = a >> 16;
+            continue;
+         }
+         if (end - pos == bs)
+            break;
+
+         //slide the window one byte
+         out = data[pos];
+         a = a - out + data[pos + bs];
+         b = b - bs * out + a;
+         pos++;
+      }
+   }
+   scanAdd(part, DELTA_LITERAL, end - literal);
+   return NULL;
+}
+
+long deltaScan(DeltaSig *sig, const uint8_t *data, uint64_t size, DeltaOp **ops)
+{
+   DeltaIndex index;
+   ScanPart parts[DELTA_THREADS_MAX];
+   pthread_t threads[DELTA_THREADS_MAX];
+   int started[DELTA_THREADS_MAX];
+   DeltaOp *all;
+   long count;
+   long total;
+   long i;
+   int failed;
+   int n;
+   int t;
+
+   *ops = NULL;
+   if (indexInit(&index, sig) < 0)
+      return -1;
+
+   n = deltaThreads(size);
+   total = 0;
+   failed = 0;
+   for (t = 0; t < n; t++)
+   {
+      memset(&parts[t], 0, sizeof(ScanPart));
+      parts[t].index = &index;
+      parts[t].data = data;
+      parts[t].start = size * t / n;
+      parts[t].end = size * (t + 1) / n;
+      started[t] = t > 0 && pthread_create(&threads[t], NULL, scanThread, &parts[t]) == 0;
+      if (t > 0 && !started[t])
+         scanThread(&parts[t]);
+   }
+   scanThread(&parts[0]);
+   for (t = 0; t < n; t++)
+   {
+      if (t > 0 && started[t])
+         pthread_join(threads[t], NULL);
+      failed |= parts[t].failed;
+      total += parts[t].count;
+   }
+   free(index.slots);
+   free(index.filter);
+
+   //the ranges are joined in order, ops that continue across a split merge
+   all = failed ? NULL : malloc((total + 1) * sizeof(DeltaOp));
+   count = 0;
+   for (t = 0; t < n; t++)
+   {
+      for (i = 0; all != NULL && i < parts[t].count; i++)
+      {
+         if (count > 0 && (parts[t].ops[i].from == DELTA_LITERAL ?
+                           all[count - 1].from == DELTA_LITERAL :
+                           all[count - 1].from != DELTA_LITERAL &&
+                           all[count - 1].from + all[count - 1].len == parts[t].ops[i].from))
+            all[count - 1].len += parts[t].ops[i].len;
+         else
+            all[count++] = parts[t].ops[i];
+      }
+      free(parts[t].ops);
+   }
+   if (all == NULL)
+      return -1;
+   *ops = all;
+   return count;
+}
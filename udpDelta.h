@@ -0,0 +1,71 @@
+//udpDelta Block signatures of the receiver's copy of a file and the copy and literal ops that rebuild the new one from it
+
+#ifndef UDPDELTA_H
+#define UDPDELTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DELTA_BLOCK_MIN	2048		//smallest signature block, the square root of the file size otherwise
+#define DELTA_BLOCK_MAX	65536		//largest, one copy frame (COMPRESS_BLOCK)
+#define DELTA_SIG_SIZE	12		//bytes of one signature entry on the wire: weak then strong hash
+#define DELTA_THREADS_MAX	16	//threads hashing or scanning one file
+#define DELTA_SPLIT_MIN	(4 << 20)	//bytes per thread below which fewer threads are used
+#define DELTA_LITERAL	UINT64_MAX	//from of an op whose bytes are sent
+#define DELTA_SUFFIX	".delta"	//appended to the file name while the new version is rebuilt
+
+/*
+	DATA STRUCTURES
+*/
+
+//weak rolling and strong hash of every whole block of the receiver's copy
+typedef struct {
+   uint32_t blockSize;		//bytes per block
+   uint32_t count;		//whole blocks, a short last block is not matched
+   uint32_t *weak;		//rolling checksum of block i
+   uint64_t *strong;		//64 bit hash of block i
+} DeltaSig;
+
+//len bytes of the new file, copied from offset from of the receiver's copy or sent
+typedef struct {
+   uint64_t from;		//offset in the receiver's copy, DELTA_LITERAL for bytes sent as they are
+   uint64_t len;		//bytes of the new file covered
+} DeltaOp;
+
+
+/*
+	FUNCTIONS
+*/
+
+//returns the signature block size for a copy of size bytes
+uint32_t deltaBlockSize(uint64_t size);
+
+//allocates an empty signature of count blocks, returns -1 if it cannot be allocated
+int deltaSigInit(DeltaSig *sig, uint32_t blockSize, uint32_t count);
+
+//hashes the whole blocks of the size byte file fh on several threads, returns -1 on a read error
+int deltaSignature(DeltaSig *sig, int fh, uint64_t size, uint32_t blockSize);
+
+//stores entries [first, first + n) in network format at to
+void deltaPackSig(DeltaSig *sig, uint32_t first, uint32_t n, char *to);
+
+//reads entries [first, first + n) stored by deltaPackSig at from
+void deltaUnpackSig(DeltaSig *sig, uint32_t first, uint32_t n, const char *from);
+
+//releases a signature, also safe on a zeroed one
+void deltaSigFree(DeltaSig *sig);
+
+//finds the blocks of sig in the size bytes at data on several threads, *ops is set to
+//an allocated list covering data in order, returns the count or -1 if it cannot be allocated
+long deltaScan(DeltaSig *sig, const uint8_t *data, uint64_t size, DeltaOp **ops);
+
+//returns the rolling checksum of len bytes, with AVX2 when the CPU has it
+uint32_t deltaWeak(const uint8_t *data, size_t len);
+
+//portable deltaWeak, same results
+uint32_t deltaWeakSoftware(const uint8_t *data, size_t len);
+
+//returns the strong hash of len bytes
+uint64_t deltaStrong(const uint8_t *data, size_t len);
+
+#endif
@@ -0,0 +1,495 @@
+#include "udpFec.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define GF_POLY		0x11d		//x^8 + x^4 + x^3 + x^2 + 1, the usual Reed-Solomon field
+
+
+/*
+	GF(256) arithmetic - log and exp tables for the odd multiply, a full
+	product table for the portable kernel, and per constant nibble tables
+	for the PSHUFB kernels
+*/
+
+static uint8_t gfExp[512];
+static uint8_t gfLog[256];
+static uint8_t gfMulTable[256][256];
+static uint8_t gfLow[256][16];		//c * x for x below 16
+static uint8_t gfHigh[256][16];		//c * (x << 4) for x below 16
+static uint8_t fecCoef[FEC_PARITY_MAX][FEC_DATA_MAX];	//generator rows of the REPAIR packets
+static void (*mulAddImpl)(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+static pthread_once_t fecOnce = PTHREAD_ONCE_INIT;
+
+static uint8_t gfMul(uint8_t a, uint8_t b)
+{
+   if (a == 0 || b == 0)
+      return 0;
+   return gfExp[gfLog[a] + gfLog[b]];
+}
+
+static uint8_t gfInv(uint8_t a)
+{
+   return gfExp[255 - gfLog[a]];
+}
+
+static void mulAddSoftware(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+   const uint8_t *row;
+   uint64_t a;
+   uint64_t b;
+   size_t i;
+
+   i = 0;
+   if (c == 1)
+   {
+      for (; i + 8 <= len; i += 8)
+      {
+         memcpy(&a, dst + i, 8);
+         memcpy(&b, src + i, 8);
+         a ^= b;
+         memcpy(dst + i, &a, 8);
+      }
+   }
+   row = gfMulTable[c];
+   for (; i < len; i++)
+      dst[i] ^= row[src[i]];
+}
+
+#if defined(__x86_64__)
+//each byte is split into nibbles that index 16 entry product tables, so one
+//PSHUFB looks up 16 (SSSE3) or 32 (AVX2) products at a time
+__attribute__((target("ssse3")))
+static void mulAddSsse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+   __m128i low;
+   __m128i high;
+   __m128i mask;
+   __m128i s;
+   __m128i p;
+   size_t i;
+
+   low = _mm_loadu_si128((const __m128i *)gfLow[c]);
+   high = _mm_loadu_si128((const __m128i *)gfHigh[c]);
+   mask = _mm_set1_epi8(0x0f);
+   for (i = 0; i + 16 <= len; i += 16)
+   {
+      s = _mm_loadu_si128((const __m128i *)(src + i));
+      p = _mm_xor_si128(_mm_shuffle_epi8(low, _mm_and_si128(s, mask)),
+                        _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+      _mm_storeu_si128((__m128i *)(dst + i),
+                       _mm_xor_si128(_mm_loadu_si128((const __m128i *)(dst + i)), p));
+   }
+   mulAddSoftware(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("avx2")))
+static void mulAddAvx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+   __m256i low;
+   __m256i high;
+   __m256i mask;
+   __m256i s;
+   __m256i p;
+   size_t i;
+
+   low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)gfLow[c]));
+   high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)gfHigh[c]));
+   mask = _mm256_set1_epi8(0x0f);
+   for (i = 0; i + 32 <= len; i += 32)
+   {
+      s = _mm256_loadu_si256((const __m256i *)(src + i));
+      p = _mm256_xor_si256(_mm256_shuffle_epi8(low, _mm256_and_si256(s, mask)),
+                           _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+      _mm256_storeu_si256((__m256i *)(dst + i),
+                          _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(dst + i)), p));
+   }
+   mulAddSoftware(dst + i, src + i, c, len - i);
+}
+#endif
+
+//fills the tables and picks the fastest kernel, once per process
+static void fecSetup(void)
+{
+   unsigned x;
+   int a;
+   int b;
+   int i;
+   int j;
+
+   for (i = 0, x = 1; i < 255; i++)
+   {
+      gfExp[i] = x;
+      gfLog[x] = i;
+      x <<= 1;
+      if (x & 0x100)
+         x ^= GF_POLY;
+   }
+   for (i = 255; i < 512; i++)
+      gfExp[i] = gfExp[i - 255];
+   for (a = 0; a < 256; a++)
+   {
+      for (b = 0; b < 256; b++)
+         gfMulTable[a][b] = gfMul(a, b);
+      for (b = 0; b < 16; b++)
+      {
+         gfLow[a][b] = gfMul(a, b);
+         gfHigh[a][b] = gfMul(a, b << 4);
+      }
+   }
+
+   //a Cauchy matrix 1 / (x_j + y_i) with x_j = j and y_i = FEC_PARITY_MAX + i
+   //has every square submatrix invertible, so any dataCount of the DATA and
+   //REPAIR packets of a group rebuild it; scaling column i by y_i keeps that
+   //and turns row 0 into all ones, making a single REPAIR packet plain XOR
+   for (j = 0; j < FEC_PARITY_MAX; j++)
+      for (i = 0; i < FEC_DATA_MAX; i++)
+         fecCoef[j][i] = gfMul(FEC_PARITY_MAX + i, gfInv(j ^ (FEC_PARITY_MAX + i)));
+
+   mulAddImpl = mulAddSoftware;
+#if defined(__x86_64__)
+   if (__builtin_cpu_supports("avx2"))
+      mulAddImpl = mulAddAvx2;
+   else if (__builtin_cpu_supports("ssse3"))
+      mulAddImpl = mulAddSsse3;
+#endif
+}
+
+void fecMulAdd(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+   pthread_once(&fecOnce, fecSetup);
+   if (c != 0)
+      mulAddImpl(dst, src, c, len);
+}
+
+void fecMulAddSoftware(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+   pthread_once(&fecOnce, fecSetup);
+   if (c != 0)
+      mulAddSoftware(dst, src, c, len);
+}
+
+//inverts the n x n matrix a into inv by Gauss-Jordan elimination, a is destroyed
+static int gfInvert(uint8_t a[FEC_PARITY_MAX][FEC_PARITY_MAX],
+                    uint8_t inv[FEC_PARITY_MAX][FEC_PARITY_MAX], int n)
+{
+   uint8_t tmp;
+   uint8_t f;
+   int row;
+   int col;
+   int i;
+
+   for (row = 0; row < n; row++)
+      for (col = 0; col < n; col++)
+         inv[row][col] = row == col;
+   for (col = 0; col < n; col++)
+   {
+      for (row = col; row < n && a[row][col] == 0; row++)
+         ;
+      if (row == n)
+         return -1;
+      for (i = 0; i < n; i++)
+      {
+         tmp = a[row][i]; a[row][i] = a[col][i]; a[col][i] = tmp;
+         tmp = inv[row][i]; inv[row][i] = inv[col][i]; inv[col][i] = tmp;
+      }
+      f = gfInv(a[col][col]);
+      for (i = 0; i < n; i++)
+      {
+         a[col][i] = gfMul(a[col][i], f);
+         inv[col][i] = gfMul(inv[col][i], f);
+      }
+      for (row = 0; row < n; row++)
+      {
+         if (row == col || a[row][col] == 0)
+            continue;
+         f = a[row][col];
+         for (i = 0; i < n; i++)
+         {
+            a[row][i] ^= gfMul(f, a[col][i]);
+            inv[row][i] ^= gfMul(f, inv[col][i]);
+         }
+      }
+   }
+   return 0;
+}
+
+int fecValid(uint32_t dataCount, uint32_t parityCount)
+{
+   return dataCount >= 1 && dataCount <= FEC_DATA_MAX &&
+          parityCount >= 1 && parityCount <= FEC_PARITY_MAX;
+}
+
+
+/*
+	ENCODER
+*/
+
+int fecEncoderInit(FecEncoder *enc, uint32_t dataCount, uint32_t parityCount, uint32_t payloadSize)
+{
+   pthread_once(&fecOnce, fecSetup);
+   memset(enc, 0, sizeof(FecEncoder));
+   if (!fecValid(dataCount, parityCount))
+      return -1;
+   enc->repair = malloc(parityCount * sizeof(Packet));
+   if (enc->repair == NULL)
+      return -1;
+   enc->dataCount = dataCount;
+   enc->parityCount = parityCount;
+   enc->payloadSize = payloadSize;
+   return 0;
+}
+
+int fecEncode(FecEncoder *enc, uint32_t seq, const char *data, int len)
+{
+   uint32_t i;
+   uint32_t j;
+   uint8_t c;
+
+   //the first packet of a group clears the parity of the last one
+   i = seq % enc->dataCount;
+   if (enc->count == 0)
+   {
+      enc->first = seq - i;
+      enc->maxLen = 0;
+      memset(enc->lens, 0, sizeof(enc->lens));
+      for (j = 0; j < enc->parityCount; j++)
+         memset(enc->repair[j].payload, 0, enc->payloadSize);
+   }
+
+   for (j = 0; j < enc->parityCount; j++)
+   {
+      c = fecCoef[j][i];
+      fecMulAdd((uint8_t *)enc->repair[j].payload, (const uint8_t *)data, c, len);
+      enc->lens[j][0] ^= gfMul(c, len & 0xff);
+      enc->lens[j][1] ^= gfMul(c, len >> 8);
+   }
+   enc->count = i + 1;
+   if ((uint32_t)len > enc->maxLen)
+      enc->maxLen = len;
+   return enc->count == enc->dataCount;
+}
+
+int fecFinish(FecEncoder *enc)
+{
+   uint32_t j;
+   uint32_t count;
+
+   //parity beyond the longest payload is zero and stays off the wire
+   count = enc->count;
+   if (count == 0)
+      return 0;
+   for (j = 0; j < enc->parityCount; j++)
+      createPacket(&enc->repair[j], enc->maxLen, enc->first,
+                   FEC_INFO(j, count, enc->lens[j][0] | enc->lens[j][1] << 8), REPAIR);
+   enc->count = 0;
+   return enc->parityCount;
+}
+
+void fecEncoderFree(FecEncoder *enc)
+{
+   free(enc->repair);
+   enc->repair = NULL;
+}
+
+
+/*
+	DECODER
+*/
+
+//buffer for DATA packet i (below dataCount) or REPAIR packet i - dataCount of a slot
+static uint8_t *fecBuf(FecDecoder *dec, FecGroup *grp, uint32_t i)
+{
+   size_t slot;
+
+   slot = grp - dec->groups;
+   return dec->bufs + (slot * (dec->dataCount + dec->parityCount) + i) * dec->payloadSize;
+}
+
+//returns the slot of group, taking it over from an older group,
+//NULL if it already holds a newer one
+static FecGroup *fecSlot(FecDecoder *dec, uint32_t group)
+{
+   FecGroup *grp;
+
+   grp = &dec->groups[group % dec->slots];
+   if (grp->used && grp->group == group)
+      return grp;
+   if (grp->used && grp->group > group)
+      return NULL;
+   grp->group = group;
+   grp->used = 1;
+   grp->done = 0;
+   grp->count = dec->dataCount;
+   grp->have = 0;
+   grp->parity = 0;
+   return grp;
+}
+
+//rebuilds the missing DATA packets of a group once as many REPAIR packets
+//are in as there are DATA packets missing, returns the number rebuilt
+static int fecSolve(FecDecoder *dec, FecGroup *grp, FecRebuilt *out)
+{
+   uint8_t a[FEC_PARITY_MAX][FEC_PARITY_MAX];
+   uint8_t inv[FEC_PARITY_MAX][FEC_PARITY_MAX];
+   uint8_t lens[FEC_PARITY_MAX][2];
+   uint32_t rows[FEC_PARITY_MAX];
+   uint32_t lost[FEC_PARITY_MAX];
+   uint8_t *syn;
+   uint8_t *buf;
+   uint8_t c;
+   uint32_t missing;
+   uint32_t i;
+   int e;
+   int r;
+   int n;
+   int x;
+   int y;
+   int len;
+
+   if (grp->done || grp->parity == 0)
+      return 0;
+   missing = 0;
+   for (i = 0; i < grp->count; i++)
+      if (!(grp->have >> i & 1))
+         missing++;
+   if (missing == 0)
+   {
+      grp->done = 1;
+      return 0;
+   }
+   if (missing > (uint32_t)__builtin_popcount(grp->parity))
+      return 0;
+
+   e = 0;
+   for (i = 0; i < grp->count; i++)
+      if (!(grp->have >> i & 1))
+         lost[e++] = i;
+   for (i = 0, r = 0; r < e; i++)
+      if (grp->parity >> i & 1)
+         rows[r++] = i;
+
+   //take what the received DATA packets contribute out of each REPAIR packet,
+   //leaving the lost ones times the rows of a
+   for (x = 0; x < e; x++)
+   {
+      syn = fecBuf(dec, grp, dec->dataCount + rows[x]);
+      lens[x][0] = grp->parityLens[rows[x]][0];
+      lens[x][1] = grp->parityLens[rows[x]][1];
+      for (i = 0; i < grp->count; i++)
+      {
+         if (!(grp->have >> i & 1))
+            continue;
+         c = fecCoef[rows[x]][i];
+         fecMulAdd(syn, fecBuf(dec, grp, i), c, dec->payloadSize);
+         lens[x][0] ^= gfMul(c, grp->lens[i][0]);
+         lens[x][1] ^= gfMul(c, grp->lens[i][1]);
+      }
+      for (y = 0; y < e; y++)
+         a[x][y] = fecCoef[rows[x]][lost[y]];
+   }
+   grp->done = 1;
+   if (gfInvert(a, inv, e) < 0)
+      return 0;
+
+   n = 0;
+   for (y = 0; y < e; y++)
+   {
+      buf = fecBuf(dec, grp, lost[y]);
+      memset(buf, 0, dec->payloadSize);
+      grp->lens[lost[y]][0] = 0;
+      grp->lens[lost[y]][1] = 0;
+      for (x = 0; x < e; x++)
+      {
+         fecMulAdd(buf, fecBuf(dec, grp, dec->dataCount + rows[x]), inv[y][x], dec->payloadSize);
+         grp->lens[lost[y]][0] ^= gfMul(inv[y][x], lens[x][0]);
+         grp->lens[lost[y]][1] ^= gfMul(inv[y][x], lens[x][1]);
+      }
+      len = grp->lens[lost[y]][0] | grp->lens[lost[y]][1] << 8;
+      if (len > (int)dec->payloadSize)
+         continue;
+      grp->have |= 1ULL << lost[y];
+      out[n].seq = grp->group * dec->dataCount + lost[y];
+      out[n].data = (char *)buf;
+      out[n].len = len;
+      n++;
+   }
+   dec->rebuilt += n;
+   return n;
+}
+
+int fecDecoderInit(FecDecoder *dec, uint32_t dataCount, uint32_t parityCount, uint32_t payloadSize,
+                   uint32_t window)
+{
+   pthread_once(&fecOnce, fecSetup);
+   memset(dec, 0, sizeof(FecDecoder));
+   if (!fecValid(dataCount, parityCount))
+      return -1;
+   dec->dataCount = dataCount;
+   dec->parityCount = parityCount;
+   dec->payloadSize = payloadSize;
+   dec->slots = window / dataCount + 2;
+   dec->groups = calloc(dec->slots, sizeof(FecGroup));
+   dec->bufs = malloc((size_t)dec->slots * (dataCount + parityCount) * payloadSize);
+   if (dec->groups == NULL || dec->bufs == NULL)
+   {
+      fecDecoderFree(dec);
+      return -1;
+   }
+   return 0;
+}
+
+int fecData(FecDecoder *dec, uint32_t seq, const char *data, int len, FecRebuilt *out)
+{
+   FecGroup *grp;
+   uint8_t *buf;
+   uint32_t i;
+
+   grp = fecSlot(dec, seq / dec->dataCount);
+   i = seq % dec->dataCount;
+   if (grp == NULL || grp->done || grp->have >> i & 1)
+      return 0;
+   buf = fecBuf(dec, grp, i);
+   memcpy(buf, data, len);
+   memset(buf + len, 0, dec->payloadSize - len);
+   grp->lens[i][0] = len & 0xff;
+   grp->lens[i][1] = len >> 8;
+   grp->have |= 1ULL << i;
+   return fecSolve(dec, grp, out);
+}
+
+int fecRepair(FecDecoder *dec, Packet *pkt, FecRebuilt *out)
+{
+   FecGroup *grp;
+   uint8_t *buf;
+   uint32_t j;
+   uint32_t count;
+
+   j = FEC_INDEX(pkt->ackNum);
+   count = FEC_COUNT(pkt->ackNum);
+   if (j >= dec->parityCount || count == 0 || count > dec->dataCount ||
+       pkt->seqNum % dec->dataCount != 0 || pkt->length > dec->payloadSize)
+      return 0;
+   grp = fecSlot(dec, pkt->seqNum / dec->dataCount);
+   if (grp == NULL || grp->done || grp->parity >> j & 1)
+      return 0;
+   buf = fecBuf(dec, grp, dec->dataCount + j);
+   memcpy(buf, pkt->payload, pkt->length);
+   memset(buf + pkt->length, 0, dec->payloadSize - pkt->length);
+   grp->parityLens[j][0] = FEC_LENGTHS(pkt->ackNum) & 0xff;
+   grp->parityLens[j][1] = FEC_LENGTHS(pkt->ackNum) >> 8;
+   grp->parity |= 1U << j;
+   grp->count = count;
+   return fecSolve(dec, grp, out);
+}
+
+void fecDecoderFree(FecDecoder *dec)
+{
+   free(dec->groups);
+   free(dec->bufs);
+   dec->groups = NULL;
+   dec->bufs = NULL;
+}
@@ -0,0 +1,111 @@
+//udpFec Forward error correction - Reed-Solomon repair packets over groups of DATA packets
+
+#ifndef UDPFEC_H
+#define UDPFEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "udpProtocol.h"
+
+#define FEC_DATA_MAX	64		//most DATA packets in a group
+#define FEC_PARITY_MAX	16		//most REPAIR packets per group
+
+//a REPAIR packet carries the first seqNum of its group in seqNum and
+//packs the rest of what the decoder needs into ackNum
+#define FEC_INFO(index, count, lenParity)	((index) | (count) << 8 | (uint32_t)(lenParity) << 16)
+#define FEC_INDEX(info)		((info) & 0xff)		//parity row of the packet
+#define FEC_COUNT(info)		(((info) >> 8) & 0xff)	//DATA packets in the group, fewer at the end of the file
+#define FEC_LENGTHS(info)	((info) >> 16)		//parity of the DATA payload lengths
+
+/*
+	DATA STRUCTURES
+*/
+
+//builds the REPAIR packets of one group at a time, groups are aligned to
+//seqNums that are multiples of dataCount
+typedef struct {
+   uint32_t dataCount;		//DATA packets per group (k)
+   uint32_t parityCount;	//REPAIR packets per group (m), 1 is plain XOR parity
+   uint32_t payloadSize;	//payload bytes per full DATA packet
+   uint32_t first;		//seqNum of the first DATA packet of the group
+   uint32_t count;		//DATA packets added to the group so far
+   uint32_t maxLen;		//longest payload added to the group
+   uint8_t lens[FEC_PARITY_MAX][2];	//parity of the payload lengths, low byte first
+   Packet *repair;		//parityCount REPAIR packets, the payloads accumulate parity
+} FecEncoder;
+
+//DATA and REPAIR packets of one group kept until it is complete or rebuilt
+typedef struct {
+   uint32_t group;		//seqNum / dataCount of the group held
+   int used;			//set once the slot holds a group
+   int done;			//set once every DATA packet is in, received or rebuilt
+   uint32_t count;		//DATA packets in the group, dataCount until a REPAIR says less
+   uint64_t have;		//bit i is set once DATA packet i is in
+   uint32_t parity;		//bit j is set once REPAIR packet j is in
+   uint8_t lens[FEC_DATA_MAX][2];	//payload length of each DATA packet
+   uint8_t parityLens[FEC_PARITY_MAX][2];	//length parity of each REPAIR packet
+} FecGroup;
+
+//packet rebuilt by the decoder, data stays valid until its slot is reused
+typedef struct {
+   uint32_t seq;		//seqNum of the rebuilt DATA packet
+   char *data;			//its payload
+   int len;			//its length
+} FecRebuilt;
+
+//rebuilds lost DATA packets of the groups still inside the receive window
+typedef struct {
+   uint32_t dataCount;		//DATA packets per group (k)
+   uint32_t parityCount;	//REPAIR packets per group (m)
+   uint32_t payloadSize;	//payload bytes per full DATA packet
+   uint32_t slots;		//groups held at a time, enough to cover the window
+   FecGroup *groups;		//slot of group g is g % slots
+   uint8_t *bufs;		//dataCount + parityCount payloads per slot
+   unsigned long rebuilt;	//DATA packets rebuilt so far
+} FecDecoder;
+
+
+/*
+	FUNCTIONS
+*/
+
+//returns 1 if dataCount DATA and parityCount REPAIR packets per group is a usable code
+int fecValid(uint32_t dataCount, uint32_t parityCount);
+
+//prepares an encoder, returns -1 if it cannot be allocated
+int fecEncoderInit(FecEncoder *enc, uint32_t dataCount, uint32_t parityCount, uint32_t payloadSize);
+
+//adds DATA packet seq of len bytes to its group, packets must come in seqNum order
+//without gaps - returns 1 once the group is complete and fecFinish should be called
+int fecEncode(FecEncoder *enc, uint32_t seq, const char *data, int len);
+
+//turns the group built so far into REPAIR packets in enc->repair (header in
+//network format, connId and checksum left to the caller) and starts the next,
+//returns the number of REPAIR packets, 0 if the group is empty
+int fecFinish(FecEncoder *enc);
+
+//releases the REPAIR packets of an encoder
+void fecEncoderFree(FecEncoder *enc);
+
+//prepares a decoder able to hold the groups of a window of window packets, returns -1 if it cannot be allocated
+int fecDecoderInit(FecDecoder *dec, uint32_t dataCount, uint32_t parityCount, uint32_t payloadSize,
+                   uint32_t window);
+
+//keeps a newly received DATA packet for its group, returns the number of
+//packets this lets the decoder rebuild into out (up to parityCount)
+int fecData(FecDecoder *dec, uint32_t seq, const char *data, int len, FecRebuilt *out);
+
+//keeps a REPAIR packet (header in host format), returns the number of packets
+//rebuilt into out as fecData does
+int fecRepair(FecDecoder *dec, Packet *pkt, FecRebuilt *out);
+
+//releases the buffers of a decoder, also safe on a zeroed one
+void fecDecoderFree(FecDecoder *dec);
+
+//adds c times len bytes at src to dst in GF(256), with SSSE3 or AVX2 when the CPU has them
+void fecMulAdd(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+
+//portable table driven fecMulAdd, same results
+void fecMulAddSoftware(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+
+#endif
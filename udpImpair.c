@@ -0,0 +1,425 @@
+#include "udpImpair.h"
+#include "udpProtocol.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+
+/*
+	RANDOM NUMBERS - xoshiro256** seeded through splitmix64, fast and the
+	same on every platform, so a run can be repeated exactly
+*/
+
+static uint64_t splitmix(uint64_t *x)
+{
+   uint64_t z;
+
+   z = (*x += 0x9e3779b97f4a7c15ULL);
+   z = (z ^ z >> 30) * 0xbf58476d1ce4e5b9ULL;
+   z = (z ^ z >> 27) * 0x94d049bb133111ebULL;
+   return z ^ z >> 31;
+}
+
+static uint64_t rotl(uint64_t x, int k)
+{
+   return x << k | x >> (64 - k);
+}
+
+static uint64_t rngNext(ImpairRng *rng)
+{
+   uint64_t result;
+   uint64_t t;
+
+   result = rotl(rng->s[1] * 5, 7) * 9;
+   t = rng->s[1] << 17;
+   rng->s[2] ^= rng->s[0];
+   rng->s[3] ^= rng->s[1];
+   rng->s[1] ^= rng->s[2];
+   rng->s[0] ^= rng->s[3];
+   rng->s[2] ^= t;
+   rng->s[3] = rotl(rng->s[3], 45);
+   return result;
+}
+
+double impairRandom(Impair *imp)
+{
+   return (rngNext(&imp->rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+//returns 1 with probability p
+static int chance(Impair *imp, double p)
+{
+   return p > 0 && impairRandom(imp) < p;
+}
+
+/*
+	CONFIGURATION
+*/
+
+void impairInit(Impair *imp)
+{
+   memset(imp, 0, sizeof(Impair));
+   imp->burstLoss = 1;
+   imp->limit = IMPAIR_LIMIT;
+   imp->seed = 1;
+}
+
+//reads a probability, returns -1 unless it is a number in [0, 1] - one of
+//several fields of a value may also end at a ':'
+static int parseChance(const char *value, double *p, int field)
+{
+   char *end;
+
+   *p = strtod(value, &end);
+   return end == value || (*end != '\0' && *end != ',' && (!field || *end != ':')) ||
+          *p < 0 || *p > 1 ? -1 : 0;
+}
+
+//reads a time in ms as us, returns -1 unless it is a non-negative number
+static int parseMs(const char *value, unsigned long long *us)
+{
+   double ms;
+   char *end;
+
+   ms = strtod(value, &end);
+   if (end == value || (*end != '\0' && *end != ',') || ms < 0)
+      return -1;
+   *us = ms * 1000;
+   return 0;
+}
+
+int impairParse(Impair *imp, const char *spec)
+{
+   const char *key;
+   const char *value;
+   const char *next;
+   double rate;
+   char *end;
+   size_t len;
+   int ret;
+
+   for (key = spec; *key != '\0'; key = next)
+   {
+      next = strchr(key, ',') ? strchr(key, ',') + 1 : key + strlen(key);
+      value = strchr(key, '=');
+      if (value == NULL || value > next)
+         return -1;
+      len = value - key;
+      value++;
+
+      if (len == 4 && strncmp(key, "loss", len) == 0)
+         ret = parseChance(value, &imp->loss, 0);
+      else if (len == 5 && strncmp(key, "burst", len) == 0)
+      {
+         //p:r, or p:r:k for a bad state that loses only some datagrams
+         ret = parseChance(value, &imp->burstP, 1);
+         value = strchr(value, ':');
+         if (ret == 0 && (value == NULL || value > next))
+            ret = -1;
+         if (ret == 0)
+            ret = parseChance(value + 1, &imp->burstR, 1);
+         value = ret == 0 ? strchr(value + 1, ':') : NULL;
+         if (value != NULL && value < next)
+            ret = parseChance(value + 1, &imp->burstLoss, 0);
+      }
+      else if (len == 5 && strncmp(key, "delay", len) == 0)
+         ret = parseMs(value, &imp->delayUs);
+      else if (len == 6 && strncmp(key, "jitter", len) == 0)
+         ret = parseMs(value, &imp->jitterUs);
+      else if (len == 7 && strncmp(key, "reorder", len) == 0)
+         ret = parseChance(value, &imp->reorder, 0);
+      else if (len == 3 && strncmp(key, "dup", len) == 0)
+         ret = parseChance(value, &imp->dup, 0);
+      else if (len == 7 && strncmp(key, "corrupt", len) == 0)
+         ret = parseChance(value, &imp->corrupt, 0);
+      else if (len == 4 && strncmp(key, "rate", len) == 0)
+      {
+         rate = strtod(value, &end);
+         ret = end == value || (*end != '\0' && *end != ',') || rate < 0 ? -1 : 0;
+         imp->rate = rate * 1e6;
+      }
+      else if (len == 5 && strncmp(key, "limit", len) == 0)
+      {
+         imp->limit = strtol(value, &end, 10);
+         ret = end == value || (*end != '\0' && *end != ',') || imp->limit < 1 ? -1 : 0;
+      }
+      else if (len == 4 && strncmp(key, "seed", len) == 0)
+      {
+         imp->seed = strtoull(value, &end, 10);
+         ret = end == value || (*end != '\0' && *end != ',') ? -1 : 0;
+      }
+      else
+         ret = -1;
+      if (ret < 0)
+         return -1;
+   }
+   return 0;
+}
+
+int impairActive(Impair *imp)
+{
+   return imp->loss > 0 || imp->burstP > 0 || imp->delayUs > 0 || imp->jitterUs > 0 ||
+          imp->reorder > 0 || imp->dup > 0 || imp->corrupt > 0 || imp->rate > 0;
+}
+
+
+/*
+	LINK - datagrams that are delayed, rate limited, reordered or corrupted
+	are copied into a heap ordered by the time they are due, one thread
+	per socket sends them then
+*/
+
+static int heapBefore(ImpairPkt *a, ImpairPkt *b)
+{
+   return a->due < b->due || (a->due == b->due && a->order < b->order);
+}
+
+static void heapPush(Impair *imp, ImpairPkt *pkt)
+{
+   ImpairPkt *swap;
+   int i;
+
+   i = imp->count++;
+   imp->heap[i] = pkt;
+   while (i > 0 && heapBefore(imp->heap[i], imp->heap[(i - 1) / 2]))
+   {
+      swap = imp->heap[i];
+      imp->heap[i] = imp->heap[(i - 1) / 2];
+      imp->heap[(i - 1) / 2] = swap;
+      i = (i - 1) / 2;
+   }
+}
+
+static ImpairPkt *heapPop(Impair *imp)
+{
+   ImpairPkt *top;
+   ImpairPkt *swap;
+   int child;
+   int i;
+
+   top = imp->heap[0];
+   imp->heap[0] = imp->heap[--imp->count];
+   for (i = 0; (child = 2 * i + 1) < imp->count; i = child)
+   {
+      if (child + 1 < imp->count && heapBefore(imp->heap[child + 1], imp->heap[child]))
+         child++;
+      if (!heapBefore(imp->heap[child], imp->heap[i]))
+         break;
+      swap = imp->heap[i];
+      imp->heap[i] = imp->heap[child];
+      imp->heap[child] = swap;
+   }
+   return top;
+}
+
+static void *linkThread(void *arg)
+{
+   Impair *imp;
+   ImpairPkt *pkt;
+   struct timespec until;
+   unsigned long long now;
+
+   //once stopped the link still delivers what it holds, then quits
+   imp = arg;
+   pthread_mutex_lock(&imp->lock);
+   while (imp->running || imp->count > 0)
+   {
+      if (imp->count == 0)
+      {
+         pthread_cond_wait(&imp->cond, &imp->lock);
+         continue;
+      }
+      now = nowUs();
+      if (imp->heap[0]->due > now)
+      {
+         until.tv_sec = imp->heap[0]->due / 1000000;
+         until.tv_nsec = imp->heap[0]->due % 1000000 * 1000;
+         pthread_cond_timedwait(&imp->cond, &imp->lock, &until);
+         continue;
+      }
+      pkt = heapPop(imp);
+      pthread_mutex_unlock(&imp->lock);
+      sendto(imp->sock, pkt->data, pkt->len, 0, (struct sockaddr *)&pkt->addr,
+             sizeof(pkt->addr));
+      free(pkt);
+      pthread_mutex_lock(&imp->lock);
+   }
+   pthread_mutex_unlock(&imp->lock);
+   return NULL;
+}
+
+int impairStart(Impair *imp, int sock, uint32_t stream)
+{
+   pthread_condattr_t attr;
+   uint64_t x;
+   int i;
+
+   //streams of one run draw from unrelated sequences of the one seed
+   x = imp->seed ^ (uint64_t)stream * 0xd1342543de82ef95ULL;
+   for (i = 0; i < 4; i++)
+      imp->rng.s[i] = splitmix(&x);
+   imp->bad = 0;
+   imp->sock = sock;
+   imp->count = 0;
+   imp->order = 0;
+   imp->linkFree = 0;
+   imp->queued = imp->delayUs > 0 || imp->jitterUs > 0 || imp->rate > 0 ||
+                 imp->reorder > 0 || imp->corrupt > 0;
+   imp->running = 0;
+   if (!imp->queued)
+      return 0;
+
+   imp->heap = malloc(imp->limit * sizeof(ImpairPkt *));
+   if (imp->heap == NULL)
+      return -1;
+   pthread_mutex_init(&imp->lock, NULL);
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&imp->cond, &attr);
+   pthread_condattr_destroy(&attr);
+   imp->running = 1;
+   if (pthread_create(&imp->thread, NULL, linkThread, imp) != 0)
+   {
+      imp->running = 0;
+      free(imp->heap);
+      imp->heap = NULL;
+      return -1;
+   }
+   return 0;
+}
+
+//copies a datagram onto the link, due after the bottleneck, the delay and
+//any jitter or reordering - drops it if the link is full
+static void linkQueue(Impair *imp, void *hdr, int hdrLen, void *data, int dataLen,
+                      struct sockaddr_in *addr, unsigned long long now)
+{
+   ImpairPkt *pkt;
+   unsigned long long due;
+   long long jitter;
+   int full;
+   int bit;
+
+   //only this thread adds datagrams, the link thread can only make room
+   //before the datagram is pushed
+   pthread_mutex_lock(&imp->lock);
+   full = imp->count >= imp->limit;
+   pthread_mutex_unlock(&imp->lock);
+   if (full)
+   {
+      imp->overflow++;
+      return;
+   }
+   pkt = malloc(sizeof(ImpairPkt) + hdrLen + dataLen);
+   if (pkt == NULL)
+   {
+      imp->overflow++;
+      return;
+   }
+   memcpy(pkt->data, hdr, hdrLen);
+   if (dataLen > 0)
+      memcpy(pkt->data + hdrLen, data, dataLen);
+   pkt->len = hdrLen + dataLen;
+   pkt->addr = *addr;
+
+   //the checksum was computed before, so the receiver sees the damage
+   if (chance(imp, imp->corrupt))
+   {
+      bit = impairRandom(imp) * pkt->len * 8;
+      pkt->data[bit / 8] ^= 1 << (bit % 8);
+      imp->corrupted++;
+   }
+
+   //the bottleneck sends one datagram at a time at rate
+   due = now;
+   if (imp->rate > 0)
+   {
+      if (imp->linkFree > due)
+         due = imp->linkFree;
+      due += pkt->len * 8e6 / imp->rate;
+      imp->linkFree = due;
+   }
+   due += imp->delayUs;
+   if (imp->jitterUs > 0)
+   {
+      jitter = (long long)(impairRandom(imp) * (2 * imp->jitterUs + 1)) - (long long)imp->jitterUs;
+      due = jitter < 0 && (unsigned long long)-jitter > due - now ? now : due + jitter;
+   }
+   if (chance(imp, imp->reorder))
+   {
+      due += IMPAIR_HOLD_US;
+      imp->reordered++;
+   }
+   pkt->due = due;
+
+   pthread_mutex_lock(&imp->lock);
+   pkt->order = imp->order++;
+   heapPush(imp, pkt);
+   if (imp->heap[0] == pkt)
+      pthread_cond_signal(&imp->cond);
+   pthread_mutex_unlock(&imp->lock);
+}
+
+int impairPass(Impair *imp, void *hdr, int hdrLen, void *data, int dataLen,
+               struct sockaddr_in *addr)
+{
+   unsigned long long now;
+   int copies;
+
+   //uniform loss, or Gilbert-Elliott: a two state chain moved once per
+   //datagram, loss bursts while it stays bad
+   if (imp->burstP > 0)
+   {
+      imp->bad = imp->bad ? !chance(imp, imp->burstR) : chance(imp, imp->burstP);
+      if (chance(imp, imp->bad ? imp->burstLoss : imp->loss))
+      {
+         imp->lost++;
+         return 0;
+      }
+   }
+   else if (chance(imp, imp->loss))
+   {
+      imp->lost++;
+      return 0;
+   }
+
+   copies = 1;
+   if (chance(imp, imp->dup))
+   {
+      copies = 2;
+      imp->duplicated++;
+   }
+   imp->passed++;
+   if (!imp->queued)
+      return copies;
+
+   now = nowUs();
+   for (; copies > 0; copies--)
+      linkQueue(imp, hdr, hdrLen, data, dataLen, addr, now);
+   return 0;
+}
+
+void impairSendto(Impair *imp, int sock, void *buf, int len, struct sockaddr_in *addr)
+{
+   int copies;
+
+   copies = imp != NULL ? impairPass(imp, buf, len, NULL, 0, addr) : 1;
+   for (; copies > 0; copies--)
+      sendto(sock, buf, len, 0, (struct sockaddr *)addr, sizeof(*addr));
+}
+
+void impairStop(Impair *imp)
+{
+   if (!imp->running)
+      return;
+   pthread_mutex_lock(&imp->lock);
+   imp->running = 0;
+   pthread_cond_signal(&imp->cond);
+   pthread_mutex_unlock(&imp->lock);
+   pthread_join(imp->thread, NULL);
+
+   free(imp->heap);
+   imp->heap = NULL;
+   pthread_cond_destroy(&imp->cond);
+   pthread_mutex_destroy(&imp->lock);
+}
@@ -0,0 +1,103 @@
+//udpImpair Emulated network faults applied to the datagrams an endpoint sends
+
+#ifndef UDPIMPAIR_H
+#define UDPIMPAIR_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#define IMPAIR_LIMIT	10000		//datagrams the emulated link holds when no limit is given
+#define IMPAIR_HOLD_US	1000		//extra time a reordered datagram is held, later ones overtake it
+#define IMPAIR_LEGACY	"loss=0.02"	//faults of the emul argument 1, the old fixed discard rate
+
+/*
+	DATA STRUCTURES
+*/
+
+//xoshiro256** state, the same seed gives the same faults for the same datagrams
+typedef struct {
+   uint64_t s[4];
+} ImpairRng;
+
+//datagram held by the emulated link until it is due
+typedef struct {
+   unsigned long long due;	//time to send it in us, on the monotonic clock
+   uint64_t order;		//arrival number, keeps datagrams due together in order
+   struct sockaddr_in addr;	//destination
+   int len;			//bytes in data
+   char data[];			//header and payload, already checksummed
+} ImpairPkt;
+
+//faults of one socket - the configuration is set by impairParse, the rest by impairStart
+typedef struct {
+   double loss;			//probability a datagram is lost, in the good state with burst
+   double burstP;		//Gilbert-Elliott: probability of going from good to bad, 0 for uniform loss
+   double burstR;		//probability of going from bad back to good
+   double burstLoss;		//probability a datagram is lost in the bad state
+   unsigned long long delayUs;	//one way delay
+   unsigned long long jitterUs;	//the delay varies uniformly by up to this either way
+   double reorder;		//probability a datagram is held IMPAIR_HOLD_US longer than the rest
+   double dup;			//probability a datagram is sent twice
+   double corrupt;		//probability one bit of a datagram is flipped after its checksum
+   double rate;			//bottleneck in bits/s, 0 for none
+   int limit;			//datagrams the link holds, more are dropped as from a full queue
+   uint64_t seed;		//seed of the fault sequence
+
+   ImpairRng rng;		//draws every fault, only the sending thread uses it
+   int bad;			//set in the Gilbert-Elliott bad state
+   int queued;			//set when datagrams go through the link thread
+   int sock;			//socket the link thread sends on
+   unsigned long long linkFree;	//time the bottleneck has sent every datagram before
+   pthread_t thread;		//link thread, sends held datagrams once due
+   pthread_mutex_t lock;	//guards heap, count and running
+   pthread_cond_t cond;		//wakes the link thread for an earlier datagram or to stop
+   ImpairPkt **heap;		//held datagrams, soonest due first, limit of them
+   int count;			//datagrams in heap
+   int running;			//cleared to stop the link thread once heap is empty
+   uint64_t order;		//datagrams taken so far
+
+   unsigned long passed;	//datagrams handed to the socket or the link
+   unsigned long lost;		//dropped by loss
+   unsigned long overflow;	//dropped by a full link
+   unsigned long duplicated;	//sent twice
+   unsigned long corrupted;	//sent with a flipped bit
+   unsigned long reordered;	//held back past later datagrams
+} Impair;
+
+
+/*
+	FUNCTIONS
+*/
+
+//prepares an impairment without faults
+void impairInit(Impair *imp);
+
+//adds the faults of spec, comma separated key=value pairs: loss=P burst=p:r[:P]
+//delay=ms jitter=ms reorder=P dup=P corrupt=P rate=Mbit/s limit=n seed=n,
+//returns -1 for an unknown key or a bad value
+int impairParse(Impair *imp, const char *spec);
+
+//returns 1 if imp has any fault
+int impairActive(Impair *imp);
+
+//seeds the faults of stream (one per socket of a run) and starts the link thread when
+//datagrams have to be held, returns -1 if it cannot be started
+int impairStart(Impair *imp, int sock, uint32_t stream);
+
+//applies the faults to one datagram of hdrLen bytes at hdr and dataLen bytes at data
+//for addr, returns how many copies the caller sends itself - 0 when it was lost or the
+//link took it
+int impairPass(Impair *imp, void *hdr, int hdrLen, void *data, int dataLen,
+               struct sockaddr_in *addr);
+
+//sendto() through the faults, for datagrams that do not go through a SendBatch
+void impairSendto(Impair *imp, int sock, void *buf, int len, struct sockaddr_in *addr);
+
+//stops the link thread once it has sent the datagrams it still holds, each when due
+void impairStop(Impair *imp);
+
+//returns the next value in [0, 1) of the fault sequence
+double impairRandom(Impair *imp);
+
+#endif
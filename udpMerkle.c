@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+#include "udpMerkle.h"
+#include "udpDelta.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+
+//parent of two nodes, the leaves are hashed with deltaStrong as well - its four
+//independent lanes keep the vector units busy on a whole chunk
+static uint64_t join(uint64_t left, uint64_t right)
+{
+   uint64_t pair[2];
+
+   pair[0] = left;
+   pair[1] = right;
+   return deltaStrong((const uint8_t *)pair, sizeof(pair));
+}
+
+//one past the last byte of leaf i
+static uint64_t leafEnd(Merkle *t, uint32_t i)
+{
+   uint64_t end;
+
+   end = (uint64_t)(i + 1) * t->chunk;
+   return end < t->size ? end : t->size;
+}
+
+int merkleInit(Merkle *t, uint64_t size, uint32_t chunk)
+{
+   uint32_t level;
+
+   memset(t, 0, sizeof(*t));
+   t->fd = -1;
+   if (size == 0 || chunk == 0 || (size + chunk - 1) / chunk > UINT32_MAX)
+      return -1;
+   t->size = size;
+   t->chunk = chunk;
+   t->counts[0] = (size + chunk - 1) / chunk;
+   for (level = 0; t->counts[level] > 1; level++)
+      t->counts[level + 1] = (t->counts[level] + 1) / 2;
+   t->levels = level + 1;
+   pthread_mutex_init(&t->lock, NULL);
+   pthread_cond_init(&t->cond, NULL);
+   for (level = 0; level < t->levels; level++)
+   {
+      t->nodes[level] = malloc(t->counts[level] * sizeof(uint64_t));
+      if (t->nodes[level] == NULL)
+      {
+         merkleFree(t);
+         return -1;
+      }
+   }
+   return 0;
+}
+
+
+/*
+	HASHING - each thread takes the lowest leaf not yet taken once its bytes
+	are in place, reads it back and hashes it
+*/
+
+static void *hashThread(void *arg)
+{
+   Merkle *t = arg;
+   uint8_t *buf;
+   uint64_t pos;
+   uint64_t end;
+   uint64_t hash;
+   ssize_t ret;
+   uint32_t leaf;
+   int failed;
+
+   buf = malloc(t->chunk);
+   pthread_mutex_lock(&t->lock);
+   while (!t->stop)
+   {
+      if (t->next == t->counts[0] || leafEnd(t, t->next) > t->avail)
+      {
+         pthread_cond_wait(&t->cond, &t->lock);
+         continue;
+      }
+      leaf = t->next++;
+      pthread_mutex_unlock(&t->lock);
+
+      //pread may stop short, a leaf that cannot be read is counted and left 0
+      pos = (uint64_t)leaf * t->chunk;
+      end = leafEnd(t, leaf);
+      failed = buf == NULL;
+      while (!failed && pos < end)
+      {
+         ret = pread(t->fd, buf + (pos - (uint64_t)leaf * t->chunk), end - pos, pos);
+         if (ret < 0 && errno == EINTR)
+            continue;
+         if (ret <= 0)
+            failed = 1;
+         else
+            pos += ret;
+      }
+      hash = failed ? 0 : deltaStrong(buf, end - (uint64_t)leaf * t->chunk);
+
+      pthread_mutex_lock(&t->lock);
+      t->nodes[0][leaf] = hash;
+      t->errors += failed;
+      t->done++;
+      if (t->done == t->counts[0])
+         pthread_cond_broadcast(&t->cond);
+   }
+   pthread_mutex_unlock(&t->lock);
+   free(buf);
+   return NULL;
+}
+
+int merkleStart(Merkle *t, const char *fileName, int threads)
+{
+   t->fd = open(fileName, O_RDONLY);
+   if (t->fd < 0)
+      return -1;
+   if (threads > MERKLE_THREADS_MAX)
+      threads = MERKLE_THREADS_MAX;
+   for (t->numThreads = 0; t->numThreads < threads; t->numThreads++)
+      if (pthread_create(&t->threads[t->numThreads], NULL, hashThread, t) != 0)
+         break;
+   return t->numThreads > 0 ? 0 : -1;
+}
+
+void merkleAvail(Merkle *t, uint64_t bytes)
+{
+   pthread_mutex_lock(&t->lock);
+   if (bytes > t->size)
+      bytes = t->size;
+
+   //the threads are woken only once a leaf is complete
+   if (bytes > t->avail && t->next < t->counts[0] && leafEnd(t, t->next) <= bytes)
+      pthread_cond_broadcast(&t->cond);
+   if (bytes > t->avail)
+      t->avail = bytes;
+   pthread_mutex_unlock(&t->lock);
+}
+
+int merkleFinish(Merkle *t)
+{
+   uint32_t level;
+   uint32_t i;
+
+   if (t->numThreads == 0)
+      return -1;
+   merkleAvail(t, t->size);
+   pthread_mutex_lock(&t->lock);
+   while (t->done < t->counts[0])
+      pthread_cond_wait(&t->cond, &t->lock);
+   pthread_mutex_unlock(&t->lock);
+
+   //a level above the leaves is a small fraction of them, hashed right here
+   for (level = 1; level < t->levels; level++)
+   {
+      for (i = 0; i < t->counts[level]; i++)
+         t->nodes[level][i] = 2 * i + 1 < t->counts[level - 1] ?
+            join(t->nodes[level - 1][2 * i], t->nodes[level - 1][2 * i + 1]) :
+            t->nodes[level - 1][2 * i];
+   }
+   t->built = 1;
+   return t->errors > 0 ? -1 : 0;
+}
+
+uint64_t merkleRoot(Merkle *t)
+{
+   return t->nodes[t->levels - 1][0];
+}
+
+
+/*
+	WIRE FORMAT - each node as its high then its low word, in network order
+*/
+
+void merklePack(Merkle *t, uint32_t level, uint32_t first, uint32_t n, char *to)
+{
+   uint32_t net[2];
+   uint32_t i;
+
+   for (i = 0; i < n; i++)
+   {
+      net[0] = htonl(t->nodes[level][first + i] >> 32);
+      net[1] = htonl(t->nodes[level][first + i] & 0xffffffff);
+      memcpy(to + i * MERKLE_HASH_SIZE, net, sizeof(net));
+   }
+}
+
+int merkleDiffer(Merkle *t, uint32_t level, uint32_t index, const char *from)
+{
+   uint32_t net[2];
+
+   memcpy(net, from, sizeof(net));
+   return ((uint64_t)ntohl(net[0]) << 32 | ntohl(net[1])) != t->nodes[level][index];
+}
+
+void merkleFree(Merkle *t)
+{
+   uint32_t level;
+   int i;
+
+   if (t->nodes[0] == NULL)
+      return;
+   if (t->numThreads > 0)
+   {
+      pthread_mutex_lock(&t->lock);
+      t->stop = 1;
+      pthread_cond_broadcast(&t->cond);
+      pthread_mutex_unlock(&t->lock);
+      for (i = 0; i < t->numThreads; i++)
+         pthread_join(t->threads[i], NULL);
+      t->numThreads = 0;
+   }
+   if (t->fd >= 0)
+      close(t->fd);
+   t->fd = -1;
+   for (level = 0; level < t->levels; level++)
+   {
+      free(t->nodes[level]);
+      t->nodes[level] = NULL;
+   }
+   pthread_cond_destroy(&t->cond);
+   pthread_mutex_destroy(&t->lock);
+}
@@ -0,0 +1,78 @@
+//udpMerkle Hash tree over fixed size chunks of a file, its leaves hashed by a
+//pool of threads as the file streams past - two copies match when their roots
+//do, and the nodes that differ lead down to the chunks that do
+
+#ifndef UDPMERKLE_H
+#define UDPMERKLE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define MERKLE_CHUNK	(1 << 20)	//bytes per leaf a client asks for
+#define MERKLE_CHUNK_MIN	(64 * 1024)	//smallest leaf either side will accept
+#define MERKLE_CHUNK_MAX	(64 << 20)	//largest
+#define MERKLE_THREADS	4		//threads hashing the leaves of one file
+#define MERKLE_THREADS_MAX	16	//most threads one tree may use
+#define MERKLE_LEVELS_MAX	33	//levels of a tree of 2^32 leaves
+#define MERKLE_HASH_SIZE	8	//bytes of one node on the wire
+#define MERKLE_REPAIR	0xffffffff	//TREE ackNum asking the server to keep all but the chunks that differ
+#define MERKLE_ROUNDS	3		//connections a client sends a file on before it gives up on a match
+
+/*
+	DATA STRUCTURES
+*/
+
+//tree of one file - a node hashes the two below it, an odd one out at the end
+//of a level moves up unchanged
+typedef struct {
+   uint64_t size;		//bytes of the file
+   uint32_t chunk;		//bytes per leaf, the last one may be shorter
+   uint32_t levels;		//levels of nodes, the leaves first and the root last
+   uint32_t counts[MERKLE_LEVELS_MAX];	//nodes per level
+   uint64_t *nodes[MERKLE_LEVELS_MAX];	//hashes of each level
+   int fd;			//file the leaves are read from, -1 before merkleStart
+   pthread_t threads[MERKLE_THREADS_MAX];
+   int numThreads;		//threads started
+   pthread_mutex_t lock;	//guards everything below
+   pthread_cond_t cond;		//signalled when bytes arrive, a leaf is hashed or the threads stop
+   uint64_t avail;		//bytes of the file in place, from its start
+   uint32_t next;		//leaf handed to a thread next
+   uint32_t done;		//leaves hashed
+   int stop;			//set to make the threads quit
+   int built;			//set once every level above the leaves is hashed
+   unsigned long errors;	//leaves that could not be read
+} Merkle;
+
+
+/*
+	FUNCTIONS
+*/
+
+//allocates an empty tree of a size byte file in leaves of chunk bytes, returns
+//-1 if it cannot be allocated
+int merkleInit(Merkle *t, uint64_t size, uint32_t chunk);
+
+//opens fileName and starts threads threads hashing its leaves once they are
+//in place, returns -1 if either fails
+int merkleStart(Merkle *t, const char *fileName, int threads);
+
+//tells the threads the first bytes of the file are in place
+void merkleAvail(Merkle *t, uint64_t bytes);
+
+//waits for every leaf, the whole file being in place, and hashes the levels
+//above them - returns -1 if a leaf could not be read
+int merkleFinish(Merkle *t);
+
+//returns the root, once merkleFinish is done
+uint64_t merkleRoot(Merkle *t);
+
+//stores nodes [first, first + n) of level in network format at to
+void merklePack(Merkle *t, uint32_t level, uint32_t first, uint32_t n, char *to);
+
+//returns 1 if node index of level differs from the one merklePack stored at from
+int merkleDiffer(Merkle *t, uint32_t level, uint32_t index, const char *from);
+
+//stops the threads, closes the file and releases the nodes, also safe on a zeroed one
+void merkleFree(Merkle *t);
+
+#endif
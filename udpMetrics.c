@@ -0,0 +1,406 @@
+#include "udpMetrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+//one exported counter or gauge of a Metrics
+typedef struct {
+   const char *name;		//metric name, udp_ prepended for Prometheus
+   size_t offset;		//position in Metrics
+   int gauge;			//set for a gauge, counters get _total
+} MetricField;
+
+static const MetricField fields[] = {
+   { "packets_sent", offsetof(Metrics, pktsSent), 0 },
+   { "bytes_sent", offsetof(Metrics, bytesSent), 0 },
+   { "packets_received", offsetof(Metrics, pktsRecv), 0 },
+   { "bytes_received", offsetof(Metrics, bytesRecv), 0 },
+   { "retransmits", offsetof(Metrics, retransmits), 0 },
+   { "timeouts", offsetof(Metrics, timeouts), 0 },
+   { "duplicates", offsetof(Metrics, duplicates), 0 },
+   { "srtt_us", offsetof(Metrics, srttUs), 1 },
+   { "rto_us", offsetof(Metrics, rtoUs), 1 },
+   { "window_packets", offsetof(Metrics, window), 1 },
+   { "cwnd_packets", offsetof(Metrics, cwnd), 1 },
+   { "in_flight_packets", offsetof(Metrics, inFlight), 1 },
+   { "out_of_order_depth", offsetof(Metrics, oooDepth), 1 },
+   { "out_of_order_max", offsetof(Metrics, oooMax), 1 }
+};
+
+//histograms, exported as summaries of these quantiles
+static const struct {
+   const char *name;
+   size_t offset;
+} hists[] = {
+   { "rtt_us", offsetof(Metrics, rtt) },
+   { "write_us", offsetof(Metrics, write) }
+};
+static const double quantiles[] = { 0.5, 0.9, 0.99 };
+
+
+/*
+	HISTOGRAMS - values below HIST_SUB have a bucket each, above that every
+	power of two is split into HIST_SUB buckets
+*/
+
+static int histBucket(uint64_t v)
+{
+   int e;
+
+   if (v < HIST_SUB)
+      return v;
+   e = 63 - __builtin_clzll(v);
+   return (e - 3) * HIST_SUB + ((v >> (e - 4)) & (HIST_SUB - 1));
+}
+
+void histAdd(Histogram *h, uint64_t v)
+{
+   int b;
+
+   b = histBucket(v);
+   METRIC_ADD(h->bucket[b], 1);
+   METRIC_ADD(h->sum, v);
+   METRIC_ADD(h->count, 1);
+}
+
+uint64_t histQuantile(Histogram *h, double q)
+{
+   uint64_t count;
+   uint64_t seen;
+   int b;
+
+   count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+   if (count == 0)
+      return 0;
+   seen = 0;
+   for (b = 0; b < HIST_BUCKETS - 1; b++)
+   {
+      seen += __atomic_load_n(&h->bucket[b], __ATOMIC_RELAXED);
+      if (seen > q * count)
+         break;
+   }
+   if (b < HIST_SUB)
+      return b;
+   return (uint64_t)(HIST_SUB + b % HIST_SUB) << (b / HIST_SUB - 1);
+}
+
+
+/*
+	LIST - the transfers of an export, done last
+*/
+
+static uint64_t fieldValue(Metrics *m, size_t offset)
+{
+   return __atomic_load_n((uint64_t *)((char *)m + offset), __ATOMIC_RELAXED);
+}
+
+void metricsAdd(MetricsExport *exp, Metrics *m, const char *role, const char *name, uint32_t id)
+{
+   memset(m, 0, sizeof(Metrics));
+   m->role = role;
+   m->id = id;
+   snprintf(m->name, sizeof(m->name), "%s", name);
+   if (exp == NULL)
+      return;
+
+   m->exp = exp;
+   pthread_mutex_lock(&exp->lock);
+   m->next = exp->head;
+   if (exp->head != NULL)
+      exp->head->prev = m;
+   exp->head = m;
+   pthread_mutex_unlock(&exp->lock);
+}
+
+//the counters and histograms of a transfer that ends carry on in done, so
+//exported totals never go down
+static void metricsFold(Metrics *done, Metrics *m)
+{
+   Histogram *from;
+   Histogram *to;
+   size_t f;
+   int b;
+
+   for (f = 0; f < sizeof(fields) / sizeof(fields[0]); f++)
+      if (!fields[f].gauge)
+         *(uint64_t *)((char *)done + fields[f].offset) += fieldValue(m, fields[f].offset);
+   for (f = 0; f < sizeof(hists) / sizeof(hists[0]); f++)
+   {
+      from = (Histogram *)((char *)m + hists[f].offset);
+      to = (Histogram *)((char *)done + hists[f].offset);
+      to->count += from->count;
+      to->sum += from->sum;
+      for (b = 0; b < HIST_BUCKETS; b++)
+         to->bucket[b] += from->bucket[b];
+   }
+}
+
+void metricsRemove(Metrics *m)
+{
+   MetricsExport *exp;
+
+   exp = m->exp;
+   if (exp == NULL)
+      return;
+   pthread_mutex_lock(&exp->lock);
+   metricsFold(&exp->done, m);
+   if (m->prev != NULL)
+      m->prev->next = m->next;
+   else
+      exp->head = m->next;
+   if (m->next != NULL)
+      m->next->prev = m->prev;
+   exp->closed++;
+   pthread_mutex_unlock(&exp->lock);
+   m->exp = NULL;
+   m->prev = m->next = NULL;
+}
+
+
+/*
+	EXPORT
+*/
+
+//writes s with the characters JSON strings and Prometheus labels escape
+static void putEscaped(FILE *fp, const char *s)
+{
+   for (; *s != '\0'; s++)
+   {
+      if (*s == '"' || *s == '\\')
+         fputc('\\', fp);
+      if (*s == '\n')
+         fputs("\\n", fp);
+      else
+         fputc(*s, fp);
+   }
+}
+
+static void putLabels(FILE *fp, Metrics *m)
+{
+   fprintf(fp, "{role=\"%s\",id=\"%u\",name=\"", m->role, m->id);
+   putEscaped(fp, m->name);
+   fputc('"', fp);
+}
+
+static void writePrometheus(MetricsExport *exp, FILE *fp)
+{
+   Histogram *h;
+   Metrics *m;
+   size_t f;
+   size_t q;
+
+   fprintf(fp, "# TYPE udp_transfers_closed_total counter\n");
+   fprintf(fp, "udp_transfers_closed_total %llu\n", (unsigned long long)exp->closed);
+   for (f = 0; f < sizeof(fields) / sizeof(fields[0]); f++)
+   {
+      fprintf(fp, "# TYPE udp_%s%s %s\n", fields[f].name, fields[f].gauge ? "" : "_total",
+              fields[f].gauge ? "gauge" : "counter");
+      for (m = exp->head; m != NULL; m = m->next)
+      {
+         fprintf(fp, "udp_%s%s", fields[f].name, fields[f].gauge ? "" : "_total");
+         putLabels(fp, m);
+         fprintf(fp, "} %llu\n", (unsigned long long)fieldValue(m, fields[f].offset));
+      }
+   }
+   for (f = 0; f < sizeof(hists) / sizeof(hists[0]); f++)
+   {
+      fprintf(fp, "# TYPE udp_%s summary\n", hists[f].name);
+      for (m = exp->head; m != NULL; m = m->next)
+      {
+         h = (Histogram *)((char *)m + hists[f].offset);
+         for (q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+         {
+            fprintf(fp, "udp_%s", hists[f].name);
+            putLabels(fp, m);
+            fprintf(fp, ",quantile=\"%g\"} %llu\n", quantiles[q],
+                    (unsigned long long)histQuantile(h, quantiles[q]));
+         }
+         fprintf(fp, "udp_%s_sum", hists[f].name);
+         putLabels(fp, m);
+         fprintf(fp, "} %llu\n", (unsigned long long)fieldValue(m, hists[f].offset + offsetof(Histogram, sum)));
+         fprintf(fp, "udp_%s_count", hists[f].name);
+         putLabels(fp, m);
+         fprintf(fp, "} %llu\n", (unsigned long long)fieldValue(m, hists[f].offset + offsetof(Histogram, count)));
+      }
+   }
+}
+
+static void writeJson(MetricsExport *exp, FILE *fp)
+{
+   struct timeval now;
+   Histogram *h;
+   Metrics *m;
+   size_t f;
+   size_t q;
+
+   gettimeofday(&now, NULL);
+   fprintf(fp, "{\"time_us\": %llu, \"closed\": %llu, \"transfers\": [",
+           now.tv_sec * 1000000ULL + now.tv_usec, (unsigned long long)exp->closed);
+   for (m = exp->head; m != NULL; m = m->next)
+   {
+      fprintf(fp, "%s\n  {\"role\": \"%s\", \"id\": %u, \"name\": \"", m == exp->head ? "" : ",",
+              m->role, m->id);
+      putEscaped(fp, m->name);
+      fputc('"', fp);
+      for (f = 0; f < sizeof(fields) / sizeof(fields[0]); f++)
+         fprintf(fp, ", \"%s\": %llu", fields[f].name,
+                 (unsigned long long)fieldValue(m, fields[f].offset));
+      for (f = 0; f < sizeof(hists) / sizeof(hists[0]); f++)
+      {
+         h = (Histogram *)((char *)m + hists[f].offset);
+         fprintf(fp, ", \"%s\": {\"count\": %llu, \"sum\": %llu", hists[f].name,
+                 (unsigned long long)__atomic_load_n(&h->count, __ATOMIC_RELAXED),
+                 (unsigned long long)__atomic_load_n(&h->sum, __ATOMIC_RELAXED));
+         for (q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+            fprintf(fp, ", \"p%g\": %llu", quantiles[q] * 100,
+                    (unsigned long long)histQuantile(h, quantiles[q]));
+         fputc('}', fp);
+      }
+      fputc('}', fp);
+   }
+   fprintf(fp, "\n]}\n");
+}
+
+static void writeExport(MetricsExport *exp, FILE *fp)
+{
+   pthread_mutex_lock(&exp->lock);
+   if (exp->json)
+      writeJson(exp, fp);
+   else
+      writePrometheus(exp, fp);
+   pthread_mutex_unlock(&exp->lock);
+}
+
+//replaces the target file with a fresh export, readers never see half of one
+static void exportFile(MetricsExport *exp)
+{
+   char tmp[PATH_MAX + 8];
+   FILE *fp;
+
+   snprintf(tmp, sizeof(tmp), "%s.tmp", exp->target);
+   fp = fopen(tmp, "w");
+   if (fp == NULL)
+      return;
+   writeExport(exp, fp);
+   if (fclose(fp) == 0)
+      rename(tmp, exp->target);
+   else
+      unlink(tmp);
+}
+
+static void *exportThread(void *arg)
+{
+   MetricsExport *exp;
+   struct pollfd fds[2];
+   FILE *fp;
+   int fd;
+
+   exp = arg;
+   fds[0].fd = exp->wake[0];
+   fds[0].events = POLLIN;
+   fds[1].fd = exp->listenFd;
+   fds[1].events = POLLIN;
+   while (1)
+   {
+      if (poll(fds, exp->listenFd >= 0 ? 2 : 1, exp->listenFd >= 0 ? -1 : exp->intervalMs) < 0)
+         continue;
+      if (fds[0].revents != 0)
+         break;
+
+      //a socket answers every connection with the export of that moment
+      if (exp->listenFd < 0)
+         exportFile(exp);
+      else if (fds[1].revents != 0 && (fd = accept(exp->listenFd, NULL, NULL)) >= 0)
+      {
+         fp = fdopen(fd, "w");
+         if (fp == NULL)
+            close(fd);
+         else
+         {
+            writeExport(exp, fp);
+            fclose(fp);
+         }
+      }
+   }
+   return NULL;
+}
+
+int metricsStart(MetricsExport *exp, const char *target, int intervalMs)
+{
+   struct sockaddr_un addr;
+   const char *path;
+   size_t len;
+
+   memset(exp, 0, sizeof(MetricsExport));
+   snprintf(exp->target, sizeof(exp->target), "%s", target);
+   len = strlen(target);
+   exp->json = len >= 5 && strcmp(target + len - 5, ".json") == 0;
+   exp->intervalMs = intervalMs > 0 ? intervalMs : METRICS_INTERVAL_MS;
+   exp->listenFd = -1;
+   exp->done.role = "closed";
+   exp->done.exp = exp;
+   exp->head = &exp->done;
+
+   if (strncmp(target, METRICS_UNIX, strlen(METRICS_UNIX)) == 0)
+   {
+      path = target + strlen(METRICS_UNIX);
+      if (strlen(path) >= sizeof(addr.sun_path))
+         return -1;
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      strcpy(addr.sun_path, path);
+      unlink(path);
+      exp->listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (exp->listenFd < 0 || bind(exp->listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+          listen(exp->listenFd, 8) < 0)
+      {
+         if (exp->listenFd >= 0)
+            close(exp->listenFd);
+         return -1;
+      }
+      snprintf(exp->target, sizeof(exp->target), "%s", path);
+   }
+
+   if (pipe(exp->wake) < 0)
+   {
+      if (exp->listenFd >= 0)
+         close(exp->listenFd);
+      return -1;
+   }
+   pthread_mutex_init(&exp->lock, NULL);
+   if (pthread_create(&exp->thread, NULL, exportThread, exp) != 0)
+   {
+      close(exp->wake[0]);
+      close(exp->wake[1]);
+      if (exp->listenFd >= 0)
+         close(exp->listenFd);
+      pthread_mutex_destroy(&exp->lock);
+      return -1;
+   }
+   return 0;
+}
+
+void metricsStop(MetricsExport *exp)
+{
+   char c;
+
+   c = 0;
+   if (write(exp->wake[1], &c, 1) == 1)
+      pthread_join(exp->thread, NULL);
+   close(exp->wake[0]);
+   close(exp->wake[1]);
+   if (exp->listenFd >= 0)
+   {
+      close(exp->listenFd);
+      unlink(exp->target);
+   }
+   else
+      exportFile(exp);
+   pthread_mutex_destroy(&exp->lock);
+}
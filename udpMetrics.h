@@ -0,0 +1,100 @@
+//udpMetrics Per transfer counters and histograms, exported while transfers run
+
+#ifndef UDPMETRICS_H
+#define UDPMETRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <limits.h>
+
+#define METRICS_INTERVAL_MS	1000	//time between exports when none is given
+#define METRICS_NAME_MAX	256	//bytes of a transfer's name kept for its labels
+#define METRICS_UNIX	"unix:"		//prefix of an export target that is a UNIX socket
+#define HIST_SUB	16		//histogram buckets per power of two, values within 1/HIST_SUB
+#define HIST_BUCKETS	(64 * HIST_SUB)	//buckets covering every 64 bit value
+
+//counter and gauge updates - a transfer has one writer, the exporter only
+//reads, so neither takes a lock or a locked instruction
+#define METRIC_ADD(field, n)	__atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define METRIC_SET(field, v)	__atomic_store_n(&(field), (v), __ATOMIC_RELAXED)
+
+/*
+	DATA STRUCTURES
+*/
+
+//log-linear histogram of values in us
+typedef struct {
+   uint64_t count;		//values added
+   uint64_t sum;		//their total
+   uint64_t bucket[HIST_BUCKETS];	//values per bucket, see histAdd
+} Histogram;
+
+//measures of one transfer, updated by the thread running it
+typedef struct Metrics {
+   uint64_t pktsSent;		//datagrams sent
+   uint64_t bytesSent;		//their bytes, headers included
+   uint64_t pktsRecv;		//datagrams received
+   uint64_t bytesRecv;		//their bytes
+   uint64_t retransmits;	//DATA packets sent again
+   uint64_t timeouts;		//retransmission timeouts
+   uint64_t duplicates;		//DATA packets received again
+   uint64_t srttUs;		//smoothed RTT
+   uint64_t rtoUs;		//retransmission timeout
+   uint64_t window;		//packets the window holds
+   uint64_t cwnd;		//congestion window in packets
+   uint64_t inFlight;		//packets sent and not yet acknowledged
+   uint64_t oooDepth;		//packets between the in-order edge and the highest received
+   uint64_t oooMax;		//largest oooDepth so far
+   Histogram rtt;		//RTT of packets sent once
+   Histogram write;		//time of each write of received blocks to disk
+
+   const char *role;		//"send" or "recv"
+   uint32_t id;			//connection ID
+   char name[METRICS_NAME_MAX];	//file being transferred
+   struct MetricsExport *exp;	//export it is listed in, NULL for none
+   struct Metrics *prev;	//neighbours in that list
+   struct Metrics *next;
+} Metrics;
+
+//transfers of one process and the thread exporting them
+typedef struct MetricsExport {
+   char target[PATH_MAX];	//file written, or UNIX socket path after METRICS_UNIX
+   int json;			//set to export JSON, Prometheus text otherwise
+   int intervalMs;		//time between file exports
+   int listenFd;		//UNIX socket answering each connection with an export, -1 for a file
+   int wake[2];			//pipe waking the thread to stop
+   pthread_t thread;		//exporting thread
+   pthread_mutex_t lock;	//guards the list, never taken on the hot path
+   Metrics *head;		//transfers listed, done last
+   Metrics done;		//counters and histograms of the transfers removed, role "closed"
+   uint64_t closed;		//transfers removed so far
+} MetricsExport;
+
+
+/*
+	FUNCTIONS
+*/
+
+//starts exporting to target every intervalMs - a file path, written whole and
+//renamed into place, or METRICS_UNIX followed by a socket path - as JSON when
+//target ends in .json, Prometheus text otherwise, returns -1 on failure
+int metricsStart(MetricsExport *exp, const char *target, int intervalMs);
+
+//zeroes m for the transfer id of name in role and lists it in exp, NULL to only count
+void metricsAdd(MetricsExport *exp, Metrics *m, const char *role, const char *name, uint32_t id);
+
+//takes m off its export, adding its counters and histograms to those of the
+//transfers removed before, also safe on a zeroed one
+void metricsRemove(Metrics *m);
+
+//exports one last time and stops the thread
+void metricsStop(MetricsExport *exp);
+
+//adds value v to h
+void histAdd(Histogram *h, uint64_t v);
+
+//returns the value at quantile q of h, the low end of its bucket
+uint64_t histQuantile(Histogram *h, double q);
+
+#endif
@@ -1,17 +1,86 @@
 #include "udpProtocol.h"
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
+#define CRC32C_POLY	0x82f63b78	//Castagnoli polynomial, reflected
+#define CRC_SHORT	256		//bytes per lane of the interleaved hardware loop
 
-int initializeServer(Tcb *servTcb)
+
+//allocates window slots, each pointing at a buffer for payloadSize bytes
+static Slot *allocSlots(Tcb *tcb, uint32_t window, uint32_t payloadSize)
 {
-  
- 
+   Slot *slots;
+   size_t stride;
+   uint32_t i;
+
+   //keep every packet header 8 byte aligned
+   stride = (HEADER_SIZE + payloadSize + 7) & ~(size_t)7;
+   slots = calloc(window, sizeof(Slot));
+   tcb->bufs = malloc(window * stride);
+   if (slots == NULL || tcb->bufs == NULL)
+   {
+      free(slots);
+      return NULL;
+   }
+   for (i = 0; i < window; i++)
+      slots[i].pkt = (Packet *)(tcb->bufs + i * stride);
+   return slots;
 }
 
 
-int initializeClient(Tcb *clientTcb)
+int initializeServer(Tcb *servTcb, uint32_t window, uint32_t payloadSize)
 {
-   
+   if (window == 0 || window > WINDOW_MAX)
+      window = WINDOW_MAX;
+   if (payloadSize < PAYLOAD_MIN || payloadSize > PAYLOAD_MAX)
+      payloadSize = PAYLOAD_SIZE;
+
+   servTcb->nextSeq = 0;
+   servTcb->expectedSeq = 0;
+   servTcb->sendBase = 0;
+   servTcb->window = window;
+   servTcb->payloadSize = payloadSize;
+   servTcb->sendWin = NULL;
+   servTcb->bufs = NULL;
+   if (bitmapInit(&servTcb->seqMap, window) < 0)
+      return -1;
+
+   return 0;
+}
+
+
+int initializeClient(Tcb *clientTcb, uint32_t window, uint32_t payloadSize)
+{
+   if (window == 0 || window > WINDOW_MAX)
+      window = WINDOW_MAX;
+   if (payloadSize < PAYLOAD_MIN || payloadSize > PAYLOAD_MAX)
+      payloadSize = PAYLOAD_SIZE;
+
+   clientTcb->nextSeq = 0;
+   clientTcb->expectedSeq = 0;
+   clientTcb->sendBase = 0;
+   clientTcb->window = window;
+   clientTcb->payloadSize = payloadSize;
+   clientTcb->sendWin = allocSlots(clientTcb, window, payloadSize);
+   if (clientTcb->sendWin == NULL || bitmapInit(&clientTcb->seqMap, window) < 0)
+      return -1;
+
+   return 0;
+}
+
+
+void releaseTcb(Tcb *tcb)
+{
+   free(tcb->sendWin);
+   free(tcb->bufs);
+   tcb->sendWin = NULL;
+   tcb->bufs = NULL;
+   bitmapFree(&tcb->seqMap);
 }
 
 
@@ -23,6 +92,8 @@ void createPacket(Packet *pkt, uint32_t l, uint32_t seq, uint32_t ack, uint32_t
    pkt->seqNum = htonl(seq);
    pkt->ackNum = htonl(ack);
    pkt->flag = htonl(flg);
+   pkt->connId = 0;
+   pkt->checksum = 0;
 }
 
 void readPacket(Packet *pkt)
@@ -31,9 +102,542 @@ void readPacket(Packet *pkt)
    pkt->seqNum = ntohl(pkt->seqNum);
    pkt->ackNum = ntohl(pkt->ackNum);
    pkt->flag = ntohl(pkt->flag);
+   pkt->connId = ntohl(pkt->connId);
+}
+
+int packetSize(Packet *pkt)
+{
+   return HEADER_SIZE + ntohl(pkt->length);
+}
+
+int paramsSize(SynParams *params)
+{
+   return PARAMS_SIZE + strlen(params->name);
+}
+
+void packParams(Packet *pkt, SynParams *params)
+{
+   uint32_t net[PARAMS_SIZE / 4];
+
+   net[0] = htonl(params->window);
+   net[1] = htonl(params->payload);
+   net[2] = htonl(params->fileSize >> 32);
+   net[3] = htonl(params->fileSize & 0xffffffff);
+   net[4] = htonl(params->offset >> 32);
+   net[5] = htonl(params->offset & 0xffffffff);
+   net[6] = htonl(params->session);
+   net[7] = htonl(params->stripe);
+   net[8] = htonl((uint32_t)params->fecData << 16 | params->fecParity);
+   net[9] = htonl(params->codec);
+   net[10] = htonl(params->stamp >> 32);
+   net[11] = htonl(params->stamp & 0xffffffff);
+   net[12] = htonl(params->resume);
+   net[13] = htonl(params->delta);
+   net[14] = htonl(params->deltaCount);
+   net[15] = htonl(params->ackEvery);
+   net[16] = htonl(params->ackDelay);
+   net[17] = htonl(params->bundle);
+   net[18] = htonl(params->verify);
+   memcpy(pkt->payload, net, sizeof(net));
+   memcpy(pkt->payload + PARAMS_SIZE, params->name, strlen(params->name));
+}
+
+void unpackParams(Packet *pkt, SynParams *params)
+{
+   uint32_t net[PARAMS_SIZE / 4];
+   uint32_t nameLen;
+
+   memcpy(net, pkt->payload, sizeof(net));
+   params->window = ntohl(net[0]);
+   params->payload = ntohl(net[1]);
+   params->fileSize = (uint64_t)ntohl(net[2]) << 32 | ntohl(net[3]);
+   params->offset = (uint64_t)ntohl(net[4]) << 32 | ntohl(net[5]);
+   params->session = ntohl(net[6]);
+   params->stripe = ntohl(net[7]);
+   params->fecData = ntohl(net[8]) >> 16;
+   params->fecParity = ntohl(net[8]) & 0xffff;
+   params->codec = ntohl(net[9]);
+   params->stamp = (uint64_t)ntohl(net[10]) << 32 | ntohl(net[11]);
+   params->resume = ntohl(net[12]);
+   params->delta = ntohl(net[13]);
+   params->deltaCount = ntohl(net[14]);
+   params->ackEvery = ntohl(net[15]);
+   params->ackDelay = ntohl(net[16]);
+   params->bundle = ntohl(net[17]);
+   params->verify = ntohl(net[18]);
+
+   //the name fills the rest of a SYN payload, without a terminator - a
+   //SYN_ACK carries extents there instead
+   nameLen = pkt->flag == SYN && pkt->length > PARAMS_SIZE ? pkt->length - PARAMS_SIZE : 0;
+   if (nameLen > FILE_NAME_MAX)
+      nameLen = FILE_NAME_MAX;
+   memcpy(params->name, pkt->payload + PARAMS_SIZE, nameLen);
+   params->name[nameLen] = '\0';
+}
+
+//stores count blocks at to in network format
+static void packBlocks(char *to, SackBlock *blocks, int count)
+{
+   SackBlock net;
+   int i;
+
+   for (i = 0; i < count; i++)
+   {
+      net.start = htonl(blocks[i].start);
+      net.end = htonl(blocks[i].end);
+      memcpy(to + i * sizeof(SackBlock), &net, sizeof(net));
+   }
+}
+
+//reads count blocks at from
+static void unpackBlocks(char *from, SackBlock *blocks, int count)
+{
+   SackBlock net;
+   int i;
+
+   for (i = 0; i < count; i++)
+   {
+      memcpy(&net, from + i * sizeof(SackBlock), sizeof(net));
+      blocks[i].start = ntohl(net.start);
+      blocks[i].end = ntohl(net.end);
+   }
+}
+
+void packExtents(Packet *pkt, SackBlock *blocks, int count)
+{
+   packBlocks(pkt->payload + PARAMS_SIZE, blocks, count);
+}
+
+int unpackExtents(Packet *pkt, SackBlock *blocks)
+{
+   int count;
+
+   count = pkt->length > PARAMS_SIZE ? (pkt->length - PARAMS_SIZE) / sizeof(SackBlock) : 0;
+   if (count > (int)((PAYLOAD_MAX - PARAMS_SIZE) / sizeof(SackBlock)))
+      count = (PAYLOAD_MAX - PARAMS_SIZE) / sizeof(SackBlock);
+   unpackBlocks(pkt->payload + PARAMS_SIZE, blocks, count);
+   return count;
+}
+
+void packAck(Packet *pkt, uint32_t delayUs, SackBlock *blocks, int count)
+{
+   uint32_t net;
+
+   net = htonl(delayUs);
+   memcpy(pkt->payload, &net, ACK_INFO_SIZE);
+   packBlocks(pkt->payload + ACK_INFO_SIZE, blocks, count);
+}
+
+int unpackAck(Packet *pkt, uint32_t *delayUs, SackBlock *blocks)
+{
+   uint32_t net;
+   int count;
+
+   if (pkt->length < ACK_INFO_SIZE)
+   {
+      *delayUs = 0;
+      return 0;
+   }
+   memcpy(&net, pkt->payload, ACK_INFO_SIZE);
+   *delayUs = ntohl(net);
+   count = (pkt->length - ACK_INFO_SIZE) / sizeof(SackBlock);
+   if (count > SACK_MAX)
+      count = SACK_MAX;
+   unpackBlocks(pkt->payload + ACK_INFO_SIZE, blocks, count);
+   return count;
+}
+
+int bitmapInit(Bitmap *map, uint32_t nbits)
+{
+   map->nwords = nbits / 64 + 1;
+   map->words = calloc(map->nwords, sizeof(uint64_t));
+   if (map->words == NULL)
+      return -1;
+   return 0;
+}
+
+void bitmapFree(Bitmap *map)
+{
+   free(map->words);
+   map->words = NULL;
+   map->nwords = 0;
+}
+
+//doubles the bitmap until it holds bit
+static void bitmapGrow(Bitmap *map, uint32_t bit)
+{
+   uint32_t nwords;
+   uint64_t *words;
+
+   nwords = map->nwords;
+   while (bit / 64 >= nwords)
+      nwords *= 2;
+   words = realloc(map->words, nwords * sizeof(uint64_t));
+   if (words == NULL)
+   {
+      printf("  *** ERROR - unable to grow bitmap to %u bits \n", bit);
+      exit(1);
+   }
+   memset(words + map->nwords, 0, (nwords - map->nwords) * sizeof(uint64_t));
+   map->words = words;
+   map->nwords = nwords;
+}
+
+void bitmapSet(Bitmap *map, uint32_t bit)
+{
+   if (bit / 64 >= map->nwords)
+      bitmapGrow(map, bit);
+   map->words[bit / 64] |= 1ULL << (bit % 64);
+}
+
+uint32_t bitmapSetRange(Bitmap *map, uint32_t start, uint32_t end)
+{
+   uint32_t cleared;
+
+   cleared = 0;
+   if (start >= end)
+      return 0;
+   if ((end - 1) / 64 >= map->nwords)
+      bitmapGrow(map, end - 1);
+
+   //partial first word, whole middle words, partial last word
+   for (; start < end && start % 64 != 0; start++)
+   {
+      cleared += !((map->words[start / 64] >> (start % 64)) & 1);
+      map->words[start / 64] |= 1ULL << (start % 64);
+   }
+   while (end - start >= 64)
+   {
+      cleared += 64 - __builtin_popcountll(map->words[start / 64]);
+      map->words[start / 64] = ~0ULL;
+      start += 64;
+   }
+   for (; start < end; start++)
+   {
+      cleared += !((map->words[start / 64] >> (start % 64)) & 1);
+      map->words[start / 64] |= 1ULL << (start % 64);
+   }
+   return cleared;
+}
+
+void bitmapClearRange(Bitmap *map, uint32_t start, uint32_t end)
+{
+   for (; start < end && start / 64 < map->nwords; start++)
+      map->words[start / 64] &= ~(1ULL << (start % 64));
+}
+
+int bitmapTest(Bitmap *map, uint32_t bit)
+{
+   if (bit / 64 >= map->nwords)
+      return 0;
+   return (map->words[bit / 64] >> (bit % 64)) & 1;
+}
+
+uint32_t bitmapNextSet(Bitmap *map, uint32_t from, uint32_t limit)
+{
+   uint64_t word;
+   uint32_t i;
+
+   for (i = from / 64; from < limit && i < map->nwords; i++)
+   {
+      word = map->words[i] & (~0ULL << (from % 64));
+      if (word != 0)
+      {
+         from = i * 64 + __builtin_ctzll(word);
+         return from < limit ? from : limit;
+      }
+      from = (i + 1) * 64;
+   }
+   return limit;
+}
+
+uint32_t bitmapNextClear(Bitmap *map, uint32_t from, uint32_t limit)
+{
+   uint64_t word;
+   uint32_t i;
+
+   for (i = from / 64; from < limit; i++)
+   {
+      //bits past the end of the bitmap are clear
+      if (i >= map->nwords)
+         return from;
+      word = ~map->words[i] & (~0ULL << (from % 64));
+      if (word != 0)
+      {
+         from = i * 64 + __builtin_ctzll(word);
+         return from < limit ? from : limit;
+      }
+      from = (i + 1) * 64;
+   }
+   return limit;
+}
+
+uint32_t bitmapRunStart(Bitmap *map, uint32_t bit, uint32_t floor)
+{
+   while (bit > floor && bitmapTest(map, bit - 1))
+   {
+      //skip whole words of set bits
+      if (bit % 64 == 0 && bit - 64 >= floor && map->words[bit / 64 - 1] == ~0ULL)
+         bit -= 64;
+      else
+         bit--;
+   }
+   return bit;
+}
+
+int bitmapRanges(Bitmap *map, uint32_t from, uint32_t limit, SackBlock *blocks, int max)
+{
+   int count;
+
+   count = 0;
+   while (count < max)
+   {
+      from = bitmapNextSet(map, from, limit);
+      if (from == limit)
+         break;
+      blocks[count].start = from;
+      from = bitmapNextClear(map, from, limit);
+      blocks[count].end = from;
+      count++;
+   }
+   return count;
+}
+
+unsigned long long nowUs(void)
+{
+   return nowNs() / 1000;
+}
+
+unsigned long long nowNs(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+	CRC32C - slicing-by-8 tables for the portable path, and operators that
+	append CRC_SHORT zero bytes to a CRC for combining the three lanes of
+	the SSE4.2 path
+*/
+
+static uint32_t crcTable[8][256];
+static uint32_t crcShort[4][256];
+static uint32_t (*crcImpl)(uint32_t crc, const unsigned char *buf, size_t len);
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+//multiplies a 32x32 GF(2) matrix by a vector
+static uint32_t gf2Times(uint32_t *mat, uint32_t vec)
+{
+   uint32_t sum;
+
+   for (sum = 0; vec != 0; vec >>= 1, mat++)
+      if (vec & 1)
+         sum ^= *mat;
+   return sum;
+}
+
+//squares a 32x32 GF(2) matrix
+static void gf2Square(uint32_t *square, uint32_t *mat)
+{
+   int n;
+
+   for (n = 0; n < 32; n++)
+      square[n] = gf2Times(mat, mat[n]);
+}
+
+//builds byte tables applying len (a power of two) zero bytes to a CRC
+static void crcZeros(uint32_t zeros[4][256], size_t len)
+{
+   uint32_t even[32];
+   uint32_t odd[32];
+   uint32_t row;
+   int n;
+
+   //operator for one zero bit, then square up to one zero byte
+   odd[0] = CRC32C_POLY;
+   for (n = 1, row = 1; n < 32; n++, row <<= 1)
+      odd[n] = row;
+   gf2Square(even, odd);
+   gf2Square(odd, even);
+   do
+   {
+      gf2Square(even, odd);
+      len >>= 1;
+      if (len == 0)
+         break;
+      gf2Square(odd, even);
+      len >>= 1;
+      if (len == 0)
+         memcpy(even, odd, sizeof(even));
+   } while (len != 0);
+
+   for (n = 0; n < 256; n++)
+   {
+      zeros[0][n] = gf2Times(even, n);
+      zeros[1][n] = gf2Times(even, n << 8);
+      zeros[2][n] = gf2Times(even, n << 16);
+      zeros[3][n] = gf2Times(even, (uint32_t)n << 24);
+   }
+}
+
+static uint32_t crcShift(uint32_t zeros[4][256], uint32_t crc)
+{
+   return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+          zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static uint32_t crcSoftware(uint32_t crc, const unsigned char *buf, size_t len)
+{
+   uint64_t word;
+
+   while (len > 0 && ((uintptr_t)buf & 7) != 0)
+   {
+      crc = crcTable[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+      len--;
+   }
+   while (len >= 8)
+   {
+      memcpy(&word, buf, 8);
+      word ^= crc;
+      crc = crcTable[7][word & 0xff] ^ crcTable[6][(word >> 8) & 0xff] ^
+            crcTable[5][(word >> 16) & 0xff] ^ crcTable[4][(word >> 24) & 0xff] ^
+            crcTable[3][(word >> 32) & 0xff] ^ crcTable[2][(word >> 40) & 0xff] ^
+            crcTable[1][(word >> 48) & 0xff] ^ crcTable[0][word >> 56];
+      buf += 8;
+      len -= 8;
+   }
+   while (len > 0)
+   {
+      crc = crcTable[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+      len--;
+   }
+   return crc;
+}
+
+#if defined(__x86_64__)
+//the crc32 instruction has a latency of three cycles and a throughput of
+//one, so three independent lanes keep it busy; the lanes are merged by
+//shifting the earlier ones past CRC_SHORT zero bytes
+__attribute__((target("sse4.2")))
+static uint32_t crcHardware(uint32_t crc, const unsigned char *buf, size_t len)
+{
+   const unsigned char *end;
+   uint64_t crc0;
+   uint64_t crc1;
+   uint64_t crc2;
+
+   crc0 = crc;
+   while (len > 0 && ((uintptr_t)buf & 7) != 0)
+   {
+      crc0 = _mm_crc32_u8(crc0, *buf++);
+      len--;
+   }
+   while (len >= CRC_SHORT * 3)
+   {
+      crc1 = 0;
+      crc2 = 0;
+      end = buf + CRC_SHORT;
+      do
+      {
+         crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)buf);
+         crc1 = _mm_crc32_u64(crc1, *(const uint64_t *)(buf + CRC_SHORT));
+         crc2 = _mm_crc32_u64(crc2, *(const uint64_t *)(buf + 2 * CRC_SHORT));
+         buf += 8;
+      } while (buf < end);
+      crc0 = crcShift(crcShort, crc0) ^ crc1;
+      crc0 = crcShift(crcShort, crc0) ^ crc2;
+      buf += 2 * CRC_SHORT;
+      len -= 3 * CRC_SHORT;
+   }
+   while (len >= 8)
+   {
+      crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)buf);
+      buf += 8;
+      len -= 8;
+   }
+   while (len > 0)
+   {
+      crc0 = _mm_crc32_u8(crc0, *buf++);
+      len--;
+   }
+   return crc0;
+}
+#endif
+
+//fills the tables and picks the fastest implementation, once for all threads
+static void crcInit(void)
+{
+   uint32_t crc;
+   int n;
+   int k;
+
+   for (n = 0; n < 256; n++)
+   {
+      crc = n;
+      for (k = 0; k < 8; k++)
+         crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+      crcTable[0][n] = crc;
+   }
+   for (n = 0; n < 256; n++)
+      for (k = 1; k < 8; k++)
+         crcTable[k][n] = crcTable[0][crcTable[k - 1][n] & 0xff] ^ (crcTable[k - 1][n] >> 8);
+   crcZeros(crcShort, CRC_SHORT);
+
+   crcImpl = crcSoftware;
+#if defined(__x86_64__)
+   if (__builtin_cpu_supports("sse4.2"))
+      crcImpl = crcHardware;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+   pthread_once(&crcOnce, crcInit);
+   return ~crcImpl(~crc, buf, len);
+}
+
+uint32_t crc32cSoftware(uint32_t crc, const void *buf, size_t len)
+{
+   pthread_once(&crcOnce, crcInit);
+   return ~crcSoftware(~crc, buf, len);
 }
 
 unsigned int checksum(char *addr, unsigned int count )
 {
+   return crc32c(0, addr, count);
+}
+
+void sealPacket(Packet *pkt)
+{
+   sealPacketData(pkt, pkt->payload);
+}
+
+void sealPacketData(Packet *pkt, const char *data)
+{
+   uint32_t crc;
+
+   pkt->checksum = 0;
+   crc = crc32c(0, pkt, HEADER_SIZE);
+   pkt->checksum = htonl(crc32c(crc, data, ntohl(pkt->length)));
+}
+
+int verifyPacket(Packet *pkt, int len)
+{
+   uint32_t sum;
+   uint32_t size;
+   int ok;
+
+   if (len < HEADER_SIZE)
+      return 0;
+   size = ntohl(pkt->length);
+   if (size > PAYLOAD_MAX || size > (uint32_t) (len - HEADER_SIZE))
+      return 0;
 
+   sum = pkt->checksum;
+   pkt->checksum = 0;
+   ok = ntohl(sum) == checksum((char *)pkt, HEADER_SIZE + size);
+   pkt->checksum = sum;
+   return ok;
 }
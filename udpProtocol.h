@@ -7,10 +7,22 @@
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <stdio.h>
-
-#define PKT_SIZE 	512
-#define PAYLOAD_SIZE 	496
-#define HEADER_SIZE 	16
+#include "udpTimer.h"
+
+#define PKT_SIZE 	512		//default datagram size, HEADER_SIZE + PAYLOAD_SIZE
+#define PAYLOAD_SIZE 	488		//default payload size when none is negotiated
+#define HEADER_SIZE 	24
+#define PAYLOAD_MAX	8948		//payload of a 9000 byte jumbo frame less IP, UDP and our header
+#define PAYLOAD_MIN	64		//smallest payload either side will accept
+
+#define WINDOW_DEFAULT	256		//packets in flight when no window is requested
+#define WINDOW_MAX	16384		//largest window either side will accept
+#define SACK_MAX	16		//SACK blocks carried by one ACK
+#define DUPTHRESH	3		//packets SACKed above a hole before it is resent without a reordering allowance
+#define PARAMS_SIZE	76		//bytes of SynParams ahead of the file name (SYN) or the extents (SYN_ACK) in the payload
+#define FILE_NAME_MAX	255		//longest file name a SYN carries
+#define ACK_INFO_SIZE	4		//bytes ahead of the SACK blocks in an ACK payload, its delay in us
+#define ACK_NOW		1		//DATA ackNum of the last packet the sender's window allows, ACKed at once
 
 #define SYN 		1
 #define SYN_ACK 	2
@@ -18,6 +30,12 @@
 #define ACK		4
 #define FIN		5
 #define FIN_ACK		6
+#define PROBE		7
+#define PROBE_ACK	8
+#define REPAIR		9
+#define SIGNATURE	10
+#define TREE		11
+#define SYN_REFUSED	12
 
 /*
 	DATA STRUCTURES
@@ -26,19 +44,71 @@
 
 //packet data structure
 typedef struct {
-   uint32_t length;		//checksum value for integrity check
+   uint32_t length;		//payload length in bytes
    uint32_t seqNum;		//number for packet sequencing
    uint32_t ackNum;		//number for ack sequencing
    uint32_t flag;		//determines type of message being sent (seq/ack/fin/etc)
-   char payload[PAYLOAD_SIZE];
+   uint32_t connId;		//connection the packet belongs to, given by the server in SYN_ACK
+   uint32_t checksum;		//CRC32C of header (this field zero) and payload for integrity check
+   char payload[PAYLOAD_MAX];	//only HEADER_SIZE + length bytes go on the wire
 } Packet;
 
-//Transfer control block for stop and wait protocol
+//handshake parameters carried in the SYN and SYN_ACK payload
+typedef struct {
+   uint32_t window;		//window size in packets (requested by client, granted by server)
+   uint32_t payload;		//payload bytes per DATA packet (requested by client, granted by server)
+   uint64_t fileSize;		//bytes in the whole file, 0 if unknown
+   uint64_t offset;		//file offset of block 0, where a stripe starts
+   uint32_t session;		//striped session the connection belongs to, 0 if not striped
+   uint32_t stripe;		//stripe number within the session, stripe 0 FINs last
+   uint16_t fecData;		//DATA packets per FEC group, 0 without FEC (granted by server)
+   uint16_t fecParity;		//REPAIR packets sent after each group
+   uint32_t codec;		//compression of the DATA payloads, 0 for none (granted by server)
+   uint64_t stamp;		//modification time of the file in ns, 0 if unknown - a transfer only resumes the same version
+   uint32_t resume;		//every block below this seqNum is already at the server (SYN_ACK only)
+   uint32_t delta;		//signature block size of the server's copy, 1 to ask for one, 0 for none (granted by server)
+   uint32_t deltaCount;		//signature entries of the server's copy (SYN_ACK only)
+   uint32_t ackEvery;		//in order packets per ACK, 0 or 1 for every one (requested by client, granted by server)
+   uint32_t ackDelay;		//longest in us an ACK is held back (requested by client, granted by server)
+   uint32_t bundle;		//BUNDLE_NONE for a file, BUNDLE_DIR for a directory's bundle, BUNDLE_MEMBER for a file of one
+   uint32_t verify;		//bytes per chunk of the hash tree the file is checked against, 0 for none (granted by server)
+   char name[FILE_NAME_MAX + 1];	//name to store the file under (SYN only), empty if none
+} SynParams;
+
+//range [start, end) of seqNums received above a hole, carried in ACK payloads
+typedef struct {
+   uint32_t start;		//first seqNum of the range
+   uint32_t end;		//one past the last seqNum of the range
+} SackBlock;
+
+//growable bitmap with one bit per seqNum
+typedef struct {
+   uint64_t *words;		//bit n lives in words[n / 64]
+   uint32_t nwords;		//number of allocated words
+} Bitmap;
+
+//one position in the send or receive window
+typedef struct {
+   Packet *pkt;			//packet in flight
+   char *data;			//payload of pkt, in pkt->payload or the mapped file (client only)
+   unsigned long long sentTime;	//time of last transmission in us (client only)
+   uint64_t delivered;		//packets delivered when this one was sent (client only)
+   unsigned long long deliveredTime;	//time delivered was reached, for delivery rate samples
+   int retransmitted;		//set once the packet has been resent, excludes it from RTT samples
+   TimerNode timer;		//retransmission or reordering deadline while in flight (client only)
+} Slot;
+
+//Transfer control block for the sliding window protocol
 typedef struct {
    uint32_t nextSeq;		//nextsequence to be sent by client
    uint32_t expectedSeq;	//expected seqNum for server 
+   uint32_t sendBase;		//oldest unacknowledged seqNum for client
+   uint32_t window;		//window size in packets
+   uint32_t payloadSize;	//payload bytes per full DATA packet
 
-   Packet currentPkt;		//client packet awaiting acknowledgement or last packet server has acknowledged
+   Slot *sendWin;		//client packets awaiting acknowledgement, indexed by seqNum % window
+   Bitmap seqMap;		//client: acknowledged seqNums, server: received seqNums
+   char *bufs;			//packet buffers of the window slots, sized for payloadSize
    
 } Tcb;
 
@@ -49,11 +119,14 @@ typedef struct {
 	FUNCTIONS
 */
 
-//initializes server state and handles initial connection with client 
-int initializeServer(Tcb *servTcb);
+//initializes server state for a receive window of window packets of up to payloadSize bytes
+int initializeServer(Tcb *servTcb, uint32_t window, uint32_t payloadSize);
 
-// intializes client state and handles connection with server
-int initializeClient(Tcb *clientTcb);
+// intializes client state and allocates a send window of window packets of up to payloadSize bytes
+int initializeClient(Tcb *clientTcb, uint32_t window, uint32_t payloadSize);
+
+//releases the windows allocated by initializeServer/initializeClient
+void releaseTcb(Tcb *tcb);
 
 //waits for SYN and sends SYNACK
 int serverConnect(int server_socket);
@@ -62,15 +135,93 @@ int serverConnect(int server_socket);
 int clientConnect(int client_socket, struct sockaddr* server_addr);
 
 
-//creates a packet with length l (size of payload), seqNum seq, ackNum ack, and flag flg 
+//creates a packet with length l (size of payload), seqNum seq, ackNum ack, and flag flg, connId is left 0
 void createPacket(Packet *pkt, uint32_t l, uint32_t seq, uint32_t ack, uint32_t flg);
 
 //converts packet header fields to host format
 void readPacket(Packet *pkt);
 
+//returns the bytes to send for a packet built by createPacket (header in network format)
+int packetSize(Packet *pkt);
+
+//returns the payload bytes packParams stores for params
+int paramsSize(SynParams *params);
+
+//stores handshake parameters in the payload of a SYN or SYN_ACK packet
+void packParams(Packet *pkt, SynParams *params);
+
+//reads handshake parameters from the payload of a SYN or SYN_ACK packet (already in host format)
+void unpackParams(Packet *pkt, SynParams *params);
+
+//stores count ranges of blocks the server already has after the parameters of a SYN_ACK,
+//the packet length has to include them
+void packExtents(Packet *pkt, SackBlock *blocks, int count);
+
+//reads the ranges of a SYN_ACK (already in host format) into blocks, returns the count
+int unpackExtents(Packet *pkt, SackBlock *blocks);
+
+//stores the time in us the ACK was held back and count SACK blocks in the payload
+//of an ACK packet, its length is ACK_INFO_SIZE + count * sizeof(SackBlock)
+void packAck(Packet *pkt, uint32_t delayUs, SackBlock *blocks, int count);
+
+//reads the delay and the SACK blocks of an ACK packet (already in host format),
+//returns the count
+int unpackAck(Packet *pkt, uint32_t *delayUs, SackBlock *blocks);
+
+//prepares an empty bitmap, returns -1 if it cannot be allocated
+int bitmapInit(Bitmap *map, uint32_t nbits);
+
+//releases the words of a bitmap
+void bitmapFree(Bitmap *map);
+
+//sets bit, growing the bitmap when needed
+void bitmapSet(Bitmap *map, uint32_t bit);
+
+//sets every bit in [start, end), returns how many were clear before
+uint32_t bitmapSetRange(Bitmap *map, uint32_t start, uint32_t end);
+
+//clears every bit in [start, end)
+void bitmapClearRange(Bitmap *map, uint32_t start, uint32_t end);
+
+//returns 1 if bit is set
+int bitmapTest(Bitmap *map, uint32_t bit);
+
+//returns the first set bit in [from, limit), or limit if there is none
+uint32_t bitmapNextSet(Bitmap *map, uint32_t from, uint32_t limit);
+
+//returns the first clear bit in [from, limit), or limit if there is none
+uint32_t bitmapNextClear(Bitmap *map, uint32_t from, uint32_t limit);
+
+//returns the first bit of the run of set bits ending at bit, no lower than floor
+uint32_t bitmapRunStart(Bitmap *map, uint32_t bit, uint32_t floor);
+
+//stores up to max runs of set bits in [from, limit) in blocks, lowest first, returns the count
+int bitmapRanges(Bitmap *map, uint32_t from, uint32_t limit, SackBlock *blocks, int max);
+
+//returns the time in us on the monotonic clock, only differences between calls mean anything
+unsigned long long nowUs(void);
+
+//as nowUs in ns
+unsigned long long nowNs(void);
+
 //Compute 32 bit checksum form "count" bytes beginning at location addr 
 unsigned int checksum(char *addr, unsigned int count );
 
+//extends crc with the CRC32C of len bytes at buf, using SSE4.2 when the CPU has it
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+//portable table driven CRC32C, same results as crc32c()
+uint32_t crc32cSoftware(uint32_t crc, const void *buf, size_t len);
+
+//stores the checksum of a packet built by createPacket, call once the payload is in place
+void sealPacket(Packet *pkt);
+
+//as sealPacket for a packet whose payload is sent from data instead of pkt->payload
+void sealPacketData(Packet *pkt, const char *data);
+
+//returns 1 if a received packet (still in network format) of len bytes is intact
+int verifyPacket(Packet *pkt, int len);
+
 #endif
 
 
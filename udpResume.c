@@ -0,0 +1,82 @@
+#include "udpResume.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+//bytes of a Resume that are saved with count ranges
+#define RESUME_BYTES(count)	(offsetof(Resume, extents) + (count) * sizeof(SackBlock))
+
+//a progress file is the magic word, the CRC32C of the rest, then the Resume
+typedef struct {
+   uint32_t magic;
+   uint32_t crc;
+} ResumeHeader;
+
+
+int resumePath(char *part, size_t size, char *path, int stripe)
+{
+   int len;
+
+   if (stripe < 0)
+      len = snprintf(part, size, "%s%s", path, RESUME_SUFFIX);
+   else
+      len = snprintf(part, size, "%s%s.%d", path, RESUME_SUFFIX, stripe);
+   return len < 0 || (size_t)len >= size ? -1 : 0;
+}
+
+int resumeLoad(Resume *res, char *part)
+{
+   ResumeHeader hdr;
+   ssize_t len;
+   int fh;
+
+   fh = open(part, O_RDONLY);
+   if (fh < 0)
+      return -1;
+   len = read(fh, &hdr, sizeof(hdr));
+   if (len == sizeof(hdr))
+      len = read(fh, res, sizeof(Resume));
+   close(fh);
+
+   //a torn or foreign file is ignored, the transfer starts over
+   if (len < (ssize_t)RESUME_BYTES(0) || hdr.magic != RESUME_MAGIC ||
+       res->count > RESUME_EXTENTS_MAX || len != (ssize_t)RESUME_BYTES(res->count) ||
+       crc32c(0, res, len) != hdr.crc || res->payloadSize < PAYLOAD_MIN ||
+       res->payloadSize > PAYLOAD_MAX)
+      return -1;
+   return 0;
+}
+
+int resumeSave(Resume *res, char *part)
+{
+   char tmp[PATH_MAX];
+   ResumeHeader hdr;
+   size_t len;
+   int ret;
+   int fh;
+
+   //written aside and renamed over the old one, a crash leaves one or the other
+   if (snprintf(tmp, sizeof(tmp), "%s.tmp", part) >= (int)sizeof(tmp))
+      return -1;
+   fh = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IREAD | S_IWRITE);
+   if (fh < 0)
+      return -1;
+   len = RESUME_BYTES(res->count);
+   hdr.magic = RESUME_MAGIC;
+   hdr.crc = crc32c(0, res, len);
+   ret = 0;
+   if (write(fh, &hdr, sizeof(hdr)) != sizeof(hdr) || write(fh, res, len) != (ssize_t)len ||
+       fsync(fh) < 0)
+      ret = -1;
+   if (close(fh) < 0 || (ret == 0 && rename(tmp, part) < 0))
+      ret = -1;
+   if (ret < 0)
+      unlink(tmp);
+   return ret;
+}
+
+void resumeRemove(char *part)
+{
+   unlink(part);
+}
@@ -0,0 +1,48 @@
+//udpResume Blocks of a partial file known to be on disk, kept next to it so a later connection can resume
+
+#ifndef UDPRESUME_H
+#define UDPRESUME_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "udpProtocol.h"
+
+#define RESUME_SUFFIX	".part"		//appended to the file name, then .stripe for a stripe
+#define RESUME_EXTENTS_MAX	1024	//ranges kept above the in-order edge, blocks past them are sent again
+#define RESUME_SYNC_US	5000000ULL	//interval between saves of a transfer that has made progress
+#define RESUME_MAGIC	0x52504455	//"UDPR", first word of a progress file
+
+/*
+	DATA STRUCTURES
+*/
+
+//progress of one transfer, the blocks it names were forced to disk before it was saved
+typedef struct {
+   uint64_t stamp;		//modification time of the sender's file in ns
+   uint64_t fileSize;		//bytes in the whole file
+   uint64_t offset;		//file offset of block 0, where the stripe starts
+   uint32_t payloadSize;	//bytes per block
+   uint32_t resume;		//every block below this seqNum is in the file
+   uint32_t count;		//ranges of blocks in the file above resume
+   SackBlock extents[RESUME_EXTENTS_MAX];	//those ranges, lowest first
+} Resume;
+
+
+/*
+	FUNCTIONS
+*/
+
+//builds the name of the progress file of path into part, stripe -1 when not striped,
+//returns -1 if it does not fit in size bytes
+int resumePath(char *part, size_t size, char *path, int stripe);
+
+//reads the progress file part, returns -1 if there is none or it is damaged
+int resumeLoad(Resume *res, char *part);
+
+//replaces the progress file part in one step and forces it to disk, returns -1 on a write error
+int resumeSave(Resume *res, char *part);
+
+//deletes the progress file part, once the file is complete or started over
+void resumeRemove(char *part);
+
+#endif
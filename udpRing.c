@@ -0,0 +1,187 @@
+#include "udpRing.h"
+
+#ifdef USE_URING
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+
+static int ringSetup(unsigned entries, struct io_uring_params *params)
+{
+   return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ringEnter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+   return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int ringRegisterOp(int fd, unsigned opcode, void *arg, unsigned nargs)
+{
+   return syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+int ringInit(Ring *ring, unsigned entries)
+{
+   struct io_uring_params params;
+   char *sq;
+   char *cq;
+
+   memset(ring, 0, sizeof(*ring));
+   memset(&params, 0, sizeof(params));
+   ring->eventFd = -1;
+   ring->fd = ringSetup(entries, &params);
+   if (ring->fd < 0)
+      return -1;
+
+   //the submission and completion rings share one mapping on newer kernels
+   ring->sqMapLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+   ring->cqMapLen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+   if (params.features & IORING_FEAT_SINGLE_MMAP)
+   {
+      if (ring->cqMapLen > ring->sqMapLen)
+         ring->sqMapLen = ring->cqMapLen;
+      ring->cqMapLen = 0;
+   }
+   ring->sqMap = mmap(NULL, ring->sqMapLen, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+   if (ring->sqMap == MAP_FAILED)
+   {
+      ring->sqMap = NULL;
+      ringFree(ring);
+      return -1;
+   }
+   ring->cqMap = ring->sqMap;
+   if (ring->cqMapLen > 0)
+   {
+      ring->cqMap = mmap(NULL, ring->cqMapLen, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+      if (ring->cqMap == MAP_FAILED)
+      {
+         ring->cqMap = NULL;
+         ringFree(ring);
+         return -1;
+      }
+   }
+   ring->sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
+   ring->sqes = mmap(NULL, ring->sqesLen, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+   if (ring->sqes == MAP_FAILED)
+   {
+      ring->sqes = NULL;
+      ringFree(ring);
+      return -1;
+   }
+
+   sq = ring->sqMap;
+   cq = ring->cqMap;
+   ring->entries = params.sq_entries;
+   ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+   ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+   ring->sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+   ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+   ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+   ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+   ring->cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+   ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+   ring->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (ring->eventFd < 0 ||
+       ringRegisterOp(ring->fd, IORING_REGISTER_EVENTFD, &ring->eventFd, 1) < 0)
+   {
+      ringFree(ring);
+      return -1;
+   }
+   return 0;
+}
+
+int ringRegister(Ring *ring, void *base, size_t len)
+{
+   struct iovec iov;
+
+   iov.iov_base = base;
+   iov.iov_len = len;
+   return ringRegisterOp(ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0 ? -1 : 0;
+}
+
+struct io_uring_sqe *ringSqe(Ring *ring)
+{
+   struct io_uring_sqe *sqe;
+   unsigned tail;
+
+   tail = *ring->sqTail;
+   if (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->entries)
+   {
+      if (ringSubmit(ring, 0) < 0)
+         return NULL;
+      tail = *ring->sqTail;
+   }
+
+   //entries map one to one onto sqes, the array is the identity
+   sqe = &ring->sqes[tail & ring->sqMask];
+   memset(sqe, 0, sizeof(*sqe));
+   ring->sqArray[tail & ring->sqMask] = tail & ring->sqMask;
+   __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+   ring->queued++;
+   return sqe;
+}
+
+int ringSubmit(Ring *ring, unsigned wait)
+{
+   int ret;
+
+   do
+      ret = ringEnter(ring->fd, ring->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+   while (ret < 0 && errno == EINTR);
+   if (ret < 0)
+      return -1;
+   ring->queued -= ret < (int)ring->queued ? ret : ring->queued;
+   return 0;
+}
+
+int ringNext(Ring *ring, uint64_t *userData, int *res)
+{
+   struct io_uring_cqe *cqe;
+   unsigned head;
+
+   head = *ring->cqHead;
+   if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+      return 0;
+   cqe = &ring->cqes[head & ring->cqMask];
+   *userData = cqe->user_data;
+   *res = cqe->res;
+   __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+   return 1;
+}
+
+void ringClearEvent(Ring *ring)
+{
+   uint64_t count;
+
+   while (read(ring->eventFd, &count, sizeof(count)) > 0)
+      ;
+}
+
+void ringFree(Ring *ring)
+{
+   if (ring->sqes != NULL)
+      munmap(ring->sqes, ring->sqesLen);
+   if (ring->cqMap != NULL && ring->cqMap != ring->sqMap)
+      munmap(ring->cqMap, ring->cqMapLen);
+   if (ring->sqMap != NULL)
+      munmap(ring->sqMap, ring->sqMapLen);
+   if (ring->eventFd >= 0)
+      close(ring->eventFd);
+   if (ring->fd >= 0)
+      close(ring->fd);
+   memset(ring, 0, sizeof(*ring));
+   ring->fd = -1;
+   ring->eventFd = -1;
+}
+
+#endif
@@ -0,0 +1,68 @@
+//udpRing Minimal io_uring on raw system calls, built in with -DUSE_URING
+
+#ifndef UDPRING_H
+#define UDPRING_H
+
+#ifdef USE_URING
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+#define RING_ENTRIES	64		//submission queue entries, completions get twice as many
+
+/*
+	DATA STRUCTURES
+*/
+
+//one io_uring instance with its queues mapped into this process
+typedef struct {
+   int fd;			//ring file descriptor
+   int eventFd;			//readable once completions are posted, for select()
+   unsigned entries;		//submission queue entries
+   unsigned *sqHead;		//advanced by the kernel as it consumes entries
+   unsigned *sqTail;		//advanced here as entries are queued
+   unsigned sqMask;
+   unsigned *sqArray;		//submission queue, indexes into sqes
+   struct io_uring_sqe *sqes;
+   unsigned *cqHead;		//advanced here as completions are consumed
+   unsigned *cqTail;		//advanced by the kernel as it posts completions
+   unsigned cqMask;
+   struct io_uring_cqe *cqes;
+   unsigned queued;		//entries queued since the last ringSubmit
+   void *sqMap;			//mappings released by ringFree
+   size_t sqMapLen;
+   void *cqMap;
+   size_t cqMapLen;
+   size_t sqesLen;
+} Ring;
+
+
+/*
+	FUNCTIONS
+*/
+
+//sets up a ring of entries submissions with an eventfd for completions, returns -1 if the kernel lacks io_uring
+int ringInit(Ring *ring, unsigned entries);
+
+//registers len bytes at base as fixed buffer 0 for the READ_FIXED and WRITE_FIXED opcodes, returns -1 on failure
+int ringRegister(Ring *ring, void *base, size_t len);
+
+//returns the next submission entry zeroed, submitting the queue first when it is full
+struct io_uring_sqe *ringSqe(Ring *ring);
+
+//submits the queued entries and waits for at least wait completions, returns -1 on failure
+int ringSubmit(Ring *ring, unsigned wait);
+
+//takes the oldest completion, returns 0 if there is none
+int ringNext(Ring *ring, uint64_t *userData, int *res);
+
+//empties the eventfd once its completions have been taken
+void ringClearEvent(Ring *ring);
+
+//releases the ring and its mappings
+void ringFree(Ring *ring);
+
+#endif
+
+#endif
@@ -8,12 +8,18 @@
 //=    4) Ignore build warnings on implicit declarations of functions.        =
 //=---------------------------------------------------------------------------=
 //=  Example execution: (./udpServer 0)           =
-//=    Starting file receive...                                              =
-//=    File receive is complete                                              =
+//=    Receiving files on port 1050...                                       =
+//=    Received 'sendFile.dat' (1000000 bytes)                               =
 //=---------------------------------------------------------------------------=
-//=  Build: gcc udpServer.c udpProtocol.c -lnsl for BSD                                   
+//=  Build: gcc udpServer.c udpProtocol.c udpBatch.c udpStorage.c udpRing.c  
+//=         udpConn.c udpFec.c udpCompress.c udpResume.c udpDelta.c          
+//=         udpImpair.c udpMetrics.c udpTimer.c udpAck.c udpBundle.c        
+//=         udpMerkle.c -lz                                                   
+//=         -lpthread -lnsl                                                   
+//=         (add -DUSE_URING for io_uring writes)                            
 //=---------------------------------------------------------------------------=
-//=  Execute: ./udpServer [packetLoss?0:1]                                                     
+//=  Execute: ./udpServer [packetLoss?0:1] [-b batchSize] [-g] [-d dir]       
+//=           [-n transfers] [-t workers] [-s] [-a] [-I faults] [-E target]  
 //=---------------------------------------------------------------------------=
 //=  Author: Justin Bramel                                                    =
 //=          University of South Florida                                      =
@@ -22,6 +28,7 @@
 //=  History:  11/27/2017 - Final version                                     =
 //=============================================================================
 #define  BSD              // WIN for Winsock and BSD for BSD sockets
+#define  _GNU_SOURCE      // Needed for sendmmsg() and recvmmsg()
 
 //----- Include files ---------------------------------------------------------
 #include <stdio.h>          // Needed for printf()
@@ -30,7 +37,17 @@
 #include <fcntl.h>          // Needed for file i/o constants
 #include <string.h>         // Used for strcpy()
 #include <ctype.h>
+#include <unistd.h>         // Needed for getopt(), write() and close()
+#include <pthread.h>        // Needed for the worker threads
 #include "udpProtocol.h"
+#include "udpBatch.h"
+#include "udpStorage.h"
+#include "udpConn.h"
+#include "udpResume.h"
+#include "udpDelta.h"
+#include "udpMetrics.h"
+#include "udpAck.h"
+#include "udpMerkle.h"
 #ifdef WIN
   #include <windows.h>      // Needed for all Winsock stuff
   #include <io.h>           // Needed for open(), close(), and eof()
@@ -45,39 +62,546 @@
   #include <netdb.h>        // Needed for sockets stuff
   #include <sys/uio.h>      // Needed for open(), close(), and eof()
   #include <sys/stat.h>     // Needed for file i/o constants
+  #include <sys/epoll.h>    // Needed for epoll_wait()
+  #include <sys/timerfd.h>  // Needed for the idle connection and ACK timers
+  #include <limits.h>       // Needed for PATH_MAX
 #endif
 
 //----- Defines ---------------------------------------------------------------
 #define  PORT_NUM   1050            // Arbitrary port number for the server
 #define  SIZE        512            // Buffer size
-#define  RECV_FILE  "recvFile.dat"  // File name of received file
-#define DISCARD_RATE 0.02           // Discard rate (from 0.0 to 1.0)
+#define  RECV_FILE  "recvFile.dat"  // File name when the client sends none
+#define  DRAIN_MAX   16             // Batches taken per epoll wakeup
+
+//----- Worker state ----------------------------------------------------------
+typedef struct {
+  pthread_t            thread;          // Thread running the worker (not worker 0)
+  int                  index;           // Worker number, 0 to workers - 1
+  int                  workers;         // Workers sharing the port
+  int                  sock;            // This worker's SO_REUSEPORT socket
+  int                  cpu;             // CPU to run on, -1 for any
+  char                *dirName;         // Directory received files go to
+  Impair               impair;          // Faults applied to the packets sent
+  MetricsExport       *metrics;         // Export listing the transfers, NULL for none
+  int                  batchSize;       // Datagrams per syscall
+  int                  gro;             // Use UDP receive offload
+  int                  transfers;       // Files to receive in all, 0 for no limit
+  int                  numCorrupt;      // Packets dropped for a bad checksum
+  int                  numStray;        // Packets of no known connection
+} Worker;
+
+static int numDone;                     // Files finished by all workers together
 
 //----- Prototypes ------------------------------------------------------------
-int recvFile(char *fileName, int portNum, int maxSize, int options);
+int recvFiles(char *dirName, int portNum, int maxSize, Impair *impair,
+              MetricsExport *metrics,
+              int batchSize, int gro, int transfers, int workers, int steer,
+              int affinity);
+static void *serveWorker(void *arg);
+
+//===== Collect SACK blocks for the ranges received above expectedSeq =========
+static int buildSack(Tcb *tcb, uint32_t seq, uint32_t highSeq, SackBlock *blocks)
+{
+  uint32_t             from;            // Start of the next range
+  uint32_t             end;             // End of the next range
+  int                  count;           // Blocks collected so far
+
+  count = 0;
+
+  // The range holding the packet just received goes first
+  if (seq > tcb->expectedSeq && seq < highSeq)
+  {
+    blocks[0].start = bitmapRunStart(&tcb->seqMap, seq, tcb->expectedSeq);
+    blocks[0].end = bitmapNextClear(&tcb->seqMap, seq, highSeq);
+    count = 1;
+  }
+
+  // Then the lowest ranges, they border the holes the sender must fill first
+  from = tcb->expectedSeq;
+  while (count < SACK_MAX)
+  {
+    from = bitmapNextSet(&tcb->seqMap, from, highSeq);
+    if (from == highSeq)
+      break;
+    end = bitmapNextClear(&tcb->seqMap, from, highSeq);
+    if (count == 0 || from != blocks[0].start)
+    {
+      blocks[count].start = from;
+      blocks[count].end = end;
+      count++;
+    }
+    from = end;
+  }
+
+  return count;
+}
+
+//===== Check whether the workers together received enough files ============
+static int allDone(Worker *self)
+{
+  return self->transfers > 0 &&
+         __atomic_load_n(&numDone, __ATOMIC_RELAXED) >= self->transfers;
+}
+
+//===== Drop a connection refused once its file is open =======================
+// Nothing of it arrived, so no progress is saved and a file made for it goes
+// again - fresh is NULL for a resumed or striped file, which keeps its blocks
+static void refuseConn(ConnTable *table, Conn *conn, char *fresh)
+{
+  storeClose(&conn->store);
+  if (fresh != NULL)
+    unlink(fresh);
+  conn->finished = 1;
+  connRemove(table, conn);
+}
+
+//===== Open the connection a SYN asks for ====================================
+static Conn *acceptConn(ConnTable *table, struct sockaddr_in *addr,
+                        SynParams *params, char *dirName, MetricsExport *metrics,
+                        TimerWheel *acks, unsigned long long now)
+{
+  Conn                *conn;            // Connection being opened
+  Conn                *other;           // Unfinished connection writing the same file
+  char                *name;            // Last path component of the requested name
+  char                 path[PATH_MAX];  // File created for the connection
+  char                 part[PATH_MAX];  // Its progress file
+  char                 spool[PATH_MAX]; // Spool file of a directory's bundle
+  char                *fresh;           // File opened empty, NULL for one written in place
+  Resume               res;             // Progress of an earlier connection
+  struct stat          st;              // The file, if it is there
+  int                  resumed;         // Set when the connection picks up res
+  int                  taken;           // Set when another upload writes the file name
+  int                  basis;           // Old version of the file for a delta transfer, or -1
+  uint32_t             i;               // Range of res
+
+  // A repeated SYN gets the connection its first copy opened
+  conn = connFindSyn(table, addr);
+  if (conn != NULL)
+    return conn;
+  conn = connAdd(table, addr);
+  if (conn == NULL)
+    return NULL;
+
+  // Nothing is written outside dirName, and two uploads of one name at a
+  // time get files of their own - the stripes of a session share one. A
+  // file streamed apart from its directory's bundle keeps its path below
+  // dirName, the directories on the way are created
+  name = strrchr(params->name, '/') ? strrchr(params->name, '/') + 1 : params->name;
+  if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    name = RECV_FILE;
+  if (params->bundle == BUNDLE_MEMBER)
+  {
+    if (!bundlePathValid(params->name) || bundleMakeParents(dirName, params->name) < 0)
+    {
+      printf("  *** ERROR - unable to create '%s' \n", params->name);
+      conn->finished = 1;
+      connRemove(table, conn);
+      return NULL;
+    }
+    name = params->name;
+  }
+  conn->session = params->session;
+  conn->stripe = params->stripe;
+
+  // A client that restarts finds its old connection silent, that one gives
+  // way and saves its progress on the way out. The name is claimed against
+  // every worker, an upload another one already writes gets a file of its own
+  while ((other = connFindName(table, name, conn->session)) != NULL &&
+         now - other->lastUs >= CONN_STALE_US)
+    connRemove(table, other);
+  snprintf(conn->name, sizeof(conn->name), "%s", name);
+  taken = connClaimName(conn) < 0;
+  if (taken)
+  {
+    snprintf(conn->name, sizeof(conn->name), "%s.%u", name, conn->id);
+    connClaimName(conn);
+  }
+  snprintf(path, sizeof(path), "%s/%s", dirName, conn->name);
+
+  // A directory's bundle lands in a spool file next to it, read back by the
+  // threads creating its files - it is neither resumed nor sent as a delta
+  if (params->bundle == BUNDLE_DIR &&
+      snprintf(spool, sizeof(spool), "%s%s", path, BUNDLE_SUFFIX) >= (int)sizeof(spool))
+  {
+    printf("  *** ERROR - unable to create '%s' \n", path);
+    conn->finished = 1;
+    connRemove(table, conn);
+    return NULL;
+  }
+
+  // A regular file sent without compression can be resumed, from the
+  // progress an earlier connection saved for the same version of it - the
+  // blocks keep their size and place, the rest is sent again
+  resumed = 0;
+  if (resumePath(part, sizeof(part), path, conn->session ? (int)conn->stripe : -1) < 0)
+    part[0] = '\0';
+  if (part[0] != '\0' && params->fileSize > 0 && params->stamp != 0 &&
+      params->codec == CODEC_NONE && params->bundle != BUNDLE_DIR && stat(path, &st) == 0 && resumeLoad(&res, part) == 0)
+    resumed = res.stamp == params->stamp && res.fileSize == params->fileSize &&
+              res.offset == params->offset && res.payloadSize <= params->payload;
+  if (!resumed && part[0] != '\0')
+    resumeRemove(part);
+
+  // A delta transfer rebuilds the file aside from the old version already
+  // here, the client sends only what the signature of that one lacks
+  basis = -1;
+  if (params->delta != 0 && !resumed && conn->session == 0 && !taken &&
+      params->bundle != BUNDLE_DIR &&
+      params->fileSize > 0 && stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_size >= deltaBlockSize(st.st_size) &&
+      snprintf(conn->deltaPath, sizeof(conn->deltaPath), "%s%s", path,
+               DELTA_SUFFIX) < (int)sizeof(conn->deltaPath))
+    basis = open(path, O_RDONLY);
+  if (basis >= 0 && deltaSignature(&conn->sig, basis, st.st_size,
+                                   deltaBlockSize(st.st_size)) < 0)
+  {
+    printf("  *** WARNING - unable to read '%s', sending it whole \n", path);
+    close(basis);
+    basis = -1;
+  }
+  if (basis < 0)
+    conn->deltaPath[0] = '\0';
+
+  // Reserve the whole file up front, blocks land at seqNum * payload from
+  // the start of the stripe
+  fresh = conn->session == 0 && !resumed ?
+          (params->bundle == BUNDLE_DIR ? spool : basis >= 0 ? conn->deltaPath : path) : NULL;
+  if (initializeServer(&conn->tcb, params->window,
+                       resumed ? res.payloadSize : params->payload) < 0 ||
+      (fresh != NULL ? storeOpen(&conn->store, fresh) :
+       storeOpenShared(&conn->store, path, params->offset)) < 0)
+  {
+    printf("  *** ERROR - unable to create '%s' \n", path);
+    if (basis >= 0)
+      close(basis);
+    conn->finished = 1;
+    connRemove(table, conn);
+    return NULL;
+  }
+  if (storeReserve(&conn->store, params->fileSize, conn->tcb.payloadSize) < 0)
+  {
+    printf("  *** ERROR - no space for a %llu byte file \n",
+           (unsigned long long)params->fileSize);
+    if (basis >= 0)
+      close(basis);
+    refuseConn(table, conn, fresh);
+    return NULL;
+  }
+  if (params->bundle == BUNDLE_DIR)
+  {
+    storeDirect(&conn->store);
+    conn->unpack = malloc(sizeof(Unpacker));
+    if (conn->unpack == NULL || bundleUnpack(conn->unpack, spool, path) < 0)
+    {
+      printf("  *** ERROR - unable to create '%s' \n", path);
+      free(conn->unpack);
+      conn->unpack = NULL;
+      refuseConn(table, conn, fresh);
+      return NULL;
+    }
+  }
+
+  // FEC is granted as asked when the code is usable, otherwise left off
+  if (params->fecData != 0 &&
+      fecDecoderInit(&conn->fec, params->fecData, params->fecParity,
+                     conn->tcb.payloadSize, conn->tcb.window) < 0)
+    printf("  *** WARNING - FEC %u:%u refused for '%s' \n", params->fecData,
+           params->fecParity, conn->name);
+
+  // Compressed and delta payloads wait in a window sized ring for the ones
+  // before them, copy frames read the old version
+  if ((params->codec != CODEC_NONE || basis >= 0) &&
+      decompressInit(&conn->decomp, params->codec, conn->tcb.window,
+                     conn->tcb.payloadSize) < 0)
+  {
+    printf("  *** WARNING - codec %u refused for '%s' \n", params->codec, conn->name);
+    if (basis >= 0)
+    {
+      close(basis);
+      refuseConn(table, conn, fresh);
+      return NULL;
+    }
+  }
+  if (basis >= 0)
+  {
+    decompressBasis(&conn->decomp, basis);
+    printf("Delta of '%s' against %llu bytes (%u blocks of %u)\n", conn->name,
+           (unsigned long long)st.st_size, conn->sig.count, conn->sig.blockSize);
+  }
+
+  // Without compression progress is saved from now on, resumed from a FEC
+  // group boundary so the client's groups line up with the decoder's
+  if (params->fileSize > 0 && params->stamp != 0 && !conn->decomp.framed)
+  {
+    snprintf(conn->part, sizeof(conn->part), "%s", part);
+    conn->stamp = params->stamp;
+    conn->savedUs = now;
+  }
+  if (resumed)
+  {
+    conn->tcb.expectedSeq = res.resume;
+    if (conn->fec.groups != NULL)
+      conn->tcb.expectedSeq -= res.resume % conn->fec.dataCount;
+    conn->highSeq = conn->tcb.expectedSeq;
+    for (i = 0; i < res.count; i++)
+    {
+      if (res.extents[i].start < conn->tcb.expectedSeq || res.extents[i].start >= res.extents[i].end)
+        continue;
+      bitmapSetRange(&conn->tcb.seqMap, res.extents[i].start, res.extents[i].end);
+      if (res.extents[i].end > conn->highSeq)
+        conn->highSeq = res.extents[i].end;
+    }
+    printf("Resuming '%s' at block %u (%u ranges above it)\n", conn->name,
+           conn->tcb.expectedSeq, res.count);
+  }
+
+  // A file checked against the client's hash tree is hashed as it lands, read
+  // back by the tree's threads - so its writes are made before they return
+  if (params->verify >= MERKLE_CHUNK_MIN && params->verify <= MERKLE_CHUNK_MAX &&
+      params->fileSize > 0 && conn->session == 0 && basis < 0 &&
+      params->bundle != BUNDLE_DIR)
+  {
+    conn->tree = malloc(sizeof(Merkle));
+    if (conn->tree == NULL || merkleInit(conn->tree, params->fileSize, params->verify) < 0 ||
+        merkleStart(conn->tree, path, MERKLE_THREADS) < 0)
+    {
+      printf("  *** WARNING - verification refused for '%s' \n", conn->name);
+      if (conn->tree != NULL)
+        merkleFree(conn->tree);
+      free(conn->tree);
+      conn->tree = NULL;
+    }
+    else
+    {
+      storeDirect(&conn->store);
+      merkleAvail(conn->tree, (uint64_t)conn->tcb.expectedSeq * conn->tcb.payloadSize);
+    }
+  }
+  metricsAdd(metrics, &conn->metrics, "recv", conn->name, conn->id);
+  METRIC_SET(conn->metrics.window, conn->tcb.window);
+  ackInit(&conn->ack, acks, params->ackEvery, params->ackDelay, conn->tcb.window);
+  return conn;
+}
+
+//===== Queue a reply to the client of a connection ===========================
+static void queueReply(SendBatch *batch, Conn *conn, Packet *pkt)
+{
+  pkt->connId = htonl(conn->id);
+  sealPacket(pkt);
+  METRIC_ADD(conn->metrics.pktsSent, 1);
+  METRIC_ADD(conn->metrics.bytesSent, packetSize(pkt));
+  batchAdd(batch, pkt, packetSize(pkt), &conn->addr);
+}
+
+//===== Queue an ACK of DATA packet seq and everything received before it =====
+static void queueAck(SendBatch *batch, Conn *conn, Packet *pkt, uint32_t seq,
+                     unsigned long long now)
+{
+  SackBlock            sack[SACK_MAX];  // Ranges received above expectedSeq
+  int                  count;           // Number of SACK blocks
+
+  count = buildSack(&conn->tcb, seq, conn->highSeq, sack);
+  createPacket(pkt, ACK_INFO_SIZE + count * sizeof(SackBlock), seq,
+               conn->tcb.expectedSeq, ACK);
+  packAck(pkt, ackSent(&conn->ack, now), sack, count);
+  queueReply(batch, conn, pkt);
+}
+
+//===== Queue the ACKs held back until now ====================================
+static void flushAcks(TimerWheel *acks, SendBatch *batch, Packet *replies,
+                      unsigned long long now)
+{
+  TimerNode           *node;            // Deadline that expired
+  Conn                *conn;            // Connection holding it
+
+  while ((node = timerPop(acks, now)) != NULL)
+  {
+    conn = (Conn *)((char *)node - offsetof(Conn, ack.timer));
+    queueAck(batch, conn, &replies[batch->count], conn->ack.lastSeq, now);
+  }
+}
+
+//===== Set a timerfd to fire once at time us on the monotonic clock ==========
+static void timerfdAt(int fd, unsigned long long us)
+{
+  struct itimerspec    at;              // Expiry, without an interval
+
+  // A zero expiry would disarm it instead
+  memset(&at, 0, sizeof(at));
+  at.it_value.tv_sec = us / 1000000;
+  at.it_value.tv_nsec = us % 1000000 * 1000 + 1;
+  timerfd_settime(fd, TFD_TIMER_ABSTIME, &at, NULL);
+}
+
+//===== Write the blocks a connection has queued, timing the write ============
+static int flushConn(Conn *conn)
+{
+  unsigned long long   start;           // Time the write started
+  int                  ret;             // Return code of storeFlush()
+
+  start = nowUs();
+  ret = storeFlush(&conn->store);
+  histAdd(&conn->metrics.write, nowUs() - start);
+  return ret;
+}
 
-double rand_val(void)
+//===== Bytes from the start of a connection's stream written in order ========
+static uint64_t inOrderBytes(Conn *conn)
 {
-  const long  a =      16807;  // Multiplier
-  const long  m = 2147483647;  // Modulus
-  const long  q =     127773;  // m div a
-  const long  r =       2836;  // m mod a
-  static long x = 1;           // Random int value (seed is set to 1)
-  long        x_div_q;         // x divided by q
-  long        x_mod_q;         // x modulo q
-  long        x_new;           // New x value
-
-  // RNG using integer arithmetic
-  x_div_q = x / q;
-  x_mod_q = x % q;
-  x_new = (a * x_mod_q) - (r * x_div_q);
-  if (x_new > 0)
-    x = x_new;
+  uint64_t             bytes;           // Bytes of the blocks below expectedSeq
+
+  if (conn->decomp.framed)
+    return conn->decomp.rawPos;
+  bytes = (uint64_t)conn->tcb.expectedSeq * conn->tcb.payloadSize;
+  return bytes < conn->store.end ? bytes : conn->store.end;
+}
+
+//===== Queue a new DATA packet for its place in the file =====================
+static int acceptData(Conn *conn, uint32_t seq, char *data, int len,
+                      Conn **dirty, int *numDirty)
+{
+  char                *block;           // Block inflated from the frames
+  uint64_t             pos;             // Its offset in the file
+  int                  ret;             // Its length
+
+  //compressed and delta payloads are a stream of frames, kept until they are in order
+  if (conn->decomp.framed)
+    decompressPut(&conn->decomp, seq, data, len);
+  else if (storeWrite(&conn->store, seq, data, len) < 0)
+  {
+    //the client will time out, the rest of the server carries on
+    printf("  *** ERROR - unable to write '%s' \n", conn->name);
+    conn->failed = 1;
+    return -1;
+  }
+  if (!conn->dirty)
+  {
+    conn->dirty = 1;
+    dirty[(*numDirty)++] = conn;
+  }
+  conn->unsaved = 1;
+  bitmapSet(&conn->tcb.seqMap, seq);
+  if (seq >= conn->highSeq)
+    conn->highSeq = seq + 1;
+  conn->tcb.expectedSeq = bitmapNextClear(&conn->tcb.seqMap,
+      conn->tcb.expectedSeq, conn->highSeq);
+  METRIC_SET(conn->metrics.oooDepth, conn->highSeq - conn->tcb.expectedSeq);
+  if (conn->metrics.oooDepth > conn->metrics.oooMax)
+    METRIC_SET(conn->metrics.oooMax, conn->metrics.oooDepth);
+  if (!conn->decomp.framed)
+    return 0;
+
+  //the packets now in order may complete frames, the decompressor reuses
+  //its buffers for the next one so each block is written right away
+  while ((ret = decompressNext(&conn->decomp, conn->tcb.expectedSeq, &block, &pos)) > 0)
+  {
+    if (storeWriteAt(&conn->store, pos, block, ret) < 0 || flushConn(conn) < 0)
+    {
+      printf("  *** ERROR - unable to write '%s' \n", conn->name);
+      conn->failed = 1;
+      return -1;
+    }
+  }
+  if (ret < 0)
+  {
+    printf("  *** ERROR - malformed compressed block in '%s' \n", conn->name);
+    conn->failed = 1;
+    return -1;
+  }
+  return 0;
+}
+
+//===== Put a delta rebuild in place of the old version =======================
+static void replaceBasis(Conn *conn, int closed, uint32_t crc)
+{
+  char                 path[PATH_MAX];  // File the rebuild replaces
+
+  snprintf(path, sizeof(path), "%s", conn->deltaPath);
+  path[strlen(path) - strlen(DELTA_SUFFIX)] = '\0';
+  if (closed && conn->decomp.crc != crc)
+    printf("  *** ERROR - '%s' does not match the sender's copy, the old version is kept \n",
+           conn->name);
+  else if (closed && rename(conn->deltaPath, path) < 0)
+    printf("  *** ERROR - unable to replace '%s' \n", conn->name);
+  else if (closed)
+    conn->deltaPath[0] = '\0';
+  if (conn->deltaPath[0] != '\0')
+    unlink(conn->deltaPath);
+  conn->deltaPath[0] = '\0';
+}
+
+//===== Keep all but the chunks that differ as the progress of a file =========
+static void takeBack(Conn *conn)
+{
+  Merkle              *tree;            // Hash tree of the file
+  uint32_t             leaf;            // Chunk that differs from the client's
+  uint32_t             chunks;          // Chunks taken back
+  uint64_t             end;             // One past the last byte of the chunk
+  uint32_t             first;           // First block holding any of it
+  int                  saved;           // Set once the progress file is written
+
+  // The blocks of those chunks are missing again, a block straddling two
+  // chunks is sent again for either - every other block is held, even
+  // those below a resume point the map never saw
+  tree = conn->tree;
+  chunks = 0;
+  bitmapSetRange(&conn->tcb.seqMap, 0, conn->tcb.expectedSeq);
+  for (leaf = bitmapNextSet(&conn->redo, 0, tree->counts[0]); leaf < tree->counts[0];
+       leaf = bitmapNextSet(&conn->redo, leaf + 1, tree->counts[0]))
+  {
+    end = (uint64_t)(leaf + 1) * tree->chunk < tree->size ?
+          (uint64_t)(leaf + 1) * tree->chunk : tree->size;
+    first = (uint64_t)leaf * tree->chunk / conn->tcb.payloadSize;
+    bitmapClearRange(&conn->tcb.seqMap, first,
+                     (end + conn->tcb.payloadSize - 1) / conn->tcb.payloadSize);
+    if (first < conn->tcb.expectedSeq)
+      conn->tcb.expectedSeq = first;
+    chunks++;
+  }
+
+  // The next connection for the same version of the file resumes from there
+  conn->unsaved = 1;
+  saved = connSave(conn) == 0;
+  if (storeClose(&conn->store) < 0)
+    saved = 0;
+  conn->finished = 1;
+  connReleaseName(conn);
+  conn->mismatch = saved ? 2 : 3;
+  if (saved)
+    printf("Kept '%s' but the %u chunks that differ, for the client to send again\n",
+           conn->name, chunks);
   else
-    x = x_new + m;
+    printf("  *** ERROR - unable to save the progress of '%s' \n", conn->name);
+}
+
+//===== Queue the DATA packets FEC rebuilt, returns the last seqNum queued or -1
+static int64_t acceptRebuilt(Conn *conn, FecRebuilt *rebuilt, int count,
+                             Conn **dirty, int *numDirty)
+{
+  int64_t              last;            // Last seqNum queued, -1 for none
+  int                  i;               // Rebuilt packet
 
-  // Return a random value between 0.0 and 1.0
-  return((double) x / m);
+  last = -1;
+  for (i = 0; i < count; i++)
+  {
+    if (rebuilt[i].seq - conn->tcb.expectedSeq >= conn->tcb.window ||
+        bitmapTest(&conn->tcb.seqMap, rebuilt[i].seq))
+      continue;
+    if (acceptData(conn, rebuilt[i].seq, rebuilt[i].data, rebuilt[i].len,
+                   dirty, numDirty) < 0)
+      return -1;
+    last = rebuilt[i].seq;
+  }
+
+  //the decoder may hand the buffers to a later group before this batch is
+  //flushed, so the rebuilt blocks are written right away
+  if (last >= 0 && flushConn(conn) < 0)
+  {
+    printf("  *** ERROR - unable to write '%s' \n", conn->name);
+    conn->failed = 1;
+    return -1;
+  }
+  return last;
 }
 
 //===== Main program ==========================================================
@@ -86,23 +610,96 @@ int main(int argc, char *argv[])
   int                  portNum;         // Port number to receive on
   int                  maxSize;         // Maximum allowed size of file
   int                  timeOut;         // Timeout in seconds
-  int                  options;         // Options
+  int                  emul;            // Emulate packet loss or not
+  Impair               impair;          // Faults applied to the packets sent
+  char                *exportTarget;    // Where metrics go, NULL for nowhere
+  MetricsExport        metrics;         // Exports the metrics of every transfer
+  int                  batchSize;       // Datagrams per syscall
+  int                  gro;             // Use UDP receive offload
+  char                *dirName;         // Directory received files go to
+  int                  transfers;       // Transfers to serve, 0 for no limit
+  int                  workers;         // Worker threads
+  int                  steer;           // Steer packets by connection ID
+  int                  affinity;        // Pin workers to CPUs
+  int                  opt;             // Current getopt() option
   int                  retcode;         // Return code
   
-  if(argc != 2){
+  // Parse optional flags, getopt() moves them ahead of the positional args
+  batchSize = BATCH_DEFAULT;
+  gro = 0;
+  dirName = ".";
+  transfers = 0;
+  workers = 1;
+  steer = 0;
+  affinity = 0;
+  impairInit(&impair);
+  exportTarget = NULL;
+  opt = 0;
+  while (opt != -1)
+  {
+    opt = getopt(argc, argv, "b:gd:n:t:saI:E:");
+    if (opt == 'b')
+      batchSize = atoi(optarg);
+    else if (opt == 'g')
+      gro = 1;
+    else if (opt == 'd')
+      dirName = optarg;
+    else if (opt == 'n')
+      transfers = atoi(optarg);
+    else if (opt == 't')
+      workers = atoi(optarg);
+    else if (opt == 's')
+      steer = 1;
+    else if (opt == 'a')
+      affinity = 1;
+    else if (opt == 'I')
+    {
+      if (impairParse(&impair, optarg) < 0)
+        argc = 0;
+    }
+    else if (opt == 'E')
+      exportTarget = optarg;
+    else if (opt != -1)
+      argc = 0;                       // Force the usage message
+  }
+
+  if(argc - optind != 1){
     printf("Usage: 'projectServer emul' where emul is whether to emulate or\n");
     printf("        not a packet loss                                      \n");
+    printf("  -b batchSize  datagrams per recvmmsg()/sendmmsg() call       \n");
+    printf("  -g            receive coalesced datagrams with UDP GRO       \n");
+    printf("  -d dir        directory to store received files in (.)      \n");
+    printf("  -n transfers  exit after this many files (default: never)   \n");
+    printf("  -t workers    threads, each with a SO_REUSEPORT socket       \n");
+    printf("  -s            steer each connection to one worker with BPF   \n");
+    printf("  -a            pin worker n to CPU n                          \n");
+    printf("  -I faults     emulate a network on the packets sent, as the  \n");
+    printf("                client's -I (emul 1 is loss=0.02)              \n");
+    printf("  -E target     export metrics each second to a file, JSON if  \n");
+    printf("                it ends in .json, or to unix:socketPath        \n");
     return (0);
   }
 
   // Initialize parameters
   portNum = PORT_NUM;
   maxSize = 0;           // This parameter is unused in this implementation
-  options = atoi(argv[1]);     
+  emul = atoi(argv[optind]);
+  if (emul == 1 && !impairActive(&impair))
+    impairParse(&impair, IMPAIR_LEGACY);
+
+  if (exportTarget != NULL && metricsStart(&metrics, exportTarget, METRICS_INTERVAL_MS) < 0)
+  {
+    printf("  *** ERROR - unable to export metrics to '%s' \n", exportTarget);
+    exit(1);
+  }
 
-  // Receive the file
-  printf("Starting file receive... \n");
-  retcode = recvFile(RECV_FILE, portNum, maxSize, options);
+  // Receive files until enough transfers have finished
+  printf("Receiving files on port %d... \n", portNum);
+  retcode = recvFiles(dirName, portNum, maxSize, &impair,
+                      exportTarget ? &metrics : NULL, batchSize, gro,
+                      transfers, workers, steer, affinity);
+  if (exportTarget != NULL)
+    metricsStop(&metrics);
   printf("File receive is complete \n");
 
   // Return
@@ -110,24 +707,34 @@ int main(int argc, char *argv[])
 }
 
 //=============================================================================
-//=  Function to receive a file using UDP                                     =
+//=  Function to receive files from any number of clients using UDP          =
 //=============================================================================
 //=  Inputs:                                                                  =
-//=    fileName -- Name of file to create and write                           =
+//=    dirName --- Directory to create the received files in                  =
 //=    portNum --- Port number to listen and receive on                       =
 //=    maxSize --- Maximum size in bytes for written file (not implemented)   =
-//=    options --- Options whether to emulate packet loss or not              =
+//=    impair ---- Faults to emulate on the packets sent, one stream a worker =
+//=    metrics --- Export listing every transfer, NULL for none               =
+//=    batchSize - Datagrams moved per recvmmsg()/sendmmsg() call             =
+//=    gro ------- Set to receive coalesced datagrams with UDP_GRO            =
+//=    transfers - Return once this many files are complete, 0 never         =
+//=    workers --- Threads with a SO_REUSEPORT socket of their own            =
+//=    steer ----- Set to send every packet of a connection to one worker     =
+//=    affinity -- Set to pin worker n to CPU n                               =
 //=---------------------------------------------------------------------------=
 //=  Outputs:                                                                 =
 //=    Returns -1 for fail and 0 for success                                  =
 //=---------------------------------------------------------------------------=
 //=  Side effects:                                                            =
-//=    None known                                                             =
+//=    Transfers still open on return are dropped                             =
 //=---------------------------------------------------------------------------=
 //=  Bugs:                                                                    =
 //=    None known                                                             =
 //=---------------------------------------------------------------------------=
-int recvFile(char *fileName, int portNum, int maxSize, int options)
+int recvFiles(char *dirName, int portNum, int maxSize, Impair *impair,
+              MetricsExport *metrics,
+              int batchSize, int gro, int transfers, int workers, int steer,
+              int affinity)
 {
 #ifdef WIN
   WORD wVersionRequested = MAKEWORD(1,1);       // Stuff for WSA functions
@@ -135,135 +742,122 @@ int recvFile(char *fileName, int portNum, int maxSize, int options)
 #endif
   int                  server_s;        // server socket descriptor
   struct sockaddr_in   server_addr;     // Server Internet address
-  int                  connect_s;       // Connection socket descriptor
-  struct sockaddr_in   client_addr;     // Client Internet address
-  struct in_addr       client_ip_addr;  // Client IP address
-  int                  addr_len;        // Internet address length
-  char                 in_buf[4096];    // Input buffer for data
-  int                  fh;              // File handle
-  int                  length;          // Length in received buffer
   int                  retcode;         // Return code
-  Packet               pkt;             // Outgoing packet
-  Packet               inPkt;           // Incoming packet
-  Tcb                  tcb;             // Transfer control block
-  double               z;               // Random value to generate packet loss
+  Worker              *pool;            // One entry per worker thread
+  int                  reuse;           // SO_REUSEPORT on
+  int                  numCorrupt;      // Packets dropped for a bad checksum
+  int                  numStray;        // Packets of no known connection
+  Impair               faults;          // Faults of every worker together
+  int                  n;               // Worker being set up
 
 #ifdef WIN
   // This stuff initializes winsock
   WSAStartup(wVersionRequested, &wsaData);
 #endif
-  
-  // Create a welcome socket
-  server_s = socket(AF_INET, SOCK_DGRAM, 0);
-  if (server_s < 0)
+
+  if (workers < 1)
+    workers = 1;
+  pool = calloc(workers, sizeof(Worker));
+  if (pool == NULL)
   {
-    printf("*** ERROR - socket() failed \n");
-    exit(-1);
+    printf("  *** ERROR - unable to allocate %d workers \n", workers);
+    exit(1);
   }
-  
-  // Fill-in server (my) address information and bind the welcome socket
+
+  // Fill-in server (my) address information
   server_addr.sin_family = AF_INET;
   server_addr.sin_port = htons(portNum);
   server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-  retcode = bind(server_s, (struct sockaddr *)&server_addr,
-    sizeof(server_addr));
-  if (retcode < 0)
-  {
-    printf("*** ERROR - bind() failed \n");
-    exit(-1);
-  }
-  addr_len = sizeof(client_addr);
-  
 
-  // Open IN_FILE for file to write
-  #ifdef WIN
-    fh = open(fileName, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, S_IREAD |
-            S_IWRITE);
-  #endif
-  #ifdef BSD
-    fh = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, S_IREAD | S_IWRITE);
-  #endif
-  if (fh == -1)
+  // Create and bind a welcome socket per worker, the kernel spreads the
+  // packets over the group by their address and port
+  reuse = 1;
+  for (n = 0; n < workers; n++)
   {
-     printf("  *** ERROR - unable to create '%s' \n", RECV_FILE);
-     exit(1);
-  }
-  
-  tcb.expectedSeq = 0;     // First sequence number will be 0
-  
-  // Receive and write file from udpClient
-  do
-  {
-    //Read incoming packet
-    length = recvfrom(server_s, (void *)&inPkt, PKT_SIZE, 0, 
-      (struct sockaddr *)&client_addr, &addr_len);
-    readPacket(&inPkt);
-    
-    //IF SYN send SYN ACK
-    if (inPkt.flag == SYN)
+    server_s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (server_s < 0)
     {
-      printf("Sending SYNACK\n");
-      createPacket(&pkt, 0, 0, 0, SYN_ACK);
-      sendto(server_s, &pkt, PKT_SIZE, 0, 
-        (struct sockaddr *)&client_addr, sizeof(client_addr));
+      printf("*** ERROR - socket() failed \n");
+      exit(-1);
     }
-    
-    //Packet loss
-    if(options == 1){
-        z = rand_val();
-        if (z <= DISCARD_RATE)
-            continue;
-    }
-    if (inPkt.flag == FIN)
+    if (workers > 1)
+      setsockopt(server_s, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    retcode = bind(server_s, (struct sockaddr *)&server_addr,
+      sizeof(server_addr));
+    if (retcode < 0)
     {
-      createPacket(&pkt, 0, 0, 0, FIN_ACK);
-      sendto(server_s, &pkt, PKT_SIZE, 0, 
-        (struct sockaddr *)&client_addr, sizeof(client_addr));
+      printf("*** ERROR - bind() failed \n");
+      exit(-1);
     }
-    	    
+    pool[n].index = n;
+    pool[n].workers = workers;
+    pool[n].sock = server_s;
+    pool[n].cpu = affinity ? n : -1;
+    pool[n].dirName = dirName;
+    pool[n].impair = *impair;
+    pool[n].metrics = metrics;
+    pool[n].batchSize = batchSize;
+    pool[n].gro = gro;
+    pool[n].transfers = transfers;
+  }
 
-    //Packet is correct packet
-    if (inPkt.flag == DATA && inPkt.seqNum == tcb.expectedSeq)
-    {
-      write(fh, inPkt.payload, inPkt.length);
-      createPacket(&pkt, 0, 0, ++(tcb.expectedSeq), ACK); 
-      sendto(server_s, &pkt, PKT_SIZE, 0, 
-	        (struct sockaddr *)&client_addr, sizeof(client_addr));
-    }
-      
-    //Packet contains incorrect seqNum - retransmitted packet after lost ACK
-    else if (inPkt.flag == DATA && inPkt.seqNum != tcb.expectedSeq)
+  // Without steering a connection stays with the worker its address hashes
+  // to, with it the connection ID names the worker
+  if (steer && workers > 1 && connSteer(pool[0].sock, workers) < 0)
+    printf("  *** WARNING - no SO_ATTACH_REUSEPORT_CBPF support, hashing by address \n");
+
+  // Run worker 0 here and the others on threads of their own
+  for (n = 1; n < workers; n++)
+  {
+    if (pthread_create(&pool[n].thread, NULL, serveWorker, &pool[n]) != 0)
     {
-        createPacket(&pkt, 0, 0, tcb.expectedSeq, ACK);
-        sendto(server_s, &pkt, PKT_SIZE, 0, 
-            (struct sockaddr *)&client_addr, sizeof(client_addr));
+      printf("*** ERROR - pthread_create() failed \n");
+      exit(-1);
     }
-        
-  } while (inPkt.length > 0);
+  }
+  serveWorker(&pool[0]);
 
-  // Close the received file
-  close(fh);
+  numCorrupt = 0;
+  numStray = 0;
+  impairInit(&faults);
+  for (n = 0; n < workers; n++)
+  {
+    if (n > 0)
+      pthread_join(pool[n].thread, NULL);
+    numCorrupt += pool[n].numCorrupt;
+    numStray += pool[n].numStray;
+    faults.passed += pool[n].impair.passed;
+    faults.lost += pool[n].impair.lost;
+    faults.overflow += pool[n].impair.overflow;
+    faults.duplicated += pool[n].impair.duplicated;
+    faults.corrupted += pool[n].impair.corrupted;
+    faults.reordered += pool[n].impair.reordered;
 
-  // Close the welcome and connect sockets
+    // Close the welcome socket
 #ifdef WIN
-  retcode = closesocket(server_s);
-  if (retcode < 0)
-  {
-    printf("*** ERROR - closesocket() failed \n");
-    exit(-1);
-  }
-  
-  
+    retcode = closesocket(pool[n].sock);
+    if (retcode < 0)
+    {
+      printf("*** ERROR - closesocket() failed \n");
+      exit(-1);
+    }
 #endif
 #ifdef BSD
-  retcode = close(server_s);
-  if (retcode < 0)
-  {
-    printf("*** ERROR - close() failed \n");
-    exit(-1);
-  }
-  
+    retcode = close(pool[n].sock);
+    if (retcode < 0)
+    {
+      printf("*** ERROR - close() failed \n");
+      exit(-1);
+    }
 #endif
+  }
+  printf("numCorrupt: %d\n", numCorrupt);
+  printf("numStray: %d\n", numStray);
+  if (impairActive(impair))
+    printf("emulated faults: %lu passed, %lu lost, %lu overflowed, %lu duplicated, "
+           "%lu corrupted, %lu reordered\n", faults.passed, faults.lost, faults.overflow,
+           faults.duplicated, faults.corrupted, faults.reordered);
+  free(pool);
 
 #ifdef WIN
   // Clean-up winsock
@@ -273,3 +867,499 @@ int recvFile(char *fileName, int portNum, int maxSize, int options)
   // Return zero
   return(0);
 }
+
+//=============================================================================
+//=  Function run by each worker, receiving on its own socket                 =
+//=============================================================================
+//=  Inputs:                                                                  =
+//=    arg ------- The Worker, with its socket bound to the shared port       =
+//=---------------------------------------------------------------------------=
+//=  Outputs:                                                                 =
+//=    Returns NULL once the workers together finished enough transfers,      =
+//=    counts dropped packets in the Worker                                   =
+//=---------------------------------------------------------------------------=
+//=  Side effects:                                                            =
+//=    Connections, files and their buffers belong to this worker alone       =
+//=---------------------------------------------------------------------------=
+static void *serveWorker(void *arg)
+{
+  Worker              *self;            // This worker
+  int                  server_s;        // server socket descriptor
+  struct sockaddr_in   client_addr;     // Client Internet address
+  Packet              *pkt;             // Outgoing packet
+  Packet              *inPkt;           // Incoming packet
+  Packet               replies[BATCH_MAX]; // Buffers for queued replies
+  RecvBatch            recvBatch;       // Packets taken by one recvmmsg()
+  SendBatch            sendBatch;       // Replies sent by one sendmmsg()
+  int                  i;               // Packet within the receive batch
+  ConnTable           *table;           // Transfers being received
+  Conn                *conn;            // Transfer a packet belongs to
+  Conn                *dirty[BATCH_OUT_MAX]; // Transfers written by this batch
+  int                  numDirty;        // Entries in dirty
+  SynParams            params;          // Handshake parameters
+  uint32_t             offset;          // Distance of a packet from expectedSeq
+  int                  urgent;          // Set when a DATA packet is acknowledged at once
+  int                  bufSize;         // Socket receive buffer size
+  int                  rcvBuf;          // Receive buffer size set so far
+  int                  count;           // Ranges, entries or transfers counted
+  SackBlock            extents[(PAYLOAD_MAX - PARAMS_SIZE) / sizeof(SackBlock)]; // Ranges a SYN_ACK reports
+  FecRebuilt           rebuilt[FEC_PARITY_MAX]; // DATA packets rebuilt by FEC
+  int64_t              last;            // Last rebuilt packet queued
+  int                  closed;          // Set when a finished file closed cleanly
+  uint32_t             node;            // Node of a TREE request
+  int                  ep;              // epoll instance
+  int                  timer_fd;        // Fires every CONN_REAP_MS
+  int                  ack_fd;          // Fires when the first ACK held back is due
+  TimerWheel           acks;            // Deadlines of the ACKs held back
+  unsigned long long   ackDue;          // Time ack_fd is set for
+  unsigned long long   due;             // Earliest deadline in acks
+  struct epoll_event   ev;              // Event registered or returned
+  struct itimerspec    tick;            // Reaping interval
+  uint64_t             ticks;           // Timer expirations read
+  int                  k;               // Batches taken this wakeup
+  unsigned long long   now;             // Current time (in us)
+  cpu_set_t            cpus;            // CPU the worker is pinned to
+
+  self = arg;
+  server_s = self->sock;
+  if (self->cpu >= 0)
+  {
+    CPU_ZERO(&cpus);
+    CPU_SET(self->cpu % CPU_SETSIZE, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+      printf("  *** WARNING - unable to run worker %d on CPU %d \n", self->index, self->cpu);
+  }
+
+  // One epoll set wakes the loop for datagrams and for the reaping timer
+  ep = epoll_create1(0);
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  ack_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (ep < 0 || timer_fd < 0 || ack_fd < 0)
+  {
+    printf("*** ERROR - epoll_create1() failed \n");
+    exit(-1);
+  }
+  tick.it_interval.tv_sec = CONN_REAP_MS / 1000;
+  tick.it_interval.tv_nsec = (CONN_REAP_MS % 1000) * 1000000L;
+  tick.it_value = tick.it_interval;
+  timerfd_settime(timer_fd, 0, &tick, NULL);
+  ev.events = EPOLLIN;
+  ev.data.fd = server_s;
+  epoll_ctl(ep, EPOLL_CTL_ADD, server_s, &ev);
+  ev.data.fd = timer_fd;
+  epoll_ctl(ep, EPOLL_CTL_ADD, timer_fd, &ev);
+  ev.data.fd = ack_fd;
+  epoll_ctl(ep, EPOLL_CTL_ADD, ack_fd, &ev);
+  timerInit(&acks, nowUs());
+  ackDue = TIMER_NONE;
+
+  table = malloc(sizeof(ConnTable));
+  if (table == NULL)
+  {
+    printf("  *** ERROR - unable to allocate the connection table \n");
+    exit(1);
+  }
+  connInit(table, self->index, self->workers);
+  rcvBuf = 0;
+  self->numCorrupt = 0;
+  self->numStray = 0;
+  
+  batchInitRecv(&recvBatch, self->batchSize);
+  batchInitSend(&sendBatch, server_s, self->batchSize);
+  if (impairStart(&self->impair, server_s, self->index) < 0)
+  {
+    printf("*** ERROR - unable to start the network emulation \n");
+    exit(-1);
+  }
+  batchImpair(&sendBatch, &self->impair);
+  if (self->gro && batchEnableGro(&recvBatch, server_s) < 0)
+    printf("  *** WARNING - no UDP GRO support, receiving datagrams one by one \n");
+
+  // Receive files from every udpClient that lands on this worker
+  while (!allDone(self))
+  {
+    //wake for the first ACK held back
+    due = timerNext(&acks);
+    if (due != TIMER_NONE && due != ackDue)
+    {
+      timerfdAt(ack_fd, due);
+      ackDue = due;
+    }
+    if (epoll_wait(ep, &ev, 1, -1) < 1)
+      continue;
+
+    //Send the ACKs whose delay ran out
+    if (ev.data.fd == ack_fd)
+    {
+      read(ack_fd, &ticks, sizeof(ticks));
+      ackDue = TIMER_NONE;
+      flushAcks(&acks, &sendBatch, replies, nowUs());
+      batchFlush(&sendBatch);
+      continue;
+    }
+
+    //Drop transfers whose client went silent, let finished ones go once a
+    //repeated FIN can no longer arrive
+    if (ev.data.fd == timer_fd)
+    {
+      read(timer_fd, &ticks, sizeof(ticks));
+      now = nowUs();
+      count = connReap(table, now);
+      if (count > 0)
+        printf("  *** WARNING - dropped %d idle transfers \n", count);
+      count = connSync(table, now);
+      if (count > 0)
+        printf("  *** WARNING - unable to save the progress of %d transfers \n", count);
+      continue;
+    }
+
+    //Read batches of incoming packets while they keep coming, a bounded
+    //number so the timer still gets its turn
+    for (k = 0; k < DRAIN_MAX && !allDone(self); k++)
+    {
+      if (batchRecv(&recvBatch, server_s, MSG_DONTWAIT) <= 0)
+        break;
+
+      now = nowUs();
+      numDirty = 0;
+      for (i = 0; i < recvBatch.count; i++)
+      {
+        inPkt = recvBatch.pkt[i];
+        client_addr = *recvBatch.from[i];
+        if (!verifyPacket(inPkt, recvBatch.len[i]))
+        {
+          self->numCorrupt++;
+          continue;
+        }
+        readPacket(inPkt);
+
+        //replies are queued in the send batch, each needs its own buffer
+        pkt = &replies[sendBatch.count];
+
+        //IF PROBE confirm the probed payload size arrived whole
+        if (inPkt->flag == PROBE)
+        {
+          createPacket(pkt, 0, recvBatch.len[i] - HEADER_SIZE, 0, PROBE_ACK);
+          sealPacket(pkt);
+          batchAdd(&sendBatch, pkt, packetSize(pkt), &client_addr);
+          continue;
+        }
+
+        //IF SYN open a connection and send SYN ACK with its ID, granting at
+        //most WINDOW_MAX packets
+        if (inPkt->flag == SYN)
+        {
+          unpackParams(inPkt, &params);
+          conn = acceptConn(table, &client_addr, &params, self->dirName,
+                            self->metrics, &acks, now);
+          if (conn == NULL)
+          {
+            //the client gives up on a refused SYN rather than sending it again
+            createPacket(pkt, 0, 0, 0, SYN_REFUSED);
+            sealPacket(pkt);
+            batchAdd(&sendBatch, pkt, packetSize(pkt), &client_addr);
+            continue;
+          }
+          printf("Sending SYNACK for '%s' (connection %u, worker %d)\n", conn->name,
+                 conn->id, self->index);
+          conn->lastUs = now;
+
+          //let the socket queue a full window of the largest transfer while
+          //files are being written
+          bufSize = conn->tcb.window * (HEADER_SIZE + conn->tcb.payloadSize);
+          if (bufSize > rcvBuf)
+          {
+            rcvBuf = bufSize;
+            setsockopt(server_s, SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof(bufSize));
+          }
+          params.window = conn->tcb.window;
+          params.payload = conn->tcb.payloadSize;
+          params.fecData = conn->fec.dataCount;
+          params.fecParity = conn->fec.parityCount;
+          params.codec = conn->decomp.codec;
+          params.delta = conn->sig.blockSize;
+          params.deltaCount = conn->sig.count;
+          params.ackEvery = conn->ack.every;
+          params.ackDelay = conn->ack.delayUs;
+          params.verify = conn->tree != NULL ? conn->tree->chunk : 0;
+          params.name[0] = '\0';
+
+          //a resumed transfer reports the blocks already in the file, as
+          //many ranges above the in-order edge as fit in one payload
+          params.resume = conn->tcb.expectedSeq;
+          count = bitmapRanges(&conn->tcb.seqMap, conn->tcb.expectedSeq, conn->highSeq,
+              extents, (conn->tcb.payloadSize - PARAMS_SIZE) / sizeof(SackBlock));
+          createPacket(pkt, paramsSize(&params) + count * sizeof(SackBlock), 0, 0, SYN_ACK);
+          packParams(pkt, &params);
+          packExtents(pkt, extents, count);
+          queueReply(&sendBatch, conn, pkt);
+          continue;
+        }
+
+        //Everything else belongs to a connection, and only its client may
+        //send on it
+        conn = connFind(table, inPkt->connId);
+        if (conn == NULL || conn->addr.sin_addr.s_addr != client_addr.sin_addr.s_addr ||
+            conn->addr.sin_port != client_addr.sin_port)
+        {
+          self->numStray++;
+          continue;
+        }
+        if (conn->failed)
+          continue;
+
+        conn->lastUs = now;
+        conn->started = 1;
+        METRIC_ADD(conn->metrics.pktsRecv, 1);
+        METRIC_ADD(conn->metrics.bytesRecv, recvBatch.len[i]);
+
+        //SIGNATURE asks for ackNum entries of the signature from seqNum on, the
+        //reply carries as many as fit in a payload - the client asks again
+        //for any that are lost
+        if (inPkt->flag == SIGNATURE)
+        {
+          if (inPkt->seqNum >= conn->sig.count)
+            continue;
+          count = conn->sig.count - inPkt->seqNum;
+          if ((uint32_t)count > inPkt->ackNum)
+            count = inPkt->ackNum;
+          if ((uint32_t)count > conn->tcb.payloadSize / DELTA_SIG_SIZE)
+            count = conn->tcb.payloadSize / DELTA_SIG_SIZE;
+          createPacket(pkt, count * DELTA_SIG_SIZE, inPkt->seqNum, count, SIGNATURE);
+          deltaPackSig(&conn->sig, inPkt->seqNum, count, pkt->payload);
+          queueReply(&sendBatch, conn, pkt);
+          continue;
+        }
+
+        //TREE carries the client's nodes of one level of the hash tree, ackNum,
+        //from seqNum on and is answered with the server's - leaves that differ
+        //are noted. MERKLE_REPAIR in ackNum then keeps all but those chunks as
+        //the file's progress, the reply's seqNum is 1 once that is saved
+        if (inPkt->flag == TREE)
+        {
+          if (conn->tree == NULL || !conn->tree->built)
+            continue;
+          if (inPkt->ackNum == MERKLE_REPAIR)
+          {
+            if (conn->mismatch == 1)
+              takeBack(conn);
+            createPacket(pkt, 0, conn->mismatch == 2, MERKLE_REPAIR, TREE);
+            queueReply(&sendBatch, conn, pkt);
+            continue;
+          }
+          count = inPkt->length / MERKLE_HASH_SIZE;
+          if (inPkt->ackNum >= conn->tree->levels ||
+              inPkt->seqNum >= conn->tree->counts[inPkt->ackNum] ||
+              (uint32_t)count > conn->tree->counts[inPkt->ackNum] - inPkt->seqNum)
+            continue;
+          for (node = 0; node < (uint32_t)count && inPkt->ackNum == 0 && conn->mismatch == 1; node++)
+            if (merkleDiffer(conn->tree, 0, inPkt->seqNum + node,
+                             inPkt->payload + node * MERKLE_HASH_SIZE))
+              bitmapSet(&conn->redo, inPkt->seqNum + node);
+          createPacket(pkt, count * MERKLE_HASH_SIZE, inPkt->seqNum, inPkt->ackNum, TREE);
+          merklePack(conn->tree, inPkt->ackNum, inPkt->seqNum, count, pkt->payload);
+          queueReply(&sendBatch, conn, pkt);
+          continue;
+        }
+
+        //FIN is only sent once every packet has been acknowledged, the file
+        //is complete - repeated FINs are answered until the connection is
+        //reaped, and a striped file is complete once stripe 0 FINs, the
+        //client sends that FIN after every other stripe has had its FIN_ACK
+        if (inPkt->flag == FIN && inPkt->seqNum == conn->tcb.expectedSeq)
+        {
+          if (!conn->finished && !conn->mismatch)
+          {
+            if (conn->dirty && flushConn(conn) < 0)
+              printf("  *** ERROR - unable to write '%s' \n", conn->name);
+            conn->dirty = 0;
+            if (conn->session != 0)
+              printf("Received stripe %u of '%s' (%llu bytes, %lu writes)\n",
+                     conn->stripe, conn->name,
+                     (unsigned long long)(conn->store.end - conn->store.base),
+                     conn->store.writes);
+            else
+              printf("Received '%s' (%llu bytes, %lu writes)\n", conn->name,
+                     (unsigned long long)conn->store.end, conn->store.writes);
+            if (conn->decomp.framed)
+            {
+              if (decompressPending(&conn->decomp))
+                printf("  *** ERROR - '%s' ends inside a compressed block \n", conn->name);
+              printf("Inflated %llu bytes into %llu (%llu copied from the old version)\n",
+                     (unsigned long long)conn->decomp.wireBytes,
+                     (unsigned long long)conn->decomp.rawPos,
+                     (unsigned long long)conn->decomp.copyBytes);
+            }
+            if (conn->fec.groups != NULL)
+              printf("FEC rebuilt %lu packets of '%s'\n", conn->fec.rebuilt, conn->name);
+
+            //a verified file matches the sender's copy once the root of its
+            //hash tree is the one the FIN carries - otherwise it stays open
+            //while the client looks for the chunks that differ, unless it
+            //could not be resumed without them
+            if (conn->tree != NULL)
+            {
+              if (merkleFinish(conn->tree) < 0)
+                printf("  *** ERROR - unable to read '%s' back \n", conn->name);
+              if (inPkt->length == MERKLE_HASH_SIZE &&
+                  !merkleDiffer(conn->tree, conn->tree->levels - 1, 0, inPkt->payload))
+                printf("Verified '%s' (%u chunks of %u bytes, root %016llx)\n", conn->name,
+                       conn->tree->counts[0], conn->tree->chunk,
+                       (unsigned long long)merkleRoot(conn->tree));
+              else if (conn->decomp.framed || conn->part[0] == '\0' ||
+                       bitmapInit(&conn->redo, conn->tree->counts[0]) < 0)
+                printf("  *** ERROR - '%s' does not match the sender's copy \n", conn->name);
+              else
+              {
+                printf("  *** WARNING - '%s' does not match the sender's copy, "
+                       "finding the chunks that differ \n", conn->name);
+                conn->mismatch = 1;
+              }
+            }
+          }
+          if (!conn->finished && !conn->mismatch)
+          {
+
+            //a delta rebuild replaces the old version only if it matches the
+            //CRC32C of the whole file the FIN carries, the FIN_ACK returns
+            //the one found so the client can tell
+            closed = storeClose(&conn->store) == 0;
+            if (!closed)
+              printf("  *** ERROR - unable to write '%s' \n", conn->name);
+            else if (conn->part[0] != '\0')
+              resumeRemove(conn->part);
+            if (conn->deltaPath[0] != '\0')
+              replaceBasis(conn, closed, inPkt->ackNum);
+
+            //a bundle is answered once every file of it is created
+            if (conn->unpack != NULL)
+            {
+              if (bundleFinish(conn->unpack, inOrderBytes(conn)) < 0)
+                printf("  *** ERROR - unable to unpack all of '%s' \n", conn->name);
+              printf("Unpacked '%s' (%lu files, %lu directories, %llu bytes, %lu errors)\n",
+                     conn->name, conn->unpack->files, conn->unpack->dirs,
+                     (unsigned long long)conn->unpack->bytes, conn->unpack->errors);
+            }
+            conn->finished = 1;
+            connReleaseName(conn);
+            if (conn->stripe == 0)
+              __atomic_add_fetch(&numDone, 1, __ATOMIC_RELAXED);
+          }
+          createPacket(pkt, conn->tree != NULL && conn->tree->built ? MERKLE_HASH_SIZE : 0,
+                       0, conn->decomp.crc, FIN_ACK);
+          if (conn->tree != NULL && conn->tree->built)
+            merklePack(conn->tree, conn->tree->levels - 1, 0, 1, pkt->payload);
+          queueReply(&sendBatch, conn, pkt);
+          continue;
+        }
+
+        //REPAIR packets rebuild lost DATA packets of a group still in the
+        //window without a retransmission, the ACK of the last one rebuilt
+        //reports them all
+        if (inPkt->flag == REPAIR)
+        {
+          if (conn->fec.groups == NULL ||
+              inPkt->seqNum + FEC_COUNT(inPkt->ackNum) <= conn->tcb.expectedSeq ||
+              inPkt->seqNum >= conn->tcb.expectedSeq + conn->tcb.window)
+            continue;
+          count = fecRepair(&conn->fec, inPkt, rebuilt);
+          last = acceptRebuilt(conn, rebuilt, count, dirty, &numDirty);
+          if (last < 0)
+            continue;
+          ackOnData(&conn->ack, last, 1, now);
+          queueAck(&sendBatch, conn, pkt, last, now);
+          continue;
+        }
+
+        if (inPkt->flag != DATA || inPkt->length > conn->tcb.payloadSize)
+          continue;
+
+        //Packet is new and within the window - queue it for its place in the
+        //file, in whatever order it arrives. One above a hole or filling one
+        //is acknowledged at once, so is one received before - the sender is
+        //recovering a loss or lost the ACK
+        offset = inPkt->seqNum - conn->tcb.expectedSeq;
+        urgent = 1;
+        if (offset < conn->tcb.window)
+        {
+          if (!bitmapTest(&conn->tcb.seqMap, inPkt->seqNum))
+          {
+            urgent = offset != 0 || conn->highSeq > inPkt->seqNum + 1;
+            if (acceptData(conn, inPkt->seqNum, inPkt->payload, inPkt->length,
+                           dirty, &numDirty) < 0)
+              continue;
+
+            //a late DATA packet may complete a group that had its REPAIR packets
+            if (conn->fec.groups != NULL)
+            {
+              count = fecData(&conn->fec, inPkt->seqNum, inPkt->payload,
+                              inPkt->length, rebuilt);
+              last = acceptRebuilt(conn, rebuilt, count, dirty, &numDirty);
+              if (last < 0 && conn->failed)
+                continue;
+              if (last >= 0)
+                urgent = 1;
+            }
+          }
+          else
+            METRIC_ADD(conn->metrics.duplicates, 1);
+        }
+
+        //Packet is beyond the window - drop it without acknowledging it
+        else if (conn->tcb.expectedSeq - inPkt->seqNum > conn->tcb.window)
+          continue;
+
+        //Packet is below the window, received before
+        else
+          METRIC_ADD(conn->metrics.duplicates, 1);
+
+        //ACK the newest packet (seqNum), the next in order packet (ackNum) and
+        //the ranges received above it (SACK blocks) - in order packets wait
+        //for the ACK of a few more or for the delay the client was granted,
+        //unless the client can send no more until this one is ACKed
+        if (ackOnData(&conn->ack, inPkt->seqNum, urgent, now) ||
+            inPkt->ackNum == ACK_NOW)
+          queueAck(&sendBatch, conn, pkt, inPkt->seqNum, now);
+      }
+
+      //write the blocks of this batch before the next one reuses their
+      //buffers, then send the replies to the whole batch with one syscall,
+      //along with any ACK held back that is due by now - a transfer that
+      //failed to write has nothing more to hand to its unpacker or tree
+      for (i = 0; i < numDirty; i++)
+      {
+        conn = dirty[i];
+        if (!conn->dirty)
+          continue;
+        conn->dirty = 0;
+        if (conn->failed)
+          continue;
+        if (flushConn(conn) < 0)
+        {
+          printf("  *** ERROR - unable to write '%s' \n", conn->name);
+          conn->failed = 1;
+        }
+        else
+        {
+          if (conn->unpack != NULL)
+            bundleAvail(conn->unpack, inOrderBytes(conn));
+          if (conn->tree != NULL)
+            merkleAvail(conn->tree, inOrderBytes(conn));
+        }
+      }
+      flushAcks(&acks, &sendBatch, replies, now);
+      batchFlush(&sendBatch);
+    }
+  }
+
+  // Close whatever is still open
+  connReap(table, ~0ULL);
+  free(table);
+  batchFreeRecv(&recvBatch);
+  batchFreeSend(&sendBatch);
+  impairStop(&self->impair);
+  close(timer_fd);
+  close(ack_fd);
+  close(ep);
+  return NULL;
+}
@@ -0,0 +1,445 @@
+#include "udpSource.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+
+#ifdef USE_URING
+
+//requests the rest of chunk n into its buffer
+static int ringReadChunk(Source *src, uint64_t n)
+{
+   struct io_uring_sqe *sqe;
+   int buf;
+
+   buf = n % SOURCE_BUFS;
+   sqe = ringSqe(&src->ring);
+   if (sqe == NULL)
+      return -1;
+   sqe->opcode = IORING_OP_READ_FIXED;
+   sqe->fd = src->fh;
+   sqe->addr = (uintptr_t)(src->pool + (size_t)buf * SOURCE_BUF_SIZE + src->chunkDone[buf]);
+   sqe->len = src->chunkWant[buf] - src->chunkDone[buf];
+   sqe->off = src->start + n * src->chunkLen + src->chunkDone[buf];
+   sqe->buf_index = 0;
+   sqe->user_data = n;
+   return 0;
+}
+
+//keeps SOURCE_BUFS chunks requested ahead of the one being sent
+static void ringReadAhead(Source *src)
+{
+   uint64_t offset;
+   int buf;
+
+   while (!src->failed && src->tail < src->head + SOURCE_BUFS)
+   {
+      offset = src->start + src->tail * src->chunkLen;
+      if (offset >= src->size)
+         break;
+      buf = src->tail % SOURCE_BUFS;
+      src->chunkDone[buf] = 0;
+      src->chunkPos[buf] = 0;
+      src->chunkWant[buf] = src->size - offset < src->chunkLen ? src->size - offset : src->chunkLen;
+      if (ringReadChunk(src, src->tail) < 0)
+      {
+         src->failed = 1;
+         break;
+      }
+      src->tail++;
+   }
+   if (ringSubmit(&src->ring, 0) < 0)
+      src->failed = 1;
+}
+
+//takes finished reads off the ring, asking again for the rest of short ones
+static void ringCollect(Source *src)
+{
+   uint64_t n;
+   int res;
+   int buf;
+
+   ringClearEvent(&src->ring);
+   while (ringNext(&src->ring, &n, &res))
+   {
+      buf = n % SOURCE_BUFS;
+      if (res == -EINTR || res == -EAGAIN)
+         res = 0;
+      else if (res <= 0)
+      {
+         //a read error or a file cut short ends the transfer at this chunk
+         src->failed = 1;
+         src->size = src->start + n * src->chunkLen + src->chunkDone[buf];
+         src->chunkWant[buf] = src->chunkDone[buf];
+         continue;
+      }
+      src->chunkDone[buf] += res;
+      if (src->chunkDone[buf] < src->chunkWant[buf] && ringReadChunk(src, n) < 0)
+         src->failed = 1;
+   }
+   if (ringSubmit(&src->ring, 0) < 0)
+      src->failed = 1;
+}
+
+static void ringOpen(Source *src)
+{
+   size_t len;
+
+   src->pool = NULL;
+   src->chunkLen = 0;
+   src->head = 0;
+   src->tail = 0;
+   src->failed = 0;
+   if (ringInit(&src->ring, RING_ENTRIES) < 0)
+      return;
+   len = (size_t)SOURCE_BUFS * SOURCE_BUF_SIZE;
+   src->pool = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (src->pool == MAP_FAILED || ringRegister(&src->ring, src->pool, len) < 0)
+   {
+      //no ring (or no locked memory for it), read() instead
+      if (src->pool != MAP_FAILED)
+         munmap(src->pool, len);
+      src->pool = NULL;
+      ringFree(&src->ring);
+   }
+}
+
+//copies the next block out of the chunk at the head, -1 if it has not arrived yet
+static int ringNextBlock(Source *src, Slot *slot, uint32_t payloadSize)
+{
+   uint32_t length;
+   int buf;
+
+   if (src->chunkLen == 0)
+   {
+      src->chunkLen = SOURCE_BUF_SIZE / payloadSize * payloadSize;
+      ringReadAhead(src);
+   }
+   if (src->offset >= src->size)
+      return 0;
+
+   buf = src->head % SOURCE_BUFS;
+   if (src->head >= src->tail || src->chunkDone[buf] < src->chunkWant[buf])
+   {
+      ringCollect(src);
+      if (src->offset >= src->size || src->head >= src->tail)
+         return 0;
+      if (src->chunkDone[buf] < src->chunkWant[buf])
+         return -1;
+   }
+
+   //the buffer is requested again for a later chunk, so the block is copied into the slot
+   length = src->chunkWant[buf] - src->chunkPos[buf];
+   if (length > payloadSize)
+      length = payloadSize;
+   slot->data = slot->pkt->payload;
+   memcpy(slot->data, src->pool + (size_t)buf * SOURCE_BUF_SIZE + src->chunkPos[buf], length);
+   src->chunkPos[buf] += length;
+   src->offset += length;
+   if (src->chunkPos[buf] == src->chunkWant[buf])
+   {
+      src->head++;
+      ringReadAhead(src);
+   }
+   return length;
+}
+
+#endif
+
+//reads up to len bytes at data, only short at the end of the file
+static uint32_t readBlock(int fh, char *data, uint32_t len)
+{
+   uint32_t length;
+   int ret;
+
+   for (length = 0; length < len; length += ret)
+   {
+      ret = read(fh, data + length, len - length);
+      if (ret <= 0)
+         break;
+   }
+   return length;
+}
+
+//publishes count on index, then wakes the side sleeping on it through fd once
+//count reaches what it waits for - the fence orders the store before the look
+//at wakeAt, as the sleeper orders setting wakeAt before its last look at count
+static void indexPublish(SourceIndex *index, uint64_t count, int done, int fd)
+{
+   uint64_t wakeAt;
+   uint64_t one;
+
+   __atomic_store_n(&index->count, count, __ATOMIC_RELEASE);
+   if (done)
+      __atomic_store_n(&index->done, 1, __ATOMIC_RELEASE);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   wakeAt = __atomic_load_n(&index->wakeAt, __ATOMIC_RELAXED);
+   if (wakeAt != 0 && (count >= wakeAt || done))
+   {
+      __atomic_store_n(&index->wakeAt, 0, __ATOMIC_RELAXED);
+      one = 1;
+      write(fd, &one, sizeof(one));
+   }
+}
+
+//announces that this side is about to sleep on index until count reaches
+//wakeAt, returns 0 instead if it did or the index is done in the meantime
+static int indexSleep(SourceIndex *index, uint64_t wakeAt)
+{
+   __atomic_store_n(&index->wakeAt, wakeAt, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if (__atomic_load_n(&index->count, __ATOMIC_ACQUIRE) < wakeAt &&
+       !__atomic_load_n(&index->done, __ATOMIC_ACQUIRE))
+      return 1;
+   __atomic_store_n(&index->wakeAt, 0, __ATOMIC_RELAXED);
+   return 0;
+}
+
+//fills the arena a block at a time, as far ahead as the blocks handed back allow
+static void *readerThread(void *arg)
+{
+   Source *src = arg;
+   uint64_t wake;
+   uint64_t n;
+   uint32_t want;
+   uint32_t length;
+
+   //offset belongs to this thread from here on
+   for (n = 0; ; n++)
+   {
+      //every block is still held by the sender, sleep until refill blocks
+      //come back rather than waking for each
+      while (n - __atomic_load_n(&src->freed.count, __ATOMIC_ACQUIRE) >= src->blocks &&
+             !__atomic_load_n(&src->freed.done, __ATOMIC_ACQUIRE))
+         if (indexSleep(&src->freed, n - src->blocks + src->refill))
+            read(src->spaceFd, &wake, sizeof(wake));
+      if (__atomic_load_n(&src->freed.done, __ATOMIC_ACQUIRE))
+         break;
+
+      want = src->blockSize;
+      if (src->size > 0 && src->size - src->offset < want)
+         want = src->size > src->offset ? src->size - src->offset : 0;
+      length = want > 0 ? readBlock(src->fh, src->arena + (n % src->blocks) * src->stride, want) : 0;
+      src->lens[n % src->blocks] = length;
+      src->offset += length;
+      if (length == 0)
+         break;
+
+      //a short block is the last, even from a pipe
+      indexPublish(&src->filled, n + 1, length < src->blockSize, src->dataFd);
+      if (length < src->blockSize)
+         return NULL;
+   }
+   indexPublish(&src->filled, n, 1, src->dataFd);
+   return NULL;
+}
+
+//hands out the next block the reader thread filled, -1 if it has not yet
+static int readerNext(Source *src, Slot *slot)
+{
+   uint64_t wake;
+   uint32_t length;
+
+   if (src->taken == __atomic_load_n(&src->filled.count, __ATOMIC_ACQUIRE))
+   {
+      //clear a wake up left over from before, then sleep until refill blocks
+      //of a file are ready - a pipe may take its time, so any block
+      read(src->dataFd, &wake, sizeof(wake));
+      if (indexSleep(&src->filled, src->taken + (src->size > 0 ? src->refill : 1)))
+         return -1;
+      if (src->taken == __atomic_load_n(&src->filled.count, __ATOMIC_ACQUIRE))
+         return 0;
+   }
+   length = src->lens[src->taken % src->blocks];
+   slot->data = src->arena + (src->taken % src->blocks) * src->stride;
+   src->taken++;
+   return length;
+}
+
+int sourceOpen(Source *src, char *fileName, int useMap)
+{
+   struct stat st;
+   void *map;
+
+   src->fh = open(fileName, O_RDONLY);
+   src->map = NULL;
+   src->size = 0;
+   src->start = 0;
+   src->offset = 0;
+   src->stamp = 0;
+   src->arena = NULL;
+#ifdef USE_URING
+   src->pool = NULL;
+#endif
+   if (src->fh < 0)
+      return -1;
+
+   //the size of a pipe is not known up front, nor can it be mapped
+   if (fstat(src->fh, &st) < 0 || !S_ISREG(st.st_mode))
+      return 0;
+   src->size = st.st_size;
+   src->stamp = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+   if (!useMap || st.st_size == 0)
+   {
+#ifdef USE_URING
+      if (st.st_size > 0)
+         ringOpen(src);
+#endif
+      return 0;
+   }
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, src->fh, 0);
+   if (map == MAP_FAILED)
+      return 0;
+
+   //blocks are sent in order, so let the kernel read well ahead
+   madvise(map, st.st_size, MADV_SEQUENTIAL);
+   src->map = map;
+   src->mapLen = st.st_size;
+   return 0;
+}
+
+int sourceNext(Source *src, Slot *slot, uint32_t payloadSize)
+{
+   uint64_t left;
+   int length;
+   int ret;
+
+   if (src->arena != NULL)
+      return readerNext(src, slot);
+#ifdef USE_URING
+   if (src->pool != NULL)
+      return ringNextBlock(src, slot, payloadSize);
+#endif
+
+   //the receiver places block n at n * payloadSize, so only the last block
+   //may be short even when a pipe hands out less at a time
+   if (src->map == NULL)
+   {
+      left = payloadSize;
+      if (src->size > 0 && src->size - src->offset < left)
+         left = src->size - src->offset;
+      slot->data = slot->pkt->payload;
+      for (length = 0; length < (int)left; length += ret)
+      {
+         ret = read(src->fh, slot->data + length, left - length);
+         if (ret <= 0)
+            break;
+      }
+      src->offset += length;
+      return length;
+   }
+
+   left = src->size - src->offset;
+   length = left < payloadSize ? left : payloadSize;
+   slot->data = src->map + src->offset;
+   src->offset += length;
+   return length;
+}
+
+void sourceRange(Source *src, uint64_t start, uint64_t end)
+{
+   src->start = start;
+   src->offset = start;
+   src->size = end;
+   if (src->map == NULL)
+      lseek(src->fh, start, SEEK_SET);
+}
+
+int sourceStart(Source *src, uint32_t payloadSize, uint32_t window)
+{
+   size_t len;
+
+   if (src->map != NULL || src->arena != NULL)
+      return -1;
+
+   //blocks start on cache lines, so the reader and the sender never write
+   //the same line, and the arena is allocated once for the whole file - the
+   //read ahead is kept to about SOURCE_AHEAD so it stays in cache
+   src->blockSize = payloadSize;
+   src->stride = (payloadSize + SOURCE_LINE - 1) & ~(SOURCE_LINE - 1);
+   src->refill = SOURCE_AHEAD / src->stride / 4;
+   if (src->refill == 0)
+      src->refill = 1;
+   src->blocks = window + 4 * src->refill;
+   len = (size_t)src->blocks * src->stride;
+   src->arena = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   src->lens = malloc(src->blocks * sizeof(uint32_t));
+   src->dataFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   src->spaceFd = eventfd(0, EFD_CLOEXEC);
+   memset(&src->filled, 0, sizeof(src->filled));
+   memset(&src->freed, 0, sizeof(src->freed));
+   src->taken = 0;
+   if (src->arena == MAP_FAILED || src->lens == NULL || src->dataFd < 0 || src->spaceFd < 0 ||
+       pthread_create(&src->reader, NULL, readerThread, src) != 0)
+   {
+      if (src->arena != MAP_FAILED)
+         munmap(src->arena, len);
+      free(src->lens);
+      if (src->dataFd >= 0)
+         close(src->dataFd);
+      if (src->spaceFd >= 0)
+         close(src->spaceFd);
+      src->arena = NULL;
+      return -1;
+   }
+
+#ifdef USE_URING
+   //the ring's chunks would only be copied out of, the reader takes over
+   if (src->pool != NULL)
+   {
+      ringFree(&src->ring);
+      munmap(src->pool, (size_t)SOURCE_BUFS * SOURCE_BUF_SIZE);
+      src->pool = NULL;
+   }
+#endif
+   return 0;
+}
+
+void sourceRelease(Source *src, uint64_t count)
+{
+   if (src->arena == NULL || count <= src->freed.count)
+      return;
+   indexPublish(&src->freed, count, 0, src->spaceFd);
+}
+
+int sourceWaitFd(Source *src)
+{
+   if (src->arena != NULL)
+      return src->dataFd;
+#ifdef USE_URING
+   if (src->pool != NULL)
+      return src->ring.eventFd;
+#endif
+   return -1;
+}
+
+void sourceClose(Source *src)
+{
+   if (src->arena != NULL)
+   {
+      //the reader may sleep on spaceFd for a block, stop and wake it
+      indexPublish(&src->freed, src->freed.count, 1, src->spaceFd);
+      pthread_join(src->reader, NULL);
+      munmap(src->arena, (size_t)src->blocks * src->stride);
+      free(src->lens);
+      close(src->dataFd);
+      close(src->spaceFd);
+      src->arena = NULL;
+   }
+#ifdef USE_URING
+   if (src->pool != NULL)
+   {
+      //reads still in flight target the pool, the ring has to go first
+      ringFree(&src->ring);
+      munmap(src->pool, (size_t)SOURCE_BUFS * SOURCE_BUF_SIZE);
+      src->pool = NULL;
+   }
+#endif
+   if (src->map != NULL)
+      munmap(src->map, src->mapLen);
+   close(src->fh);
+   src->map = NULL;
+}
@@ -0,0 +1,94 @@
+//udpSource Blocks of the file being sent, read into window slots or mapped
+
+#ifndef UDPSOURCE_H
+#define UDPSOURCE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "udpProtocol.h"
+#include "udpRing.h"
+
+#define SOURCE_BUFS	8		//chunks read ahead with -DUSE_URING
+#define SOURCE_BUF_SIZE	(256 * 1024)	//bytes in one read ahead chunk
+#define SOURCE_AHEAD	(1024 * 1024)	//bytes the reader thread reads beyond the sender's window
+#define SOURCE_LINE	64		//cache line, arena blocks and ring indexes start on their own
+
+/*
+	DATA STRUCTURES
+*/
+
+//one side's position in the reader thread's ring, alone on its cache line so
+//the reader and the sender each write a line the other only reads
+typedef struct {
+   uint64_t count;		//blocks moved past this side so far
+   uint64_t wakeAt;		//count the other side sleeps until, 0 while it does not
+   int done;			//set once count no longer moves - end of file or stop
+   char pad[SOURCE_LINE - 2 * sizeof(uint64_t) - sizeof(int)];
+} SourceIndex;
+
+//file being sent, handed out one payload sized block at a time
+typedef struct {
+   int fh;			//file handle
+   char *map;			//whole file mapped read only, NULL when blocks are read()
+   size_t mapLen;		//bytes mapped
+   uint64_t size;		//file size in bytes, 0 if unknown (pipes), or the end of a range
+   uint64_t start;		//offset of the first block handed out
+   uint64_t offset;		//offset of the next block, the reader thread's once started
+   uint64_t stamp;		//modification time in ns, 0 if unknown (pipes)
+#ifdef USE_URING
+   Ring ring;			//reads ahead of the sender, NULL pool when read() is used
+   char *pool;			//SOURCE_BUFS registered buffers, chunk n lives in buffer n % SOURCE_BUFS
+   uint32_t chunkLen;		//bytes per chunk, whole blocks so none straddles two chunks
+   uint64_t head;		//chunk blocks are taken from
+   uint64_t tail;		//next chunk to request
+   uint32_t chunkDone[SOURCE_BUFS];	//bytes read into each buffer so far
+   uint32_t chunkWant[SOURCE_BUFS];	//bytes requested for each buffer
+   uint32_t chunkPos[SOURCE_BUFS];	//bytes already handed out from each buffer
+   int failed;			//set once a read has failed, the file ends there
+#endif
+   char *arena;			//ring of blocks the reader thread fills, NULL without one
+   uint32_t *lens;		//bytes read into each block
+   uint32_t blocks;		//blocks in the arena
+   uint32_t stride;		//bytes from one block to the next, whole cache lines
+   uint32_t blockSize;		//bytes read per block, only the last may be shorter
+   uint32_t refill;		//blocks a side waits for once woken, a quarter of those read ahead
+   int dataFd;			//eventfd waking the sender once blocks were read
+   int spaceFd;			//eventfd waking the reader once blocks were handed back
+   pthread_t reader;		//reader thread
+   SourceIndex filled;		//blocks read, by the reader
+   SourceIndex freed;		//blocks handed back, by the sender - done stops the reader
+   uint64_t taken;		//blocks handed out to the sender
+} Source;
+
+
+/*
+	FUNCTIONS
+*/
+
+//opens fileName, mapping it when useMap is set and the file can be mapped, returns -1 if it cannot be opened
+int sourceOpen(Source *src, char *fileName, int useMap);
+
+//limits the blocks handed out to the bytes [start, end) of a regular file
+void sourceRange(Source *src, uint64_t start, uint64_t end);
+
+//points slot->data at the next block of up to payloadSize bytes, returns its length, 0 at the end of the file,
+//-1 with -DUSE_URING or a reader thread when the read ahead has not caught up (wait on sourceWaitFd)
+int sourceNext(Source *src, Slot *slot, uint32_t payloadSize);
+
+//moves the reads to a thread filling an arena of window blocks of payloadSize
+//bytes plus SOURCE_AHEAD, which sourceNext then hands out without a copy - a block
+//stays untouched until sourceRelease hands it back. Returns -1, leaving the
+//reads to sourceNext, for a mapped file or when the thread cannot be started
+int sourceStart(Source *src, uint32_t payloadSize, uint32_t window);
+
+//hands back the first count blocks sourceNext handed out since sourceStart,
+//nothing happens without a reader thread
+void sourceRelease(Source *src, uint64_t count);
+
+//returns a descriptor that turns readable when sourceNext may have a block again, -1 without a ring or reader thread
+int sourceWaitFd(Source *src);
+
+//unmaps and closes the file
+void sourceClose(Source *src);
+
+#endif
@@ -0,0 +1,385 @@
+#define _GNU_SOURCE
+#include "udpStorage.h"
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+
+#ifdef USE_URING
+
+//one ring and buffer pool shared by every Storage a thread has open, so
+//server workers never contend for it
+static __thread struct {
+   Ring ring;
+   char *pool;			//STORE_BUFS registered buffers of STORE_BUF_SIZE bytes
+   int users;			//open Storages writing through the ring
+   int freeBufs[STORE_BUFS];	//buffers not holding a run
+   int nfree;
+   int writing;			//buffers submitted and not yet completed
+   Storage *owner[STORE_BUFS];	//Storage each buffer holds a run of
+   uint64_t offset[STORE_BUFS];	//file offset each submitted buffer is written at
+   uint32_t len[STORE_BUFS];	//bytes of each buffer to be written
+   uint32_t done[STORE_BUFS];	//bytes of each buffer already written
+} shared;
+
+//starts writing buf from its first unwritten byte
+static int ringWriteBuf(int buf)
+{
+   struct io_uring_sqe *sqe;
+
+   sqe = ringSqe(&shared.ring);
+   if (sqe == NULL)
+      return -1;
+   sqe->opcode = IORING_OP_WRITE_FIXED;
+   sqe->fd = shared.owner[buf]->fh;
+   sqe->addr = (uintptr_t)(shared.pool + (size_t)buf * STORE_BUF_SIZE + shared.done[buf]);
+   sqe->len = shared.len[buf] - shared.done[buf];
+   sqe->off = shared.offset[buf] + shared.done[buf];
+   sqe->buf_index = 0;
+   sqe->user_data = buf;
+   shared.owner[buf]->writes++;
+   return 0;
+}
+
+//takes finished writes of every Storage off the ring, returning their
+//buffers and resubmitting short writes
+static void ringCollect(void)
+{
+   Storage *store;
+   uint64_t buf;
+   int res;
+
+   ringClearEvent(&shared.ring);
+   while (ringNext(&shared.ring, &buf, &res))
+   {
+      store = shared.owner[buf];
+      if (res < 0 && res != -EINTR && res != -EAGAIN)
+         store->failed = 1;
+      if (res > 0)
+         shared.done[buf] += res;
+      if (!store->failed && shared.done[buf] < shared.len[buf])
+      {
+         if (ringWriteBuf(buf) < 0)
+            store->failed = 1;
+         else
+            continue;
+      }
+      store->inFlight--;
+      shared.writing--;
+      shared.owner[buf] = NULL;
+      shared.freeBufs[shared.nfree++] = buf;
+   }
+}
+
+//hands the current run of store to the ring
+static int ringSubmitRun(Storage *store)
+{
+   int buf;
+
+   buf = store->cur;
+   store->cur = -1;
+   shared.offset[buf] = store->runStart;
+   shared.len[buf] = store->curLen;
+   shared.done[buf] = 0;
+   if (ringWriteBuf(buf) < 0)
+   {
+      store->failed = 1;
+      shared.owner[buf] = NULL;
+      shared.freeBufs[shared.nfree++] = buf;
+      return -1;
+   }
+   store->inFlight++;
+   shared.writing++;
+   return 0;
+}
+
+//waits until a buffer is free, only when the disk is STORE_BUFS writes behind
+static int ringTakeBuf(Storage *store)
+{
+   int buf;
+
+   while (shared.nfree == 0 && !store->failed)
+   {
+      //every buffer may be an open run of some file, those have to go first
+      if (shared.writing == 0)
+      {
+         for (buf = 0; buf < STORE_BUFS; buf++)
+         {
+            if (shared.owner[buf] != NULL && shared.owner[buf]->cur == buf)
+               ringSubmitRun(shared.owner[buf]);
+         }
+      }
+      if (ringSubmit(&shared.ring, 1) < 0)
+         return -1;
+      ringCollect();
+   }
+   if (store->failed)
+      return -1;
+   buf = shared.freeBufs[--shared.nfree];
+   shared.owner[buf] = store;
+   return buf;
+}
+
+//joins the shared ring, setting it up for the first Storage
+static void ringOpen(Storage *store)
+{
+   size_t len;
+   int i;
+
+   store->ringOn = 0;
+   store->cur = -1;
+   store->curLen = 0;
+   store->inFlight = 0;
+   store->failed = 0;
+   if (shared.users == 0)
+   {
+      if (ringInit(&shared.ring, RING_ENTRIES) < 0)
+         return;
+      len = (size_t)STORE_BUFS * STORE_BUF_SIZE;
+      shared.pool = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (shared.pool == MAP_FAILED || ringRegister(&shared.ring, shared.pool, len) < 0)
+      {
+         //no ring (or no locked memory for it), write with pwritev instead
+         if (shared.pool != MAP_FAILED)
+            munmap(shared.pool, len);
+         shared.pool = NULL;
+         ringFree(&shared.ring);
+         return;
+      }
+      shared.nfree = 0;
+      shared.writing = 0;
+      for (i = STORE_BUFS - 1; i >= 0; i--)
+      {
+         shared.owner[i] = NULL;
+         shared.freeBufs[shared.nfree++] = i;
+      }
+   }
+   shared.users++;
+   store->ringOn = 1;
+}
+
+//waits for the writes of store and leaves the ring, releasing it after the last Storage
+static void ringClose(Storage *store)
+{
+   if (store->cur >= 0)
+      ringSubmitRun(store);
+   while (store->inFlight > 0 && ringSubmit(&shared.ring, 1) == 0)
+      ringCollect();
+   if (store->inFlight > 0)
+      store->failed = 1;
+   store->ringOn = 0;
+   if (--shared.users > 0)
+      return;
+   munmap(shared.pool, (size_t)STORE_BUFS * STORE_BUF_SIZE);
+   shared.pool = NULL;
+   ringFree(&shared.ring);
+}
+
+#endif
+
+//opens fileName with flags and resets the queue
+static int storeOpenFlags(Storage *store, char *fileName, int flags, uint64_t base)
+{
+   store->fh = open(fileName, O_WRONLY | O_CREAT | flags, S_IREAD | S_IWRITE);
+   store->payloadSize = 0;
+   store->base = base;
+   store->size = 0;
+   store->shared = !(flags & O_TRUNC);
+   store->end = base;
+   store->count = 0;
+   store->runStart = 0;
+   store->runEnd = 0;
+   store->writes = 0;
+#ifdef USE_URING
+   store->ringOn = 0;
+   if (store->fh >= 0)
+      ringOpen(store);
+#endif
+   return store->fh < 0 ? -1 : 0;
+}
+
+int storeOpen(Storage *store, char *fileName)
+{
+   return storeOpenFlags(store, fileName, O_TRUNC, 0);
+}
+
+int storeOpenShared(Storage *store, char *fileName, uint64_t base)
+{
+   return storeOpenFlags(store, fileName, 0, base);
+}
+
+void storeDirect(Storage *store)
+{
+#ifdef USE_URING
+   if (store->ringOn)
+      ringClose(store);
+#endif
+}
+
+int storeReserve(Storage *store, uint64_t size, uint32_t payloadSize)
+{
+   store->payloadSize = payloadSize;
+   store->size = size;
+   if (size == 0)
+      return 0;
+
+   //file systems without fallocate just grow the file as blocks land
+   if (fallocate(store->fh, 0, 0, size) < 0 && errno != EOPNOTSUPP && errno != ENOSYS)
+      return -1;
+   return 0;
+}
+
+int storeFlush(Storage *store)
+{
+   struct iovec *iov;
+   uint64_t offset;
+   ssize_t ret;
+   int left;
+
+#ifdef USE_URING
+   //the open run keeps collecting blocks, full ones are already queued
+   if (store->ringOn)
+   {
+      if (ringSubmit(&shared.ring, 0) < 0)
+         store->failed = 1;
+      ringCollect();
+      return store->failed ? -1 : 0;
+   }
+#endif
+
+   //pwritev may stop short, carry on from where it stopped
+   iov = store->iovs;
+   left = store->count;
+   offset = store->runStart;
+   while (left > 0)
+   {
+      ret = pwritev(store->fh, iov, left, offset);
+      store->writes++;
+      if (ret < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         return -1;
+      }
+      offset += ret;
+      while (left > 0 && (size_t)ret >= iov->iov_len)
+      {
+         ret -= iov->iov_len;
+         iov++;
+         left--;
+      }
+      if (left > 0)
+      {
+         iov->iov_base = (char *)iov->iov_base + ret;
+         iov->iov_len -= ret;
+      }
+   }
+
+   store->count = 0;
+   return 0;
+}
+
+int storeWrite(Storage *store, uint32_t seq, char *data, uint32_t len)
+{
+   return storeWriteAt(store, (uint64_t)seq * store->payloadSize, data, len);
+}
+
+int storeWriteAt(Storage *store, uint64_t pos, char *data, uint32_t len)
+{
+   uint64_t offset;
+
+   offset = store->base + pos;
+#ifdef USE_URING
+   if (store->ringOn)
+   {
+      if (store->cur >= 0 && (offset != store->runEnd || store->curLen + len > STORE_BUF_SIZE))
+      {
+         if (ringSubmitRun(store) < 0)
+            return -1;
+      }
+      if (store->cur < 0)
+      {
+         store->cur = ringTakeBuf(store);
+         if (store->cur < 0)
+            return -1;
+         store->curLen = 0;
+         store->runStart = offset;
+         store->runEnd = offset;
+      }
+
+      //the receive buffer is reused by the next batch, the ring owns this copy
+      memcpy(shared.pool + (size_t)store->cur * STORE_BUF_SIZE + store->curLen, data, len);
+      store->curLen += len;
+      store->runEnd += len;
+      if (store->runEnd > store->end)
+         store->end = store->runEnd;
+      return store->failed ? -1 : 0;
+   }
+#endif
+
+   //start a new run unless the block continues the current one
+   if (store->count > 0 && (offset != store->runEnd || store->count == STORE_IOV_MAX))
+   {
+      if (storeFlush(store) < 0)
+         return -1;
+   }
+   if (store->count == 0)
+   {
+      store->runStart = offset;
+      store->runEnd = offset;
+   }
+
+   store->iovs[store->count].iov_base = data;
+   store->iovs[store->count].iov_len = len;
+   store->count++;
+   store->runEnd += len;
+   if (store->runEnd > store->end)
+      store->end = store->runEnd;
+   return 0;
+}
+
+int storeSync(Storage *store)
+{
+   int ret;
+
+   ret = storeFlush(store);
+#ifdef USE_URING
+   //the open run goes too, then the ring is drained of this file's writes
+   if (store->ringOn)
+   {
+      if (store->cur >= 0 && ringSubmitRun(store) < 0)
+         ret = -1;
+      while (store->inFlight > 0 && ringSubmit(&shared.ring, 1) == 0)
+         ringCollect();
+      if (store->inFlight > 0 || store->failed)
+         ret = -1;
+   }
+#endif
+   if (fdatasync(store->fh) < 0)
+      ret = -1;
+   return ret;
+}
+
+int storeClose(Storage *store)
+{
+   int ret;
+
+   ret = storeFlush(store);
+#ifdef USE_URING
+   //every write has to land before the file is trimmed
+   if (store->ringOn)
+   {
+      ringClose(store);
+      if (store->failed)
+         ret = -1;
+   }
+#endif
+   //every stripe leaves the file at its whole size, whichever closes last
+   if (ftruncate(store->fh, store->shared && store->size > 0 ? store->size : store->end) < 0)
+      ret = -1;
+   close(store->fh);
+   return ret;
+}
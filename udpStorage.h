@@ -0,0 +1,77 @@
+//udpStorage Received blocks written at their file offset, adjacent blocks coalesced
+
+#ifndef UDPSTORAGE_H
+#define UDPSTORAGE_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include "udpRing.h"
+
+#define STORE_IOV_MAX	1024		//blocks coalesced into one pwritev (IOV_MAX on Linux)
+#define STORE_BUFS	32		//registered write buffers shared by a thread's files with -DUSE_URING
+#define STORE_BUF_SIZE	(256 * 1024)	//bytes coalesced into one asynchronous write
+
+/*
+	DATA STRUCTURES
+*/
+
+//file being received, block seq lives at seq * payloadSize
+typedef struct {
+   int fh;			//file handle
+   uint32_t payloadSize;	//bytes in every block but the last
+   uint64_t base;		//file offset of block 0, nonzero for later stripes
+   uint64_t size;		//size reserved for the whole file, 0 if unknown
+   int shared;			//set when other stripes write the same file
+   uint64_t end;		//offset just past the furthest block written
+   struct iovec iovs[STORE_IOV_MAX];	//run of adjacent blocks waiting to be written
+   int count;			//blocks in the run
+   uint64_t runStart;		//file offset of the run
+   uint64_t runEnd;		//offset just past the run
+   unsigned long writes;	//pwritev calls made, or writes submitted to the ring
+#ifdef USE_URING
+   int ringOn;			//set when writes go through the ring shared by the thread's Storages
+   int cur;			//shared buffer collecting the current run, -1 if none
+   uint32_t curLen;		//bytes in that buffer
+   int inFlight;		//writes submitted and not yet completed
+   int failed;			//set once a write has failed
+#endif
+} Storage;
+
+
+/*
+	FUNCTIONS
+*/
+
+//creates or truncates fileName, returns -1 if it cannot be created
+int storeOpen(Storage *store, char *fileName);
+
+//opens fileName without truncating it for one stripe whose block 0 lives at base,
+//returns -1 if it cannot be created
+int storeOpenShared(Storage *store, char *fileName, uint64_t base);
+
+//makes every later storeFlush write the blocks queued before it returns, for a
+//file read back while it is received - with -DUSE_URING the file leaves the ring
+void storeDirect(Storage *store);
+
+//sets the block size and preallocates size bytes (0 if unknown), returns -1 if the disk is full
+int storeReserve(Storage *store, uint64_t size, uint32_t payloadSize);
+
+//queues len bytes at data as block seq - data must stay valid until the next storeFlush, returns -1 on a write error
+//with -DUSE_URING the block is copied into a registered buffer and written asynchronously
+int storeWrite(Storage *store, uint32_t seq, char *data, uint32_t len);
+
+//as storeWrite for len bytes pos bytes past base, for blocks not sized payloadSize
+int storeWriteAt(Storage *store, uint64_t pos, char *data, uint32_t len);
+
+//writes the queued run, or with -DUSE_URING submits full runs and collects finished writes without waiting, returns -1 on a write error
+int storeFlush(Storage *store);
+
+//flushes, waits for every write to complete and forces the file to disk,
+//returns -1 on a write error
+int storeSync(Storage *store);
+
+//flushes, trims the preallocation to the blocks written (a stripe to the reserved size)
+//and closes the file, returns -1 on a write error
+int storeClose(Storage *store);
+
+#endif
@@ -0,0 +1,194 @@
+#include "udpTimer.h"
+#include <string.h>
+
+#define TIMER_MASK	(TIMER_SLOTS - 1)
+#define TIMER_SPAN	(1ULL << (TIMER_BITS * TIMER_LEVELS))	//ticks the wheel covers
+
+
+//first tick at or after time t, so a node never expires early
+static unsigned long long tickOf(unsigned long long t)
+{
+   return (t + TIMER_TICK_US - 1) / TIMER_TICK_US;
+}
+
+static void unlink(TimerNode *node)
+{
+   *node->pprev = node->next;
+   if (node->next != NULL)
+      node->next->pprev = node->pprev;
+   node->next = NULL;
+   node->pprev = NULL;
+}
+
+static void push(TimerNode **head, TimerNode *node)
+{
+   node->next = *head;
+   if (*head != NULL)
+      (*head)->pprev = &node->next;
+   node->pprev = head;
+   *head = node;
+}
+
+//links node into the slot holding its tick, the lowest level whose slots still
+//tell it apart from the ticks before it
+static void insert(TimerWheel *w, TimerNode *node)
+{
+   unsigned long long tick;
+   unsigned long long delta;
+   int level;
+
+   tick = tickOf(node->due);
+   if (tick < w->tick)
+      tick = w->tick;
+   delta = tick - w->tick;
+   if (delta >= TIMER_SPAN)
+   {
+      //parked in the last slot reached, inserted again from there
+      delta = TIMER_SPAN - 1;
+      tick = w->tick + delta;
+   }
+   for (level = 0; level < TIMER_LEVELS - 1; level++)
+      if (delta < 1ULL << (TIMER_BITS * (level + 1)))
+         break;
+   push(&w->slot[level][(tick >> (TIMER_BITS * level)) & TIMER_MASK], node);
+}
+
+//moves the nodes of one slot down to the levels below
+static void cascade(TimerWheel *w, int level, unsigned long long tick)
+{
+   TimerNode *node;
+   TimerNode **head;
+
+   head = &w->slot[level][(tick >> (TIMER_BITS * level)) & TIMER_MASK];
+   while ((node = *head) != NULL)
+   {
+      unlink(node);
+      insert(w, node);
+   }
+}
+
+void timerInit(TimerWheel *w, unsigned long long now)
+{
+   memset(w, 0, sizeof(*w));
+   w->tick = now / TIMER_TICK_US;
+}
+
+void timerAdd(TimerWheel *w, TimerNode *node, unsigned long long due)
+{
+   if (timerArmed(node))
+      unlink(node);
+   else
+      w->count++;
+   node->due = due;
+   insert(w, node);
+}
+
+void timerCancel(TimerWheel *w, TimerNode *node)
+{
+   if (!timerArmed(node))
+      return;
+   unlink(node);
+   w->count--;
+}
+
+TimerNode *timerPop(TimerWheel *w, unsigned long long now)
+{
+   unsigned long long nowTick;
+   unsigned long long t;
+   TimerNode *node;
+   int level;
+
+   nowTick = now / TIMER_TICK_US;
+   while (w->expired == NULL)
+   {
+      if (w->count == 0 && w->tick < nowTick)
+         w->tick = nowTick;
+      if (w->tick > nowTick)
+         return NULL;
+
+      //at the start of a slot of a level, its nodes move down, highest level first
+      t = w->tick;
+      for (level = 1; level < TIMER_LEVELS; level++)
+         if ((t >> (TIMER_BITS * level)) << (TIMER_BITS * level) != t)
+            break;
+      while (--level > 0)
+         cascade(w, level, t);
+
+      //every node left in this level 0 slot is due
+      w->expired = w->slot[0][t & TIMER_MASK];
+      w->slot[0][t & TIMER_MASK] = NULL;
+      if (w->expired != NULL)
+         w->expired->pprev = &w->expired;
+      w->tick++;
+   }
+   node = w->expired;
+   unlink(node);
+   w->count--;
+   return node;
+}
+
+unsigned long long timerNext(TimerWheel *w)
+{
+   unsigned long long t;
+   int i;
+
+   if (w->count == 0)
+      return TIMER_NONE;
+   if (w->expired != NULL)
+      return 0;
+
+   //the first occupied level 0 slot, or the next cascade, which may bring one
+   for (i = 0; i < TIMER_SLOTS; i++)
+   {
+      t = w->tick + i;
+      if ((t & TIMER_MASK) == 0 || w->slot[0][t & TIMER_MASK] != NULL)
+         return t * TIMER_TICK_US;
+   }
+   return (w->tick + TIMER_SLOTS) * TIMER_TICK_US;
+}
+
+void rttInit(RttEstimator *e)
+{
+   memset(e, 0, sizeof(*e));
+   e->rtoUs = RTO_INIT_US;
+}
+
+void rttSample(RttEstimator *e, unsigned long long rttUs)
+{
+   unsigned long long err;
+   unsigned long long var;
+
+   if (e->srttUs == 0)
+   {
+      e->srttUs = rttUs > 0 ? rttUs : 1;
+      e->rttvarUs = rttUs / 2;
+      e->minRttUs = rttUs;
+   }
+   else
+   {
+      //gains of 1/8 and 1/4 as in RFC 6298
+      err = rttUs > e->srttUs ? rttUs - e->srttUs : e->srttUs - rttUs;
+      e->rttvarUs = (3 * e->rttvarUs + err) / 4;
+      e->srttUs = (7 * e->srttUs + rttUs) / 8;
+      if (e->srttUs == 0)
+         e->srttUs = 1;
+      if (rttUs < e->minRttUs)
+         e->minRttUs = rttUs;
+   }
+
+   //samples are in us so there is no clock granularity term, instead the
+   //variation counts as at least an RTT plus RTO_SLACK_US - a steady path
+   //would otherwise time out on the first stall of either end, and losses
+   //at the tail are left to a probe after two RTTs before the RTO
+   var = e->srttUs + RTO_SLACK_US;
+   if (4 * e->rttvarUs > var)
+      var = 4 * e->rttvarUs;
+   e->rtoUs = e->srttUs + var + e->ackDelayUs;
+   if (e->rtoUs > RTO_MAX_US)
+      e->rtoUs = RTO_MAX_US;
+}
+
+void rttBackoff(RttEstimator *e)
+{
+   e->rtoUs = e->rtoUs * 2 < RTO_MAX_US ? e->rtoUs * 2 : RTO_MAX_US;
+}
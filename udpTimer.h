@@ -0,0 +1,82 @@
+//udpTimer Hierarchical timer wheel holding a deadline per packet in flight
+
+#ifndef UDPTIMER_H
+#define UDPTIMER_H
+
+#include <stddef.h>
+
+#define TIMER_TICK_US	64		//resolution, deadlines are rounded up to a tick
+#define TIMER_BITS	8		//log2 of the slots per level
+#define TIMER_SLOTS	(1 << TIMER_BITS)
+#define TIMER_LEVELS	4		//levels cover 2^32 ticks, over three days
+#define TIMER_NONE	(~0ULL)		//timerNext when nothing is armed
+
+#define RTO_INIT_US	100000		//retransmission timeout before the first RTT sample
+#define RTO_MAX_US	60000000	//longest retransmission timeout, once backed off
+#define RTO_SLACK_US	1000		//least the timeout exceeds twice the smoothed RTT by
+
+/*
+	DATA STRUCTURES
+*/
+
+//deadline embedded in whatever it times, linked into the wheel while armed
+typedef struct TimerNode {
+   unsigned long long due;	//time it expires in us
+   struct TimerNode *next;	//neighbour in its slot
+   struct TimerNode **pprev;	//link pointing at this node, NULL while not armed
+} TimerNode;
+
+//wheel of TIMER_LEVELS levels, each slot of level n spans TIMER_SLOTS^n ticks -
+//nodes move down a level as their time comes closer, so adding, cancelling and
+//expiring a node costs the same however many are armed
+typedef struct {
+   TimerNode *slot[TIMER_LEVELS][TIMER_SLOTS];
+   TimerNode *expired;		//nodes due, handed out one by one by timerPop
+   unsigned long long tick;	//next tick to expire, every earlier one is done
+   unsigned count;		//nodes armed, expired ones included
+} TimerWheel;
+
+//RTT estimate and retransmission timeout of RFC 6298, kept in us
+typedef struct {
+   unsigned long long srttUs;	//smoothed RTT, 0 before the first sample
+   unsigned long long rttvarUs;	//mean deviation of the samples
+   unsigned long long minRttUs;	//lowest sample, 0 before the first
+   unsigned long long rtoUs;	//retransmission timeout
+   unsigned long long ackDelayUs;	//longest the peer holds an ACK back, added to the timeout
+} RttEstimator;
+
+
+/*
+	FUNCTIONS
+*/
+
+//prepares an empty wheel starting at time now
+void timerInit(TimerWheel *w, unsigned long long now);
+
+//arms node to expire at due, moving it if it is armed already
+void timerAdd(TimerWheel *w, TimerNode *node, unsigned long long due);
+
+//disarms node, nothing happens if it is not armed
+void timerCancel(TimerWheel *w, TimerNode *node);
+
+//returns 1 if node is armed
+#define timerArmed(node)	((node)->pprev != NULL)
+
+//returns the next node due by now, disarmed, or NULL once there is none - nodes
+//may be added and cancelled between calls
+TimerNode *timerPop(TimerWheel *w, unsigned long long now);
+
+//prepares an estimator without samples, rtoUs RTO_INIT_US
+void rttInit(RttEstimator *e);
+
+//adds a sample of rttUs and recomputes the timeout, undoing any back off
+void rttSample(RttEstimator *e, unsigned long long rttUs);
+
+//doubles the timeout after it expired, up to RTO_MAX_US
+void rttBackoff(RttEstimator *e);
+
+//returns a time no later than the next node can expire - its deadline rounded up
+//to a tick - TIMER_NONE if none is armed
+unsigned long long timerNext(TimerWheel *w);
+
+#endif